@@ -11,6 +11,11 @@ else
         CC=toolchain.hisilicon-hi3516ev200
 fi
 
+if [ "$1" = "venc-host" ]; then
+	make -C venc -B venc-host
+	exit $?
+fi
+
 GCC=$PWD/toolchain/$CC/bin/arm-linux-gcc
 
 if [ ! -e toolchain/$CC ]; then
@@ -41,6 +46,6 @@ elif [ "$1" = "osd" ]; then
         cmake -Bbuild -DCMAKE_C_COMPILER=$GCC -DCMAKE_BUILD_TYPE=Release
 	cmake --build build --parallel 8
 else
-	echo "Usage: $0 [vdec|venc-goke|venc-hisi|osd]"
+	echo "Usage: $0 [vdec|venc-goke|venc-hisi|venc-host|osd]"
 	exit 1
 fi
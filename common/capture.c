@@ -0,0 +1,409 @@
+#include "capture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC_US 0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+
+#define PCAPNG_SECTION 0x0A0D0D0A
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_INTERFACE 1
+#define PCAPNG_SIMPLE_PACKET 3
+#define PCAPNG_ENHANCED_PACKET 6
+#define PCAPNG_OPTION_TSRESOL 9
+
+#define LINK_NULL 0
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_LINUX_SLL 113
+#define LINK_IPV4 228
+#define LINK_IPV6 229
+#define LINK_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86DD
+#define ETHERTYPE_VLAN 0x8100
+
+static uint32_t read32(const CaptureReader* reader, const uint8_t* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return reader->swapped ? __builtin_bswap32(value) : value;
+}
+
+static uint16_t read16(const CaptureReader* reader, const uint8_t* data) {
+  uint16_t value;
+  memcpy(&value, data, sizeof(value));
+  return reader->swapped ? __builtin_bswap16(value) : value;
+}
+
+static uint16_t readBe16(const uint8_t* data) {
+  return (data[0] << 8) | data[1];
+}
+
+static bool ensureCapacity(CaptureReader* reader, uint32_t size) {
+  if (size <= reader->capacity) {
+    return true;
+  }
+
+  uint8_t* buffer = realloc(reader->buffer, size);
+  if (!buffer) {
+    return false;
+  }
+
+  reader->buffer = buffer;
+  reader->capacity = size;
+  return true;
+}
+
+static uint64_t toMicroseconds(uint64_t ticks, uint64_t tick_rate) {
+  return ticks / tick_rate * 1000000 + ticks % tick_rate * 1000000 / tick_rate;
+}
+
+int capture_open(CaptureReader* reader, const char* path) {
+  memset(reader, 0x00, sizeof(CaptureReader));
+  reader->file = fopen(path, "rb");
+  if (!reader->file) {
+    printf("ERROR: Unable to open capture [%s]\n", path);
+    return -1;
+  }
+
+  reader->capacity = 256 * 1024;
+  reader->buffer = malloc(reader->capacity);
+  if (!reader->buffer) {
+    capture_close(reader);
+    return -1;
+  }
+
+  uint8_t header[24];
+  if (fread(header, sizeof(header), 1, reader->file) != 1) {
+    printf("ERROR: Capture [%s] is too short\n", path);
+    capture_close(reader);
+    return -1;
+  }
+
+  uint32_t magic;
+  memcpy(&magic, header, sizeof(magic));
+  if (magic == PCAPNG_SECTION) {
+    // Section header is parsed again by capture_next
+    reader->pcapng = true;
+    fseek(reader->file, 0, SEEK_SET);
+    return 0;
+  }
+
+  bool nanosecond;
+  if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+    nanosecond = magic == PCAP_MAGIC_NS;
+  } else if (__builtin_bswap32(magic) == PCAP_MAGIC_US ||
+      __builtin_bswap32(magic) == PCAP_MAGIC_NS) {
+    reader->swapped = true;
+    nanosecond = __builtin_bswap32(magic) == PCAP_MAGIC_NS;
+  } else {
+    printf("ERROR: Capture [%s] is not a pcap or pcapng file\n", path);
+    capture_close(reader);
+    return -1;
+  }
+
+  reader->interface_count = 1;
+  reader->link_types[0] = read32(reader, header + 20) & 0xFFFF;
+  reader->tick_rates[0] = nanosecond ? 1000000000 : 1000000;
+  return 0;
+}
+
+// Find the UDP payload in a captured frame, returns false for other traffic
+static bool parseFrame(uint16_t link_type, const uint8_t* data,
+  uint32_t size, CapturePacket* packet) {
+  uint32_t offset = 0;
+  uint16_t ethertype = 0;
+
+  switch (link_type) {
+    case LINK_ETHERNET:
+      if (size < 14) {
+        return false;
+      }
+      ethertype = readBe16(data + 12);
+      offset = 14;
+      while (ethertype == ETHERTYPE_VLAN && size >= offset + 4) {
+        ethertype = readBe16(data + offset + 2);
+        offset += 4;
+      }
+      break;
+
+    case LINK_LINUX_SLL:
+      if (size < 16) {
+        return false;
+      }
+      ethertype = readBe16(data + 14);
+      offset = 16;
+      break;
+
+    case LINK_LINUX_SLL2:
+      if (size < 20) {
+        return false;
+      }
+      ethertype = readBe16(data);
+      offset = 20;
+      break;
+
+    case LINK_NULL:
+      // Address family in host byte order of the capturing machine
+      if (size < 4) {
+        return false;
+      }
+      ethertype = data[0] == 2 || data[3] == 2 ? ETHERTYPE_IPV4 : ETHERTYPE_IPV6;
+      offset = 4;
+      break;
+
+    case LINK_RAW:
+    case LINK_IPV4:
+    case LINK_IPV6:
+      if (!size) {
+        return false;
+      }
+      ethertype = (data[0] >> 4) == 4 ? ETHERTYPE_IPV4 : ETHERTYPE_IPV6;
+      break;
+
+    default:
+      return false;
+  }
+
+  data += offset;
+  size -= offset;
+
+  if (ethertype == ETHERTYPE_IPV4) {
+    if (size < 20 || (data[0] >> 4) != 4 || data[9] != 17) {
+      return false;
+    }
+
+    // Only the first fragment of a fragmented datagram carries UDP header
+    if (readBe16(data + 6) & 0x3FFF) {
+      return false;
+    }
+
+    uint32_t header_size = (data[0] & 0x0F) * 4;
+    uint32_t total_size = readBe16(data + 2);
+    if (total_size < size) {
+      size = total_size;
+    }
+    if (header_size > size) {
+      return false;
+    }
+    data += header_size;
+    size -= header_size;
+  } else if (ethertype == ETHERTYPE_IPV6) {
+    if (size < 40 || (data[0] >> 4) != 6 || data[6] != 17) {
+      return false;
+    }
+    data += 40;
+    size -= 40;
+  } else {
+    return false;
+  }
+
+  if (size < 8) {
+    return false;
+  }
+
+  uint32_t udp_size = readBe16(data + 4);
+  packet->src_port = readBe16(data);
+  packet->dst_port = readBe16(data + 2);
+  packet->data = data + 8;
+  packet->size = (udp_size >= 8 && udp_size <= size ? udp_size : size) - 8;
+  return true;
+}
+
+// Classic pcap record, returns frame in reader->buffer
+static int readPcapRecord(CaptureReader* reader, uint32_t* interface,
+  uint64_t* timestamp, uint32_t* size) {
+  uint8_t header[16];
+  if (fread(header, sizeof(header), 1, reader->file) != 1) {
+    return 0;
+  }
+
+  uint32_t captured = read32(reader, header + 8);
+  if (!ensureCapacity(reader, captured)) {
+    return -1;
+  }
+
+  if (captured && fread(reader->buffer, captured, 1, reader->file) != 1) {
+    return 0;
+  }
+
+  uint64_t seconds = read32(reader, header);
+  uint64_t fraction = read32(reader, header + 4);
+  *interface = 0;
+  *timestamp = seconds * 1000000 +
+    toMicroseconds(fraction, reader->tick_rates[0]);
+  *size = captured;
+  return 1;
+}
+
+static void parseInterface(CaptureReader* reader, const uint8_t* body,
+  uint32_t size) {
+  if (reader->interface_count >= CAPTURE_MAX_INTERFACES || size < 8) {
+    return;
+  }
+
+  uint32_t index = reader->interface_count++;
+  reader->link_types[index] = read16(reader, body);
+  reader->tick_rates[index] = 1000000;
+
+  // Options follow link type, reserved and snap length
+  uint32_t offset = 8;
+  while (offset + 4 <= size) {
+    uint16_t code = read16(reader, body + offset);
+    uint16_t length = read16(reader, body + offset + 2);
+    if (!code || offset + 4 + length > size) {
+      break;
+    }
+
+    if (code == PCAPNG_OPTION_TSRESOL && length >= 1) {
+      uint8_t resolution = body[offset + 4];
+      uint64_t rate = 1;
+      for (uint32_t i = 0; i < (resolution & 0x7F) && rate < UINT64_MAX / 10; i++) {
+        rate *= resolution & 0x80 ? 2 : 10;
+      }
+      reader->tick_rates[index] = rate;
+    }
+
+    offset += 4 + ((length + 3) & ~3);
+  }
+}
+
+// Next pcapng packet block, returns frame in reader->buffer
+static int readPcapngBlock(CaptureReader* reader, uint32_t* interface,
+  uint64_t* timestamp, uint32_t* size) {
+  while (true) {
+    uint8_t header[8];
+    if (fread(header, sizeof(header), 1, reader->file) != 1) {
+      return 0;
+    }
+
+    uint32_t type;
+    memcpy(&type, header, sizeof(type));
+    if (type == PCAPNG_SECTION) {
+      // Byte order is only known after reading the magic of a section
+      uint8_t magic[4];
+      if (fread(magic, sizeof(magic), 1, reader->file) != 1) {
+        return 0;
+      }
+
+      uint32_t byte_order;
+      memcpy(&byte_order, magic, sizeof(byte_order));
+      reader->swapped = byte_order != PCAPNG_BYTE_ORDER;
+      reader->interface_count = 0;
+
+      uint32_t length = read32(reader, header + 4);
+      if (length < 12 || fseek(reader->file, length - 12, SEEK_CUR)) {
+        return 0;
+      }
+      continue;
+    }
+
+    type = read32(reader, header);
+    uint32_t length = read32(reader, header + 4);
+    if (length < 12 || !ensureCapacity(reader, length)) {
+      return -1;
+    }
+
+    uint32_t body_size = length - 12;
+    uint8_t* body = reader->buffer;
+    if (fread(body, length - 8, 1, reader->file) != 1) {
+      return 0;
+    }
+
+    if (type == PCAPNG_INTERFACE) {
+      parseInterface(reader, body, body_size);
+      continue;
+    }
+
+    if (type == PCAPNG_ENHANCED_PACKET && body_size >= 20) {
+      *interface = read32(reader, body);
+      uint64_t ticks = (uint64_t)read32(reader, body + 4) << 32 |
+        read32(reader, body + 8);
+      uint32_t captured = read32(reader, body + 12);
+      if (*interface >= reader->interface_count || captured > body_size - 20) {
+        continue;
+      }
+
+      *timestamp = toMicroseconds(ticks, reader->tick_rates[*interface]);
+      memmove(body, body + 20, captured);
+      *size = captured;
+      return 1;
+    }
+
+    if (type == PCAPNG_SIMPLE_PACKET && body_size >= 4 && reader->interface_count) {
+      // No timestamp, keep the previous one
+      uint32_t captured = read32(reader, body);
+      *interface = 0;
+      *timestamp = reader->last_timestamp;
+      *size = captured < body_size - 4 ? captured : body_size - 4;
+      memmove(body, body + 4, *size);
+      return 1;
+    }
+  }
+}
+
+int capture_next(CaptureReader* reader, CapturePacket* packet, uint16_t port) {
+  while (true) {
+    uint32_t interface, size;
+    uint64_t timestamp;
+    int ret = reader->pcapng
+      ? readPcapngBlock(reader, &interface, &timestamp, &size)
+      : readPcapRecord(reader, &interface, &timestamp, &size);
+    if (ret <= 0) {
+      return ret;
+    }
+
+    reader->last_timestamp = timestamp;
+    if (!parseFrame(reader->link_types[interface], reader->buffer, size, packet)) {
+      continue;
+    }
+
+    if (port && packet->dst_port != port) {
+      continue;
+    }
+
+    packet->timestamp = timestamp;
+    return 1;
+  }
+}
+
+static uint64_t getMonotonicTime(void) {
+  struct timespec timestamp;
+  clock_gettime(CLOCK_MONOTONIC, &timestamp);
+  return (uint64_t)timestamp.tv_sec * 1000000 + timestamp.tv_nsec / 1000;
+}
+
+void capture_pace(CaptureReader* reader, const CapturePacket* packet) {
+  if (!reader->realtime) {
+    return;
+  }
+
+  uint64_t now = getMonotonicTime();
+  if (!reader->start_time) {
+    reader->start_time = now;
+    reader->first_timestamp = packet->timestamp;
+    return;
+  }
+
+  // Captures can step backwards, never wait for those
+  if (packet->timestamp <= reader->first_timestamp) {
+    return;
+  }
+
+  uint64_t due = reader->start_time + packet->timestamp - reader->first_timestamp;
+  if (due > now) {
+    usleep(due - now);
+  }
+}
+
+void capture_close(CaptureReader* reader) {
+  if (reader->file) {
+    fclose(reader->file);
+  }
+
+  free(reader->buffer);
+  memset(reader, 0x00, sizeof(CaptureReader));
+}
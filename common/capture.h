@@ -0,0 +1,61 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Reader for packet captures (pcap and pcapng) of our UDP streams. Only
+// the UDP payload is returned, other traffic in the capture is skipped.
+
+#define CAPTURE_MAX_INTERFACES 16
+
+typedef struct {
+  FILE* file;
+  bool pcapng;
+  bool swapped;         // Capture written with the other byte order
+  uint8_t* buffer;
+  uint32_t capacity;
+
+  // Link type and timestamp ticks per second for each interface,
+  // classic pcap files have a single interface
+  uint32_t interface_count;
+  uint16_t link_types[CAPTURE_MAX_INTERFACES];
+  uint64_t tick_rates[CAPTURE_MAX_INTERFACES];
+  uint64_t last_timestamp;
+
+  // Replay pacing, see capture_pace
+  bool realtime;
+  uint64_t first_timestamp;
+  uint64_t start_time;
+} CaptureReader;
+
+typedef struct {
+  const uint8_t* data;  // UDP payload, valid until the next read
+  uint32_t size;
+  uint64_t timestamp;   // Capture time in microseconds
+  uint16_t src_port;
+  uint16_t dst_port;
+} CapturePacket;
+
+/**
+ * @brief Open a capture file
+ * @return 0 on success
+ */
+int capture_open(CaptureReader* reader, const char* path);
+
+/**
+ * @brief Read the next UDP datagram
+ * @param port - Only return datagrams sent to this port, 0 for any
+ * @return 1 if a packet was read, 0 at end of file, -1 on error
+ */
+int capture_next(CaptureReader* reader, CapturePacket* packet, uint16_t port);
+
+/**
+ * @brief Sleep until a packet is due when replaying with original timing.
+ * Returns immediately unless reader->realtime is set.
+ */
+void capture_pace(CaptureReader* reader, const CapturePacket* packet);
+
+/**
+ * @brief Close capture file and release buffers
+ */
+void capture_close(CaptureReader* reader);
@@ -0,0 +1,83 @@
+#include "combiner.h"
+#include "packet.h"
+#include <string.h>
+
+static bool testSeen(const Combiner* combiner, uint16_t sequence) {
+  uint32_t bit = sequence % COMBINER_WINDOW;
+  return combiner->seen[bit / 32] & (1u << (bit % 32));
+}
+
+static void markSeen(Combiner* combiner, uint16_t sequence) {
+  uint32_t bit = sequence % COMBINER_WINDOW;
+  combiner->seen[bit / 32] |= 1u << (bit % 32);
+}
+
+static void clearSeen(Combiner* combiner, uint16_t sequence) {
+  uint32_t bit = sequence % COMBINER_WINDOW;
+  combiner->seen[bit / 32] &= ~(1u << (bit % 32));
+}
+
+static void countPathLoss(CombinerPath* path, uint16_t sequence) {
+  if (path->sequence_valid) {
+    uint16_t gap = sequence - path->next_sequence;
+    if (gap >= 0x8000) {
+      return; // Late on this path, no loss
+    }
+
+    if (gap < COMBINER_WINDOW) {
+      path->lost += gap;
+    }
+  }
+
+  path->next_sequence = sequence + 1;
+  path->sequence_valid = true;
+}
+
+void combiner_init(Combiner* combiner, uint32_t path_count) {
+  memset(combiner, 0x00, sizeof(*combiner));
+  combiner->path_count = path_count < COMBINER_MAX_PATHS
+    ? path_count : COMBINER_MAX_PATHS;
+}
+
+bool combiner_accept(Combiner* combiner, uint32_t path, const uint8_t* data,
+  uint32_t size) {
+  CombinerPath* statistics = &combiner->paths[path % COMBINER_MAX_PATHS];
+  statistics->packets++;
+  if (!packet_header_size(data, size)) {
+    statistics->first++;
+    combiner->passed++;
+    return true;
+  }
+
+  uint16_t sequence = (data[2] << 8) | data[3];
+  countPathLoss(statistics, sequence);
+
+  uint16_t ahead = sequence - combiner->highest;
+  uint16_t behind = combiner->highest - sequence;
+  if (!combiner->sequence_valid || (ahead >= 0x8000 && behind >= COMBINER_WINDOW)) {
+    // First packet or sender restart, nothing remembered applies
+    combiner->restarts += combiner->sequence_valid;
+    memset(combiner->seen, 0x00, sizeof(combiner->seen));
+    combiner->highest = sequence;
+    combiner->sequence_valid = true;
+  } else if (ahead && ahead < 0x8000) {
+    // Forget the numbers the window slides over
+    if (ahead >= COMBINER_WINDOW) {
+      memset(combiner->seen, 0x00, sizeof(combiner->seen));
+    } else {
+      for (uint16_t i = 1; i <= ahead; i++) {
+        clearSeen(combiner, combiner->highest + i);
+      }
+    }
+    combiner->highest = sequence;
+  } else if (testSeen(combiner, sequence)) {
+    statistics->duplicates++;
+    combiner->duplicates++;
+    return false;
+  }
+
+  markSeen(combiner, sequence);
+  statistics->first++;
+  combiner->passed++;
+  return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Diversity combiner: the same RTP stream received over several paths
+// (antennas, links) is merged by sequence number. The first copy of each
+// packet passes, later copies are dropped using a bitmap of recently seen
+// sequence numbers. Compact mode packets have no sequence number and
+// always pass, only one path should carry them.
+
+#define COMBINER_MAX_PATHS 4
+
+// Sequence numbers remembered for duplicate suppression, power of two
+#define COMBINER_WINDOW 1024
+
+typedef struct {
+  bool sequence_valid;
+  uint16_t next_sequence; // Expected on this path
+
+  // Totals since init
+  uint64_t packets;       // Received on this path
+  uint64_t first;         // Passed, no other path had it yet
+  uint64_t duplicates;    // Already received on another path
+  uint64_t lost;          // Sequence gaps on this path, reordering included
+} CombinerPath;
+
+typedef struct {
+  uint32_t path_count;
+  CombinerPath paths[COMBINER_MAX_PATHS];
+
+  bool sequence_valid;
+  uint16_t highest;       // Newest sequence number seen
+  uint32_t seen[COMBINER_WINDOW / 32];
+
+  // Totals since init
+  uint64_t passed;
+  uint64_t duplicates;
+  uint64_t restarts;      // Window dropped on a far sequence jump
+} Combiner;
+
+/**
+ * @brief Reset combiner
+ * @param path_count - Receive paths, at most COMBINER_MAX_PATHS
+ */
+void combiner_init(Combiner* combiner, uint32_t path_count);
+
+/**
+ * @brief Check one received datagram and count it for its path
+ * @param path - Index of the path it arrived on
+ * @return true if it is the first copy and must be processed
+ */
+bool combiner_accept(Combiner* combiner, uint32_t path, const uint8_t* data,
+  uint32_t size);
@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include "dvr.h"
+#include "packet.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// tfhd and trun flags
+#define TFHD_BASE_DATA_OFFSET 0x000001
+#define TFHD_DEFAULT_DURATION 0x000008
+#define TFHD_DEFAULT_SIZE 0x000010
+#define TFHD_DEFAULT_FLAGS 0x000020
+#define TRUN_DATA_OFFSET 0x000001
+#define TRUN_FIRST_FLAGS 0x000004
+#define TRUN_DURATION 0x000100
+#define TRUN_SIZE 0x000200
+#define TRUN_FLAGS 0x000400
+#define TRUN_COMPOSITION 0x000800
+#define SAMPLE_NON_SYNC 0x00010000
+
+// Until the index tells otherwise
+#define DEFAULT_FRAME_DURATION 3000
+
+static uint32_t readBe32(const uint8_t* data) {
+  return (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static uint64_t readBe64(const uint8_t* data) {
+  return (uint64_t)readBe32(data) << 32 | readBe32(data + 4);
+}
+
+static int growBuffer(DvrReader* reader, uint32_t size) {
+  if (size <= reader->capacity) {
+    return 0;
+  }
+
+  uint32_t capacity = reader->capacity ? reader->capacity : 1024 * 1024;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+
+  uint8_t* buffer = realloc(reader->buffer, capacity);
+  if (!buffer) {
+    printf("ERROR: Unable to allocate %d bytes for playback\n", capacity);
+    return -1;
+  }
+
+  reader->buffer = buffer;
+  reader->capacity = capacity;
+  return 0;
+}
+
+// Offset of the first start code at or after offset, size if there is none
+static uint32_t findStartCode(const uint8_t* data, uint32_t size, uint32_t offset) {
+  const uint8_t* end = data + size;
+  const uint8_t* position = data + offset + 2;
+  while (position < end && (position = memchr(position, 1, end - position))) {
+    if (!position[-1] && !position[-2]) {
+      uint32_t start = position - 2 - data;
+      return start > offset && !data[start - 1] ? start - 1 : start;
+    }
+    position++;
+  }
+
+  return size;
+}
+
+static void loadIndex(DvrReader* reader) {
+  char path[sizeof(reader->path) + 8];
+  snprintf(path, sizeof(path), "%s%s", reader->path, DVR_INDEX_EXTENSION);
+
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    printf("WARN: No keyframe index [%s], seeking disabled\n", path);
+    return;
+  }
+
+  fseeko(file, 0, SEEK_END);
+  uint32_t count = ftello(file) / sizeof(DvrIndexEntry);
+  fseeko(file, 0, SEEK_SET);
+
+  reader->index = count ? malloc(count * sizeof(DvrIndexEntry)) : 0;
+  if (reader->index) {
+    reader->index_count = fread(reader->index, sizeof(DvrIndexEntry), count, file);
+  }
+
+  fclose(file);
+}
+
+// Raw files start with parameter sets, VPS tells H.265 apart
+static bool detectHevc(const uint8_t* data, uint32_t size) {
+  uint32_t start = findStartCode(data, size, 0);
+  uint32_t header = start + 2 < size && data[start + 2] == 1 ? start + 3 : start + 4;
+  if (header + 2 > size) {
+    return false;
+  }
+
+  uint8_t type = (data[header] >> 1) & 0x3F;
+  return !(data[header] & 0x81) && data[header + 1] == 1 && type >= 32 && type <= 35;
+}
+
+int dvr_open(DvrReader* reader, const char* path) {
+  memset(reader, 0x00, sizeof(DvrReader));
+  snprintf(reader->path, sizeof(reader->path), "%s", path);
+  reader->frame_duration = DEFAULT_FRAME_DURATION;
+
+  reader->file = fopen(path, "rb");
+  if (!reader->file) {
+    printf("ERROR: Unable to open recording [%s]\n", path);
+    return -1;
+  }
+
+  if (growBuffer(reader, 1024 * 1024)) {
+    dvr_close(reader);
+    return -1;
+  }
+
+  reader->size = fread(reader->buffer, 1, reader->capacity, reader->file);
+  if (reader->size < 8) {
+    printf("ERROR: Recording [%s] is too short\n", path);
+    dvr_close(reader);
+    return -1;
+  }
+
+  reader->mp4 = !memcmp(reader->buffer + 4, "ftyp", 4) ||
+    !memcmp(reader->buffer + 4, "moov", 4) || !memcmp(reader->buffer + 4, "moof", 4);
+  if (reader->mp4) {
+    // Sample entry in the init segment names the codec
+    reader->hevc = memmem(reader->buffer, reader->size, "hev1", 4) ||
+      memmem(reader->buffer, reader->size, "hvc1", 4);
+    reader->size = 0;
+  } else {
+    reader->hevc = detectHevc(reader->buffer, reader->size);
+  }
+
+  loadIndex(reader);
+  printf("> Playback: %s, %s%s, %d keyframes indexed\n", path,
+    reader->mp4 ? "MP4 " : "", reader->hevc ? "H.265" : "H.264",
+    reader->index_count);
+  return 0;
+}
+
+int dvr_open_next(DvrReader* reader) {
+  // Digits right before the extension are the segment number
+  char path[sizeof(reader->path)];
+  memcpy(path, reader->path, sizeof(path));
+  char* name = strrchr(path, '/');
+  char* extension = strrchr(name ? name : path, '.');
+  char* end = extension ? extension : path + strlen(path);
+  char* digit = end;
+  while (digit > path && digit[-1] >= '0' && digit[-1] <= '9') {
+    digit--;
+  }
+
+  if (digit == end) {
+    return -1;
+  }
+
+  char next[sizeof(path)];
+  snprintf(next, sizeof(next), "%.*s%0*u%s", (int)(digit - path), path,
+    (int)(end - digit), (unsigned)strtoul(digit, 0, 10) + 1, end);
+  if (access(next, R_OK)) {
+    return -1;
+  }
+
+  dvr_close(reader);
+  return dvr_open(reader, next);
+}
+
+static int fillBuffer(DvrReader* reader) {
+  // Keep the unread part, a single access unit may need a larger buffer
+  if (reader->start) {
+    memmove(reader->buffer, reader->buffer + reader->start,
+      reader->size - reader->start);
+    reader->buffer_offset += reader->start;
+    reader->size -= reader->start;
+    reader->start = 0;
+  } else if (reader->size == reader->capacity &&
+      growBuffer(reader, reader->capacity * 2)) {
+    return -1;
+  }
+
+  size_t count = fread(reader->buffer + reader->size, 1,
+    reader->capacity - reader->size, reader->file);
+  reader->size += count;
+  reader->eof = count == 0;
+  return 0;
+}
+
+// Length of the access unit at data, 0 if more data is needed
+static uint32_t findUnitEnd(const DvrReader* reader, const uint8_t* data,
+  uint32_t size, uint8_t* flags) {
+  bool slice = false;
+  *flags = 0;
+
+  uint32_t position = 0;
+  while (position < size) {
+    uint32_t header = position + (data[position + 2] == 1 ? 3 : 4);
+    if (header + 3 > size) {
+      break;
+    }
+
+    uint8_t nal = packet_classify(reader->hevc, data + header, size - header);
+    if ((nal & NAL_FLAG_UNIT_START) && slice) {
+      return position;
+    }
+
+    slice |= (nal & NAL_FLAG_SLICE) != 0;
+    *flags |= nal;
+    position = findStartCode(data, size, header);
+  }
+
+  return reader->eof ? size : 0;
+}
+
+static int readRaw(DvrReader* reader, DvrFrame* frame) {
+  uint8_t flags;
+  uint32_t size;
+  while (true) {
+    // Skip anything before the first start code
+    uint8_t* data = reader->buffer + reader->start;
+    uint32_t available = reader->size - reader->start;
+    uint32_t skip = findStartCode(data, available, 0);
+    if (skip == available && reader->eof) {
+      return 0;
+    }
+
+    if (skip < available) {
+      reader->start += skip;
+      size = findUnitEnd(reader, data + skip, available - skip, &flags);
+      if (size) {
+        break;
+      }
+    }
+
+    if (fillBuffer(reader)) {
+      return -1;
+    }
+  }
+
+  // Raw files have no timestamps, the index gives the start of every GOP
+  // and the frame rate within
+  uint64_t offset = reader->buffer_offset + reader->start;
+  while (reader->next_entry < reader->index_count &&
+      reader->index[reader->next_entry].offset < offset) {
+    reader->next_entry++;
+  }
+
+  if (reader->next_entry < reader->index_count &&
+      reader->index[reader->next_entry].offset == offset) {
+    const DvrIndexEntry* entry = &reader->index[reader->next_entry++];
+    reader->timestamp = entry->time;
+    if (entry->frame_duration) {
+      reader->frame_duration = entry->frame_duration;
+    }
+  }
+
+  frame->data = reader->buffer + reader->start;
+  frame->size = size;
+  frame->timestamp = reader->timestamp;
+  frame->keyframe = (flags & NAL_FLAG_IRAP) != 0;
+  reader->start += size;
+  reader->timestamp += reader->frame_duration;
+  return 1;
+}
+
+static const uint8_t* findBox(const uint8_t* data, uint32_t size,
+  const char* type, uint32_t* box_size) {
+  uint32_t offset = 0;
+  while (offset + 8 <= size) {
+    uint32_t length = readBe32(data + offset);
+    if (length < 8 || length > size - offset) {
+      break;
+    }
+
+    if (!memcmp(data + offset + 4, type, 4)) {
+      *box_size = length - 8;
+      return data + offset + 8;
+    }
+
+    offset += length;
+  }
+
+  return 0;
+}
+
+// Sample table of the first track fragment
+static int parseFragment(DvrReader* reader, const uint8_t* moof, uint32_t size,
+  uint64_t moof_offset) {
+  uint32_t traf_size, tfhd_size, trun_size, tfdt_size;
+  const uint8_t* traf = findBox(moof, size, "traf", &traf_size);
+  const uint8_t* tfhd = traf ? findBox(traf, traf_size, "tfhd", &tfhd_size) : 0;
+  const uint8_t* trun = traf ? findBox(traf, traf_size, "trun", &trun_size) : 0;
+  const uint8_t* tfdt = traf ? findBox(traf, traf_size, "tfdt", &tfdt_size) : 0;
+  if (!tfhd || tfhd_size < 8 || !trun || trun_size < 8) {
+    return -1;
+  }
+
+  uint64_t base = moof_offset;
+  uint32_t default_duration = reader->frame_duration;
+  uint32_t default_size = 0;
+  uint32_t default_flags = 0;
+  uint32_t flags = readBe32(tfhd) & 0xFFFFFF;
+  const uint8_t* field = tfhd + 8;
+  const uint8_t* end = tfhd + tfhd_size;
+  if ((flags & TFHD_BASE_DATA_OFFSET) && field + 8 <= end) {
+    base = readBe64(field);
+    field += 8;
+  }
+
+  field += flags & 0x000002 ? 4 : 0; // Sample description index
+  if ((flags & TFHD_DEFAULT_DURATION) && field + 4 <= end) {
+    default_duration = readBe32(field);
+    field += 4;
+  }
+
+  if ((flags & TFHD_DEFAULT_SIZE) && field + 4 <= end) {
+    default_size = readBe32(field);
+    field += 4;
+  }
+
+  if ((flags & TFHD_DEFAULT_FLAGS) && field + 4 <= end) {
+    default_flags = readBe32(field);
+  }
+
+  if (tfdt && tfdt_size >= 8) {
+    reader->timestamp = tfdt[0] == 1 && tfdt_size >= 12 ?
+      (uint32_t)readBe64(tfdt + 4) : readBe32(tfdt + 4);
+  }
+
+  flags = readBe32(trun) & 0xFFFFFF;
+  uint32_t count = readBe32(trun + 4);
+  field = trun + 8;
+  end = trun + trun_size;
+  uint64_t offset = base;
+  if (flags & TRUN_DATA_OFFSET) {
+    offset += (int32_t)readBe32(field);
+    field += 4;
+  }
+
+  uint32_t first_flags = default_flags;
+  if (flags & TRUN_FIRST_FLAGS) {
+    first_flags = readBe32(field);
+    field += 4;
+  }
+
+  if (count > reader->sample_capacity) {
+    DvrSample* samples = realloc(reader->samples, count * sizeof(DvrSample));
+    if (!samples) {
+      return -1;
+    }
+
+    reader->samples = samples;
+    reader->sample_capacity = count;
+  }
+
+  uint32_t entry_size = ((flags & TRUN_DURATION) ? 4 : 0) + ((flags & TRUN_SIZE) ? 4 : 0) +
+    ((flags & TRUN_FLAGS) ? 4 : 0) + ((flags & TRUN_COMPOSITION) ? 4 : 0);
+  if (field + (uint64_t)entry_size * count > end) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    DvrSample* sample = &reader->samples[i];
+    sample->duration = default_duration;
+    sample->size = default_size;
+    uint32_t sample_flags = i ? default_flags : first_flags;
+    if (flags & TRUN_DURATION) {
+      sample->duration = readBe32(field);
+      field += 4;
+    }
+
+    if (flags & TRUN_SIZE) {
+      sample->size = readBe32(field);
+      field += 4;
+    }
+
+    if (flags & TRUN_FLAGS) {
+      sample_flags = readBe32(field);
+      field += 4;
+    }
+
+    field += flags & TRUN_COMPOSITION ? 4 : 0;
+    sample->offset = offset;
+    sample->sync = !(sample_flags & SAMPLE_NON_SYNC);
+    offset += sample->size;
+  }
+
+  reader->sample_count = count;
+  reader->next_sample = 0;
+  return 0;
+}
+
+// Load the next moof, other boxes are skipped
+static int nextFragment(DvrReader* reader) {
+  while (true) {
+    uint8_t header[16];
+    if (fseeko(reader->file, reader->next_box, SEEK_SET) ||
+        fread(header, 8, 1, reader->file) != 1) {
+      return 0;
+    }
+
+    uint64_t size = readBe32(header);
+    uint32_t header_size = 8;
+    if (size == 1) {
+      if (fread(header + 8, 8, 1, reader->file) != 1) {
+        return 0;
+      }
+
+      size = readBe64(header + 8);
+      header_size = 16;
+    } else if (!size) {
+      return 0; // Box runs to the end of the file
+    }
+
+    if (size < header_size) {
+      printf("ERROR: Recording [%s] is damaged at %llu\n", reader->path,
+        (unsigned long long)reader->next_box);
+      return -1;
+    }
+
+    uint64_t offset = reader->next_box;
+    reader->next_box += size;
+    if (memcmp(header + 4, "moof", 4)) {
+      continue;
+    }
+
+    if (size > 16 * 1024 * 1024 || growBuffer(reader, size)) {
+      return -1;
+    }
+
+    uint32_t body = size - header_size;
+    if (fread(reader->buffer, 1, body, reader->file) != body) {
+      return 0; // Cut short by power loss
+    }
+
+    if (parseFragment(reader, reader->buffer, body, offset)) {
+      printf("ERROR: Recording [%s] has an unusable fragment at %llu\n",
+        reader->path, (unsigned long long)offset);
+      return -1;
+    }
+
+    if (reader->sample_count) {
+      return 1;
+    }
+  }
+}
+
+static int readMp4(DvrReader* reader, DvrFrame* frame) {
+  if (reader->next_sample >= reader->sample_count) {
+    int ret = nextFragment(reader);
+    if (ret <= 0) {
+      return ret;
+    }
+  }
+
+  const DvrSample* sample = &reader->samples[reader->next_sample++];
+  if (growBuffer(reader, sample->size)) {
+    return -1;
+  }
+
+  if (fseeko(reader->file, sample->offset, SEEK_SET) ||
+      fread(reader->buffer, 1, sample->size, reader->file) != sample->size) {
+    return 0;
+  }
+
+  // Length prefixes become start codes of the same size
+  uint32_t offset = 0;
+  while (offset + 4 <= sample->size) {
+    uint32_t length = readBe32(reader->buffer + offset);
+    if (length > sample->size - offset - 4) {
+      printf("WARN: Sample at %llu has a bad NAL length\n",
+        (unsigned long long)sample->offset);
+      break;
+    }
+
+    memcpy(reader->buffer + offset, "\x00\x00\x00\x01", 4);
+    offset += 4 + length;
+  }
+
+  frame->data = reader->buffer;
+  frame->size = offset;
+  frame->timestamp = reader->timestamp;
+  frame->keyframe = sample->sync;
+  reader->timestamp += sample->duration;
+  return 1;
+}
+
+int dvr_read(DvrReader* reader, DvrFrame* frame) {
+  return reader->mp4 ? readMp4(reader, frame) : readRaw(reader, frame);
+}
+
+int dvr_seek(DvrReader* reader, uint32_t time) {
+  if (!reader->index_count) {
+    return -1;
+  }
+
+  // Last GOP starting at or before time
+  uint32_t low = 0;
+  uint32_t high = reader->index_count;
+  while (high - low > 1) {
+    uint32_t middle = (low + high) / 2;
+    if (reader->index[middle].time <= time) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+
+  const DvrIndexEntry* entry = &reader->index[low];
+  if (reader->mp4) {
+    reader->next_box = entry->offset;
+    reader->sample_count = 0;
+    reader->next_sample = 0;
+  } else {
+    fseeko(reader->file, entry->offset, SEEK_SET);
+    reader->buffer_offset = entry->offset;
+    reader->start = 0;
+    reader->size = 0;
+    reader->eof = false;
+    reader->next_entry = low;
+  }
+
+  reader->timestamp = entry->time;
+  dvr_rebase(reader);
+  return 0;
+}
+
+static uint64_t getMonotonicTime(void) {
+  struct timespec timestamp;
+  clock_gettime(CLOCK_MONOTONIC, &timestamp);
+  return (uint64_t)timestamp.tv_sec * 1000000 + timestamp.tv_nsec / 1000;
+}
+
+void dvr_pace(DvrReader* reader, const DvrFrame* frame) {
+  uint64_t now = getMonotonicTime();
+  int32_t elapsed = frame->timestamp - reader->first_timestamp;
+  uint64_t due = reader->start_time + (int64_t)elapsed * 100 / 9;
+
+  // Event recordings jump over the time nothing was recorded
+  if (!reader->start_time || elapsed < 0 || (due > now && due - now > DVR_MAX_GAP_US)) {
+    reader->start_time = now;
+    reader->first_timestamp = frame->timestamp;
+    return;
+  }
+
+  if (due > now) {
+    usleep(due - now);
+  }
+}
+
+void dvr_rebase(DvrReader* reader) {
+  reader->start_time = 0;
+}
+
+void dvr_close(DvrReader* reader) {
+  if (reader->file) {
+    fclose(reader->file);
+    reader->file = 0;
+  }
+
+  free(reader->buffer);
+  free(reader->samples);
+  free(reader->index);
+  reader->buffer = 0;
+  reader->samples = 0;
+  reader->index = 0;
+}
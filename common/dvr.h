@@ -0,0 +1,110 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Reader for DVR recordings, raw Annex-B or fragmented MP4 as written by
+// the recorder, one access unit at a time. Each file has a sidecar index
+// with one record per GOP, so seeking is a lookup instead of a scan.
+
+#define DVR_INDEX_EXTENSION ".idx"
+
+// Gaps in the recording longer than this are skipped when pacing
+#define DVR_MAX_GAP_US 1000000
+
+// Sidecar index record, host byte order, in file order
+typedef struct {
+  uint64_t offset;      // Parameter sets of the GOP, the moof in MP4 files
+  uint32_t time;        // 90 kHz since the start of the file
+  uint16_t frames;      // Access units in the GOP
+  uint16_t frame_duration; // Raw files: 90 kHz between frames, 0 if unknown
+} DvrIndexEntry;
+
+typedef struct {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t duration;
+  bool sync;
+} DvrSample;
+
+typedef struct {
+  FILE* file;
+  char path[256];
+  bool mp4;
+  bool hevc;
+
+  // Access unit returned by the last read, Annex-B
+  uint8_t* buffer;
+  uint32_t capacity;
+  uint32_t start;       // Raw files: unread data is buffer[start..size)
+  uint32_t size;
+  uint64_t buffer_offset; // File position of buffer[0]
+  bool eof;
+
+  // MP4 files: samples of the current fragment
+  DvrSample* samples;
+  uint32_t sample_count;
+  uint32_t sample_capacity;
+  uint32_t next_sample;
+  uint64_t next_box;    // Position of the next top level box
+
+  DvrIndexEntry* index;
+  uint32_t index_count;
+  uint32_t next_entry;  // Raw files: next GOP to sync timestamps with
+
+  uint32_t timestamp;   // Of the next access unit
+  uint32_t frame_duration;
+
+  // Playback pacing, see dvr_pace
+  uint64_t start_time;
+  uint32_t first_timestamp;
+} DvrReader;
+
+typedef struct {
+  uint8_t* data;        // Annex-B access unit, valid until the next read
+  uint32_t size;
+  uint32_t timestamp;   // 90 kHz since the start of the file
+  bool keyframe;
+} DvrFrame;
+
+/**
+ * @brief Open a recording and its index, the format is detected
+ * @return 0 on success
+ */
+int dvr_open(DvrReader* reader, const char* path);
+
+/**
+ * @brief Continue with the next segment, name_00042.ext after
+ * name_00041.ext, if it exists
+ * @return 0 on success, the current file stays open otherwise
+ */
+int dvr_open_next(DvrReader* reader);
+
+/**
+ * @brief Read the next access unit
+ * @return 1 if a frame was read, 0 at end of file, -1 on error
+ */
+int dvr_read(DvrReader* reader, DvrFrame* frame);
+
+/**
+ * @brief Continue reading at the last keyframe at or before time
+ * @param time - 90 kHz since the start of the file
+ * @return 0 on success, -1 without index
+ */
+int dvr_seek(DvrReader* reader, uint32_t time);
+
+/**
+ * @brief Sleep until a frame is due with its recorded timing. The next
+ * frame after dvr_rebase is shown immediately.
+ */
+void dvr_pace(DvrReader* reader, const DvrFrame* frame);
+
+/**
+ * @brief Restart pacing, after a pause, seek or new file
+ */
+void dvr_rebase(DvrReader* reader);
+
+/**
+ * @brief Close recording and release buffers
+ */
+void dvr_close(DvrReader* reader);
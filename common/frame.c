@@ -0,0 +1,76 @@
+#include "frame.h"
+#include "packet.h"
+#include <string.h>
+
+void frame_reset(FrameAssembler* frame, uint8_t* buffer, uint32_t capacity) {
+  frame->data = buffer;
+  frame->capacity = capacity;
+  frame->size = 0;
+  frame->nals = 0;
+  frame->has_slice = false;
+  frame->nal_flags = 0;
+}
+
+bool frame_starts_unit(const FrameAssembler* frame, const uint8_t* data,
+  uint32_t size) {
+  if (!frame->has_slice) {
+    return false;
+  }
+
+  uint32_t header_size = packet_header_size(data, size);
+  data += header_size;
+  size -= header_size;
+  if (size < 4) {
+    return false;
+  }
+
+  // Rebuild the NAL header of a fragmentation unit start
+  uint8_t nal[3];
+  if (frame->hevc && ((data[0] >> 1) & 0x3F) == NAL_FU_HEVC) {
+    if (!(data[2] & 0x80)) {
+      return false;
+    }
+    nal[0] = (data[2] & 0x3F) << 1;
+    nal[1] = data[1];
+    nal[2] = data[3];
+  } else if (!frame->hevc && (data[0] & 0x1F) == NAL_FU_AVC) {
+    if (!(data[1] & 0x80)) {
+      return false;
+    }
+    nal[0] = data[1] & 0x1F;
+    nal[1] = data[2];
+    nal[2] = data[3];
+  } else {
+    memcpy(nal, data, sizeof(nal));
+  }
+
+  return packet_classify(frame->hevc, nal, sizeof(nal)) & NAL_FLAG_UNIT_START;
+}
+
+int frame_append(FrameAssembler* frame, const uint8_t* nal, uint32_t size,
+  uint8_t flags, uint64_t now) {
+  uint8_t* tail = frame->data + frame->size;
+  if (nal != tail) {
+    if (size > frame->capacity - frame->size) {
+      frame->overflows++;
+      return -1;
+    }
+    memmove(tail, nal, size);
+  }
+
+  frame->has_slice |= (flags & NAL_FLAG_SLICE) != 0;
+  frame->nal_flags |= flags;
+
+  if (!frame->nals) {
+    frame->start_time = now;
+  }
+
+  frame->size += size;
+  frame->nals++;
+  return 0;
+}
+
+uint8_t* frame_tail(const FrameAssembler* frame, uint32_t* capacity) {
+  *capacity = frame->capacity - frame->size;
+  return frame->data + frame->size;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Groups depacketized NAL units into access units for frame mode
+// decoding. NAL units are laid out back to back in one buffer, the
+// depacketizer reassembles fragments straight at the tail. A unit ends
+// on the RTP marker bit, when the first slice or a parameter set of the
+// next picture arrives, or when the caller's timeout expires.
+
+typedef struct {
+  bool hevc;
+  uint8_t* data;          // Start of the access unit
+  uint32_t size;
+  uint32_t capacity;
+  uint32_t nals;
+  bool has_slice;
+  uint8_t nal_flags;      // NAL_FLAG_* of all NAL units in the unit
+  uint64_t start_time;    // Arrival of the first NAL unit, microseconds
+  uint32_t timestamp;     // 90 kHz, of the first NAL unit, set by the caller
+
+  // Totals since init
+  uint64_t frames;
+  uint64_t timeouts;      // Units closed by the timeout
+  uint64_t overflows;     // NAL units dropped for lack of space
+} FrameAssembler;
+
+/**
+ * @brief Start an empty access unit
+ * @param buffer - Where the unit is laid out
+ */
+void frame_reset(FrameAssembler* frame, uint8_t* buffer, uint32_t capacity);
+
+/**
+ * @brief Peek at a datagram before depacketizing it
+ * @return true if it opens the next access unit while one is pending
+ */
+bool frame_starts_unit(const FrameAssembler* frame, const uint8_t* data,
+  uint32_t size);
+
+/**
+ * @brief Append a NAL unit with start code, copied unless it already sits
+ * at the tail
+ * @param flags - NAL_FLAG_* from the depacketizer, not parsed again
+ * @param now - Arrival time in microseconds
+ * @return 0 on success, -1 if it does not fit
+ */
+int frame_append(FrameAssembler* frame, const uint8_t* nal, uint32_t size,
+  uint8_t flags, uint64_t now);
+
+/**
+ * @brief Free space behind the last NAL unit, for the depacketizer
+ */
+uint8_t* frame_tail(const FrameAssembler* frame, uint32_t* capacity);
@@ -0,0 +1,207 @@
+#include "jitter.h"
+#include "packet.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Sequence numbers further behind than this mean a sender restart
+#define JITTER_RESTART_WINDOW 256
+
+static uint32_t slotStride(const JitterBuffer* jitter) {
+  return (JITTER_HEADROOM + jitter->slot_size + 63) & ~63;
+}
+
+static uint8_t* slotData(const JitterBuffer* jitter, uint32_t index) {
+  return jitter->slab + (size_t)index * slotStride(jitter) + JITTER_HEADROOM;
+}
+
+static uint32_t slotIndex(const JitterBuffer* jitter, uint16_t ahead) {
+  return (jitter->head + ahead) % jitter->depth;
+}
+
+static void advance(JitterBuffer* jitter, uint16_t count) {
+  jitter->next_sequence += count;
+  jitter->head = slotIndex(jitter, count % jitter->depth);
+}
+
+static void flushHeld(JitterBuffer* jitter) {
+  jitter->overflow.size = 0;
+  for (uint32_t i = 0; i < jitter->depth; i++) {
+    jitter->slots[i].size = 0;
+  }
+
+  jitter->flushed += jitter->held;
+  jitter->held = 0;
+}
+
+// Give up on the missing packets in front of the oldest held one
+static void skipGap(JitterBuffer* jitter) {
+  uint16_t gap = 1;
+  while (gap < jitter->depth) {
+    if (jitter->slots[slotIndex(jitter, gap)].size) {
+      break;
+    }
+    gap++;
+  }
+
+  advance(jitter, gap);
+  jitter->skipped += gap;
+}
+
+static uint64_t oldestArrival(const JitterBuffer* jitter) {
+  uint64_t oldest = UINT64_MAX;
+  for (uint32_t i = 0; i < jitter->depth; i++) {
+    if (jitter->slots[i].size && jitter->slots[i].arrival < oldest) {
+      oldest = jitter->slots[i].arrival;
+    }
+  }
+
+  return oldest;
+}
+
+int jitter_init(JitterBuffer* jitter, uint32_t depth, uint32_t hold_us,
+  uint32_t slot_size) {
+  memset(jitter, 0x00, sizeof(JitterBuffer));
+  jitter->depth = depth;
+  jitter->hold_us = hold_us;
+  jitter->slot_size = slot_size;
+  if (!depth) {
+    return 0;
+  }
+
+  jitter->slab = malloc((size_t)slotStride(jitter) * (depth + 1));
+  jitter->slots = calloc(depth, sizeof(JitterSlot));
+  if (!jitter->slab || !jitter->slots) {
+    jitter_free(jitter);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void passThrough(JitterBuffer* jitter, uint8_t* data, uint32_t size) {
+  jitter->direct = data;
+  jitter->direct_size = size;
+}
+
+void jitter_push(JitterBuffer* jitter, uint8_t* data, uint32_t size,
+  uint64_t now) {
+  // No buffer, no sequence number, no room to hold it or still draining
+  if (!jitter->depth || !packet_header_size(data, size) ||
+    size > jitter->slot_size || jitter->overflow.size) {
+    passThrough(jitter, data, size);
+    return;
+  }
+
+  uint16_t sequence = (data[2] << 8) | data[3];
+  if (!jitter->sequence_valid) {
+    jitter->next_sequence = sequence;
+    jitter->sequence_valid = true;
+  }
+
+  uint16_t ahead = sequence - jitter->next_sequence;
+  if (ahead >= 0x8000) {
+    uint16_t behind = jitter->next_sequence - sequence;
+    if (behind <= JITTER_RESTART_WINDOW) {
+      // Late or duplicate, the depacketizer counts and drops it
+      passThrough(jitter, data, size);
+      return;
+    }
+
+    flushHeld(jitter);
+    jitter->next_sequence = sequence;
+    ahead = 0;
+  }
+
+  // Nothing waiting, release without a copy
+  if (!jitter->held && ahead < jitter->depth) {
+    if (!ahead) {
+      advance(jitter, 1);
+      passThrough(jitter, data, size);
+      return;
+    }
+  } else if (!jitter->held) {
+    jitter->skipped += ahead;
+    advance(jitter, ahead + 1);
+    passThrough(jitter, data, size);
+    return;
+  }
+
+  JitterSlot* slot;
+  uint8_t* slot_data;
+  if (ahead >= jitter->depth) {
+    slot = &jitter->overflow;
+    slot_data = slotData(jitter, jitter->depth);
+  } else {
+    slot = &jitter->slots[slotIndex(jitter, ahead)];
+    slot_data = slotData(jitter, slotIndex(jitter, ahead));
+    if (slot->size) {
+      return; // Duplicate of a held packet
+    }
+    jitter->held++;
+  }
+
+  memcpy(slot_data, data, size);
+  slot->size = size;
+  slot->sequence = sequence;
+  slot->arrival = now;
+}
+
+int jitter_pop(JitterBuffer* jitter, uint8_t** data, uint32_t* size,
+  uint64_t now) {
+  if (jitter->direct) {
+    *data = jitter->direct;
+    *size = jitter->direct_size;
+    jitter->direct = 0;
+    return 1;
+  }
+
+  if (!jitter->held) {
+    if (!jitter->overflow.size) {
+      return 0;
+    }
+
+    uint16_t gap = jitter->overflow.sequence - jitter->next_sequence;
+    jitter->skipped += gap;
+    advance(jitter, gap + 1);
+    *data = slotData(jitter, jitter->depth);
+    *size = jitter->overflow.size;
+    jitter->overflow.size = 0;
+    return 1;
+  }
+
+  uint32_t index = jitter->head;
+  if (!jitter->slots[index].size) {
+    // Wait for the gap to fill unless a packet overflowed the ring
+    if (!jitter->overflow.size &&
+      oldestArrival(jitter) + jitter->hold_us > now) {
+      return 0;
+    }
+
+    skipGap(jitter);
+    index = jitter->head;
+  }
+
+  *data = slotData(jitter, index);
+  *size = jitter->slots[index].size;
+  jitter->slots[index].size = 0;
+  jitter->held--;
+  jitter->reordered++;
+  advance(jitter, 1);
+  return 1;
+}
+
+int jitter_timeout_ms(const JitterBuffer* jitter, uint64_t now) {
+  if (!jitter->held) {
+    return -1;
+  }
+
+  uint64_t expiry = oldestArrival(jitter) + jitter->hold_us;
+  return expiry > now ? (expiry - now + 999) / 1000 : 0;
+}
+
+void jitter_free(JitterBuffer* jitter) {
+  free(jitter->slab);
+  free(jitter->slots);
+  jitter->slab = 0;
+  jitter->slots = 0;
+}
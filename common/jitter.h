@@ -0,0 +1,81 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Reorder buffer keyed by RTP sequence number. In-order packets are
+// passed straight through, out-of-order ones are held until the gap is
+// filled, the hold time runs out or the buffer is full. Depth 0 disables
+// reordering entirely. Compact mode packets have no sequence number and
+// always pass through.
+
+// Space in front of each held packet, the depacketizer writes start codes there
+#define JITTER_HEADROOM 8
+
+typedef struct {
+  uint32_t size;          // 0 if the slot is empty
+  uint16_t sequence;
+  uint64_t arrival;       // Microseconds, caller supplied clock
+} JitterSlot;
+
+typedef struct {
+  uint32_t depth;         // Packets held at most
+  uint32_t hold_us;       // Longest wait for a missing packet
+  uint32_t slot_size;     // Largest packet accepted
+  uint8_t* slab;          // depth + 1 slots with headroom
+  JitterSlot* slots;      // Ring starting at next_sequence
+  uint32_t head;          // Slot of next_sequence
+  uint32_t held;
+
+  // Packet too far ahead for the ring, released after everything held
+  JitterSlot overflow;
+
+  bool sequence_valid;
+  uint16_t next_sequence; // Next packet to release
+
+  // Packet passed through without a copy, released by the next pop
+  uint8_t* direct;
+  uint32_t direct_size;
+
+  // Totals since init
+  uint64_t reordered;     // Held packets released in order
+  uint64_t skipped;       // Missing packets given up on
+  uint64_t flushed;       // Held packets dropped on sender restart
+} JitterBuffer;
+
+/**
+ * @brief Allocate jitter buffer
+ * @param depth - Packets held at most, 0 for pass-through
+ * @param hold_us - Longest wait for a missing packet in microseconds
+ * @param slot_size - Largest packet accepted, longer ones pass through
+ * @return 0 on success
+ */
+int jitter_init(JitterBuffer* jitter, uint32_t depth, uint32_t hold_us,
+  uint32_t slot_size);
+
+/**
+ * @brief Queue one received datagram. Packets that can be released right
+ * away are not copied and must stay valid until the next jitter_pop.
+ * @param now - Arrival time in microseconds
+ */
+void jitter_push(JitterBuffer* jitter, uint8_t* data, uint32_t size,
+  uint64_t now);
+
+/**
+ * @brief Next packet in sequence order. Data stays valid until the next
+ * push or pop, JITTER_HEADROOM bytes in front of it may be overwritten.
+ * @param now - Current time in microseconds, expires the hold time
+ * @return 1 if a packet was returned, 0 if none is ready
+ */
+int jitter_pop(JitterBuffer* jitter, uint8_t** data, uint32_t* size,
+  uint64_t now);
+
+/**
+ * @brief Time until a held packet expires, for the receive timeout
+ * @return Milliseconds, -1 if nothing is held
+ */
+int jitter_timeout_ms(const JitterBuffer* jitter, uint64_t now);
+
+/**
+ * @brief Release jitter buffer memory
+ */
+void jitter_free(JitterBuffer* jitter);
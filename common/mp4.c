@@ -0,0 +1,534 @@
+#include "mp4.h"
+#include "packet.h"
+#include <stdlib.h>
+#include <string.h>
+
+// trun sample flags
+#define SAMPLE_SYNC 0x02000000      // Depends on no other sample
+#define SAMPLE_NON_SYNC 0x01010000  // Depends on others, not a sync sample
+
+static const uint32_t unity_matrix[9] = {
+  0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000
+};
+
+static int growBuffer(uint8_t** buffer, uint32_t* capacity, uint32_t needed) {
+  if (needed <= *capacity) {
+    return 0;
+  }
+
+  uint32_t size = *capacity ? *capacity : 64 * 1024;
+  while (size < needed) {
+    size *= 2;
+  }
+
+  uint8_t* grown = realloc(*buffer, size);
+  if (!grown) {
+    return -1;
+  }
+
+  *buffer = grown;
+  *capacity = size;
+  return 0;
+}
+
+static void putBytes(Mp4Muxer* muxer, const void* data, uint32_t size) {
+  if (growBuffer(&muxer->boxes, &muxer->boxes_capacity,
+    muxer->boxes_size + size)) {
+    return;
+  }
+
+  memcpy(muxer->boxes + muxer->boxes_size, data, size);
+  muxer->boxes_size += size;
+}
+
+static void put8(Mp4Muxer* muxer, uint8_t value) {
+  putBytes(muxer, &value, 1);
+}
+
+static void put16(Mp4Muxer* muxer, uint16_t value) {
+  uint8_t bytes[2] = {value >> 8, value};
+  putBytes(muxer, bytes, sizeof(bytes));
+}
+
+static void put32(Mp4Muxer* muxer, uint32_t value) {
+  uint8_t bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+  putBytes(muxer, bytes, sizeof(bytes));
+}
+
+static void put64(Mp4Muxer* muxer, uint64_t value) {
+  put32(muxer, value >> 32);
+  put32(muxer, value);
+}
+
+static void putZeros(Mp4Muxer* muxer, uint32_t count) {
+  while (count--) {
+    put8(muxer, 0);
+  }
+}
+
+static void writeBe32(uint8_t* data, uint32_t value) {
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+// Returns the box offset for endBox, which patches in the size
+static uint32_t beginBox(Mp4Muxer* muxer, const char* type) {
+  uint32_t offset = muxer->boxes_size;
+  put32(muxer, 0);
+  putBytes(muxer, type, 4);
+  return offset;
+}
+
+static uint32_t beginFullBox(Mp4Muxer* muxer, const char* type,
+  uint8_t version, uint32_t flags) {
+  uint32_t offset = beginBox(muxer, type);
+  put32(muxer, (uint32_t)version << 24 | flags);
+  return offset;
+}
+
+static void endBox(Mp4Muxer* muxer, uint32_t offset) {
+  if (offset + 4 <= muxer->boxes_size) {
+    writeBe32(muxer->boxes + offset, muxer->boxes_size - offset);
+  }
+}
+
+static void putMatrix(Mp4Muxer* muxer) {
+  for (uint32_t i = 0; i < 9; i++) {
+    put32(muxer, unity_matrix[i]);
+  }
+}
+
+static void putAvcConfiguration(Mp4Muxer* muxer) {
+  uint32_t box = beginBox(muxer, "avcC");
+  put8(muxer, 1);
+  putBytes(muxer, muxer->sps + 1, 3); // Profile, constraint flags, level
+  put8(muxer, 0xFF);                  // 4-byte NAL unit lengths
+  put8(muxer, 0xE1);
+  put16(muxer, muxer->sps_size);
+  putBytes(muxer, muxer->sps, muxer->sps_size);
+  put8(muxer, 1);
+  put16(muxer, muxer->pps_size);
+  putBytes(muxer, muxer->pps, muxer->pps_size);
+
+  uint8_t profile = muxer->sps[1];
+  if (profile == 100 || profile == 110 || profile == 122 || profile == 244) {
+    put8(muxer, 0xFC | muxer->format.chroma_format);
+    put8(muxer, 0xF8 | (muxer->format.bit_depth_luma - 8));
+    put8(muxer, 0xF8 | (muxer->format.bit_depth_chroma - 8));
+    put8(muxer, 0);
+  }
+  endBox(muxer, box);
+}
+
+static void putHevcConfiguration(Mp4Muxer* muxer) {
+  uint32_t box = beginBox(muxer, "hvcC");
+  put8(muxer, 1);
+  putBytes(muxer, muxer->format.profile_tier_level,
+    sizeof(muxer->format.profile_tier_level));
+  put16(muxer, 0xF000);               // min_spatial_segmentation_idc
+  put8(muxer, 0xFC);                  // parallelismType unknown
+  put8(muxer, 0xFC | muxer->format.chroma_format);
+  put8(muxer, 0xF8 | (muxer->format.bit_depth_luma - 8));
+  put8(muxer, 0xF8 | (muxer->format.bit_depth_chroma - 8));
+  put16(muxer, 0);                    // avgFrameRate unknown
+  put8(muxer, 0x03);                  // 4-byte NAL unit lengths
+
+  // Arrays are not complete, hev1 repeats parameter sets in band
+  const uint8_t* sets[3] = {muxer->vps, muxer->sps, muxer->pps};
+  uint32_t sizes[3] = {muxer->vps_size, muxer->sps_size, muxer->pps_size};
+  put8(muxer, 3);
+  for (uint32_t i = 0; i < 3; i++) {
+    put8(muxer, 32 + i);
+    put16(muxer, 1);
+    put16(muxer, sizes[i]);
+    putBytes(muxer, sets[i], sizes[i]);
+  }
+  endBox(muxer, box);
+}
+
+static void putSampleEntry(Mp4Muxer* muxer) {
+  uint32_t box = beginBox(muxer, muxer->hevc ? "hev1" : "avc3");
+  putZeros(muxer, 6);
+  put16(muxer, 1);                    // data_reference_index
+  putZeros(muxer, 16);
+  put16(muxer, muxer->format.width);
+  put16(muxer, muxer->format.height);
+  put32(muxer, 0x00480000);           // 72 dpi
+  put32(muxer, 0x00480000);
+  put32(muxer, 0);
+  put16(muxer, 1);                    // frame_count
+  putZeros(muxer, 32);                // compressorname
+  put16(muxer, 0x0018);
+  put16(muxer, 0xFFFF);
+  if (muxer->hevc) {
+    putHevcConfiguration(muxer);
+  } else {
+    putAvcConfiguration(muxer);
+  }
+  endBox(muxer, box);
+}
+
+// ftyp and moov with one video track and no samples
+static int writeHeader(Mp4Muxer* muxer) {
+  sps_parse(muxer->sps, muxer->sps_size, &muxer->format);
+  muxer->boxes_size = 0;
+
+  uint32_t ftyp = beginBox(muxer, "ftyp");
+  putBytes(muxer, "iso5", 4);
+  put32(muxer, 512);
+  putBytes(muxer, "iso5iso6mp41", 12);
+  endBox(muxer, ftyp);
+
+  uint32_t moov = beginBox(muxer, "moov");
+  uint32_t mvhd = beginFullBox(muxer, "mvhd", 0, 0);
+  put32(muxer, 0);
+  put32(muxer, 0);
+  put32(muxer, 1000);
+  put32(muxer, 0);
+  put32(muxer, 0x00010000);           // Rate 1.0
+  put16(muxer, 0x0100);               // Volume 1.0
+  putZeros(muxer, 10);
+  putMatrix(muxer);
+  putZeros(muxer, 24);
+  put32(muxer, 2);                    // next_track_ID
+  endBox(muxer, mvhd);
+
+  uint32_t trak = beginBox(muxer, "trak");
+  uint32_t tkhd = beginFullBox(muxer, "tkhd", 0, 3); // Enabled, in movie
+  put32(muxer, 0);
+  put32(muxer, 0);
+  put32(muxer, 1);                    // track_ID
+  put32(muxer, 0);
+  put32(muxer, 0);
+  putZeros(muxer, 16);
+  putMatrix(muxer);
+  put32(muxer, muxer->format.width << 16);
+  put32(muxer, muxer->format.height << 16);
+  endBox(muxer, tkhd);
+
+  uint32_t mdia = beginBox(muxer, "mdia");
+  uint32_t mdhd = beginFullBox(muxer, "mdhd", 0, 0);
+  put32(muxer, 0);
+  put32(muxer, 0);
+  put32(muxer, MP4_TIMESCALE);
+  put32(muxer, 0);
+  put16(muxer, 0x55C4);               // "und"
+  put16(muxer, 0);
+  endBox(muxer, mdhd);
+
+  uint32_t hdlr = beginFullBox(muxer, "hdlr", 0, 0);
+  put32(muxer, 0);
+  putBytes(muxer, "vide", 4);
+  putZeros(muxer, 12);
+  putBytes(muxer, "VideoHandler", 13);
+  endBox(muxer, hdlr);
+
+  uint32_t minf = beginBox(muxer, "minf");
+  uint32_t vmhd = beginFullBox(muxer, "vmhd", 0, 1);
+  putZeros(muxer, 8);
+  endBox(muxer, vmhd);
+
+  uint32_t dinf = beginBox(muxer, "dinf");
+  uint32_t dref = beginFullBox(muxer, "dref", 0, 0);
+  put32(muxer, 1);
+  endBox(muxer, beginFullBox(muxer, "url ", 0, 1)); // Data in this file
+  endBox(muxer, dref);
+  endBox(muxer, dinf);
+
+  uint32_t stbl = beginBox(muxer, "stbl");
+  uint32_t stsd = beginFullBox(muxer, "stsd", 0, 0);
+  put32(muxer, 1);
+  putSampleEntry(muxer);
+  endBox(muxer, stsd);
+
+  // Samples live in the fragments
+  const char* empty[] = {"stts", "stsc", "stco"};
+  for (uint32_t i = 0; i < 3; i++) {
+    uint32_t table = beginFullBox(muxer, empty[i], 0, 0);
+    put32(muxer, 0);
+    endBox(muxer, table);
+  }
+  uint32_t stsz = beginFullBox(muxer, "stsz", 0, 0);
+  put32(muxer, 0);
+  put32(muxer, 0);
+  endBox(muxer, stsz);
+  endBox(muxer, stbl);
+  endBox(muxer, minf);
+  endBox(muxer, mdia);
+  endBox(muxer, trak);
+
+  uint32_t mvex = beginBox(muxer, "mvex");
+  uint32_t trex = beginFullBox(muxer, "trex", 0, 0);
+  put32(muxer, 1);                    // track_ID
+  put32(muxer, 1);                    // Sample description
+  put32(muxer, 0);
+  put32(muxer, 0);
+  put32(muxer, 0);
+  endBox(muxer, trex);
+  endBox(muxer, mvex);
+  endBox(muxer, moov);
+
+  muxer->header_written = true;
+  muxer->written += muxer->boxes_size;
+  return muxer->writer(muxer->context, muxer->boxes, muxer->boxes_size);
+}
+
+// Drop the closed samples, the open one moves to the front
+static void releaseSamples(Mp4Muxer* muxer) {
+  memmove(muxer->data, muxer->data + muxer->size, muxer->open_size);
+  muxer->size = 0;
+  muxer->sample_count = 0;
+}
+
+// Write the closed samples as moof + mdat, the open sample stays
+static int flushFragment(Mp4Muxer* muxer) {
+  if (!muxer->sample_count) {
+    return 0;
+  }
+
+  int ret = 0;
+  if (!muxer->header_written) {
+    // No parameter sets yet, nothing playable
+    if (!muxer->sps_size || !muxer->pps_size ||
+      (muxer->hevc && !muxer->vps_size)) {
+      releaseSamples(muxer);
+      return 0;
+    }
+
+    ret = writeHeader(muxer);
+  }
+
+  muxer->boxes_size = 0;
+  uint32_t moof = beginBox(muxer, "moof");
+  uint32_t mfhd = beginFullBox(muxer, "mfhd", 0, 0);
+  put32(muxer, ++muxer->sequence);
+  endBox(muxer, mfhd);
+
+  uint32_t traf = beginBox(muxer, "traf");
+  uint32_t tfhd = beginFullBox(muxer, "tfhd", 0, 0x020000); // Base is moof
+  put32(muxer, 1);
+  endBox(muxer, tfhd);
+
+  uint64_t start_time = muxer->decode_time;
+  uint32_t tfdt = beginFullBox(muxer, "tfdt", 1, 0);
+  put64(muxer, start_time);
+  endBox(muxer, tfdt);
+
+  // Data offset, sample duration, size and flags present
+  uint32_t trun = beginFullBox(muxer, "trun", 0, 0x000701);
+  put32(muxer, muxer->sample_count);
+  uint32_t data_offset = muxer->boxes_size;
+  put32(muxer, 0);
+  for (uint32_t i = 0; i < muxer->sample_count; i++) {
+    Mp4Sample* sample = &muxer->samples[i];
+    put32(muxer, sample->duration);
+    put32(muxer, sample->size);
+    put32(muxer, sample->sync ? SAMPLE_SYNC : SAMPLE_NON_SYNC);
+    muxer->decode_time += sample->duration;
+  }
+  endBox(muxer, trun);
+  endBox(muxer, traf);
+  endBox(muxer, moof);
+
+  uint32_t moof_size = muxer->boxes_size - moof;
+  put32(muxer, 8 + muxer->size);
+  putBytes(muxer, "mdat", 4);
+  if (data_offset + 4 <= muxer->boxes_size) {
+    writeBe32(muxer->boxes + data_offset, moof_size + 8);
+  }
+
+  // Fragments opened by a keyframe are the seek points of the file
+  if (muxer->samples[0].sync) {
+    muxer->sync_offset = muxer->written;
+    muxer->sync_time = start_time;
+    muxer->sync_frames = muxer->frames;
+    muxer->sync_fragments++;
+  }
+
+  ret |= muxer->writer(muxer->context, muxer->boxes, muxer->boxes_size);
+  ret |= muxer->writer(muxer->context, muxer->data, muxer->size);
+  muxer->written += muxer->boxes_size + muxer->size;
+  muxer->fragments++;
+  muxer->frames += muxer->sample_count;
+  releaseSamples(muxer);
+  return ret ? -1 : 0;
+}
+
+// The next sample starting at timestamp tells the duration of this one
+static int closeSample(Mp4Muxer* muxer, uint32_t timestamp) {
+  uint32_t duration = timestamp - muxer->open_timestamp;
+  if ((int32_t)duration <= 0 || duration > MP4_TIMESCALE * 10) {
+    duration = muxer->last_duration ? muxer->last_duration : MP4_TIMESCALE / 30;
+  }
+  muxer->last_duration = duration;
+  muxer->open = false;
+
+  // Fragments start at keyframes, long GOPs are split
+  int ret = 0;
+  if (muxer->open_sync || muxer->size + muxer->open_size > MP4_FRAGMENT_LIMIT) {
+    ret = flushFragment(muxer);
+  }
+
+  if (muxer->sample_count == muxer->sample_capacity) {
+    uint32_t capacity = muxer->sample_capacity ? muxer->sample_capacity * 2 : 256;
+    Mp4Sample* samples = realloc(muxer->samples, capacity * sizeof(Mp4Sample));
+    if (!samples) {
+      muxer->open_size = 0;
+      return -1;
+    }
+    muxer->samples = samples;
+    muxer->sample_capacity = capacity;
+  }
+
+  Mp4Sample* sample = &muxer->samples[muxer->sample_count++];
+  sample->size = muxer->open_size;
+  sample->duration = duration;
+  sample->sync = muxer->open_sync;
+  muxer->size += muxer->open_size;
+  muxer->open_size = 0;
+  return ret;
+}
+
+static void keepParameterSet(Mp4Muxer* muxer, const uint8_t* nal, uint32_t size) {
+  uint8_t type = muxer->hevc ? (nal[0] >> 1) & 0x3F : nal[0] & 0x1F;
+  uint8_t* target = 0;
+  uint32_t* target_size = 0;
+  if (muxer->hevc ? type == 32 : false) {
+    target = muxer->vps;
+    target_size = &muxer->vps_size;
+  } else if (muxer->hevc ? type == 33 : type == 7) {
+    target = muxer->sps;
+    target_size = &muxer->sps_size;
+  } else if (muxer->hevc ? type == 34 : type == 8) {
+    target = muxer->pps;
+    target_size = &muxer->pps_size;
+  }
+
+  if (target && size <= sizeof(muxer->sps)) {
+    memcpy(target, nal, size);
+    *target_size = size;
+  }
+}
+
+// Offset of the next 3 or 4 byte start code at or after offset
+static uint32_t nextStartCode(const uint8_t* data, uint32_t size, uint32_t offset) {
+  const uint8_t* end = data + size;
+  const uint8_t* position = data + offset + 2;
+  while (position < end && (position = memchr(position, 1, end - position))) {
+    if (!position[-1] && !position[-2]) {
+      uint32_t start = position - 2 - data;
+      return start > offset && !data[start - 1] ? start - 1 : start;
+    }
+    position++;
+  }
+
+  return size;
+}
+
+int mp4_init(Mp4Muxer* muxer, bool hevc, Mp4Writer writer, void* context) {
+  memset(muxer, 0x00, sizeof(*muxer));
+  muxer->hevc = hevc;
+  muxer->writer = writer;
+  muxer->context = context;
+  muxer->wait_keyframe = true;
+  return growBuffer(&muxer->data, &muxer->capacity, 1024 * 1024);
+}
+
+int mp4_write(Mp4Muxer* muxer, const uint8_t* data, uint32_t size,
+  uint8_t flags, uint32_t timestamp) {
+  int ret = 0;
+  if ((flags & NAL_FLAG_UNIT_START) && muxer->open && muxer->open_slice) {
+    ret = closeSample(muxer, timestamp);
+  }
+
+  if (!muxer->open) {
+    // Playback has to start at a keyframe
+    if (muxer->wait_keyframe && !(flags & NAL_FLAG_RECOVERY)) {
+      muxer->skipped++;
+      return ret;
+    }
+
+    muxer->wait_keyframe = false;
+    muxer->open = true;
+    muxer->open_sync = false;
+    muxer->open_slice = false;
+    muxer->open_size = 0;
+    muxer->open_timestamp = timestamp;
+  }
+
+  muxer->open_sync |= (flags & NAL_FLAG_IRAP) != 0;
+  muxer->open_slice |= (flags & NAL_FLAG_SLICE) != 0;
+
+  // Annex-B to 4-byte length prefixes
+  for (uint32_t start = nextStartCode(data, size, 0); start < size;) {
+    uint32_t payload = start + (data[start + 2] == 1 ? 3 : 4);
+    uint32_t end = nextStartCode(data, size, payload);
+    uint32_t nal_size = end - payload;
+    uint32_t used = muxer->size + muxer->open_size;
+    if (!nal_size || growBuffer(&muxer->data, &muxer->capacity, used + 4 + nal_size)) {
+      start = end;
+      continue;
+    }
+
+    if (flags & NAL_FLAG_PARAMETER_SET) {
+      keepParameterSet(muxer, data + payload, nal_size);
+    }
+
+    writeBe32(muxer->data + used, nal_size);
+    memcpy(muxer->data + used + 4, data + payload, nal_size);
+    muxer->open_size += 4 + nal_size;
+    start = end;
+  }
+
+  return ret;
+}
+
+int mp4_discontinuity(Mp4Muxer* muxer, uint32_t timestamp) {
+  // Pending sample starts where the written timeline ends
+  uint32_t gap = muxer->open ? timestamp - muxer->open_timestamp : 0;
+  muxer->open = false;
+  muxer->open_size = 0;
+  muxer->discontinuities++;
+
+  int ret = flushFragment(muxer);
+  if ((int32_t)gap > 0) {
+    muxer->decode_time += gap;
+  }
+
+  // Like the first write, wait for a keyframe
+  muxer->wait_keyframe = true;
+  return ret;
+}
+
+int mp4_finish(Mp4Muxer* muxer) {
+  int ret = 0;
+  if (muxer->open && muxer->open_size) {
+    ret = closeSample(muxer, muxer->open_timestamp + muxer->last_duration);
+  }
+
+  muxer->open = false;
+  muxer->open_size = 0;
+  return flushFragment(muxer) | ret;
+}
+
+void mp4_restart(Mp4Muxer* muxer) {
+  releaseSamples(muxer);
+  muxer->open = false;
+  muxer->open_size = 0;
+  muxer->header_written = false;
+  muxer->wait_keyframe = true;
+  muxer->sequence = 0;
+  muxer->decode_time = 0;
+  muxer->written = 0;
+}
+
+void mp4_free(Mp4Muxer* muxer) {
+  free(muxer->data);
+  free(muxer->samples);
+  free(muxer->boxes);
+  muxer->data = 0;
+  muxer->samples = 0;
+  muxer->boxes = 0;
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include "sps.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Fragmented MP4 muxer for one H.264 or H.265 track. Every keyframe
+// starts a fragment (moof + mdat) that is written as a whole, so a file
+// cut short by power loss stays playable up to the last fragment.
+// Parameter sets are kept in band (avc3 / hev1) as well, which lets the
+// stream change resolution without a new init segment.
+
+// Media timescale, RTP video clock
+#define MP4_TIMESCALE 90000
+
+// Long GOPs are split into several fragments above this size
+#define MP4_FRAGMENT_LIMIT (4 * 1024 * 1024)
+
+/**
+ * @brief Output callback, receives the file contents in order
+ * @return 0 on success
+ */
+typedef int (*Mp4Writer)(void* context, const uint8_t* data, uint32_t size);
+
+typedef struct {
+  uint32_t size;
+  uint32_t duration;
+  bool sync;
+} Mp4Sample;
+
+typedef struct {
+  Mp4Writer writer;
+  void* context;
+  bool hevc;
+
+  // Parameter sets for the init segment, without start codes
+  uint8_t vps[256];
+  uint8_t sps[256];
+  uint8_t pps[256];
+  uint32_t vps_size;
+  uint32_t sps_size;
+  uint32_t pps_size;
+  SpsInfo format;
+  bool header_written;
+
+  // Closed samples of the open fragment and their length prefixed data
+  Mp4Sample* samples;
+  uint32_t sample_count;
+  uint32_t sample_capacity;
+  uint8_t* data;
+  uint32_t size;
+  uint32_t capacity;
+
+  // Sample still collecting NAL units, its data follows the closed ones
+  bool open;
+  bool open_sync;
+  bool open_slice;
+  uint32_t open_size;
+  uint32_t open_timestamp;
+  uint32_t last_duration;
+  bool wait_keyframe;     // Drop data until a recovery point
+
+  uint32_t sequence;      // moof sequence number
+  uint64_t decode_time;   // Start of the open fragment, MP4_TIMESCALE
+  uint64_t written;       // Bytes passed to the writer for this file
+
+  // Last fragment starting with a keyframe, a seek point for indexing
+  uint64_t sync_offset;   // Position of its moof in the file
+  uint64_t sync_time;     // Its decode time
+  uint64_t sync_frames;   // Frames written before it since init
+  uint64_t sync_fragments;
+
+  // Box scratch
+  uint8_t* boxes;
+  uint32_t boxes_size;
+  uint32_t boxes_capacity;
+
+  // Totals since init
+  uint64_t fragments;
+  uint64_t frames;
+  uint64_t skipped;       // NAL units before a keyframe
+  uint64_t discontinuities;
+} Mp4Muxer;
+
+/**
+ * @brief Prepare muxer, nothing is written before the first keyframe
+ * @param hevc - Stream is H.265
+ * @param writer - Output callback
+ * @return 0 on success
+ */
+int mp4_init(Mp4Muxer* muxer, bool hevc, Mp4Writer writer, void* context);
+
+/**
+ * @brief Add Annex-B data, one NAL unit or a whole access unit
+ * @param flags - NAL_FLAG_* of the data as classified by the depacketizer,
+ * NAL_FLAG_UNIT_START opens a new sample once the current one has a slice
+ * @param timestamp - 90 kHz, RTP timestamp or arrival time
+ * @return 0 on success, -1 on output error
+ */
+int mp4_write(Mp4Muxer* muxer, const uint8_t* data, uint32_t size,
+  uint8_t flags, uint32_t timestamp);
+
+/**
+ * @brief Data up to timestamp was lost. Drops the possibly incomplete
+ * pending sample and writes the fragment, the next one starts after a gap
+ * in the timeline. Writing resumes at the next keyframe.
+ * @param timestamp - 90 kHz, of the first data after the loss
+ * @return 0 on success, -1 on output error
+ */
+int mp4_discontinuity(Mp4Muxer* muxer, uint32_t timestamp);
+
+/**
+ * @brief Close the pending sample and write the last fragment
+ * @return 0 on success, -1 on output error
+ */
+int mp4_finish(Mp4Muxer* muxer);
+
+/**
+ * @brief Start the next file after mp4_finish, the writer gets a new init
+ * segment at the next keyframe. Known parameter sets are kept.
+ */
+void mp4_restart(Mp4Muxer* muxer);
+
+/**
+ * @brief Release muxer buffers
+ */
+void mp4_free(Mp4Muxer* muxer);
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+#include "packet.h"
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+int packetizer_init(Packetizer* packetizer, bool hevc, bool rtp,
+  uint16_t max_payload) {
+  memset(packetizer, 0x00, sizeof(Packetizer));
+  packetizer->hevc = hevc;
+  packetizer->rtp = rtp;
+  packetizer->max_payload = max_payload;
+  packetizer->payload_type = 96;
+  packetizer->ssrc_id = 0xDEADBEEF;
+  packetizer->messages = calloc(PACKETIZER_BATCH, sizeof(struct mmsghdr));
+  return packetizer->messages ? 0 : -1;
+}
+
+void packetizer_free(Packetizer* packetizer) {
+  free(packetizer->messages);
+  packetizer->messages = NULL;
+}
+
+static uint32_t skipStartCode(const uint8_t* nal, uint32_t size) {
+  if (size >= 4 && !nal[0] && !nal[1] && !nal[2] && nal[3] == 1) {
+    return 4;
+  }
+
+  if (size >= 3 && !nal[0] && !nal[1] && nal[2] == 1) {
+    return 3;
+  }
+
+  return 0;
+}
+
+static int flushBatch(Packetizer* packetizer, uint32_t count,
+  int socket_handle) {
+  uint32_t sent = 0;
+  while (sent < count) {
+    int ret = sendmmsg(socket_handle, packetizer->messages + sent,
+      count - sent, 0);
+    if (ret <= 0) {
+      return -1;
+    }
+    sent += ret;
+  }
+
+  return 0;
+}
+
+int packetizer_send(Packetizer* packetizer, const uint8_t* nal, uint32_t size,
+  int socket_handle, const struct sockaddr* dst_address) {
+  uint32_t prefix = skipStartCode(nal, size);
+  nal += prefix;
+  size -= prefix;
+  if (!size) {
+    return 0;
+  }
+
+  // FU replaces the NAL header with indicator and FU header
+  bool fragmented = size > packetizer->max_payload;
+  uint32_t nal_header_size = packetizer->hevc ? 2 : 1;
+  uint32_t offset = fragmented ? nal_header_size : 0;
+  uint32_t count = 0;
+  int packets = 0;
+
+  while (offset < size) {
+    uint32_t chunk = size - offset;
+    if (chunk > packetizer->max_payload) {
+      chunk = packetizer->max_payload;
+    }
+
+    uint8_t* header = packetizer->headers[count];
+    uint32_t header_size = 0;
+    if (packetizer->rtp) {
+      header[0] = 0x80;
+      header[1] = packetizer->payload_type & 0x7F;
+      if (packetizer->marker && offset + chunk == size) {
+        header[1] |= 0x80;
+      }
+      uint16_t sequence = htobe16(packetizer->sequence++);
+      uint32_t timestamp = htobe32(packetizer->timestamp);
+      uint32_t ssrc_id = htobe32(packetizer->ssrc_id);
+      memcpy(header + 2, &sequence, sizeof(sequence));
+      memcpy(header + 4, &timestamp, sizeof(timestamp));
+      memcpy(header + 8, &ssrc_id, sizeof(ssrc_id));
+      header_size = PACKET_RTP_HEADER_SIZE;
+    }
+
+    if (fragmented) {
+      uint8_t flags = (offset == nal_header_size ? 0x80 : 0) |
+        (offset + chunk == size ? 0x40 : 0);
+      if (packetizer->hevc) {
+        header[header_size++] = (nal[0] & 0x81) | NAL_FU_HEVC << 1;
+        header[header_size++] = nal[1];
+        header[header_size++] = flags | ((nal[0] >> 1) & 0x3F);
+      } else {
+        header[header_size++] = (nal[0] & 0xE0) | NAL_FU_AVC;
+        header[header_size++] = flags | (nal[0] & 0x1F);
+      }
+    }
+
+    struct iovec* vector = packetizer->vectors[count];
+    vector[0].iov_base = header;
+    vector[0].iov_len = header_size;
+    vector[1].iov_base = (void*)(nal + offset);
+    vector[1].iov_len = chunk;
+
+    struct msghdr* msg = &packetizer->messages[count].msg_hdr;
+    memset(msg, 0x00, sizeof(struct msghdr));
+    msg->msg_name = (void*)dst_address;
+    msg->msg_namelen = sizeof(struct sockaddr_in);
+    msg->msg_iov = vector;
+    msg->msg_iovlen = 2;
+
+    packetizer->bytes += header_size + chunk;
+    packetizer->packets++;
+    packets++;
+    offset += chunk;
+
+    if (++count == PACKETIZER_BATCH) {
+      if (flushBatch(packetizer, count, socket_handle)) {
+        return -1;
+      }
+      count = 0;
+    }
+  }
+
+  if (count && flushBatch(packetizer, count, socket_handle)) {
+    return -1;
+  }
+
+  return packets;
+}
+
+void depacketizer_init(Depacketizer* depacketizer, uint8_t* buffer,
+  uint32_t capacity) {
+  memset(depacketizer, 0x00, sizeof(Depacketizer));
+  depacketizer->buffer = buffer;
+  depacketizer->capacity = capacity;
+}
+
+uint8_t packet_classify(bool hevc, const uint8_t* nal, uint32_t size) {
+  if (size < 3) {
+    return 0;
+  }
+
+  uint8_t flags = 0;
+  if (hevc) {
+    uint8_t type = (nal[0] >> 1) & 0x3F;
+    if (type < 32) {
+      flags |= NAL_FLAG_SLICE | (nal[2] & 0x80 ? NAL_FLAG_UNIT_START : 0);
+      flags |= type >= 16 && type <= 21 ? NAL_FLAG_IRAP | NAL_FLAG_RECOVERY : 0;
+    } else if (type <= 39 && type != 36 && type != 37 && type != 38) {
+      flags |= NAL_FLAG_UNIT_START;
+    }
+
+    flags |= type >= 32 && type <= 34 ? NAL_FLAG_PARAMETER_SET : 0;
+    flags |= type == 32 || type == 33 ? NAL_FLAG_RECOVERY : 0;
+    return flags;
+  }
+
+  uint8_t type = nal[0] & 0x1F;
+  if (type >= 1 && type <= 5) {
+    // first_mb_in_slice == 0
+    flags |= NAL_FLAG_SLICE | (nal[1] & 0x80 ? NAL_FLAG_UNIT_START : 0);
+    flags |= type == 5 ? NAL_FLAG_IRAP | NAL_FLAG_RECOVERY : 0;
+  } else if (type >= 6 && type <= 9) {
+    flags |= NAL_FLAG_UNIT_START;
+  }
+
+  flags |= type == 7 || type == 8 ? NAL_FLAG_PARAMETER_SET : 0;
+  flags |= type == 7 ? NAL_FLAG_RECOVERY : 0;
+  return flags;
+}
+
+uint32_t packet_header_size(const uint8_t* data, uint32_t size) {
+  // Forbidden zero bit keeps compact datagrams clear of the RTP version
+  if (size < PACKET_RTP_HEADER_SIZE || !(data[0] & 0x80) || !(data[1] & 0x60)) {
+    return 0;
+  }
+
+  uint32_t header_size = PACKET_RTP_HEADER_SIZE + (data[0] & 0x0F) * 4;
+  if (data[0] & 0x10 && size >= header_size + 4) {
+    uint16_t extension_size;
+    memcpy(&extension_size, data + header_size + 2, sizeof(extension_size));
+    header_size += 4 + be16toh(extension_size) * 4;
+  }
+
+  return header_size < size ? header_size : size;
+}
+
+static void discardNal(Depacketizer* depacketizer) {
+  if (depacketizer->size) {
+    depacketizer->size = 0;
+    depacketizer->nals_discarded++;
+  }
+
+  if (depacketizer->skip_to_keyframe) {
+    depacketizer->waiting = true;
+  }
+}
+
+// Returns false for late packets that must be dropped
+static bool checkSequence(Depacketizer* depacketizer, const uint8_t* header) {
+  uint16_t sequence = (header[2] << 8) | header[3];
+  if (depacketizer->sequence_valid) {
+    uint16_t gap = sequence - depacketizer->next_sequence;
+    uint16_t behind = depacketizer->next_sequence - sequence;
+    if (gap >= 0x8000 && behind <= DEPACKETIZER_REORDER_WINDOW) {
+      depacketizer->late++;
+      return false;
+    }
+
+    // Forward jump is loss, far backward jump is a restarted sender
+    if (gap && gap < 0x8000) {
+      depacketizer->lost += gap;
+    }
+
+    if (gap) {
+      discardNal(depacketizer);
+    }
+  }
+
+  depacketizer->next_sequence = sequence + 1;
+  depacketizer->sequence_valid = true;
+  return true;
+}
+
+static uint8_t* completeNal(Depacketizer* depacketizer, uint8_t* nal,
+  uint32_t size, bool marker, uint32_t* out_size) {
+  uint8_t flags = packet_classify(depacketizer->hevc, nal + 4, size - 4);
+  if (depacketizer->waiting) {
+    if (!(flags & NAL_FLAG_RECOVERY)) {
+      depacketizer->nals_skipped++;
+      return NULL;
+    }
+    depacketizer->waiting = false;
+  }
+
+  depacketizer->nals++;
+  depacketizer->nal_flags = flags;
+  depacketizer->marker = marker;
+  *out_size = size;
+  return nal;
+}
+
+uint8_t* depacketizer_push(Depacketizer* depacketizer, uint8_t* data,
+  uint32_t size, uint32_t* out_size) {
+  uint32_t header_size = packet_header_size(data, size);
+  depacketizer->packets++;
+  if (header_size && !checkSequence(depacketizer, data)) {
+    return NULL;
+  }
+
+  bool marker = header_size && (data[1] & 0x80);
+  depacketizer->timestamp_valid = header_size != 0;
+  if (header_size) {
+    depacketizer->timestamp = (uint32_t)data[4] << 24 | data[5] << 16 |
+      data[6] << 8 | data[7];
+  }
+
+  data += header_size;
+  size -= header_size;
+  if (!size) {
+    return NULL;
+  }
+
+  uint8_t type_avc = data[0] & 0x1F;
+  uint8_t type_hevc = (data[0] >> 1) & 0x3F;
+  bool fu_avc = type_avc == NAL_FU_AVC;
+  bool fu_hevc = type_hevc == NAL_FU_HEVC;
+
+  if (!fu_avc && !fu_hevc) {
+    // End fragment of the NAL being reassembled never arrived
+    if (depacketizer->size) {
+      discardNal(depacketizer);
+    }
+
+    // Single NAL, write start code in front and return in place
+    data -= 4;
+    data[0] = 0;
+    data[1] = 0;
+    data[2] = 0;
+    data[3] = 1;
+    return completeNal(depacketizer, data, size + 4, marker, out_size);
+  }
+
+  depacketizer->hevc = fu_hevc;
+  uint32_t fu_size = fu_hevc ? 3 : 2;
+  if (size <= fu_size) {
+    return NULL;
+  }
+
+  uint8_t flags = data[fu_size - 1];
+  uint8_t* nal = depacketizer->buffer;
+  uint32_t payload_size = size - fu_size;
+
+  if (flags & 0x80) {
+    if (depacketizer->size) {
+      discardNal(depacketizer);
+    }
+
+    // Rebuild start code and original NAL header
+    nal[0] = 0;
+    nal[1] = 0;
+    nal[2] = 0;
+    nal[3] = 1;
+    if (fu_hevc) {
+      nal[4] = (data[0] & 0x81) | (flags & 0x3F) << 1;
+      nal[5] = data[1];
+      depacketizer->size = 6;
+    } else {
+      nal[4] = (data[0] & 0xE0) | (flags & 0x1F);
+      depacketizer->size = 5;
+    }
+  } else if (!depacketizer->size) {
+    // Start fragment was lost
+    depacketizer->fragments_dropped++;
+    return NULL;
+  }
+
+  if (depacketizer->size + payload_size > depacketizer->capacity) {
+    discardNal(depacketizer);
+    return NULL;
+  }
+
+  memcpy(nal + depacketizer->size, data + fu_size, payload_size);
+  depacketizer->size += payload_size;
+
+  if (!(flags & 0x40)) {
+    return NULL;
+  }
+
+  uint32_t nal_size = depacketizer->size;
+  depacketizer->size = 0;
+  return completeNal(depacketizer, nal, nal_size, marker, out_size);
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// RFC 6184 / RFC 7798 packetization shared by venc, vdec and samples.
+// All state lives in the caller owned structs, no globals.
+
+#define PACKET_RTP_HEADER_SIZE 12
+
+// Space a compact mode datagram needs in front of it for in-place output
+#define PACKET_HEADROOM 4
+
+// Fragmentation unit NAL types
+#define NAL_FU_AVC 28
+#define NAL_FU_HEVC 49
+
+// NAL unit classification, see packet_classify
+#define NAL_FLAG_SLICE 0x01         // Coded slice
+#define NAL_FLAG_UNIT_START 0x02    // Prefix NAL unit or first slice of a picture
+#define NAL_FLAG_PARAMETER_SET 0x04 // VPS, SPS or PPS
+#define NAL_FLAG_IRAP 0x08          // IDR, CRA or BLA slice
+#define NAL_FLAG_RECOVERY 0x10      // VPS, SPS or IRAP, decoding can start here
+
+// Datagrams handed to the kernel in one sendmmsg call
+#define PACKETIZER_BATCH 64
+
+typedef struct {
+  bool hevc;            // H.265 FU headers instead of H.264 FU-A
+  bool rtp;             // Prepend RTP header, compact mode otherwise
+  uint16_t max_payload; // NAL bytes per datagram, excluding headers
+  uint8_t payload_type;
+  uint16_t sequence;
+  uint32_t timestamp;   // 90 kHz, set by the caller per access unit
+  bool marker;          // Next NAL unit ends an access unit
+  uint32_t ssrc_id;
+
+  // Totals since init
+  uint64_t packets;
+  uint64_t bytes;
+
+  // Scratch for one batch, headers reference NAL data without copying
+  struct mmsghdr* messages;
+  struct iovec vectors[PACKETIZER_BATCH][2];
+  uint8_t headers[PACKETIZER_BATCH][PACKET_RTP_HEADER_SIZE + 3];
+} Packetizer;
+
+// RTP sequence numbers further behind than this mean a sender restart
+#define DEPACKETIZER_REORDER_WINDOW 256
+
+typedef struct {
+  uint8_t* buffer;      // Fragment reassembly buffer, may be swapped
+  uint32_t capacity;    // between NAL units
+  uint32_t size;        // Bytes of the NAL being reassembled, 0 if none
+  bool hevc;            // Codec, preset by caller or learned from fragments
+  bool marker;          // Last returned NAL unit ends an access unit (RTP)
+  uint8_t nal_flags;    // NAL_FLAG_* of the last returned NAL unit
+  bool timestamp_valid; // Last packet was RTP framed
+  uint32_t timestamp;   // Its RTP timestamp, 90 kHz
+
+  // After a loss drop everything up to the next parameter set or IRAP
+  bool skip_to_keyframe;
+  bool waiting;         // Currently skipping, may be preset to gate start
+
+  bool sequence_valid;
+  uint16_t next_sequence;
+
+  // Totals since init
+  uint32_t nals;
+  uint32_t packets;
+  uint32_t fragments_dropped; // Fragments without their start
+  uint32_t lost;              // Packets missing from the RTP sequence
+  uint32_t late;              // Duplicate or reordered packets dropped
+  uint32_t nals_discarded;    // Incomplete NAL units thrown away
+  uint32_t nals_skipped;      // Complete NAL units dropped while waiting
+} Depacketizer;
+
+/**
+ * @brief Prepare packetizer state
+ * @param hevc - Stream is H.265
+ * @param rtp - Send RTP framed datagrams
+ * @param max_payload - Maximum NAL bytes per datagram
+ * @return 0 on success
+ */
+int packetizer_init(Packetizer* packetizer, bool hevc, bool rtp,
+  uint16_t max_payload);
+
+/**
+ * @brief Release packetizer batch scratch
+ */
+void packetizer_free(Packetizer* packetizer);
+
+/**
+ * @brief Packetize one NAL unit and send all its datagrams.
+ * Payload is never copied, FU headers are sent from a separate iovec.
+ * @param nal - NAL unit, with or without Annex-B start code
+ * @param size - Size of NAL unit
+ * @return Number of datagrams sent, -1 on socket error
+ */
+int packetizer_send(Packetizer* packetizer, const uint8_t* nal, uint32_t size,
+  int socket_handle, const struct sockaddr* dst_address);
+
+/**
+ * @brief Prepare depacketizer state
+ * @param buffer - Reassembly buffer, must hold the largest NAL unit
+ * @param capacity - Size of buffer
+ */
+void depacketizer_init(Depacketizer* depacketizer, uint8_t* buffer,
+  uint32_t capacity);
+
+/**
+ * @brief Classify a NAL unit by its header
+ * @param nal - NAL unit without start code, 3 bytes are enough
+ * @return NAL_FLAG_* bits, 0 for unusable data
+ */
+uint8_t packet_classify(bool hevc, const uint8_t* nal, uint32_t size);
+
+/**
+ * @brief Size of the RTP header in front of a received datagram
+ * @return 0 for compact mode datagrams
+ */
+uint32_t packet_header_size(const uint8_t* data, uint32_t size);
+
+/**
+ * @brief Feed one received datagram, RTP or compact.
+ * Unfragmented NAL units are returned in place, the start code is written
+ * over the PACKET_HEADROOM bytes (or RTP header) in front of the payload.
+ * RTP sequence gaps discard the NAL unit being reassembled, compact mode
+ * only notices losses that break the fragment start/end structure.
+ * @param data - Datagram, preceded by PACKET_HEADROOM writable bytes
+ * @param size - Datagram size
+ * @param out_size - Size of returned NAL unit
+ * @return Complete NAL unit with 4-byte start code, NULL if none yet
+ */
+uint8_t* depacketizer_push(Depacketizer* depacketizer, uint8_t* data,
+  uint32_t size, uint32_t* out_size);
@@ -0,0 +1,94 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Caller holds the lock
+static PoolBlock* findFreeBlock(NalPool* pool) {
+  for (uint32_t i = 0; i < pool->count; i++) {
+    if (!pool->blocks[i].references) {
+      return &pool->blocks[i];
+    }
+  }
+
+  return 0;
+}
+
+int pool_init(NalPool* pool, uint32_t count, uint32_t block_size,
+  uint32_t reserve) {
+  memset(pool, 0x00, sizeof(NalPool));
+  pool->count = count;
+  pool->block_size = block_size;
+  pool->reserve = reserve < block_size ? reserve : block_size;
+  pthread_mutex_init(&pool->lock, NULL);
+
+  pool->blocks = calloc(count, sizeof(PoolBlock));
+  if (!pool->blocks) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    pool->blocks[i].data = malloc(block_size);
+    if (!pool->blocks[i].data) {
+      pool_free(pool);
+      return -1;
+    }
+  }
+
+  pool->current = &pool->blocks[0];
+  pool->current->references = 1;
+  return 0;
+}
+
+uint8_t* pool_buffer(NalPool* pool, uint32_t* capacity) {
+  *capacity = pool->block_size - pool->current->used;
+  return pool->current->data + pool->current->used;
+}
+
+PoolBlock* pool_commit(NalPool* pool, uint32_t size) {
+  pthread_mutex_lock(&pool->lock);
+  PoolBlock* block = pool->current;
+  PoolBlock* next = 0;
+
+  // Never leave the write position short of the reserve
+  if (block->used + size + pool->reserve > pool->block_size) {
+    next = findFreeBlock(pool);
+    if (!next) {
+      pool->exhausted++;
+      pthread_mutex_unlock(&pool->lock);
+      return 0;
+    }
+  }
+
+  block->used += size;
+  block->references++;
+  pool->committed++;
+
+  if (next) {
+    block->references--;
+    next->used = 0;
+    next->references = 1;
+    pool->current = next;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return block;
+}
+
+void pool_release(NalPool* pool, PoolBlock* block) {
+  pthread_mutex_lock(&pool->lock);
+  block->references--;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(NalPool* pool) {
+  if (pool->blocks) {
+    for (uint32_t i = 0; i < pool->count; i++) {
+      free(pool->blocks[i].data);
+    }
+  }
+
+  free(pool->blocks);
+  pool->blocks = 0;
+  pool->current = 0;
+  pthread_mutex_destroy(&pool->lock);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Refcounted blocks holding consecutive NAL units. The depacketizer
+// reassembles straight into the free space of the current block, a
+// consumer that wants to keep a NAL unit commits it in place and holds a
+// block reference instead of copying it.
+
+typedef struct {
+  uint8_t* data;
+  uint32_t used;          // Bytes committed
+  uint32_t references;    // Committed NAL units still held, +1 if current
+} PoolBlock;
+
+typedef struct {
+  PoolBlock* blocks;
+  uint32_t count;
+  uint32_t block_size;
+  uint32_t reserve;       // Free space guaranteed in the current block
+  PoolBlock* current;
+  pthread_mutex_t lock;
+
+  // Totals since init
+  uint64_t committed;
+  uint64_t exhausted;     // Commits refused, every block held
+} NalPool;
+
+/**
+ * @brief Allocate pool blocks
+ * @param count - Number of blocks, 1 disables commits
+ * @param block_size - Bytes per block
+ * @param reserve - Largest NAL unit assembled, at most block_size
+ * @return 0 on success
+ */
+int pool_init(NalPool* pool, uint32_t count, uint32_t block_size,
+  uint32_t reserve);
+
+/**
+ * @brief Write position for the next NAL unit, changes after each commit
+ * @param capacity - Returns free space at the write position
+ */
+uint8_t* pool_buffer(NalPool* pool, uint32_t* capacity);
+
+/**
+ * @brief Keep size bytes at the write position, caller owns one reference
+ * @return Block holding the data, NULL if no block is free to continue in
+ */
+PoolBlock* pool_commit(NalPool* pool, uint32_t size);
+
+/**
+ * @brief Drop one reference, thread safe
+ */
+void pool_release(NalPool* pool, PoolBlock* block);
+
+/**
+ * @brief Release pool memory, every reference must be dropped
+ */
+void pool_free(NalPool* pool);
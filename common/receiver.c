@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include "receiver.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+int receiver_init(Receiver* receiver, int socket_handle, uint32_t slot_size) {
+  memset(receiver, 0x00, sizeof(Receiver));
+  receiver->socket_handle = socket_handle;
+  receiver->slot_size = slot_size;
+
+  // Keep every slot start aligned for the copies out of the slab
+  uint32_t stride = (RECEIVER_HEADROOM + slot_size + 63) & ~63;
+  receiver->slab = malloc((size_t)stride * RECEIVER_BATCH);
+  receiver->messages = calloc(RECEIVER_BATCH, sizeof(struct mmsghdr));
+  receiver->vectors = calloc(RECEIVER_BATCH, sizeof(struct iovec));
+  if (!receiver->slab || !receiver->messages || !receiver->vectors) {
+    receiver_free(receiver);
+    return -1;
+  }
+
+  // Room for a whole IDR burst, capped by net.core.rmem_max
+  int buffer_size = RECEIVER_SOCKET_BUFFER;
+  setsockopt(socket_handle, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+    sizeof(buffer_size));
+
+  for (uint32_t i = 0; i < RECEIVER_BATCH; i++) {
+    receiver->vectors[i].iov_base = receiver->slab + (size_t)i * stride +
+      RECEIVER_HEADROOM;
+    receiver->vectors[i].iov_len = slot_size;
+    receiver->messages[i].msg_hdr.msg_iov = &receiver->vectors[i];
+    receiver->messages[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  return 0;
+}
+
+int receiver_next(Receiver* receiver, uint8_t** data, uint32_t* size,
+  int timeout_ms) {
+  while (receiver->next >= receiver->count) {
+    receiver->next = 0;
+    receiver->count = 0;
+
+    // Drain without waiting first, poll only when the socket is empty
+    int ret = recvmmsg(receiver->socket_handle, receiver->messages,
+      RECEIVER_BATCH, MSG_DONTWAIT, NULL);
+    if (ret > 0) {
+      receiver->count = ret;
+      receiver->batches++;
+      break;
+    }
+
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      return -1;
+    }
+
+    struct pollfd descriptor = {
+      .fd = receiver->socket_handle,
+      .events = POLLIN,
+    };
+
+    ret = poll(&descriptor, 1, timeout_ms);
+    if (ret < 0 && errno != EINTR) {
+      return -1;
+    }
+
+    if (ret <= 0) {
+      return 0;
+    }
+  }
+
+  struct mmsghdr* message = &receiver->messages[receiver->next];
+  *data = receiver->vectors[receiver->next].iov_base;
+  *size = message->msg_len;
+  receiver->truncated += (message->msg_hdr.msg_flags & MSG_TRUNC) != 0;
+  receiver->packets++;
+  receiver->next++;
+  return 1;
+}
+
+void receiver_free(Receiver* receiver) {
+  free(receiver->slab);
+  free(receiver->messages);
+  free(receiver->vectors);
+  receiver->slab = NULL;
+  receiver->messages = NULL;
+  receiver->vectors = NULL;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Batched UDP reception: blocks in poll, then drains every pending
+// datagram with one recvmmsg call into a preallocated slab.
+
+#define RECEIVER_BATCH 32
+
+// Kernel socket buffer requested for the stream
+#define RECEIVER_SOCKET_BUFFER (2 * 1024 * 1024)
+
+// Space in front of each datagram, the depacketizer writes start codes there
+#define RECEIVER_HEADROOM 8
+
+typedef struct {
+  int socket_handle;
+  uint32_t slot_size;     // Largest datagram accepted
+  uint8_t* slab;          // RECEIVER_BATCH slots with headroom
+  struct mmsghdr* messages;
+  struct iovec* vectors;
+  uint32_t count;         // Datagrams in the current batch
+  uint32_t next;          // Next datagram handed out
+
+  // Totals since init
+  uint64_t packets;
+  uint64_t batches;
+  uint64_t truncated;
+} Receiver;
+
+/**
+ * @brief Allocate receive slab for a bound UDP socket
+ * @param slot_size - Largest datagram accepted, longer ones are truncated
+ * @return 0 on success
+ */
+int receiver_init(Receiver* receiver, int socket_handle, uint32_t slot_size);
+
+/**
+ * @brief Next received datagram, waits for a new batch when drained.
+ * Data stays valid until the batch is drained, RECEIVER_HEADROOM bytes
+ * in front of it may be overwritten.
+ * @param timeout_ms - Wait limit, -1 to wait forever
+ * @return 1 if a datagram was returned, 0 on timeout, -1 on error
+ */
+int receiver_next(Receiver* receiver, uint8_t** data, uint32_t* size,
+  int timeout_ms);
+
+/**
+ * @brief Release receive slab, socket is left open
+ */
+void receiver_free(Receiver* receiver);
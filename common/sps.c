@@ -0,0 +1,239 @@
+#include "sps.h"
+#include <string.h>
+
+// Enough RBSP for every field up to the conformance window
+#define SPS_MAX_RBSP 512
+
+typedef struct {
+  const uint8_t* data;
+  uint32_t size;
+  uint32_t position;      // Bit offset
+  bool overrun;
+} BitReader;
+
+static uint32_t readBits(BitReader* reader, uint32_t count) {
+  uint32_t value = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (reader->position >= reader->size * 8) {
+      reader->overrun = true;
+      return 0;
+    }
+
+    uint8_t byte = reader->data[reader->position / 8];
+    value = (value << 1) | ((byte >> (7 - reader->position % 8)) & 1);
+    reader->position++;
+  }
+
+  return value;
+}
+
+static void skipBits(BitReader* reader, uint32_t count) {
+  reader->position += count;
+  if (reader->position > reader->size * 8) {
+    reader->overrun = true;
+  }
+}
+
+// Exp-Golomb ue(v)
+static uint32_t readUe(BitReader* reader) {
+  uint32_t zeros = 0;
+  while (!readBits(reader, 1)) {
+    if (reader->overrun || ++zeros > 31) {
+      reader->overrun = true;
+      return 0;
+    }
+  }
+
+  return ((1u << zeros) - 1) + readBits(reader, zeros);
+}
+
+static int32_t readSe(BitReader* reader) {
+  uint32_t value = readUe(reader);
+  return value & 1 ? (int32_t)((value + 1) / 2) : -(int32_t)(value / 2);
+}
+
+// Strip emulation prevention bytes (00 00 03)
+static uint32_t unescape(const uint8_t* nal, uint32_t size, uint8_t* rbsp) {
+  uint32_t length = 0;
+  uint32_t zeros = 0;
+  for (uint32_t i = 0; i < size && length < SPS_MAX_RBSP; i++) {
+    if (zeros >= 2 && nal[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+
+    zeros = nal[i] ? 0 : zeros + 1;
+    rbsp[length++] = nal[i];
+  }
+
+  return length;
+}
+
+static void skipScalingList(BitReader* reader, uint32_t size) {
+  int32_t last = 8, next = 8;
+  for (uint32_t i = 0; i < size && !reader->overrun; i++) {
+    if (next) {
+      next = (last + readSe(reader) + 256) % 256;
+    }
+    last = next ? next : last;
+  }
+}
+
+static int parseAvc(BitReader* reader, SpsInfo* info) {
+  uint32_t profile = readBits(reader, 8);
+  skipBits(reader, 8); // Constraint flags
+  info->profile = profile;
+  info->level = readBits(reader, 8);
+  readUe(reader); // seq_parameter_set_id
+
+  uint32_t chroma_format = 1;
+  bool separate_planes = false;
+  if (profile == 100 || profile == 110 || profile == 122 || profile == 244 ||
+      profile == 44 || profile == 83 || profile == 86 || profile == 118 ||
+      profile == 128 || profile == 138 || profile == 139 || profile == 134 ||
+      profile == 135) {
+    chroma_format = readUe(reader);
+    if (chroma_format == 3) {
+      separate_planes = readBits(reader, 1);
+    }
+    info->bit_depth_luma = readUe(reader) + 8;
+    info->bit_depth_chroma = readUe(reader) + 8;
+    skipBits(reader, 1);
+    if (readBits(reader, 1)) {
+      for (uint32_t i = 0; i < (chroma_format == 3 ? 12 : 8); i++) {
+        if (readBits(reader, 1)) {
+          skipScalingList(reader, i < 6 ? 16 : 64);
+        }
+      }
+    }
+  }
+
+  info->chroma_format = chroma_format;
+  readUe(reader); // log2_max_frame_num_minus4
+  uint32_t poc_type = readUe(reader);
+  if (poc_type == 0) {
+    readUe(reader);
+  } else if (poc_type == 1) {
+    skipBits(reader, 1);
+    readSe(reader);
+    readSe(reader);
+    uint32_t cycle = readUe(reader);
+    for (uint32_t i = 0; i < cycle && !reader->overrun; i++) {
+      readSe(reader);
+    }
+  }
+
+  readUe(reader); // max_num_ref_frames
+  skipBits(reader, 1);
+  uint32_t width_mbs = readUe(reader) + 1;
+  uint32_t height_units = readUe(reader) + 1;
+  uint32_t frame_mbs_only = readBits(reader, 1);
+  if (!frame_mbs_only) {
+    skipBits(reader, 1);
+  }
+  skipBits(reader, 1); // direct_8x8_inference_flag
+
+  uint32_t crop[4] = {0};
+  if (readBits(reader, 1)) {
+    for (uint32_t i = 0; i < 4; i++) {
+      crop[i] = readUe(reader);
+    }
+  }
+
+  // Crop units depend on chroma subsampling and field coding
+  uint32_t array_type = separate_planes ? 0 : chroma_format;
+  uint32_t crop_x = array_type == 1 || array_type == 2 ? 2 : 1;
+  uint32_t crop_y = (array_type == 1 ? 2 : 1) * (2 - frame_mbs_only);
+  info->width = width_mbs * 16 - crop_x * (crop[0] + crop[1]);
+  info->height = (2 - frame_mbs_only) * height_units * 16 -
+    crop_y * (crop[2] + crop[3]);
+  return 0;
+}
+
+static int parseHevc(BitReader* reader, SpsInfo* info) {
+  skipBits(reader, 4); // sps_video_parameter_set_id
+  uint32_t sub_layers = readBits(reader, 3);
+  skipBits(reader, 1);
+
+  // profile_tier_level, general part
+  if (reader->size >= 1 + sizeof(info->profile_tier_level)) {
+    memcpy(info->profile_tier_level, reader->data + 1,
+      sizeof(info->profile_tier_level));
+  }
+  skipBits(reader, 3);
+  info->profile = readBits(reader, 5);
+  skipBits(reader, 32 + 48);
+  info->level = readBits(reader, 8);
+
+  bool profile_present[8], level_present[8];
+  for (uint32_t i = 0; i < sub_layers; i++) {
+    profile_present[i] = readBits(reader, 1);
+    level_present[i] = readBits(reader, 1);
+  }
+  if (sub_layers) {
+    skipBits(reader, (8 - sub_layers) * 2);
+  }
+  for (uint32_t i = 0; i < sub_layers; i++) {
+    skipBits(reader, (profile_present[i] ? 88 : 0) + (level_present[i] ? 8 : 0));
+  }
+
+  readUe(reader); // sps_seq_parameter_set_id
+  uint32_t chroma_format = readUe(reader);
+  bool separate_planes = false;
+  if (chroma_format == 3) {
+    separate_planes = readBits(reader, 1);
+  }
+
+  info->width = readUe(reader);
+  info->height = readUe(reader);
+  if (readBits(reader, 1)) {
+    uint32_t array_type = separate_planes ? 0 : chroma_format;
+    uint32_t crop_x = array_type == 1 || array_type == 2 ? 2 : 1;
+    uint32_t crop_y = array_type == 1 ? 2 : 1;
+    uint32_t left = readUe(reader), right = readUe(reader);
+    uint32_t top = readUe(reader), bottom = readUe(reader);
+    info->width -= crop_x * (left + right);
+    info->height -= crop_y * (top + bottom);
+  }
+
+  info->chroma_format = chroma_format;
+  info->bit_depth_luma = readUe(reader) + 8;
+  info->bit_depth_chroma = readUe(reader) + 8;
+
+  return 0;
+}
+
+bool sps_is_vps(const uint8_t* nal, uint32_t size) {
+  return size > 2 && ((nal[0] >> 1) & 0x3F) == 32 && nal[1] == 1;
+}
+
+int sps_parse(const uint8_t* nal, uint32_t size, SpsInfo* info) {
+  if (size < 4) {
+    return -1;
+  }
+
+  // H.265 SPS 0x42 0x01 reads as H.264 type 2, H.264 SPS as H.265 type 51
+  bool hevc = ((nal[0] >> 1) & 0x3F) == 33 && nal[1] == 1;
+  bool avc = (nal[0] & 0x9F) == 7;
+  if (!hevc && !avc) {
+    return -1;
+  }
+
+  uint32_t header_size = hevc ? 2 : 1;
+  uint8_t rbsp[SPS_MAX_RBSP];
+  BitReader reader;
+  memset(&reader, 0x00, sizeof(reader));
+  reader.data = rbsp;
+  reader.size = unescape(nal + header_size, size - header_size, rbsp);
+
+  memset(info, 0x00, sizeof(SpsInfo));
+  info->hevc = hevc;
+  info->bit_depth_luma = 8;
+  info->bit_depth_chroma = 8;
+  int ret = hevc ? parseHevc(&reader, info) : parseAvc(&reader, info);
+  if (ret || reader.overrun || !info->width || !info->height) {
+    return -1;
+  }
+
+  return 0;
+}
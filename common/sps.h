@@ -0,0 +1,30 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Sequence parameter set parsing for codec and picture size detection.
+// NAL units are passed without start code. H.264 and H.265 parameter
+// sets are told apart by their headers, no codec needs to be known.
+
+typedef struct {
+  bool hevc;
+  uint32_t width;         // Luma samples after conformance cropping
+  uint32_t height;
+  uint8_t profile;
+  uint8_t level;
+  uint8_t chroma_format;  // 1 for 4:2:0
+  uint8_t bit_depth_luma;
+  uint8_t bit_depth_chroma;
+  uint8_t profile_tier_level[12]; // H.265 general part, for hvcC
+} SpsInfo;
+
+/**
+ * @brief Check for an H.265 video parameter set
+ */
+bool sps_is_vps(const uint8_t* nal, uint32_t size);
+
+/**
+ * @brief Parse an H.264 or H.265 sequence parameter set
+ * @return 0 on success, -1 if the NAL unit is no SPS or is truncated
+ */
+int sps_parse(const uint8_t* nal, uint32_t size, SpsInfo* info);
@@ -1,10 +1,15 @@
 /*
- * gcc vdec-stdout.c -o vdec-stdout -s -Wall
+ * gcc vdec-stdout.c ../common/packet.c ../common/capture.c ../common/receiver.c \
+ *   -o vdec-stdout -s -Wall
  *
  * Usage:
  * ./vdec-stdout 5600 | ffplay -i -
  * ./vdec-stdout 5600 | gst-launch-1.0 fdsrc ! decodebin ! fpsdisplaysink sync=false
  *
+ * Replay datagrams to port 5600 from a capture, with original timing or fast:
+ * ./vdec-stdout 5600 flight.pcapng | ffplay -i -
+ * ./vdec-stdout 5600 flight.pcapng fast > flight.h265
+ *
  */
 
 #include <stdio.h>
@@ -14,76 +19,11 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 
-#define BUFFER_SIZE 512 * 512
-
-static int nal_size = 0;
-static bool nal_start = false;
-
-static int decode_frame(char *rx_buffer, int rx_length, int header_size, char *nal_buffer) {
-	rx_buffer += header_size;
-	rx_length -= header_size;
-
-	char fragment_avc = rx_buffer[0] & 0x1F;
-	char fragment_hevc = (rx_buffer[0] >> 1) & 0x3F;
-
-	char start_bit = 0;
-	char end_bit = 0;
-	char nal_code = 4;
-
-	if (fragment_avc == 7 || fragment_hevc == 32) {
-		nal_start = true;
-	}
-
-	if (fragment_avc == 28 || fragment_hevc == 49) {
-		if (fragment_avc == 28) {
-			start_bit = rx_buffer[1] & 0x80;
-			end_bit = rx_buffer[1] & 0x40;
-			nal_buffer[4] = (rx_buffer[0] & 0xE0) | (rx_buffer[1] & 0x1F);
-		} else {
-			start_bit = rx_buffer[2] & 0x80;
-			end_bit = rx_buffer[2] & 0x40;
-			nal_buffer[4] = (rx_buffer[0] & 0x81) | (rx_buffer[2] & 0x3F) << 1;
-			nal_buffer[5] = 1;
-
-			nal_code++;
-			rx_buffer++;
-			rx_length--;
-		}
-
-		rx_buffer++;
-		rx_length--;
-
-		if (start_bit) {
-			nal_buffer[0] = 0;
-			nal_buffer[1] = 0;
-			nal_buffer[2] = 0;
-			nal_buffer[3] = 1;
-
-			memcpy(nal_buffer + nal_code, rx_buffer, rx_length);
-			nal_size = rx_length + nal_code;
-		} else {
-			rx_buffer++;
-			rx_length--;
-
-			memcpy(nal_buffer + nal_size, rx_buffer, rx_length);
-			nal_size += rx_length;
-
-			if (end_bit) {
-				return nal_size;
-			}
-		}
-	} else {
-		nal_buffer[0] = 0;
-		nal_buffer[1] = 0;
-		nal_buffer[2] = 0;
-		nal_buffer[3] = 1;
-		memcpy(nal_buffer + nal_code, rx_buffer, rx_length);
-
-		return rx_length + nal_code;
-	}
+#include "../common/capture.h"
+#include "../common/packet.h"
+#include "../common/receiver.h"
 
-	return 0;
-}
+#define BUFFER_SIZE 512 * 512
 
 int main(int argc, const char *argv[]) {
 	int rtp_port = 5600;
@@ -92,38 +32,80 @@ int main(int argc, const char *argv[]) {
 		rtp_port = atoi(argv[1]);
 	}
 
+	CaptureReader replay;
+	bool replaying = argc > 2;
+	if (replaying) {
+		if (capture_open(&replay, argv[2])) {
+			return 1;
+		}
+		replay.realtime = argc < 4 || strcmp(argv[3], "fast");
+	}
+
 	struct sockaddr_in address;
 	address.sin_family = AF_INET;
 	address.sin_port = htons(rtp_port);
 	address.sin_addr.s_addr = INADDR_ANY;
 
 	int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
-	bind(udp_sock, (struct sockaddr*)&address, sizeof(struct sockaddr_in));
+	if (!replaying) {
+		bind(udp_sock, (struct sockaddr*)&address, sizeof(struct sockaddr_in));
+	}
+
+	Receiver receiver;
+	if (receiver_init(&receiver, udp_sock, 4096)) {
+		return 1;
+	}
 
-	char *rx_buffer = malloc(BUFFER_SIZE);
-	char *nal_buffer = malloc(BUFFER_SIZE);
+	uint8_t *rx_buffer = malloc(BUFFER_SIZE);
+	uint8_t *nal_buffer = malloc(BUFFER_SIZE);
+	bool nal_start = false;
+
+	Depacketizer depacketizer;
+	depacketizer_init(&depacketizer, nal_buffer, BUFFER_SIZE);
 
 	while (true) {
-		int rx_length = recv(udp_sock, rx_buffer, BUFFER_SIZE, 0);
-		if (rx_length < 0) {
-			usleep(1);
+		uint8_t *rx_data;
+		uint32_t rx_length;
+		if (replaying) {
+			CapturePacket packet;
+			if (capture_next(&replay, &packet, rtp_port) <= 0) {
+				break;
+			}
+
+			capture_pace(&replay, &packet);
+			rx_length = packet.size < BUFFER_SIZE - PACKET_HEADROOM ?
+				packet.size : BUFFER_SIZE - PACKET_HEADROOM;
+			rx_data = rx_buffer + PACKET_HEADROOM;
+			memcpy(rx_data, packet.data, rx_length);
+		} else if (receiver_next(&receiver, &rx_data, &rx_length, -1) <= 0) {
+			continue;
+		}
+
+		uint32_t nal_size = 0;
+		uint8_t *nal = depacketizer_push(&depacketizer,
+			rx_data, rx_length, &nal_size);
+		if (!nal) {
 			continue;
 		}
 
-		int rtp_header = 0;
-		if (rx_buffer[0] & 0x80 && rx_buffer[1] & 0x60) {
-			rtp_header = 12;
+		// Start output at the first SPS / VPS
+		if ((nal[4] & 0x1F) == 7 || ((nal[4] >> 1) & 0x3F) == 32) {
+			nal_start = true;
 		}
 
-		int nal_size = decode_frame(rx_buffer, rx_length, rtp_header, nal_buffer);
-		if (!nal_size || !nal_start) {
+		if (!nal_start) {
 			continue;
 		}
 
-		fwrite(nal_buffer, nal_size, 1, stdout);
+		fwrite(nal, nal_size, 1, stdout);
 		fflush(stdout);
 	}
 
+	if (replaying) {
+		capture_close(&replay);
+	}
+
+	receiver_free(&receiver);
 	free(rx_buffer);
 	free(nal_buffer);
 
@@ -0,0 +1,488 @@
+// Stream analyzer: per access unit size, NAL type breakdown, GOP
+// structure, arrival jitter and loss from a pcap or a live UDP port
+#include "../common/capture.h"
+#include "../common/packet.h"
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DATAGRAM 65536
+
+typedef struct {
+  uint64_t index;
+  uint64_t arrival;     // First packet, microseconds
+  uint32_t size;
+  uint32_t nals;
+  uint32_t slices;
+  uint32_t packets;
+  uint32_t lost;        // Sequence gaps while this unit was received
+  uint32_t failures;    // Reassembly failures while this unit was received
+  bool keyframe;
+} AccessUnit;
+
+typedef struct {
+  uint64_t bytes;
+  uint32_t frames;
+  uint32_t keyframes;
+  uint32_t packets;
+  uint32_t lost;
+  uint32_t failures;
+} TimelineBucket;
+
+static const char* avc_names[32] = {
+  [1] = "slice", [5] = "idr", [6] = "sei", [7] = "sps", [8] = "pps",
+  [9] = "aud", [12] = "filler",
+};
+
+static const char* hevc_names[64] = {
+  [0] = "trail_n", [1] = "trail_r", [16] = "bla_w_lp", [17] = "bla_w_radl",
+  [18] = "bla_n_lp", [19] = "idr_w_radl", [20] = "idr_n_lp", [21] = "cra",
+  [32] = "vps", [33] = "sps", [34] = "pps", [35] = "aud", [39] = "sei_prefix",
+  [40] = "sei_suffix",
+};
+
+static volatile bool running = true;
+
+// Codec, -1 until a parameter set or fragment reveals it
+static int hevc = -1;
+
+static uint64_t nal_count[64];
+static uint64_t nal_bytes[64];
+
+static AccessUnit unit;
+static bool unit_has_slice = false;
+static uint64_t unit_count = 0;
+static uint64_t pending_packets = 0;
+
+// Summary statistics
+static uint64_t total_bytes = 0;
+static uint64_t total_packets = 0;
+static uint64_t total_lost = 0;
+static uint64_t unit_bytes_max = 0;
+static uint64_t keyframe_count = 0;
+static uint64_t keyframe_bytes = 0;
+static uint64_t keyframe_bytes_max = 0;
+static uint64_t gop_min = UINT64_MAX;
+static uint64_t gop_max = 0;
+static uint64_t gop_sum = 0;
+static uint64_t gop_count = 0;
+static uint64_t last_keyframe = UINT64_MAX;
+static uint64_t last_arrival = 0;
+static double interval_sum = 0;
+static double interval_square_sum = 0;
+static uint64_t interval_max = 0;
+static uint64_t interval_count = 0;
+
+// RTP state
+static bool rtp_seen = false;
+static bool sequence_valid = false;
+static uint16_t last_sequence = 0;
+static double rtp_jitter = 0;
+static bool transit_valid = false;
+static int64_t last_transit = 0;
+
+static FILE* units_csv = 0;
+static FILE* timeline_csv = 0;
+static TimelineBucket* buckets = 0;
+static uint64_t bucket_count = 0;
+static uint64_t first_arrival = 0;
+
+static void handler(int signo) {
+  running = false;
+}
+
+static void writeTimeline(void) {
+  for (uint64_t second = 0; timeline_csv && second < bucket_count; second++) {
+    TimelineBucket* bucket = &buckets[second];
+    fprintf(timeline_csv, "%llu,%llu,%.1f,%u,%u,%u,%u,%u\n",
+      (unsigned long long)second, (unsigned long long)bucket->bytes,
+      bucket->bytes * 8 / 1000., bucket->frames, bucket->keyframes,
+      bucket->packets, bucket->lost, bucket->failures);
+  }
+}
+
+// Units are finished after packets of the next one arrived, so keep all
+// seconds around instead of streaming them out
+static TimelineBucket* getBucket(uint64_t arrival) {
+  uint64_t second = (arrival - first_arrival) / 1000000;
+  if (second >= bucket_count) {
+    uint64_t count = second + 64;
+    buckets = realloc(buckets, count * sizeof(TimelineBucket));
+    memset(buckets + bucket_count, 0x00,
+      (count - bucket_count) * sizeof(TimelineBucket));
+    bucket_count = count;
+  }
+  return &buckets[second];
+}
+
+static void finishUnit(void) {
+  if (!unit.nals) {
+    return;
+  }
+
+  unit.index = unit_count++;
+  total_bytes += unit.size;
+  unit_bytes_max = unit.size > unit_bytes_max ? unit.size : unit_bytes_max;
+
+  if (unit.keyframe) {
+    keyframe_count++;
+    keyframe_bytes += unit.size;
+    keyframe_bytes_max = unit.size > keyframe_bytes_max ? unit.size : keyframe_bytes_max;
+    if (last_keyframe != UINT64_MAX) {
+      uint64_t gop = unit.index - last_keyframe;
+      gop_min = gop < gop_min ? gop : gop_min;
+      gop_max = gop > gop_max ? gop : gop_max;
+      gop_sum += gop;
+      gop_count++;
+    }
+    last_keyframe = unit.index;
+  }
+
+  if (last_arrival) {
+    uint64_t interval = unit.arrival - last_arrival;
+    interval_sum += interval;
+    interval_square_sum += (double)interval * interval;
+    interval_max = interval > interval_max ? interval : interval_max;
+    interval_count++;
+  }
+  last_arrival = unit.arrival;
+
+  TimelineBucket* current = getBucket(unit.arrival);
+  current->frames++;
+  current->keyframes += unit.keyframe;
+  current->bytes += unit.size;
+
+  if (units_csv) {
+    fprintf(units_csv, "%llu,%.6f,%u,%u,%u,%u,%d,%u,%u\n",
+      (unsigned long long)unit.index, (unit.arrival - first_arrival) / 1000000.,
+      unit.size, unit.nals, unit.slices, unit.packets, unit.keyframe,
+      unit.lost, unit.failures);
+  }
+
+  memset(&unit, 0x00, sizeof(unit));
+  unit_has_slice = false;
+}
+
+static void detectCodec(const uint8_t* nal, uint32_t size) {
+  if (hevc >= 0 || size < 2) {
+    return;
+  }
+
+  if ((nal[0] & 0x1F) == 7 && !(nal[0] & 0x80)) {
+    hevc = 0;
+  } else if (((nal[0] >> 1) & 0x3F) == 32 && nal[1] == 1) {
+    hevc = 1;
+  }
+}
+
+static void processNal(const uint8_t* nal, uint32_t size, uint64_t arrival) {
+  // Skip start code added by the depacketizer
+  nal += 4;
+  size -= 4;
+  if (size < 3) {
+    return;
+  }
+
+  detectCodec(nal, size);
+  if (hevc < 0) {
+    return;
+  }
+
+  uint8_t type;
+  bool slice, first_slice, keyframe, prefix;
+  if (hevc) {
+    type = (nal[0] >> 1) & 0x3F;
+    slice = type < 32;
+    first_slice = slice && (nal[2] & 0x80);
+    keyframe = type >= 16 && type <= 21;
+    prefix = type >= 32 && type <= 39 && type != 36 && type != 37 && type != 38;
+  } else {
+    type = nal[0] & 0x1F;
+    slice = type == 1 || type == 5;
+    first_slice = slice && (nal[1] & 0x80); // first_mb_in_slice == 0
+    keyframe = type == 5;
+    prefix = type == 6 || type == 7 || type == 8 || type == 9;
+  }
+
+  // Parameter sets, SEI or the first slice of a picture open a new unit
+  if (unit_has_slice && (prefix || first_slice)) {
+    finishUnit();
+  }
+
+  if (!unit.nals) {
+    unit.arrival = arrival;
+  }
+
+  nal_count[type]++;
+  nal_bytes[type] += size;
+  unit.nals++;
+  unit.size += size + 4;
+  unit.slices += slice;
+  unit.keyframe |= keyframe;
+  unit.packets += pending_packets;
+  pending_packets = 0;
+  unit_has_slice |= slice;
+}
+
+static void processDatagram(Depacketizer* depacketizer, uint8_t* data,
+  uint32_t size, uint64_t arrival) {
+  if (!first_arrival) {
+    first_arrival = arrival;
+  }
+
+  total_packets++;
+  pending_packets++;
+  TimelineBucket* current = getBucket(arrival);
+  current->packets++;
+
+  uint32_t header_size = packet_header_size(data, size);
+  if (header_size) {
+    rtp_seen = true;
+    uint16_t sequence = (data[2] << 8) | data[3];
+    uint32_t timestamp = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+
+    // Gaps of more than half the space are reordering or a sender restart
+    uint16_t gap = sequence - last_sequence - 1;
+    if (sequence_valid && gap && gap < 0x8000) {
+      total_lost += gap;
+      unit.lost += gap;
+      current->lost += gap;
+    }
+    last_sequence = sequence;
+    sequence_valid = true;
+
+    // RFC 3550 interarrival jitter, in 90 kHz units
+    if (timestamp) {
+      int64_t transit = (int64_t)(arrival * 9 / 100) - timestamp;
+      if (transit_valid) {
+        int64_t delta = llabs(transit - last_transit);
+        rtp_jitter += (delta - rtp_jitter) / 16;
+      }
+      last_transit = transit;
+      transit_valid = true;
+    }
+  }
+
+  // FU indicator tells the codec even before a parameter set arrives
+  if (hevc < 0 && size > header_size) {
+    uint8_t indicator = data[header_size];
+    if ((indicator & 0x1F) == 28) {
+      hevc = 0;
+    } else if (((indicator >> 1) & 0x3F) == 49) {
+      hevc = 1;
+    }
+  }
+
+  uint32_t failures = depacketizer->fragments_dropped;
+  uint32_t nal_size = 0;
+  uint8_t* nal = depacketizer_push(depacketizer, data, size, &nal_size);
+  failures = depacketizer->fragments_dropped - failures;
+  unit.failures += failures;
+  current->failures += failures;
+
+  if (nal) {
+    processNal(nal, nal_size, arrival);
+  }
+}
+
+static uint64_t getMicroseconds(void) {
+  struct timespec timestamp;
+  clock_gettime(CLOCK_REALTIME, &timestamp);
+  return (uint64_t)timestamp.tv_sec * 1000000 + timestamp.tv_nsec / 1000;
+}
+
+static void printSummary(const Depacketizer* depacketizer, double duration) {
+  finishUnit();
+
+  printf("> Stream: %s, %s, %.2f s\n",
+    hevc == 1 ? "H.265" : hevc == 0 ? "H.264" : "unknown codec",
+    rtp_seen ? "RTP" : "compact", duration);
+  // Compact datagrams carry no sequence numbers to count losses by
+  char lost[32] = "n/a";
+  if (rtp_seen) {
+    snprintf(lost, sizeof(lost), "%llu", (unsigned long long)total_lost);
+  }
+
+  printf("> Packets: %llu, lost %s, reassembly failures %u\n",
+    (unsigned long long)total_packets, lost, depacketizer->fragments_dropped);
+  printf("> Access units: %llu, avg %llu B, max %llu B, %.2f Mbit/sec.\n",
+    (unsigned long long)unit_count,
+    (unsigned long long)(unit_count ? total_bytes / unit_count : 0),
+    (unsigned long long)unit_bytes_max,
+    duration > 0 ? total_bytes * 8 / duration / 1000000 : 0);
+  printf("> Keyframes: %llu, avg %llu B, max %llu B\n",
+    (unsigned long long)keyframe_count,
+    (unsigned long long)(keyframe_count ? keyframe_bytes / keyframe_count : 0),
+    (unsigned long long)keyframe_bytes_max);
+  if (gop_count) {
+    printf("> GOP: min %llu, avg %.1f, max %llu frames\n",
+      (unsigned long long)gop_min, (double)gop_sum / gop_count,
+      (unsigned long long)gop_max);
+  }
+
+  if (interval_count) {
+    double mean = interval_sum / interval_count;
+    double deviation = sqrt(fmax(interval_square_sum / interval_count - mean * mean, 0));
+    printf("> Arrival: interval avg %.2f ms, stddev %.2f ms, max %.2f ms",
+      mean / 1000, deviation / 1000, interval_max / 1000.);
+    if (transit_valid) {
+      printf(", RTP jitter %.2f ms", rtp_jitter / 90);
+    }
+    printf("\n");
+  }
+
+  printf("> NAL types:\n");
+  for (int type = 0; type < 64; type++) {
+    if (!nal_count[type]) {
+      continue;
+    }
+
+    const char* name = hevc == 1 ? hevc_names[type] : type < 32 ? avc_names[type] : 0;
+    printf("    %2d %-12s %8llu units %10llu B\n", type, name ? name : "-",
+      (unsigned long long)nal_count[type], (unsigned long long)nal_bytes[type]);
+  }
+}
+
+int main(int argc, const char* argv[]) {
+  const char* capture_path = 0;
+  const char* units_path = 0;
+  const char* timeline_path = 0;
+  uint16_t listen_port = 0;
+  uint16_t filter_port = 0;
+  uint32_t duration = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : "";
+    if (!strcmp(arg, "-i")) {
+      capture_path = value; i++;
+    } else if (!strcmp(arg, "-l")) {
+      listen_port = atoi(value); i++;
+    } else if (!strcmp(arg, "-p")) {
+      filter_port = atoi(value); i++;
+    } else if (!strcmp(arg, "-c")) {
+      hevc = !strcmp(value, "265"); i++;
+    } else if (!strcmp(arg, "-d")) {
+      duration = atoi(value); i++;
+    } else if (!strcmp(arg, "--units")) {
+      units_path = value; i++;
+    } else if (!strcmp(arg, "--timeline")) {
+      timeline_path = value; i++;
+    } else {
+      printf(
+        "Usage: analyze -i [Capture] | -l [Port] [Arguments]\n"
+        "  -i [File]         - pcap capture to read\n"
+        "  -l [Port]         - Listen for live UDP stream instead\n"
+        "  -p [Port]         - Only use datagrams to this port (capture)\n"
+        "  -c [Codec]        - 264 / 265               (Default: detect)\n"
+        "  -d [Seconds]      - Stop live capture after duration\n"
+        "  --units [File]    - Per access unit CSV\n"
+        "  --timeline [File] - Per second bitrate CSV\n");
+      return 1;
+    }
+  }
+
+  if (!capture_path && !listen_port) {
+    printf("ERROR: No capture file or listen port\n");
+    return 1;
+  }
+
+  if (units_path) {
+    units_csv = fopen(units_path, "w");
+    if (!units_csv) {
+      printf("ERROR: Unable to open [%s]\n", units_path);
+      return 1;
+    }
+    fprintf(units_csv, "index,time,bytes,nals,slices,packets,keyframe,lost,failures\n");
+  }
+
+  if (timeline_path) {
+    timeline_csv = fopen(timeline_path, "w");
+    if (!timeline_csv) {
+      printf("ERROR: Unable to open [%s]\n", timeline_path);
+      return 1;
+    }
+    fprintf(timeline_csv, "second,bytes,kbit,frames,keyframes,packets,lost,failures\n");
+  }
+
+  // Headroom for the start code the depacketizer writes in place
+  uint8_t* rx_buffer = malloc(MAX_DATAGRAM + PACKET_HEADROOM);
+  uint8_t* nal_buffer = malloc(4 * 1024 * 1024);
+  Depacketizer depacketizer;
+  depacketizer_init(&depacketizer, nal_buffer, 4 * 1024 * 1024);
+  uint64_t last_packet = 0;
+
+  if (capture_path) {
+    CaptureReader reader;
+    if (capture_open(&reader, capture_path)) {
+      return 1;
+    }
+
+    CapturePacket packet;
+    while (capture_next(&reader, &packet, filter_port) > 0) {
+      uint32_t size = packet.size < MAX_DATAGRAM ? packet.size : MAX_DATAGRAM;
+      memcpy(rx_buffer + PACKET_HEADROOM, packet.data, size);
+      processDatagram(&depacketizer, rx_buffer + PACKET_HEADROOM, size,
+        packet.timestamp);
+      last_packet = packet.timestamp;
+    }
+
+    capture_close(&reader);
+  } else {
+    int socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in address;
+    memset(&address, 0x00, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(listen_port);
+    if (bind(socket_handle, (struct sockaddr*)&address, sizeof(address))) {
+      printf("ERROR: Unable to bind port %d\n", listen_port);
+      return 1;
+    }
+
+    // Wake up periodically to honour duration and Ctrl+C
+    struct timeval timeout = {0, 200000};
+    setsockopt(socket_handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    signal(SIGINT, handler);
+
+    uint64_t start = getMicroseconds();
+    while (running) {
+      int size = recv(socket_handle, rx_buffer + PACKET_HEADROOM, MAX_DATAGRAM, 0);
+      uint64_t now = getMicroseconds();
+      if (size > 0) {
+        processDatagram(&depacketizer, rx_buffer + PACKET_HEADROOM, size, now);
+        last_packet = now;
+      }
+
+      if (duration && now - start >= (uint64_t)duration * 1000000) {
+        break;
+      }
+    }
+
+    close(socket_handle);
+  }
+
+  double elapsed = first_arrival ? (last_packet - first_arrival) / 1000000. : 0;
+  printSummary(&depacketizer, elapsed);
+
+  // Trim preallocated seconds past the last packet
+  if (first_arrival) {
+    bucket_count = (last_packet - first_arrival) / 1000000 + 1;
+  }
+  writeTimeline();
+
+  if (units_csv) {
+    fclose(units_csv);
+  }
+
+  if (timeline_csv) {
+    fclose(timeline_csv);
+  }
+
+  free(rx_buffer);
+  free(nal_buffer);
+  return 0;
+}
@@ -0,0 +1,285 @@
+// Microbenchmark for the packetize (venc sendPacket) and depacketize
+// hot paths. Socket calls are wrapped at link time, so only the packet
+// handling itself is timed.
+#define _GNU_SOURCE
+#include "../venc/stream.h"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+// Packet size, then headroom for the start code the depacketizer prepends
+#define PACKET_OFFSET 16
+#define PACKET_SLOT 2048
+#define WORKLOAD_BYTES (32 * 1024 * 1024)
+
+typedef struct {
+  const char* name;
+  PAYLOAD_TYPE_E codec;
+  bool keyframe;
+  uint32_t min_size;
+  uint32_t max_size;
+} Workload;
+
+static const Workload workloads[] = {
+  {"h264-tiny-p", PT_H264, false, 200, 2000},
+  {"h264-p", PT_H264, false, 8000, 40000},
+  {"h264-idr", PT_H264, true, 200000, 200000},
+  {"h265-tiny-p", PT_H265, false, 200, 2000},
+  {"h265-p", PT_H265, false, 8000, 40000},
+  {"h265-idr", PT_H265, true, 200000, 200000},
+};
+
+// Packets captured by the wrapped socket calls
+static uint8_t* capture_buffer = 0;
+static uint32_t capture_capacity = 0;
+static uint32_t capture_count = 0;
+static bool capture_enabled = false;
+
+static void capturePacket(const struct iovec* iov, int iov_count) {
+  if (!capture_enabled || capture_count == capture_capacity) {
+    return;
+  }
+
+  uint8_t* slot = capture_buffer + (size_t)capture_count++ * PACKET_SLOT;
+  uint32_t size = 0;
+  for (int i = 0; i < iov_count; i++) {
+    memcpy(slot + PACKET_OFFSET + size,
+      iov[i].iov_base, iov[i].iov_len);
+    size += iov[i].iov_len;
+  }
+
+  memcpy(slot, &size, sizeof(uint32_t));
+}
+
+ssize_t __wrap_sendto(int socket_handle, const void* data, size_t size,
+  int flags, const struct sockaddr* address, socklen_t address_size) {
+  struct iovec iov = {.iov_base = (void*)data, .iov_len = size};
+  capturePacket(&iov, 1);
+  return size;
+}
+
+ssize_t __wrap_sendmsg(int socket_handle, const struct msghdr* msg, int flags) {
+  capturePacket(msg->msg_iov, msg->msg_iovlen);
+  return 0;
+}
+
+int __wrap_sendmmsg(int socket_handle, struct mmsghdr* messages,
+  unsigned int count, int flags) {
+  for (unsigned int i = 0; i < count; i++) {
+    capturePacket(messages[i].msg_hdr.msg_iov, messages[i].msg_hdr.msg_iovlen);
+  }
+  return count;
+}
+
+static uint64_t getNanoseconds(void) {
+  struct timespec timestamp;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &timestamp);
+  return (uint64_t)timestamp.tv_sec * 1000000000 + timestamp.tv_nsec;
+}
+
+static int cycle_counter = -1;
+
+static void openCycleCounter(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0x00, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  cycle_counter = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t readCycles(void) {
+  uint64_t cycles = 0;
+  if (cycle_counter < 0 || read(cycle_counter, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+    return 0;
+  }
+  return cycles;
+}
+
+static uint8_t* generateNals(const Workload* workload, uint32_t* out_count,
+    uint32_t** out_sizes) {
+  uint32_t capacity = WORKLOAD_BYTES / workload->min_size + 1;
+  uint32_t* sizes = malloc(capacity * sizeof(uint32_t));
+  uint32_t count = 0;
+  uint64_t total = 0;
+
+  while (total < WORKLOAD_BYTES && count < capacity) {
+    uint32_t size = workload->min_size +
+      (workload->max_size > workload->min_size
+        ? rand() % (workload->max_size - workload->min_size + 1) : 0);
+    sizes[count++] = size;
+    total += size;
+  }
+
+  uint8_t* data = malloc(total);
+  uint8_t* nal = data;
+  for (uint32_t i = 0; i < count; i++) {
+    for (uint32_t j = 0; j < sizes[i]; j++) {
+      nal[j] = rand() | 0x01;
+    }
+
+    // Annex-B start code and NAL header
+    nal[0] = 0;
+    nal[1] = 0;
+    nal[2] = 0;
+    nal[3] = 1;
+    if (workload->codec == PT_H265) {
+      nal[4] = (workload->keyframe ? 19 : 1) << 1;
+      nal[5] = 1;
+    } else {
+      nal[4] = workload->keyframe ? 0x65 : 0x41;
+    }
+    nal += sizes[i];
+  }
+
+  *out_count = count;
+  *out_sizes = sizes;
+  return data;
+}
+
+static void printResult(const char* workload, const char* stage,
+    uint32_t packets, uint64_t bytes, uint64_t ns, uint64_t cycles) {
+  char per_cycle[16] = "-";
+  if (cycles) {
+    snprintf(per_cycle, sizeof(per_cycle), "%.3f", (double)bytes / cycles);
+  }
+
+  printf("%-12s %-8s %8u %10.1f %10.1f %11s\n", workload, stage, packets,
+    (double)ns / packets, (double)bytes / ns * 1000000000 / 1024 / 1024,
+    per_cycle);
+}
+
+int main(int argc, const char* argv[]) {
+  uint16_t max_frame_size = 1400;
+  uint32_t runs = 5;
+  const char* filter = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char* value = i + 1 < argc ? argv[i + 1] : "";
+    if (!strcmp(argv[i], "-m")) {
+      stream_mode = !strcmp(value, "rtp"); i++;
+    } else if (!strcmp(argv[i], "-n")) {
+      max_frame_size = atoi(value); i++;
+    } else if (!strcmp(argv[i], "-r")) {
+      runs = MAX(atoi(value), 1); i++;
+    } else if (!strcmp(argv[i], "-w")) {
+      filter = value; i++;
+    } else {
+      printf(
+        "Usage: bench [Arguments]\n"
+        "  -m [Mode]     - compact / rtp         (Default: compact)\n"
+        "  -n [Size]     - Max payload size      (Default: 1400)\n"
+        "  -r [Runs]     - Runs per workload, best is reported (Default: 5)\n"
+        "  -w [Name]     - Only run workloads containing name\n");
+      return 1;
+    }
+  }
+
+  if (max_frame_size + 32 > PACKET_SLOT - PACKET_OFFSET) {
+    printf("ERROR: Max payload size must be below %d\n",
+      PACKET_SLOT - PACKET_OFFSET - 32);
+    return 1;
+  }
+
+  openCycleCounter();
+  uint8_t* nal_buffer = malloc(1024 * 1024);
+  Depacketizer depacketizer;
+  depacketizer_init(&depacketizer, nal_buffer, 1024 * 1024);
+
+  // Fixed seed and workload sizes keep results comparable across commits
+  srand(1);
+  printf("# mode %s, payload %u, %u MB per workload, best of %u runs%s\n",
+    stream_mode ? "rtp" : "compact", max_frame_size,
+    WORKLOAD_BYTES / 1024 / 1024, runs,
+    cycle_counter < 0 ? ", no cycle counter" : "");
+  printf("%-12s %-8s %8s %10s %10s %11s\n",
+    "workload", "stage", "packets", "ns/packet", "MB/s", "bytes/cycle");
+
+  for (uint32_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    const Workload* workload = &workloads[w];
+    uint32_t nal_count;
+    uint32_t* sizes;
+    uint8_t* nals = generateNals(workload, &nal_count, &sizes);
+
+    // Generate skipped workloads too, filtering must not shift the data
+    if (filter && !strstr(workload->name, filter)) {
+      free(nals);
+      free(sizes);
+      continue;
+    }
+
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < nal_count; i++) {
+      bytes += sizes[i];
+    }
+
+    packetizer_free(&stream_packetizer);
+    initStream(workload->codec, max_frame_size);
+
+    // Capture the packet stream once as depacketizer input
+    capture_capacity = bytes / (max_frame_size / 2) + nal_count * 2;
+    capture_buffer = malloc((size_t)capture_capacity * PACKET_SLOT);
+    capture_count = 0;
+    capture_enabled = true;
+    for (uint32_t i = 0, offset = 0; i < nal_count; offset += sizes[i++]) {
+      sendPacket(nals + offset, sizes[i], 0, 0);
+    }
+    capture_enabled = false;
+    uint32_t packet_count = capture_count;
+
+    uint64_t best_ns = UINT64_MAX, best_cycles = 0;
+    for (uint32_t run = 0; run < runs; run++) {
+      uint64_t cycles = readCycles();
+      uint64_t start = getNanoseconds();
+      for (uint32_t i = 0, offset = 0; i < nal_count; offset += sizes[i++]) {
+        sendPacket(nals + offset, sizes[i], 0, 0);
+      }
+      uint64_t elapsed = getNanoseconds() - start;
+      cycles = readCycles() - cycles;
+      if (elapsed < best_ns) {
+        best_ns = elapsed;
+        best_cycles = cycles;
+      }
+    }
+    printResult(workload->name, "packet", packet_count, bytes, best_ns, best_cycles);
+
+    uint64_t received = 0;
+    best_ns = UINT64_MAX;
+    for (uint32_t run = 0; run < runs; run++) {
+      received = 0;
+      uint64_t cycles = readCycles();
+      uint64_t start = getNanoseconds();
+      for (uint32_t i = 0; i < packet_count; i++) {
+        uint8_t* slot = capture_buffer + (size_t)i * PACKET_SLOT;
+        uint32_t size;
+        memcpy(&size, slot, sizeof(uint32_t));
+
+        uint32_t nal_size;
+        if (depacketizer_push(&depacketizer, slot + PACKET_OFFSET, size,
+            &nal_size)) {
+          received += nal_size;
+        }
+      }
+      uint64_t elapsed = getNanoseconds() - start;
+      cycles = readCycles() - cycles;
+      if (elapsed < best_ns) {
+        best_ns = elapsed;
+        best_cycles = cycles;
+      }
+    }
+    printResult(workload->name, "depacket", packet_count, bytes, best_ns, best_cycles);
+
+    if (received != bytes) {
+      printf("WARN: %s reassembled %llu of %llu bytes\n", workload->name,
+        (unsigned long long)received, (unsigned long long)bytes);
+    }
+
+    free(capture_buffer);
+    free(nals);
+    free(sizes);
+  }
+
+  return 0;
+}
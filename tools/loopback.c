@@ -0,0 +1,440 @@
+// Loopback harness: venc packetizer -> UDP loopback -> impairment ->
+// depacketizer, compared NAL by NAL against the reference bitstream
+#include "../venc/encoder.h"
+#include "../venc/stream.h"
+#include "../common/combiner.h"
+#include "../common/jitter.h"
+#include <math.h>
+#include <time.h>
+
+#define MAX_PACKET_SIZE 4096
+#define MAX_QUEUED_PACKETS 4096
+#define SEARCH_WINDOW 256
+
+typedef struct {
+  uint32_t size;
+  uint32_t path;          // Receive path it travels on
+  uint64_t deliver_time;  // Virtual microseconds
+  uint64_t order;         // Arrival order for equal delivery times
+  uint8_t data[MAX_PACKET_SIZE];
+} Packet;
+
+typedef struct {
+  double loss;            // Random loss probability
+  double burst_start;     // Probability to enter a loss burst
+  double burst_length;    // Mean burst length in packets
+  double reorder;         // Probability to hold a packet back
+  uint32_t reorder_depth; // Packets delivered before a held one
+  double duplicate;       // Probability to deliver a packet twice
+  uint32_t jitter;        // Maximum extra delay in microseconds
+} Impairment;
+
+typedef struct {
+  uint32_t offset;
+  uint32_t size;
+  uint32_t frame;
+  uint64_t hash;
+} ReferenceNal;
+
+// Impairment state, independent per receive path
+typedef struct {
+  bool in_burst;
+  Packet held[64];
+  uint32_t held_countdown[64];
+  uint32_t held_count;
+} PathState;
+
+static Packet* queue;
+static uint32_t queue_count = 0;
+static uint64_t arrival_order = 0;
+static PathState paths[COMBINER_MAX_PATHS];
+
+// Statistics
+static uint64_t stat_sent = 0;
+static uint64_t stat_lost = 0;
+static uint64_t stat_duplicated = 0;
+static uint64_t stat_reordered = 0;
+static uint64_t stat_delivered = 0;
+
+static double randomUnit(void) {
+  return (double)rand() / ((double)RAND_MAX + 1);
+}
+
+static uint64_t hashData(const uint8_t* data, uint32_t size) {
+  uint64_t hash = 1469598103934665603ULL;
+  for (uint32_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static uint32_t skipStartCode(const uint8_t* data, uint32_t size) {
+  uint32_t offset = 0;
+  while (offset < size && !data[offset]) {
+    offset++;
+  }
+  return offset < size ? offset + 1 : size;
+}
+
+static double getCpuTime(void) {
+  struct timespec timestamp;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &timestamp);
+  return timestamp.tv_sec + timestamp.tv_nsec / 1000000000.;
+}
+
+static void enqueue(const Packet* packet, uint64_t now, const Impairment* impairment) {
+  if (queue_count >= MAX_QUEUED_PACKETS) {
+    stat_lost++;
+    return;
+  }
+
+  Packet* entry = &queue[queue_count++];
+  memcpy(entry, packet, sizeof(Packet) - MAX_PACKET_SIZE + packet->size);
+  entry->deliver_time = now + (impairment->jitter
+    ? (uint64_t)(randomUnit() * impairment->jitter) : 0);
+  entry->order = arrival_order++;
+}
+
+static void impair(Packet* packet, uint64_t now, const Impairment* impairment) {
+  PathState* path = &paths[packet->path];
+  stat_sent++;
+
+  // Gilbert-Elliott style bursts on top of uniform loss
+  if (path->in_burst) {
+    path->in_burst = randomUnit() >= 1. / MAX(impairment->burst_length, 1.);
+  } else {
+    path->in_burst = randomUnit() < impairment->burst_start;
+  }
+
+  if (path->in_burst || randomUnit() < impairment->loss) {
+    stat_lost++;
+    return;
+  }
+
+  // Release held packets once enough newer ones passed
+  for (uint32_t i = 0; i < path->held_count;) {
+    if (!path->held_countdown[i]--) {
+      enqueue(&path->held[i], now, impairment);
+      path->held[i] = path->held[path->held_count - 1];
+      path->held_countdown[i] = path->held_countdown[path->held_count - 1];
+      path->held_count--;
+      continue;
+    }
+    i++;
+  }
+
+  if (impairment->reorder_depth && path->held_count < 64 &&
+      randomUnit() < impairment->reorder) {
+    path->held[path->held_count] = *packet;
+    path->held_countdown[path->held_count] = impairment->reorder_depth;
+    path->held_count++;
+    stat_reordered++;
+    return;
+  }
+
+  enqueue(packet, now, impairment);
+  if (randomUnit() < impairment->duplicate) {
+    enqueue(packet, now, impairment);
+    stat_duplicated++;
+  }
+}
+
+static int comparePackets(const void* a, const void* b) {
+  const Packet* first = (const Packet*)a;
+  const Packet* second = (const Packet*)b;
+  if (first->deliver_time != second->deliver_time) {
+    return first->deliver_time < second->deliver_time ? -1 : 1;
+  }
+  return first->order < second->order ? -1 : first->order > second->order;
+}
+
+int main(int argc, const char* argv[]) {
+  EncoderConfig config;
+  memset(&config, 0x00, sizeof(config));
+  config.codec = PT_H264;
+  config.framerate = 0;
+
+  Impairment impairment;
+  memset(&impairment, 0x00, sizeof(impairment));
+
+  uint32_t fps = 60;
+  uint16_t max_frame_size = 1400;
+  uint32_t seed = 1;
+  bool expect_clean = false;
+  bool codec_set = false;
+  uint32_t jitter_depth = 0;
+  uint32_t jitter_hold = 20000;
+  uint32_t path_count = 1;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = i + 1 < argc ? argv[i + 1] : "";
+    if (!strcmp(arg, "-i")) {
+      config.source_path = value; i++;
+    } else if (!strcmp(arg, "-c")) {
+      config.codec = !strcmp(value, "265") ? PT_H265 : PT_H264; codec_set = true; i++;
+    } else if (!strcmp(arg, "-m")) {
+      stream_mode = !strcmp(value, "rtp"); i++;
+    } else if (!strcmp(arg, "-n")) {
+      max_frame_size = atoi(value); i++;
+    } else if (!strcmp(arg, "-f")) {
+      fps = MAX(atoi(value), 1); i++;
+    } else if (!strcmp(arg, "--seed")) {
+      seed = atoi(value); i++;
+    } else if (!strcmp(arg, "--loss")) {
+      impairment.loss = atof(value) / 100; i++;
+    } else if (!strcmp(arg, "--burst") && i + 2 < argc) {
+      impairment.burst_start = atof(argv[i + 1]) / 100;
+      impairment.burst_length = atof(argv[i + 2]);
+      i += 2;
+    } else if (!strcmp(arg, "--reorder") && i + 2 < argc) {
+      impairment.reorder = atof(argv[i + 1]) / 100;
+      impairment.reorder_depth = atoi(argv[i + 2]);
+      i += 2;
+    } else if (!strcmp(arg, "--dup")) {
+      impairment.duplicate = atof(value) / 100; i++;
+    } else if (!strcmp(arg, "--jitter")) {
+      impairment.jitter = atof(value) * 1000; i++;
+    } else if (!strcmp(arg, "--jitter-depth")) {
+      jitter_depth = atoi(value); i++;
+    } else if (!strcmp(arg, "--jitter-hold")) {
+      jitter_hold = atoi(value); i++;
+    } else if (!strcmp(arg, "--paths")) {
+      path_count = MIN(MAX(atoi(value), 1), COMBINER_MAX_PATHS); i++;
+    } else if (!strcmp(arg, "--expect-clean")) {
+      expect_clean = true;
+    } else {
+      printf(
+        "Usage: loopback -i [File] [Arguments]\n"
+        "  -c [Codec]           - 264 / 265             (Default: by extension)\n"
+        "  -m [Mode]            - compact / rtp         (Default: compact)\n"
+        "  -n [Size]            - Max payload size      (Default: 1400)\n"
+        "  -f [FPS]             - Virtual frame rate    (Default: 60)\n"
+        "  --seed [Value]       - Random seed           (Default: 1)\n"
+        "  --loss [%%]           - Random packet loss\n"
+        "  --burst [%%] [Length] - Burst loss start probability and mean length\n"
+        "  --reorder [%%] [Depth] - Hold packets back by Depth packets\n"
+        "  --dup [%%]            - Duplicate packets\n"
+        "  --jitter [ms]        - Random extra delay up to value\n"
+        "  --jitter-depth [N]   - Receive jitter buffer depth in packets (Default: 0)\n"
+        "  --jitter-hold [us]   - Receive jitter buffer hold time (Default: 20000)\n"
+        "  --paths [N]          - Independently impaired copies, combined (Default: 1)\n"
+        "  --expect-clean       - Exit with error unless every NAL unit matches\n");
+      return 1;
+    }
+  }
+
+  if (!config.source_path) {
+    printf("ERROR: No source file\n");
+    return 1;
+  }
+
+  if (!codec_set) {
+    const char* extension = strrchr(config.source_path, '.');
+    if (extension && (!strcmp(extension, ".h265") || !strcmp(extension, ".hevc"))) {
+      config.codec = PT_H265;
+    }
+  }
+
+  srand(seed);
+  config.by_frame = HI_TRUE;
+  const EncoderBackend* encoder = &encoder_host;
+  if (encoder->create(0, &config)) {
+    return 1;
+  }
+
+  // Receiver on an ephemeral loopback port, large buffer for unpaced bursts
+  int rx_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  int tx_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  int buffer_size = 8 * 1024 * 1024;
+  setsockopt(rx_socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+  struct sockaddr_in address;
+  socklen_t address_size = sizeof(address);
+  memset(&address, 0x00, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(rx_socket, (struct sockaddr*)&address, sizeof(address));
+  getsockname(rx_socket, (struct sockaddr*)&address, &address_size);
+  fcntl(rx_socket, F_SETFL, O_NONBLOCK);
+
+  initStream(config.codec, max_frame_size);
+  queue = malloc(sizeof(Packet) * MAX_QUEUED_PACKETS);
+  uint8_t* rx_buffer = malloc(MAX_PACKET_SIZE + PACKET_HEADROOM);
+  uint8_t* nal_buffer = malloc(1024 * 1024);
+  Depacketizer depacketizer;
+  depacketizer_init(&depacketizer, nal_buffer, 1024 * 1024);
+  JitterBuffer jitter;
+  jitter_init(&jitter, jitter_depth, jitter_hold, MAX_PACKET_SIZE);
+  Combiner combiner;
+  combiner_init(&combiner, path_count);
+
+  ReferenceNal* reference = calloc(1024, sizeof(ReferenceNal));
+  uint32_t reference_capacity = 1024;
+  uint32_t reference_count = 0;
+  uint32_t reference_position = 0;
+  uint32_t frame_count = 0;
+
+  uint64_t nal_intact = 0;
+  uint64_t nal_corrupt = 0;
+  uint64_t payload_bytes = 0;
+  uint8_t* nal_ok = calloc(1, 1);
+
+  double cpu_send = 0;
+  double cpu_receive = 0;
+  struct timespec start_timestamp, end_timestamp;
+  clock_gettime(CLOCK_MONOTONIC, &start_timestamp);
+
+  EncoderStream stream;
+  while (encoder->get_stream(0, &stream, 0) > 0) {
+    uint64_t now = (uint64_t)frame_count * 1000000 / fps;
+
+    // Reference NAL units of this access unit
+    for (uint32_t i = 0; i < stream.pack_count; i++) {
+      if (reference_count == reference_capacity) {
+        reference_capacity *= 2;
+        reference = realloc(reference, reference_capacity * sizeof(ReferenceNal));
+      }
+
+      uint32_t skip = skipStartCode(stream.packs[i].data, stream.packs[i].size);
+      ReferenceNal* nal = &reference[reference_count++];
+      nal->frame = frame_count;
+      nal->size = stream.packs[i].size - skip;
+      nal->hash = hashData(stream.packs[i].data + skip, nal->size);
+    }
+
+    // Packetize and send over real loopback UDP
+    double cpu_start = getCpuTime();
+    for (uint32_t i = 0; i < stream.pack_count; i++) {
+      sendPacket(stream.packs[i].data, stream.packs[i].size, tx_socket,
+        (struct sockaddr*)&address);
+    }
+    encoder->release(0, &stream);
+    frame_count++;
+    cpu_send += getCpuTime() - cpu_start;
+
+    // Collect datagrams and run them through the impairment stage
+    Packet packet;
+    int size;
+    while ((size = recv(rx_socket, packet.data, MAX_PACKET_SIZE, 0)) > 0) {
+      packet.size = size;
+      for (packet.path = 0; packet.path < path_count; packet.path++) {
+        impair(&packet, now, &impairment);
+      }
+    }
+
+    // Deliver everything due by the end of this frame interval
+    qsort(queue, queue_count, sizeof(Packet), comparePackets);
+    uint64_t frame_end = (uint64_t)frame_count * 1000000 / fps;
+    uint32_t delivered = 0;
+    nal_ok = realloc(nal_ok, reference_count);
+    memset(nal_ok + reference_count - stream.pack_count, 0, stream.pack_count);
+
+    cpu_start = getCpuTime();
+    for (bool flush = false; !flush;) {
+      // Hold time of the jitter buffer expires at the end of the interval
+      uint64_t receive_time = frame_end;
+      if (delivered < queue_count && queue[delivered].deliver_time < frame_end) {
+        Packet* entry = &queue[delivered++];
+        memcpy(rx_buffer + PACKET_HEADROOM, entry->data, entry->size);
+        stat_delivered++;
+        receive_time = entry->deliver_time;
+        if (combiner_accept(&combiner, entry->path,
+          rx_buffer + PACKET_HEADROOM, entry->size)) {
+          jitter_push(&jitter, rx_buffer + PACKET_HEADROOM, entry->size,
+            receive_time);
+        }
+      } else {
+        flush = true;
+      }
+
+      uint8_t* data;
+      uint32_t data_size;
+      while (jitter_pop(&jitter, &data, &data_size, receive_time) > 0) {
+        uint32_t nal_size = 0;
+        uint8_t* nal = depacketizer_push(&depacketizer, data, data_size,
+          &nal_size);
+        if (!nal) {
+          continue;
+        }
+
+        payload_bytes += nal_size;
+
+        // Match against upcoming reference NAL units, skipping lost ones
+        uint32_t skip = skipStartCode(nal, nal_size);
+        uint64_t hash = hashData(nal + skip, nal_size - skip);
+        bool matched = false;
+        for (uint32_t n = reference_position;
+            n < reference_count && n < reference_position + SEARCH_WINDOW; n++) {
+          if (reference[n].hash == hash && reference[n].size == nal_size - skip) {
+            nal_ok[n] = 1;
+            reference_position = n + 1;
+            matched = true;
+            break;
+          }
+        }
+
+        if (matched) {
+          nal_intact++;
+        } else {
+          nal_corrupt++;
+        }
+      }
+    }
+    cpu_receive += getCpuTime() - cpu_start;
+
+    memmove(queue, queue + delivered, (queue_count - delivered) * sizeof(Packet));
+    queue_count -= delivered;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end_timestamp);
+  double elapsed = getTimeInterval(&end_timestamp, &start_timestamp);
+
+  // A frame is recovered when every one of its NAL units arrived intact
+  uint32_t frames_recovered = 0;
+  for (uint32_t n = 0, frame = 0; frame < frame_count; frame++) {
+    bool complete = true;
+    for (; n < reference_count && reference[n].frame == frame; n++) {
+      complete &= nal_ok[n];
+    }
+    frames_recovered += complete;
+  }
+
+  uint64_t nal_missing = reference_count - nal_intact;
+  printf("> Packets: %llu sent, %llu delivered, %llu lost, %llu duplicated, "
+    "%llu reordered\n",
+    (unsigned long long)stat_sent, (unsigned long long)stat_delivered,
+    (unsigned long long)stat_lost, (unsigned long long)stat_duplicated,
+    (unsigned long long)stat_reordered);
+  printf("> NAL units: %u reference, %llu intact, %llu corrupt, %llu missing\n",
+    reference_count, (unsigned long long)nal_intact,
+    (unsigned long long)nal_corrupt, (unsigned long long)nal_missing);
+  printf("> Depacketizer: %u lost, %u late, %u NAL units discarded\n",
+    depacketizer.lost, depacketizer.late, depacketizer.nals_discarded);
+  printf("> Jitter buffer: %llu reordered, %llu skipped, %llu flushed\n",
+    (unsigned long long)jitter.reordered, (unsigned long long)jitter.skipped,
+    (unsigned long long)jitter.flushed);
+  if (path_count > 1) {
+    printf("> Combiner: %llu passed, %llu duplicates\n",
+      (unsigned long long)combiner.passed,
+      (unsigned long long)combiner.duplicates);
+    for (uint32_t i = 0; i < path_count; i++) {
+      CombinerPath* path = &combiner.paths[i];
+      printf("> Path %u: %llu packets, %llu first, %llu duplicates, %llu lost\n",
+        i, (unsigned long long)path->packets, (unsigned long long)path->first,
+        (unsigned long long)path->duplicates, (unsigned long long)path->lost);
+    }
+  }
+  printf("> Frames: %u total, %u recovered, %u lost\n",
+    frame_count, frames_recovered, frame_count - frames_recovered);
+  printf("> Throughput: %.0f packets/s, %.2f MB/s | CPU per packet: "
+    "send %.2f us, receive %.2f us\n",
+    elapsed > 0 ? stat_sent / elapsed : 0,
+    elapsed > 0 ? payload_bytes / elapsed / 1024 / 1024 : 0,
+    stat_sent ? cpu_send * 1000000 / stat_sent : 0,
+    stat_delivered ? cpu_receive * 1000000 / stat_delivered : 0);
+
+  jitter_free(&jitter);
+  encoder->destroy(0);
+  return expect_clean && (nal_corrupt || nal_missing) ? 1 : 0;
+}
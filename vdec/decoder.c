@@ -0,0 +1,202 @@
+#include "main.h"
+
+// Mod pool is shared by all VDEC channels, blocks fit the largest picture
+static uint32_t pool_channels = 1;
+static uint32_t pool_users = 0;
+static bool pool_held[VDEC_MAX_CHN_NUM];
+static uint32_t pool_picture_size = 0;
+static uint32_t pool_pmv_size = 0;
+
+static void getBlockSizes(PAYLOAD_TYPE_E codec, uint32_t width, uint32_t height,
+  uint32_t* picture_size, uint32_t* pmv_size) {
+  uint32_t aligned_width = ALIGN_UP(width, DEFAULT_ALIGN);
+  uint32_t aligned_height = ALIGN_UP(height, DEFAULT_ALIGN);
+  VB_PIC_BLK_SIZE(aligned_width, aligned_height, codec, *picture_size);
+  VB_PMV_BLK_SIZE(aligned_width, aligned_height, codec, *pmv_size);
+}
+
+void VDEC_init(uint32_t channel_count) {
+  pool_channels = MAX(channel_count, 1);
+}
+
+bool VDEC_fits(PAYLOAD_TYPE_E codec, uint32_t width, uint32_t height) {
+  uint32_t picture_size, pmv_size;
+  getBlockSizes(codec, width, height, &picture_size, &pmv_size);
+  return !pool_users ||
+    (picture_size <= pool_picture_size && pmv_size <= pool_pmv_size);
+}
+
+int VDEC_start(VDEC_CHN channel_id, PAYLOAD_TYPE_E codec, uint32_t width,
+  uint32_t height, HI_BOOL stream_mode, VO_LAYER vo_layer_id, VO_CHN vo_channel_id) {
+  // Buffers sized to the stream instead of the largest supported picture
+  uint32_t aligned_width = ALIGN_UP(width, DEFAULT_ALIGN);
+  uint32_t aligned_height = ALIGN_UP(height, DEFAULT_ALIGN);
+
+  uint32_t picture_size, pmv_size;
+  getBlockSizes(codec, width, height, &picture_size, &pmv_size);
+  if (!pool_users) {
+    // Never shrink, channels restarted after a pool resize reuse it
+    pool_picture_size = MAX(pool_picture_size, picture_size);
+    pool_pmv_size = MAX(pool_pmv_size, pmv_size);
+
+    VB_CONF_S vb_conf;
+    memset(&vb_conf, 0x00, sizeof(vb_conf));
+    vb_conf.u32MaxPoolCnt = 2;
+    vb_conf.astCommPool[0].u32BlkCnt = 4 * pool_channels;
+    vb_conf.astCommPool[0].u32BlkSize = pool_picture_size;
+    vb_conf.astCommPool[1].u32BlkCnt = 2 * pool_channels;
+    vb_conf.astCommPool[1].u32BlkSize = pool_pmv_size;
+    printf("> VDEC picture block size = %d, %d, %d channels\n",
+      pool_picture_size, pool_pmv_size, pool_channels);
+
+    int ret = HI_MPI_VB_SetModPoolConf(VB_UID_VDEC, &vb_conf);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to configure ModComPool\n");
+      return ret;
+    }
+
+    ret = HI_MPI_VB_InitModCommPool(VB_UID_VDEC);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to init ModComPool = 0x%x\n", ret);
+      return ret;
+    }
+  } else if (picture_size > pool_picture_size || pmv_size > pool_pmv_size) {
+    printf("ERROR: Picture %dx%d does not fit the shared VDEC pool\n",
+      width, height);
+    return HI_FAILURE;
+  }
+
+  pool_users++;
+  pool_held[channel_id] = true;
+
+  VDEC_CHN_ATTR_S config;
+  memset(&config, 0x00, sizeof(config));
+  config.enType = codec;
+  config.u32BufSize = aligned_width * aligned_height * 3 / 2;
+  config.u32Priority = 128;
+  config.u32PicWidth = aligned_width;
+  config.u32PicHeight = aligned_height;
+
+  config.stVdecVideoAttr.bTemporalMvpEnable = (codec == PT_H265) ? HI_TRUE : HI_FALSE;
+  config.stVdecVideoAttr.enMode = stream_mode ? VIDEO_MODE_STREAM : VIDEO_MODE_FRAME;
+  config.stVdecVideoAttr.u32RefFrameNum = 1;
+
+  // Create VDEC channel
+  int ret = HI_MPI_VDEC_CreateChn(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to create VDEC channel\n");
+    return ret;
+  }
+
+  // Set display mode
+  ret = HI_MPI_VDEC_SetDisplayMode(channel_id, VIDEO_DISPLAY_MODE_PREVIEW);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set VDEC display mode\n");
+    return ret;
+  }
+
+  // Read decoder protocol information
+  VDEC_PRTCL_PARAM_S protocol;
+  HI_MPI_VDEC_GetProtocolParam(channel_id, &protocol);
+
+  switch (protocol.enType) {
+    case PT_H264:
+      protocol.stH264PrtclParam.s32MaxPpsNum = 256;
+      protocol.stH264PrtclParam.s32MaxSpsNum = 32;
+      protocol.stH264PrtclParam.s32MaxSliceNum = 100;
+      ret = HI_MPI_VDEC_SetProtocolParam(channel_id, &protocol);
+      if (ret != HI_SUCCESS) {
+        printf("ERROR: Unable to set VDEC protocol parameters\n");
+        return ret;
+      }
+
+      HI_MPI_VDEC_GetProtocolParam(channel_id, &protocol);
+      printf("> VDEC Protocol = Type: %s, PPS: %d, SLICE: %d, SPS: %d\n",
+        (codec == PT_H264 ? "H264" : (codec == PT_H265 ? "H265" : "Unknown")),
+        protocol.stH264PrtclParam.s32MaxPpsNum,
+        protocol.stH264PrtclParam.s32MaxSliceNum,
+        protocol.stH264PrtclParam.s32MaxSpsNum);
+      break;
+
+    case PT_H265:
+      protocol.stH265PrtclParam.s32MaxPpsNum = 64;
+      protocol.stH265PrtclParam.s32MaxSpsNum = 16;
+      protocol.stH265PrtclParam.s32MaxVpsNum = 16;
+      protocol.stH265PrtclParam.s32MaxSliceSegmentNum = 100;
+      ret = HI_MPI_VDEC_SetProtocolParam(channel_id, &protocol);
+      if (ret != HI_SUCCESS) {
+        printf("ERROR: Unable to set VDEC protocol parameters\n");
+        return ret;
+      }
+
+      HI_MPI_VDEC_GetProtocolParam(channel_id, &protocol);
+      printf("> VDEC Protocol = Type: %s, PPS: %d, SLICE: %d, SPS: %d\n",
+        (codec == PT_H264 ? "H264" : (codec == PT_H265 ? "H265" : "Unknown")),
+        protocol.stH265PrtclParam.s32MaxPpsNum,
+        protocol.stH265PrtclParam.s32MaxSliceSegmentNum,
+        protocol.stH265PrtclParam.s32MaxSpsNum);
+      break;
+  }
+
+  // Assemble pipeline
+  MPP_CHN_S src;
+  MPP_CHN_S dst;
+
+  src.enModId = HI_ID_VDEC;
+  src.s32DevId = 0;
+  src.s32ChnId = channel_id;
+
+  dst.enModId = HI_ID_VOU;
+  dst.s32DevId = vo_layer_id;
+  dst.s32ChnId = vo_channel_id;
+
+  ret = HI_MPI_SYS_Bind(&src, &dst);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to bind VDEC -> VO\n");
+    return ret;
+  }
+
+  // Start VDEC
+  ret = HI_MPI_VDEC_StartRecvStream(channel_id);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to start VDEC channel\n");
+    return ret;
+  }
+
+  printf("> VDEC started: %s %dx%d\n", codec == PT_H265 ? "H265" : "H264",
+    width, height);
+  return HI_SUCCESS;
+}
+
+void VDEC_stop(VDEC_CHN channel_id, VO_LAYER vo_layer_id, VO_CHN vo_channel_id) {
+  HI_MPI_VDEC_StopRecvStream(channel_id);
+
+  MPP_CHN_S src;
+  MPP_CHN_S dst;
+
+  src.enModId = HI_ID_VDEC;
+  src.s32DevId = 0;
+  src.s32ChnId = channel_id;
+
+  dst.enModId = HI_ID_VOU;
+  dst.s32DevId = vo_layer_id;
+  dst.s32ChnId = vo_channel_id;
+
+  HI_MPI_SYS_UnBind(&src, &dst);
+  HI_MPI_VDEC_DestroyChn(channel_id);
+
+  // VO still holds pictures from the pool, release them before the pool
+  HI_MPI_VO_ClearChnBuffer(vo_layer_id, vo_channel_id, HI_TRUE);
+  if (!pool_held[channel_id]) {
+    return;
+  }
+
+  pool_held[channel_id] = false;
+  if (--pool_users) {
+    return;
+  }
+
+  if (HI_MPI_VB_ExitModCommPool(VB_UID_VDEC) != HI_SUCCESS) {
+    printf("WARN: Unable to release VDEC memory pool\n");
+  }
+}
@@ -119,13 +119,20 @@ void printHelp() {
     "\n"
     "  Arguments:\n"
     "    -p [Port]      - Listen port                       (Default: 5600)\n"
-    "    -c [Codec]     - Video codec                       (Default: h264)\n"
+    "    --input [Port] - Decode one more stream, up to %d inputs\n"
+    "    --diversity [Port] - Same stream as the previous input on one more\n"
+    "                         port, copies are merged by RTP sequence\n"
+    "    --layout [Mode] - Screen layout of inputs          (Default: pip)\n"
+    "      pip            - First input full screen, others inset\n"
+    "      grid           - Equal tiles\n"
+    "\n"
+    "    -c [Codec]     - Codec until the first SPS arrives (Default: h264)\n"
     "      h264           - H264\n"
     "      h265           - H265\n"
     "\n"
     "    -d [Format]    - Data format                       (Default: stream)\n"
     "      stream         - Incoming data is stream\n"
-    "      frame          - Incoming data is frame\n"
+    "      frame          - Assemble access units, decode whole frames\n"
     "\n"
     "    -t [Format]    - OSD Type                          (Default: normal)\n"
     "      normal         - Regular OSD\n"
@@ -140,8 +147,31 @@ void printHelp() {
     "      1600x1200x60   - 1600 x 1200   @ 60 fps\n"
     "      2560x1440x30   - 2560 x 1440   @ 30 fps\n"
     "\n"
-    "    -w [Path]        - DVR feature: saving video to file extention h265 (tested with SDcard reader)\n"
-    "      Example        -w /mnt/sda1/recorder/video1.h265\n"
+    "    -w [Path]        - DVR feature: saving video of the first input (tested with SDcard reader),\n"
+    "                       fragmented MP4 for .mp4, raw H.264/H.265 otherwise,\n"
+    "                       segments are numbered video1_00000.mp4, video1_00001.mp4, ...\n"
+    "      Example        -w /mnt/sda1/recorder/video1.mp4\n"
+    "    --dvr-buffer [MB]  - RAM queue ahead of SD card    (Default: 16)\n"
+    "    --dvr-segment [s]  - New segment after N seconds   (Default: 300)\n"
+    "    --dvr-segment-size [MB] - New segment above size   (Default: 1024)\n"
+    "                       both 0 writes one file at the exact path\n"
+    "    --dvr-budget [MB]  - Delete oldest segments above  (Default: 0, no limit)\n"
+    "    --dvr-preroll [s]  - Record events only, keep N s before in RAM\n"
+    "    --dvr-arm          - Event while the vehicle is armed (MavLink)\n"
+    "    --dvr-control [Port] - Event on UDP commands start, stop\n"
+    "                       SIGUSR1 starts and SIGUSR2 ends an event as well,\n"
+    "                       playback takes pause, play, seek [+-]seconds\n"
+    "    --play [Path]    - Play a recording instead of UDP input, continues\n"
+    "                       with the following segments\n"
+    "\n"
+    "    --replay [Path]  - Read stream from pcap/pcapng file instead of UDP,\n"
+    "                       datagrams to the input ports are used\n"
+    "    --replay-fast    - Replay as fast as possible instead of original timing\n"
+    "    --no-decode      - Do not submit stream to the decoder (profiling)\n"
+    "    --wait-keyframe  - After RTP packet loss drop NAL units until the next keyframe\n"
+    "    --jitter-depth [N]   - Reorder RTP packets         (Default: 0)\n"
+    "    --jitter-hold [us]   - Wait for lost packet        (Default: 20000)\n"
+    "    --frame-timeout [ms] - Incomplete frame wait       (Default: 20)\n"
     "\n"
     "    --ar [mode]      - Aspect ratio mode               (Default: keep)\n"
     "      keep             - Keep stream aspect ratio\n"
@@ -162,19 +192,436 @@ void printHelp() {
     "    --bg-r [Value]         - Background color red      (Default: 0)\n"
     "    --bg-g [Value]         - Background color green    (Default: 96)\n"
     "    --bg-b [Value]         - Background color blue     (Default: 0)\n"
-    "\n", __DATE__
+    "\n", __DATE__, VDEC_MAX_STREAMS
   );
 }
 
-extern uint32_t frames_received;
+// Inputs in command line order, the first one is shown full screen in the
+// PiP layout and feeds the recorder and the HUD
+VdecStream streams[VDEC_MAX_STREAMS];
+uint32_t stream_count = 0;
+VdecPath paths[VDEC_MAX_PATHS];
+uint32_t path_count = 0;
 uint32_t stats_rx_bytes = 0;
 struct timespec last_timestamp = {0, 0};
 
+// Playback commands from the DVR control port
+pthread_mutex_t playback_lock = PTHREAD_MUTEX_INITIALIZER;
+bool playback_paused = false;
+bool playback_seek = false;
+bool playback_seek_relative = false;
+int32_t playback_seek_seconds = 0;
+
 double getTimeInterval(struct timespec* timestamp, struct timespec* last_meansure_timestamp) {
   return (timestamp->tv_sec - last_meansure_timestamp->tv_sec) +
        (timestamp->tv_nsec - last_meansure_timestamp->tv_nsec) / 1000000000.;
 }
 
+static uint64_t getMonotonicUs(void) {
+  struct timespec timestamp;
+  clock_gettime(CLOCK_MONOTONIC, &timestamp);
+  return timestamp.tv_sec * 1000000ULL + timestamp.tv_nsec / 1000;
+}
+
+static VdecPath* findPath(uint16_t port) {
+  for (uint32_t i = 0; i < path_count; i++) {
+    if (paths[i].port == port) {
+      return &paths[i];
+    }
+  }
+
+  return 0;
+}
+
+// Hand a NAL unit (stream mode) or access unit (frame mode) to the
+// recorder and the decoder, flags and 90 kHz timestamp are for the recorder
+static void submitStream(VdecStream* input, uint8_t* data, uint32_t size,
+  HI_BOOL end_of_frame, uint8_t flags, uint32_t timestamp) {
+  VDEC_STREAM_S stream;
+  memset(&stream, 0x00, sizeof(stream));
+  stream.pu8Addr = data;
+  stream.u32Len = size;
+  stream.bEndOfStream = HI_FALSE;
+  stream.bEndOfFrame = end_of_frame;
+
+  stats_rx_bytes += size;
+  if (input->recording) {
+    recorder_input_data(&stream, input->depacketizer.hevc ? HI_TRUE : HI_FALSE,
+      flags, timestamp);
+  }
+
+  if (!input->decode || !input->decoder_running) {
+    return;
+  }
+
+  int ret = HI_MPI_VDEC_SendStream(input->channel_id, &stream, 0);
+  if (ret != HI_SUCCESS) {
+    printf("WARN: Unable to send data into VDEC = 0x%x\n", ret);
+  }
+}
+
+// VDEC channel N is bound to VO channel N
+static void startDecoder(VdecStream* input) {
+  SpsInfo* format = &input->decoder_format;
+  input->decoder_running = VDEC_start(input->channel_id,
+    format->hevc ? PT_H265 : PT_H264, format->width, format->height,
+    input->stream_mode ? HI_TRUE : HI_FALSE,
+    input->vo_layer_id, input->channel_id) == HI_SUCCESS;
+  if (!input->decoder_running) {
+    VDEC_stop(input->channel_id, input->vo_layer_id, input->channel_id);
+    return;
+  }
+
+  // In stream mode the VPS went ahead of this SPS, frame mode still has it
+  if (input->stream_mode && format->hevc && input->vps_size) {
+    VDEC_STREAM_S stream;
+    memset(&stream, 0x00, sizeof(stream));
+    stream.pu8Addr = input->vps_cache;
+    stream.u32Len = input->vps_size;
+    HI_MPI_VDEC_SendStream(input->channel_id, &stream, 0);
+  }
+}
+
+// Follow parameter sets, recreate only the VDEC channel when codec or
+// picture size change. VO and OSD stay up.
+static void checkFormat(VdecStream* input, const uint8_t* nal, uint32_t size) {
+  if (sps_is_vps(nal + 4, size - 4) && size <= sizeof(input->vps_cache)) {
+    memcpy(input->vps_cache, nal, size);
+    input->vps_size = size;
+    return;
+  }
+
+  SpsInfo format;
+  if (sps_parse(nal + 4, size - 4, &format)) {
+    return;
+  }
+
+  input->depacketizer.hevc = format.hevc;
+  SpsInfo* current = &input->decoder_format;
+  if (input->decoder_running && format.hevc == current->hevc &&
+    format.width == current->width && format.height == current->height) {
+    return;
+  }
+
+  if (input->decoder_running) {
+    printf("> Stream %d changed from %s %dx%d\n", input->port,
+      current->hevc ? "H265" : "H264", current->width, current->height);
+    VDEC_stop(input->channel_id, input->vo_layer_id, input->channel_id);
+    input->decoder_running = false;
+  }
+
+  // Channels share the mod pool, a larger picture recreates it under all
+  // of them. They resync on their next keyframe.
+  bool restart[VDEC_MAX_STREAMS] = {false};
+  if (!VDEC_fits(format.hevc ? PT_H265 : PT_H264, format.width, format.height)) {
+    for (uint32_t i = 0; i < stream_count; i++) {
+      restart[i] = streams[i].decoder_running;
+      if (restart[i]) {
+        VDEC_stop(streams[i].channel_id, streams[i].vo_layer_id,
+          streams[i].channel_id);
+      }
+    }
+  }
+
+  input->decoder_format = format;
+  startDecoder(input);
+
+  for (uint32_t i = 0; i < stream_count; i++) {
+    if (restart[i]) {
+      startDecoder(&streams[i]);
+    }
+  }
+}
+
+// Submit the pending access unit and start the next one at the pool
+// write position, which moves if the recorder kept the data
+static void flushFrame(VdecStream* input) {
+  FrameAssembler* frame = &input->frame;
+  if (frame->size) {
+    submitStream(input, frame->data, frame->size, HI_TRUE,
+      frame->nal_flags | NAL_FLAG_UNIT_START, frame->timestamp);
+    frame->frames++;
+  }
+
+  uint32_t capacity;
+  uint8_t* buffer = pool_buffer(&input->pool, &capacity);
+  frame_reset(frame, buffer, capacity);
+  input->depacketizer.buffer = frame_tail(frame, &input->depacketizer.capacity);
+}
+
+// Reorder, depacketize and submit one datagram. Without data only packets
+// held by the jitter buffer and a stalled frame are released.
+static void processPacket(VdecStream* input, uint8_t* data, uint32_t size,
+  uint64_t now) {
+  Depacketizer* depacketizer = &input->depacketizer;
+  FrameAssembler* frame = &input->frame;
+  if (size) {
+    jitter_push(&input->jitter, data, size, now);
+  }
+
+  while (jitter_pop(&input->jitter, &data, &size, now) > 0) {
+    // Compact mode has no marker, the next picture closes the unit
+    if (!input->stream_mode && frame_starts_unit(frame, data, size)) {
+      flushFrame(input);
+    }
+
+    // Decode UDP stream, RTP or compact
+    uint32_t nal_size;
+    uint8_t* nal = depacketizer_push(depacketizer, data, size, &nal_size);
+    if (!nal) {
+      continue;
+    }
+
+    if (nal_size < 5) {
+      printf("> Broken frame\n");
+    }
+
+    if (input->decode) {
+      checkFormat(input, nal, nal_size);
+      frame->hevc = depacketizer->hevc;
+    }
+
+    // RTP clock if present, arrival time otherwise
+    uint32_t timestamp = depacketizer->timestamp_valid ?
+      depacketizer->timestamp : (uint32_t)(now * 9 / 100);
+    if (input->stream_mode) {
+      submitStream(input, nal, nal_size, HI_FALSE, depacketizer->nal_flags,
+        timestamp);
+      depacketizer->buffer = pool_buffer(&input->pool, &depacketizer->capacity);
+      continue;
+    }
+
+    if (!frame->nals) {
+      frame->timestamp = timestamp;
+    }
+
+    frame_append(frame, nal, nal_size, depacketizer->nal_flags, now);
+    depacketizer->buffer = frame_tail(frame, &depacketizer->capacity);
+    if (depacketizer->marker) {
+      flushFrame(input);
+    }
+  }
+
+  // Sender stalled or last packets lost, decode what arrived
+  if (frame->size && !depacketizer->size &&
+    now - frame->start_time >= input->frame_timeout * 1000) {
+    frame->timeouts++;
+    flushFrame(input);
+  }
+}
+
+// Copies of a packet from redundant paths are processed once
+static void receivePacket(VdecPath* path, uint8_t* data, uint32_t size,
+  uint64_t now) {
+  if (combiner_accept(&path->stream->combiner, path->index, data, size)) {
+    processPacket(path->stream, data, size, now);
+  }
+}
+
+// Milliseconds until the jitter buffer or an incomplete frame need service
+static int getServiceTimeout(VdecStream* input, uint64_t now) {
+  int timeout = jitter_timeout_ms(&input->jitter, now);
+  timeout = timeout < 0 || timeout > 100 ? 100 : timeout;
+  if (input->frame.size) {
+    uint64_t deadline = input->frame.start_time + input->frame_timeout * 1000;
+    timeout = MIN(timeout, deadline > now ? (deadline - now + 999) / 1000 : 0);
+  }
+
+  return timeout;
+}
+
+// Socket and receive slab of one port
+static int openPath(VdecPath* path) {
+  path->socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in address;
+  memset(&address, 0x00, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(path->port);
+  if (bind(path->socket_handle, (struct sockaddr*)&address,
+    sizeof(struct sockaddr_in))) {
+    printf("ERROR: Unable to bind port %d\n", path->port);
+    return 1;
+  }
+
+  if (fcntl(path->socket_handle, F_SETFL, O_NONBLOCK) == -1) {
+    printf("ERROR: Unable to set non-blocking mode\n");
+    return 1;
+  }
+
+  // Drains bursts with one syscall
+  if (receiver_init(&path->receiver, path->socket_handle, 4096)) {
+    printf("ERROR: Unable to allocate receive buffers\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// Combiner, jitter buffer, NAL pool and depacketizer of one input
+static int openStream(VdecStream* input, uint32_t input_paths,
+  PAYLOAD_TYPE_E codec_id, bool wait_keyframe, uint32_t jitter_depth,
+  uint32_t jitter_hold, uint32_t record_buffer) {
+  combiner_init(&input->combiner, input_paths);
+  if (jitter_init(&input->jitter, jitter_depth, jitter_hold, 4096)) {
+    printf("ERROR: Unable to allocate jitter buffer\n");
+    return 1;
+  }
+
+  // Fragments are reassembled straight into pool blocks, the recorder
+  // keeps block references instead of copying NAL units again. The
+  // blocks double as recorder queue, two MB each so the largest NAL unit
+  // is one MB like without recording.
+  if (pool_init(&input->pool, input->recording ? MAX(record_buffer / 2, 2) : 1,
+    input->recording ? 2 * 1024 * 1024 : 1024 * 1024, 1024 * 1024)) {
+    printf("ERROR: Unable to allocate NAL pool\n");
+    return 1;
+  }
+
+  uint32_t nal_capacity;
+  uint8_t* nal_buffer = pool_buffer(&input->pool, &nal_capacity);
+  depacketizer_init(&input->depacketizer, nal_buffer, nal_capacity);
+  input->depacketizer.hevc = codec_id == PT_H265;
+  input->depacketizer.skip_to_keyframe = wait_keyframe;
+  input->depacketizer.waiting = wait_keyframe;
+
+  // Frame mode decodes whole access units, laid out in the pool
+  memset(&input->frame, 0x00, sizeof(input->frame));
+  input->frame.hevc = codec_id == PT_H265;
+  frame_reset(&input->frame, nal_buffer, nal_capacity);
+  return 0;
+}
+
+static void printStreamStats(VdecStream* input) {
+  Depacketizer* depacketizer = &input->depacketizer;
+  Combiner* combiner = &input->combiner;
+  for (uint32_t i = 0; combiner->path_count > 1 && i < path_count; i++) {
+    CombinerPath* path = &combiner->paths[paths[i].index];
+    if (paths[i].stream == input) {
+      printf("> Port %d via %d: %llu packets, %llu first, %llu duplicates, "
+        "%llu lost\n", input->port, paths[i].port,
+        (unsigned long long)path->packets, (unsigned long long)path->first,
+        (unsigned long long)path->duplicates, (unsigned long long)path->lost);
+    }
+  }
+
+  printf("> Port %d: %u packets, %u NAL units, %u dropped fragments\n",
+    input->port, depacketizer->packets, depacketizer->nals,
+    depacketizer->fragments_dropped);
+  printf("> Port %d: %u lost, %u late, %u NAL units discarded, %u skipped\n",
+    input->port, depacketizer->lost, depacketizer->late,
+    depacketizer->nals_discarded, depacketizer->nals_skipped);
+  printf("> Port %d jitter buffer: %llu reordered, %llu skipped, %llu flushed\n",
+    input->port, (unsigned long long)input->jitter.reordered,
+    (unsigned long long)input->jitter.skipped,
+    (unsigned long long)input->jitter.flushed);
+  printf("> Port %d frames: %llu submitted, %llu by timeout, %llu NAL units dropped\n",
+    input->port, (unsigned long long)input->frame.frames,
+    (unsigned long long)input->frame.timeouts,
+    (unsigned long long)input->frame.overflows);
+
+  if (input->recording) {
+    RecorderStats recorder;
+    recorder_get_stats(&recorder);
+    printf("> Port %d recorder: %.2f MB written, %llu GOPs dropped, "
+      "%llu NAL units, %.2f MB\n", input->port,
+      (double)recorder.u64WrittenBytes / 1024 / 1024,
+      (unsigned long long)recorder.u64DroppedGops,
+      (unsigned long long)recorder.u64DroppedNals,
+      (double)recorder.u64DroppedBytes / 1024 / 1024);
+  }
+}
+
+// Recorded access units go to the first input in frame mode with their
+// recorded timing, VO and OSD run as for live video
+static int playRecording(VdecStream* input, const char* path) {
+  DvrReader reader;
+  if (dvr_open(&reader, path)) {
+    return 1;
+  }
+
+  input->depacketizer.hevc = reader.hevc;
+  uint32_t position = 0;
+  bool show_frame = false;
+  while (1) {
+    pthread_mutex_lock(&playback_lock);
+    bool paused = playback_paused;
+    bool seek = playback_seek;
+    int64_t target = (int64_t)playback_seek_seconds * 90000 +
+      (playback_seek_relative ? position : 0);
+    playback_seek = false;
+    pthread_mutex_unlock(&playback_lock);
+
+    // Index points to the GOP, a paused picture still moves there
+    if (seek) {
+      if (dvr_seek(&reader, target > 0 ? target : 0)) {
+        printf("WARN: Recording has no keyframe index, can not seek\n");
+      } else {
+        printf("> Playback: seek to %.1f s\n", (double)reader.timestamp / 90000);
+        show_frame = paused;
+      }
+    }
+
+    if (paused && !show_frame) {
+      dvr_rebase(&reader);
+      usleep(20000);
+      continue;
+    }
+
+    DvrFrame frame;
+    int ret = dvr_read(&reader, &frame);
+    if (ret < 0) {
+      break;
+    }
+
+    if (!ret) {
+      if (dvr_open_next(&reader)) {
+        break;
+      }
+
+      input->depacketizer.hevc = reader.hevc;
+      continue;
+    }
+
+    dvr_pace(&reader, &frame);
+    show_frame = false;
+    position = frame.timestamp;
+
+    // Parameter sets lead the access unit, they start or reconfigure the
+    // decoder like on a live stream
+    uint32_t offset = 0;
+    while (input->decode && offset + 5 < frame.size) {
+      uint8_t flags = packet_classify(input->depacketizer.hevc,
+        frame.data + offset + 4, frame.size - offset - 4);
+      if (flags & NAL_FLAG_SLICE) {
+        break;
+      }
+
+      uint32_t end = offset + 4;
+      while (end + 4 <= frame.size && memcmp(frame.data + end, "\x00\x00\x00\x01", 4)) {
+        end++;
+      }
+
+      end = end + 4 <= frame.size ? end : frame.size;
+      checkFormat(input, frame.data + offset, end - offset);
+      offset = end;
+    }
+
+    submitStream(input, frame.data, frame.size, HI_TRUE, NAL_FLAG_UNIT_START |
+      NAL_FLAG_SLICE | (frame.keyframe ? NAL_FLAG_IRAP : 0), frame.timestamp);
+    input->frame.frames++;
+  }
+
+  printf("> Playback: %llu frames, ended in %s\n",
+    (unsigned long long)input->frame.frames, reader.path);
+  dvr_close(&reader);
+  return 0;
+}
+
+// kill -USR1 starts and kill -USR2 ends a recorder event
+static void onRecordSignal(int signal_number) {
+  recorder_trigger(signal_number == SIGUSR1 ? HI_TRUE : HI_FALSE);
+}
+
 uint16_t osd_element1x = 0;
 uint16_t osd_element1y = 0;
 uint16_t osd_element2x = 0;
@@ -214,6 +661,8 @@ uint16_t osd_element18y = 0;
 uint16_t osd_element19x = 0;
 uint16_t osd_element19y = 0;
 uint16_t mavlink_port = 14550;
+bool record_on_arm = false;
+uint16_t record_control_port = 0;
 uint32_t vo_width = 1280;
 uint32_t vo_height = 720;
 
@@ -221,19 +670,36 @@ int main(int argc, const char* argv[]) {
   VO_INTF_SYNC_E vo_mode = VO_OUTPUT_720P60;
   uint32_t vo_framerate = 60;
 
-  VDEC_CHN vdec_channel_id = 0;
   int ret = 0;
 
   VPSS_GRP vpss_group_id = 0;
   VPSS_CHN vpss_channel_id = 0;
   VO_DEV vo_device_id = 0;
   VO_LAYER vo_layer_id = 0;
-  VO_CHN vo_channel_id = 0;
 
-  uint16_t listen_port = 5600;
+  uint16_t input_ports[VDEC_MAX_STREAMS] = {5600};
+  uint32_t input_count = 1;
+  uint16_t diversity_ports[VDEC_MAX_PATHS];
+  uint32_t diversity_inputs[VDEC_MAX_PATHS];
+  uint32_t diversity_count = 0;
+  VdecLayout layout = LAYOUT_PIP;
   uint32_t background_color = 0x006000;
 
   const char* write_stream_path = 0;
+  uint32_t record_buffer = 16;
+  uint32_t record_segment = 300;
+  uint32_t record_segment_size = 1024;
+  uint32_t record_budget = 0;
+  bool record_on_event = false;
+  uint32_t record_preroll = 0;
+  const char* replay_path = 0;
+  bool replay_fast = false;
+  const char* play_path = 0;
+  bool enable_decode = true;
+  bool wait_keyframe = false;
+  uint32_t jitter_depth = 0;
+  uint32_t jitter_hold = 20000;
+  uint32_t frame_timeout = 20;
   int enable_osd = 0;
   int codec_mode_stream = 1;
   PAYLOAD_TYPE_E codec_id = PT_H264;
@@ -245,7 +711,45 @@ int main(int argc, const char* argv[]) {
 
   // Load console arguments
   __BeginParseConsoleArguments__(printHelp) __OnArgument("-p") {
-    listen_port = atoi(__ArgValue);
+    input_ports[0] = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--input") {
+    uint16_t port = atoi(__ArgValue);
+    if (input_count < VDEC_MAX_STREAMS) {
+      input_ports[input_count++] = port;
+    } else {
+      printf("> ERROR: Too many inputs, port %d ignored\n", port);
+    }
+    continue;
+  }
+
+  __OnArgument("--diversity") {
+    uint16_t port = atoi(__ArgValue);
+    uint32_t input_paths = 1;
+    for (uint32_t i = 0; i < diversity_count; i++) {
+      input_paths += diversity_inputs[i] == input_count - 1;
+    }
+
+    if (input_paths < COMBINER_MAX_PATHS) {
+      diversity_ports[diversity_count] = port;
+      diversity_inputs[diversity_count++] = input_count - 1;
+    } else {
+      printf("> ERROR: Too many paths, port %d ignored\n", port);
+    }
+    continue;
+  }
+
+  __OnArgument("--layout") {
+    const char* mode = __ArgValue;
+    if (!strcmp(mode, "pip")) {
+      layout = LAYOUT_PIP;
+    } else if (!strcmp(mode, "grid")) {
+      layout = LAYOUT_GRID;
+    } else {
+      printf("> ERROR: Unsupported layout [%s]\n", mode);
+    }
     continue;
   }
 
@@ -342,6 +846,84 @@ int main(int argc, const char* argv[]) {
     continue;
   }
 
+  __OnArgument("--dvr-buffer") {
+    record_buffer = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--dvr-segment") {
+    record_segment = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--dvr-segment-size") {
+    record_segment_size = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--dvr-budget") {
+    record_budget = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--dvr-preroll") {
+    record_preroll = atoi(__ArgValue);
+    record_on_event = true;
+    continue;
+  }
+
+  __OnArgument("--dvr-arm") {
+    record_on_arm = true;
+    record_on_event = true;
+    continue;
+  }
+
+  __OnArgument("--dvr-control") {
+    record_control_port = atoi(__ArgValue);
+    record_on_event = true;
+    continue;
+  }
+
+  __OnArgument("--play") {
+    play_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--replay") {
+    replay_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--replay-fast") {
+    replay_fast = true;
+    continue;
+  }
+
+  __OnArgument("--no-decode") {
+    enable_decode = false;
+    continue;
+  }
+
+  __OnArgument("--wait-keyframe") {
+    wait_keyframe = true;
+    continue;
+  }
+
+  __OnArgument("--jitter-depth") {
+    jitter_depth = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--jitter-hold") {
+    jitter_hold = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--frame-timeout") {
+    frame_timeout = atoi(__ArgValue);
+    continue;
+  }
+
   __OnArgument("--osd") {
     enable_osd = 1;
     continue;
@@ -581,9 +1163,32 @@ int main(int argc, const char* argv[]) {
 
   __EndParseConsoleArguments__
 
-  // Calculate maximum video settings
-  uint32_t vdec_max_width = ALIGN_UP(2592, DEFAULT_ALIGN);
-  uint32_t vdec_max_height = ALIGN_UP(1944, DEFAULT_ALIGN);
+  stream_count = input_count;
+  for (uint32_t i = 0; i < stream_count; i++) {
+    VdecStream* input = &streams[i];
+    memset(input, 0x00, sizeof(*input));
+    input->port = input_ports[i];
+    input->channel_id = i;
+    input->vo_layer_id = vo_layer_id;
+    input->decode = enable_decode;
+    input->stream_mode = codec_mode_stream && !play_path;
+    input->recording = !i && write_stream_path && !play_path;
+    input->frame_timeout = frame_timeout;
+
+    // Primary port first, then the redundant ones of this input
+    paths[path_count].port = input->port;
+    paths[path_count].stream = input;
+    paths[path_count++].index = 0;
+    for (uint32_t n = 0, index = 1; n < diversity_count; n++) {
+      if (diversity_inputs[n] == i) {
+        paths[path_count].port = diversity_ports[n];
+        paths[path_count].stream = input;
+        paths[path_count++].index = index++;
+      }
+    }
+  }
+
+  VDEC_init(stream_count);
 
   uint32_t vo_layer_max_width = MIN2(1920, vo_width);
   uint32_t vo_layer_max_height = MIN2(1200, vo_height);
@@ -646,40 +1251,16 @@ int main(int argc, const char* argv[]) {
     return 1;
   }
 
-  // Configure video buffer for decoder
-  memset(&vb_conf, 0x00, sizeof(vb_conf));
-  vb_conf.u32MaxPoolCnt = 2;
-  vb_conf.astCommPool[0].u32BlkCnt = 4;
-  vb_conf.astCommPool[0].u32BlkSize = 0;
-  vb_conf.astCommPool[1].u32BlkCnt = 2;
-  vb_conf.astCommPool[1].u32BlkSize = 0;
-
-  // Calculate required size for video buffer
-  VB_PIC_BLK_SIZE(vdec_max_width, vdec_max_height, codec_id, vb_conf.astCommPool[0].u32BlkSize);
-  VB_PMV_BLK_SIZE(vdec_max_width, vdec_max_height, codec_id, vb_conf.astCommPool[1].u32BlkSize);
-  printf("> VDEC picture block size = %d, %d\n",
-    vb_conf.astCommPool[0].u32BlkSize, vb_conf.astCommPool[1].u32BlkSize);
-
-  ret = HI_MPI_VB_SetModPoolConf(VB_UID_VDEC, &vb_conf);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to configure ModComPool\n");
-    return 1;
-  }
-
-  ret = HI_MPI_VB_InitModCommPool(VB_UID_VDEC);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to init ModComPool = 0x%x\n", ret);
-    return 1;
-  }
-
   ret = HI_MPI_VO_SetDispBufLen(vo_layer_id, 2);
   if (ret != HI_SUCCESS) {
     printf("ERROR: Unable to set display buffer length\n");
     return 1;
   }
 
-  // Set partitioning mode
-  HI_MPI_VO_SetVideoLayerPartitionMode(vo_layer_id, VO_PART_MODE_SINGLE);
+  // Software partition composes overlapping channels by priority, which
+  // PiP needs. Hardware cells are cheaper but must not overlap.
+  HI_MPI_VO_SetVideoLayerPartitionMode(vo_layer_id,
+    stream_count > 1 && layout == LAYOUT_GRID ? VO_PART_MODE_MULTI : VO_PART_MODE_SINGLE);
 
   // Initialize VO
   VO_init(vo_device_id, VO_INTF_HDMI | VO_INTF_VGA, vo_mode, vo_framerate, background_color);
@@ -730,209 +1311,245 @@ int main(int argc, const char* argv[]) {
     return 1;
   }
 
-  // Configure video channel
-  VO_CHN_ATTR_S channel_config;
-  ret = HI_MPI_VO_GetChnAttr(vo_layer_id, vo_channel_id, &channel_config);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to get channel configuration\n");
-    return 1;
-  }
-
-  channel_config.bDeflicker = HI_FALSE;
-  channel_config.u32Priority = VO_MAX_PRIORITY;
-  channel_config.stRect.s32X = 0;
-  channel_config.stRect.s32Y = 0;
-  channel_config.stRect.u32Width = vo_layer_max_width;
-  channel_config.stRect.u32Height = vo_layer_max_height;
-
-  ret = HI_MPI_VO_SetChnAttr(vo_layer_id, vo_channel_id, &channel_config);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to configure channel\n");
-    return 1;
+  // One VO channel per input
+  uint32_t columns = 1;
+  while (columns * columns < stream_count) {
+    columns++;
   }
 
-  ret = HI_MPI_VO_EnableChn(vo_layer_id, vo_channel_id);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to enable video channel\n");
-    return 1;
-  }
+  uint32_t rows = (stream_count + columns - 1) / columns;
+  for (uint32_t i = 0; i < stream_count; i++) {
+    VO_CHN_ATTR_S channel_config;
+    ret = HI_MPI_VO_GetChnAttr(vo_layer_id, i, &channel_config);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to get channel configuration\n");
+      return 1;
+    }
 
-  // Configure aspect ratio
-  VO_CHN_PARAM_S param;
-  HI_MPI_VO_GetChnParam(vo_layer_id, vo_channel_id, &param);
-  param.stAspectRatio.enMode = vo_layer_aspect_ratio;
-  param.stAspectRatio.u32BgColor = vo_layer_fill_color;
-  param.stAspectRatio.stVideoRect = vo_layer_aspect_ratio_rect;
+    channel_config.bDeflicker = HI_FALSE;
+    channel_config.u32Priority = VO_MAX_PRIORITY;
+    channel_config.stRect.s32X = 0;
+    channel_config.stRect.s32Y = 0;
+    channel_config.stRect.u32Width = vo_layer_max_width;
+    channel_config.stRect.u32Height = vo_layer_max_height;
+
+    if (layout == LAYOUT_GRID) {
+      uint32_t width = ALIGN_BACK(vo_layer_max_width / columns, 2);
+      uint32_t height = ALIGN_BACK(vo_layer_max_height / rows, 2);
+      channel_config.stRect.s32X = (i % columns) * width;
+      channel_config.stRect.s32Y = (i / columns) * height;
+      channel_config.stRect.u32Width = width;
+      channel_config.stRect.u32Height = height;
+    } else if (i) {
+      // Quarter size insets stacked on the right, above the main picture
+      uint32_t width = ALIGN_BACK(vo_layer_max_width / 4, 2);
+      uint32_t height = ALIGN_BACK(vo_layer_max_height / 4, 2);
+      channel_config.stRect.s32X = vo_layer_max_width - width - 16;
+      channel_config.stRect.s32Y = 16 + (i - 1) * (height + 16);
+      channel_config.stRect.u32Width = width;
+      channel_config.stRect.u32Height = height;
+    } else if (stream_count > 1) {
+      channel_config.u32Priority = 0;
+    }
 
-  ret = HI_MPI_VO_SetChnParam(vo_layer_id, vo_channel_id, &param);
-  if (ret != HI_SUCCESS) {
-    printf("> ERROR: Unable to set channel param\n");
-  }
+    ret = HI_MPI_VO_SetChnAttr(vo_layer_id, i, &channel_config);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to configure channel\n");
+      return 1;
+    }
 
-  // Start VDEC at 1920x1080 maximum resolution
-  VDEC_CHN_ATTR_S config;
-  memset(&config, 0x00, sizeof(config));
-  config.enType = codec_id;
-  config.u32BufSize = vdec_max_width * vdec_max_height * 3 / 2;
-  config.u32Priority = 128;
-  config.u32PicWidth = vdec_max_width;
-  config.u32PicHeight = vdec_max_height;
+    ret = HI_MPI_VO_EnableChn(vo_layer_id, i);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to enable video channel\n");
+      return 1;
+    }
 
-  config.stVdecVideoAttr.bTemporalMvpEnable = (codec_id == PT_H265) ? HI_TRUE : HI_FALSE;
-  config.stVdecVideoAttr.enMode = codec_mode_stream ? VIDEO_MODE_STREAM : VIDEO_MODE_FRAME;
-  config.stVdecVideoAttr.u32RefFrameNum = 1;
+    // Configure aspect ratio
+    VO_CHN_PARAM_S param;
+    HI_MPI_VO_GetChnParam(vo_layer_id, i, &param);
+    param.stAspectRatio.enMode = vo_layer_aspect_ratio;
+    param.stAspectRatio.u32BgColor = vo_layer_fill_color;
+    param.stAspectRatio.stVideoRect = vo_layer_aspect_ratio_rect;
 
-  // Create VDEC channel
-  ret = HI_MPI_VDEC_CreateChn(vdec_channel_id, &config);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to create VDEC channel\n");
-    return 1;
+    ret = HI_MPI_VO_SetChnParam(vo_layer_id, i, &param);
+    if (ret != HI_SUCCESS) {
+      printf("> ERROR: Unable to set channel param\n");
+    }
   }
 
-  // Set display mode
-  ret = HI_MPI_VDEC_SetDisplayMode(vdec_channel_id, VIDEO_DISPLAY_MODE_PREVIEW);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to set VDEC display mode\n");
-    return 1;
+  // Playback and replay never touch the live ports
+  for (uint32_t i = 0; i < path_count && !play_path && !replay_path; i++) {
+    if (openPath(&paths[i])) {
+      return 1;
+    }
   }
 
-  // Read decoder protocol information
-  VDEC_PRTCL_PARAM_S protocol;
-  HI_MPI_VDEC_GetProtocolParam(vdec_channel_id, &protocol);
-
-  switch (protocol.enType) {
-    case PT_H264:
-      protocol.stH264PrtclParam.s32MaxPpsNum = 256;
-      protocol.stH264PrtclParam.s32MaxSpsNum = 32;
-      protocol.stH264PrtclParam.s32MaxSliceNum = 100;
-      ret = HI_MPI_VDEC_SetProtocolParam(vdec_channel_id, &protocol);
-      if (ret != HI_SUCCESS) {
-        printf("ERROR: Unable to set VDEC protocol parameters\n");
-        return 1;
-      }
-
-      HI_MPI_VDEC_GetProtocolParam(vdec_channel_id, &protocol);
-      printf("> VDEC Protocol = Type: %s, PPS: %d, SLICE: %d, SPS: %d\n",
-        (codec_id == PT_H264 ? "H264" : (codec_id == PT_H265 ? "H265" : "Unknown")),
-        protocol.stH264PrtclParam.s32MaxPpsNum,
-        protocol.stH264PrtclParam.s32MaxSliceNum,
-        protocol.stH264PrtclParam.s32MaxSpsNum);
-      break;
-
-    case PT_H265:
-      protocol.stH265PrtclParam.s32MaxPpsNum = 64;
-      protocol.stH265PrtclParam.s32MaxSpsNum = 16;
-      protocol.stH265PrtclParam.s32MaxVpsNum = 16;
-      protocol.stH265PrtclParam.s32MaxSliceSegmentNum = 100;
-      ret = HI_MPI_VDEC_SetProtocolParam(vdec_channel_id, &protocol);
-      if (ret != HI_SUCCESS) {
-        printf("ERROR: Unable to set VDEC protocol parameters\n");
-        return 1;
-      }
+  for (uint32_t i = 0; i < stream_count; i++) {
+    uint32_t input_paths = 0;
+    for (uint32_t n = 0; n < path_count; n++) {
+      input_paths += paths[n].stream == &streams[i];
+    }
 
-      HI_MPI_VDEC_GetProtocolParam(vdec_channel_id, &protocol);
-      printf("> VDEC Protocol = Type: %s, PPS: %d, SLICE: %d, SPS: %d\n",
-        (codec_id == PT_H264 ? "H264" : (codec_id == PT_H265 ? "H265" : "Unknown")),
-        protocol.stH265PrtclParam.s32MaxPpsNum,
-        protocol.stH265PrtclParam.s32MaxSliceSegmentNum,
-        protocol.stH265PrtclParam.s32MaxSpsNum);
-      break;
+    if (openStream(&streams[i], input_paths, codec_id, wait_keyframe,
+      jitter_depth, jitter_hold, record_buffer)) {
+      return 1;
+    }
   }
 
-  // Assemble pipeline
-  MPP_CHN_S src;
-  MPP_CHN_S dst;
-
-  src.enModId = HI_ID_VDEC;
-  src.s32DevId = 0;
-  src.s32ChnId = vdec_channel_id;
-
-  dst.enModId = HI_ID_VOU;
-  dst.s32DevId = vo_layer_id;
-  dst.s32ChnId = vo_channel_id;
+  uint8_t* rx_buffer = malloc(1024 * 1024);
 
-  ret = HI_MPI_SYS_Bind(&src, &dst);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to bind VDEC -> VO\n");
-    return 1;
+  // Deterministic replay of a field capture instead of the sockets
+  CaptureReader replay;
+  if (replay_path) {
+    if (capture_open(&replay, replay_path)) {
+      return 1;
+    }
+    replay.realtime = !replay_fast;
+    printf("> Replaying %s, %s\n", replay_path,
+      replay_fast ? "as fast as possible" : "original timing");
   }
 
-  // Start VDEC
-  ret = HI_MPI_VDEC_StartRecvStream(vdec_channel_id);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to start VDEC channel\n");
-    return 1;
+  // Open write file
+  if (streams[0].recording) {
+    RecorderConfig record_config;
+    memset(&record_config, 0x00, sizeof(record_config));
+    record_config.u32SegmentSeconds = record_segment;
+    record_config.u32SegmentMBytes = record_segment_size;
+    record_config.u32BudgetMBytes = record_budget;
+    record_config.bOnEvent = record_on_event ? HI_TRUE : HI_FALSE;
+    record_config.u32PrerollSeconds = record_preroll;
+    recorder_int(write_stream_path, &streams[0].pool, &record_config);
   }
 
-  // Create socket
-  int port = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  struct sockaddr_in address;
-  memset(&address, 0x00, sizeof(address));
-  address.sin_family = AF_INET;
-  address.sin_port = htons(listen_port);
-  bind(port, (struct sockaddr*)&address, sizeof(struct sockaddr_in));
-
-  if (fcntl(port, F_SETFL, O_NONBLOCK) == -1) {
-    printf("ERROR: Unable to set non-blocking mode\n");
-    return 1;
+  // Manual event trigger
+  if (streams[0].recording && record_on_event) {
+    signal(SIGUSR1, onRecordSignal);
+    signal(SIGUSR2, onRecordSignal);
   }
 
-  uint8_t* rx_buffer = malloc(1024 * 1024);
-  uint8_t* nal_buffer = malloc(1024 * 1024);
-
-  // Open write file
-  if (codec_id == PT_H265 && write_stream_path) {
-    recorder_int(write_stream_path);
+  pthread_t control_thread;
+  if ((streams[0].recording || play_path) && record_control_port) {
+    pthread_create(&control_thread, NULL, __DVR_CONTROL_THREAD__, 0);
   }
 
-  // Start ISP service thread
+  // Start ISP service thread, telemetry also feeds the arm trigger
   pthread_t osd_thread;
   if (enable_osd) {
     pthread_create(&osd_thread, NULL, __OSD_THREAD__, 0);
+  }
+
+  if (enable_osd || (streams[0].recording && record_on_arm)) {
     pthread_create(&osd_thread, NULL, __MAVLINK_THREAD__, 0);
   }
 
+  if (play_path) {
+    ret = playRecording(&streams[0], play_path);
+    printStreamStats(&streams[0]);
+    return ret;
+  }
+
   uint32_t write_buffer_capacity = 1024 * 1024 * 2;
   uint8_t* write_buffer = malloc(write_buffer_capacity);
   uint32_t write_buffer_size = 0;
 
-  while (1) {
-    int rx = recv(port, rx_buffer+8, 4096, 0);
-    if (rx <= 0) {
-      usleep(1);
-      continue;
+  struct timespec replay_start;
+  clock_gettime(CLOCK_MONOTONIC, &replay_start);
+  uint64_t replay_bytes = 0;
+
+  // One thread services all inputs
+  int poll_handle = epoll_create1(0);
+  for (uint32_t i = 0; i < path_count && !replay_path; i++) {
+    struct epoll_event event;
+    memset(&event, 0x00, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (epoll_ctl(poll_handle, EPOLL_CTL_ADD, paths[i].socket_handle, &event)) {
+      printf("ERROR: Unable to poll port %d\n", paths[i].port);
+      return 1;
     }
+  }
 
-    VDEC_STREAM_S stream;
-    memset(&stream, 0x00, sizeof(stream));
-    stream.bEndOfStream = HI_FALSE;
-    stream.bEndOfFrame = codec_mode_stream ? HI_FALSE : HI_TRUE;
+  while (1) {
+    uint8_t* rx_data;
+    uint32_t rx = 0;
+    uint64_t now;
+    if (replay_path) {
+      CapturePacket packet;
+      if (capture_next(&replay, &packet, 0) <= 0) {
+        break;
+      }
 
-    uint32_t rtp_header = 0;
-    if (rx_buffer[8] & 0x80 && rx_buffer[9] & 0x60) {
-      rtp_header = 12;
-    }
+      // Datagrams are routed by destination port like on the socket
+      VdecPath* path = findPath(packet.dst_port);
+      if (!path) {
+        continue;
+      }
 
-    // Decode UDP stream
-    stream.pu8Addr = decode_frame(rx_buffer + 8, rx,
-      rtp_header, nal_buffer, &stream.u32Len);
-    if (!stream.pu8Addr) {
-      continue;
+      capture_pace(&replay, &packet);
+      rx = MIN(packet.size, 1024 * 1024 - 8);
+      rx_data = rx_buffer + 8;
+      memcpy(rx_data, packet.data, rx);
+      replay_bytes += rx;
+      now = packet.timestamp;
+      receivePacket(path, rx_data, rx, now);
+    } else {
+      // Wake up in time to release packets held by the jitter buffers
+      now = getMonotonicUs();
+      int timeout = 100;
+      for (uint32_t i = 0; i < stream_count; i++) {
+        timeout = MIN(timeout, getServiceTimeout(&streams[i], now));
+      }
+
+      struct epoll_event events[VDEC_MAX_PATHS];
+      int ready = epoll_wait(poll_handle, events, VDEC_MAX_PATHS, timeout);
+      for (int e = 0; e < ready; e++) {
+        VdecPath* path = &paths[events[e].data.u32];
+
+        // Bounded so a flooded port can not starve the others
+        for (uint32_t n = 0; n < RECEIVER_BATCH; n++) {
+          if (receiver_next(&path->receiver, &rx_data, &rx, 0) <= 0) {
+            break;
+          }
+
+          receivePacket(path, rx_data, rx, getMonotonicUs());
+        }
+      }
+
+      now = getMonotonicUs();
     }
 
-    if (stream.u32Len < 5) {
-      printf("> Broken frame\n");
+    for (uint32_t i = 0; i < stream_count; i++) {
+      processPacket(&streams[i], 0, 0, now);
     }
+  }
 
-    stats_rx_bytes += stream.u32Len;
+  uint32_t replay_packets = 0;
+  for (uint32_t i = 0; i < stream_count; i++) {
+    flushFrame(&streams[i]);
+    replay_packets += streams[i].depacketizer.packets;
+  }
 
-    recorder_input_data(&stream);
+  // Only a finished replay gets here
+  struct timespec replay_end;
+  clock_gettime(CLOCK_MONOTONIC, &replay_end);
+  double elapsed = getTimeInterval(&replay_end, &replay_start);
+  printf("> Replay: %u packets, %.2f MB in %.2f s, %.2f Mbit/sec., "
+    "%.0f packets/sec.\n", replay_packets,
+    (double)replay_bytes / 1024 / 1024, elapsed,
+    elapsed > 0 ? replay_bytes * 8 / elapsed / 1024 / 1024 : 0,
+    elapsed > 0 ? replay_packets / elapsed : 0);
 
-    // Send frame into decoder
-    int ret = HI_MPI_VDEC_SendStream(vdec_channel_id, &stream, 0);
-    if (ret != HI_SUCCESS) {
-      printf("WARN: Unable to send data into VDEC = 0x%x\n", ret);
-    }
+  // Written totals are final once the file is closed
+  if (streams[0].recording) {
+    recorder_stop();
+  }
+
+  for (uint32_t i = 0; i < stream_count; i++) {
+    printStreamStats(&streams[i]);
+  }
+
+  if (replay_path) {
+    capture_close(&replay);
   }
 
   return 0;
@@ -964,6 +1581,7 @@ float telemetry_raw_imu = 0;
 float telemetry_resolution = 0;
 float telemetry_arm = 0;
 float armed = 0;
+bool vehicle_armed = false;
 char c1[30] = "0";
 char c2[30] = "0";
 char s1[30] = "0";
@@ -972,6 +1590,58 @@ char s3[30] = "0";
 char s4[30] = "0";
 char* ptr;
 
+// Text commands start and stop, e.g. echo start | nc -u -w1 <ip> <port>,
+// pause, play and seek [+-]seconds while playing a recording
+void* __DVR_CONTROL_THREAD__(void* arg) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    printf("ERROR: Unable to create DVR control socket: %s\n", strerror(errno));
+    return 0;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(record_control_port);
+  if (bind(fd, (struct sockaddr*)(&addr), sizeof(addr)) != 0) {
+    printf("ERROR: Unable to bind DVR control port: %s\n", strerror(errno));
+    close(fd);
+    return 0;
+  }
+
+  char buffer[64];
+  while (1) {
+    int ret = recv(fd, buffer, sizeof(buffer) - 1, 0);
+    if (ret <= 0) {
+      continue;
+    }
+
+    buffer[ret] = 0;
+    if (!strncmp(buffer, "start", 5)) {
+      printf("> DVR control: start\n");
+      recorder_trigger(HI_TRUE);
+    } else if (!strncmp(buffer, "stop", 4)) {
+      printf("> DVR control: stop\n");
+      recorder_trigger(HI_FALSE);
+    } else if (!strncmp(buffer, "pause", 5) || !strncmp(buffer, "play", 4)) {
+      bool paused = buffer[1] == 'a';
+      printf("> DVR control: %s\n", paused ? "pause" : "play");
+      pthread_mutex_lock(&playback_lock);
+      playback_paused = paused;
+      pthread_mutex_unlock(&playback_lock);
+    } else if (!strncmp(buffer, "seek ", 5)) {
+      pthread_mutex_lock(&playback_lock);
+      playback_seek = true;
+      playback_seek_relative = buffer[5] == '+' || buffer[5] == '-';
+      playback_seek_seconds = atoi(buffer + 5);
+      pthread_mutex_unlock(&playback_lock);
+    } else {
+      printf("WARN: Unknown DVR control command\n");
+    }
+  }
+}
+
 void* __MAVLINK_THREAD__(void* arg) {
   // Create socket
   int fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -1019,7 +1689,23 @@ void* __MAVLINK_THREAD__(void* arg) {
       if (mavlink_parse_char(MAVLINK_COMM_0, buffer[i], &message, &status) == 1) {
         switch (message.msgid) {
           case MAVLINK_MSG_ID_HEARTBEAT:
-            // handle_heartbeat(&message);
+            {
+              // Ground stations send heartbeats too, only the vehicle
+              // reports the arm state
+              mavlink_heartbeat_t heartbeat;
+              mavlink_msg_heartbeat_decode(&message, &heartbeat);
+              if (heartbeat.type == MAV_TYPE_GCS ||
+                heartbeat.autopilot == MAV_AUTOPILOT_INVALID) {
+                break;
+              }
+
+              bool is_armed = heartbeat.base_mode & MAV_MODE_FLAG_SAFETY_ARMED;
+              if (record_on_arm && is_armed != vehicle_armed) {
+                printf("> Vehicle %s\n", is_armed ? "armed" : "disarmed");
+                recorder_trigger(is_armed ? HI_TRUE : HI_FALSE);
+              }
+              vehicle_armed = is_armed;
+            }
             break;
           
           case MAVLINK_MSG_ID_RAW_IMU:
@@ -1308,9 +1994,10 @@ void* __OSD_THREAD__(void* arg) {
       }
     }
 
-    char hud_frames_rx[32];
+    char hud_frames_rx[48];
     memset(hud_frames_rx, 0, sizeof(hud_frames_rx));
-    sprintf(hud_frames_rx, "RX Packets %d", frames_received);
+    sprintf(hud_frames_rx, "RX Packets %u Lost %u", streams[0].depacketizer.nals,
+      streams[0].depacketizer.lost);
     if (osd_element15x > 0){fbg_write(fbg, hud_frames_rx, osd_element15x*resX_multiplier, osd_element15y*resY_multiplier);}
     memset(hud_frames_rx, 0, sizeof(hud_frames_rx));
     sprintf(hud_frames_rx, "Rate %.02f Kbit/s", rx_rate);
@@ -13,6 +13,8 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 
@@ -52,10 +54,20 @@
 #define ALIGN_UP(x, a) ((x + a - 1) & (~(a - 1)))
 #define ALIGN_BACK(x, a) ((a) * (((x) / (a))))
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 #include "fbg_fbdev.h"
 #include "fbgraphics.h"
 #include "mavlink/common/mavlink.h"
+#include "../common/capture.h"
+#include "../common/combiner.h"
+#include "../common/dvr.h"
+#include "../common/frame.h"
+#include "../common/jitter.h"
+#include "../common/packet.h"
+#include "../common/pool.h"
+#include "../common/receiver.h"
+#include "../common/sps.h"
 
 /**
  * @brief Initialize VO device
@@ -76,16 +88,77 @@ int VO_init(VO_DEV device_id, VO_INTF_TYPE_E interface_type,
  */
 int VO_HDMI_init(HI_HDMI_ID_E device_id, VO_INTF_SYNC_E interface_mode);
 
+// Inputs decoded side by side, each gets the VDEC and VO channel of its index
+#define VDEC_MAX_STREAMS 4
+
+typedef enum {
+  LAYOUT_PIP,   // First stream full screen, others small on the right
+  LAYOUT_GRID   // Equal tiles
+} VdecLayout;
+
+typedef struct {
+  uint16_t port;          // First receive path, names the input in logs
+  VDEC_CHN channel_id;
+  VO_LAYER vo_layer_id;
+  Combiner combiner;      // Merges redundant receive paths
+  JitterBuffer jitter;
+  Depacketizer depacketizer;
+  FrameAssembler frame;
+  NalPool pool;
+
+  bool decode;            // Submit to VDEC, off for profiling
+  bool stream_mode;       // VIDEO_MODE_STREAM instead of whole frames
+  bool recording;         // Feeds the DVR recorder
+  uint32_t frame_timeout; // Milliseconds
+
+  // Decoder is created once the first SPS tells codec and picture size
+  bool decoder_running;
+  SpsInfo decoder_format;
+  uint8_t vps_cache[256];
+  uint32_t vps_size;
+} VdecStream;
+
+// One UDP port carrying an input, several ports of an input are combined
+#define VDEC_MAX_PATHS (VDEC_MAX_STREAMS * COMBINER_MAX_PATHS)
+
+typedef struct {
+  uint16_t port;
+  int socket_handle;
+  Receiver receiver;
+  VdecStream* stream;
+  uint32_t index;         // Path index in the combiner of the stream
+} VdecPath;
+
 /**
- * @brief
- * @param rx_buffer - UDP data
- * @param rx_size - Size of UDP data
- * @param header_size - Size of data before payload
- * @param nal_buffer - Buffer for NAL reassembly
- * @param out_nal_size
+ * @brief Set how many VDEC channels share the mod pool, call before the
+ * first VDEC_start
+ */
+void VDEC_init(uint32_t channel_count);
+
+/**
+ * @brief Check whether a channel for this picture can be started while
+ * other channels hold the mod pool
+ * @return false if the pool has to be recreated with larger blocks
+ */
+bool VDEC_fits(PAYLOAD_TYPE_E codec, uint32_t width, uint32_t height);
+
+/**
+ * @brief Create VDEC channel, set up the shared mod pool for the first
+ * channel and bind it to the VO channel
+ * @param codec - PT_H264 or PT_H265
+ * @param width - Picture width from the SPS
+ * @param height - Picture height from the SPS
+ * @param stream_mode - VIDEO_MODE_STREAM instead of VIDEO_MODE_FRAME
+ * @return HI_SUCCESS on success
+ */
+int VDEC_start(VDEC_CHN channel_id, PAYLOAD_TYPE_E codec, uint32_t width,
+  uint32_t height, HI_BOOL stream_mode, VO_LAYER vo_layer_id, VO_CHN vo_channel_id);
+
+/**
+ * @brief Unbind and destroy VDEC channel, the last channel releases the
+ * mod pool. VO layer and channel stay enabled.
  */
-uint8_t* decode_frame(uint8_t* rx_buffer, uint32_t rx_size,
-  uint32_t header_size, uint8_t* nal_buffer, uint32_t* out_nal_size);
+void VDEC_stop(VDEC_CHN channel_id, VO_LAYER vo_layer_id, VO_CHN vo_channel_id);
 
 /* --- Console arguments parser --- */
 #define __BeginParseConsoleArguments__(printHelpFunction) \
@@ -100,3 +173,4 @@ uint8_t* decode_frame(uint8_t* rx_buffer, uint32_t rx_size,
 
 void* __OSD_THREAD__(void*);
 void* __MAVLINK_THREAD__(void*);
+void* __DVR_CONTROL_THREAD__(void*);
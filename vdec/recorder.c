@@ -1,164 +1,845 @@
 /**************************DVR made by Dinh Cong Bang from VietNam***************************/
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include "recorder.h"
+#include "../common/dvr.h"
+#include "../common/packet.h"
 
-FILE* fpRecordFile = HI_NULL;
+int fdRecordFile = -1;
 HI_BOOL allowSavingThreadRun = HI_FALSE;
 HI_BOOL bIsRecorderReady = HI_FALSE;
 HI_BOOL isFoundIFrame = HI_FALSE;
 RingBuffer ringbuff;
-Data videoDataBuffer;
+pthread_t recording_thread;
+NalPool* pNalPool = HI_NULL;
+HI_BOOL bDropping = HI_FALSE;
+RecorderStats stStats;
+HI_BOOL bMuxMp4 = HI_FALSE;
+Mp4Muxer stMuxer;
+
+// Writer thread only: page aligned staging buffer and file position
+HI_U8* pWriteBuffer = HI_NULL;
+HI_U32 u32WriteBufferSize = 0;
+HI_U64 u64FileSize = 0;
+HI_U64 u64FileAllocated = 0;
+HI_BOOL bPreallocate = HI_FALSE;
+HI_U64 u64FileRetired = 0;  // Written back and dropped from the page cache
+
+// Sidecar keyframe index of the open file for seeking in playback, one
+// record per GOP written once the GOP is complete
+int fdIndexFile = -1;
+DvrIndexEntry stGop;
+HI_BOOL bGopOpen = HI_FALSE;
+HI_BOOL bGopSlice = HI_FALSE;
+HI_U32 u32GopFirstTime = 0;     // Raw: timestamps of its first and newest frame
+HI_U32 u32GopLastTime = 0;
+HI_U64 u64GopFirstFrame = 0;    // MP4: stMuxer.frames before the GOP
+HI_U64 u64SyncFragments = 0;    // MP4: stMuxer.sync_fragments indexed
+
+// Segments named <stem>_<index><extension> next to the -w path, oldest
+// first, the last one is being written
+char szSegmentDirectory[256];
+char szSegmentStem[128];
+char szSegmentExtension[16];
+Segment* pSegments = HI_NULL;
+HI_U32 u32SegmentCount = 0;
+HI_U32 u32SegmentCapacity = 0;
+HI_U64 u64SegmentsSize = 0;   // Closed segments only
+HI_U32 u32SegmentTime = 0;    // 90 kHz, 0 for no limit
+HI_U64 u64SegmentSize = 0;
+HI_U64 u64Budget = 0;
+HI_BOOL bSegmented = HI_FALSE;
+HI_BOOL bSegmentEmpty = HI_TRUE;
+HI_U32 u32SegmentStart = 0;
+
+// Event mode: GOPs wait in RAM until recorder_trigger starts an event
+HI_BOOL bOnEvent = HI_FALSE;
+atomic_int s32Triggered;
+HI_BOOL bEventActive = HI_FALSE;    // Writer thread view of s32Triggered
+HI_U32 u32Preroll = 0;              // 90 kHz
+Data* pPreroll = HI_NULL;
+HI_U32 u32PrerollCount = 0;
+HI_U32 u32PrerollCapacity = 0;
+HI_U32 u32PrerollBlocks = 0;        // Pool blocks referenced by the pre-roll
+HI_U32 u32PrerollBlockLimit = 0;    // Leaves pool blocks for new data
+HI_BOOL bPrerollLimited = HI_FALSE;
+atomic_int s32PrerollFull;          // Pool ran out while only the pre-roll held it
+HI_BOOL bDropGap = HI_TRUE;         // Receive thread: dropped data leaves a gap
 
 extern double getTimeInterval(struct timespec* timestamp, struct timespec* last_meansure_timestamp) ;
 
 void init(RingBuffer* rb) {
-    rb->head = 0;
-    rb->tail = 0;
-    rb->count = 0;
-    pthread_mutex_init(&rb->lock, NULL);
-    pthread_cond_init(&rb->not_full, NULL);
-    pthread_cond_init(&rb->not_empty, NULL);
-    for(int i = 0; i<RINGBUFFER_SIZE; i++)
+    atomic_init(&rb->head, 0);
+    atomic_init(&rb->tail, 0);
+    sem_init(&rb->ready, 0, 0);
+}
+
+void destroy(RingBuffer* rb) {
+    sem_destroy(&rb->ready);
+}
+
+// Never blocks the receive loop, returns HI_FALSE if the queue is full
+HI_BOOL enqueue(RingBuffer* rb, const Data* pItem) {
+    unsigned head = atomic_load_explicit(&rb->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&rb->tail, memory_order_acquire);
+    if (head - tail == RINGBUFFER_SIZE)
+        return HI_FALSE;
+
+    rb->buffer[head % RINGBUFFER_SIZE] = *pItem;
+    atomic_store_explicit(&rb->head, head + 1, memory_order_release);
+    sem_post(&rb->ready);
+    return HI_TRUE;
+}
+
+// Waits until pDeadline (CLOCK_REALTIME) for an item, HI_NULL only takes
+// what is queued. HI_FALSE on timeout or a wake-up by recorder_stop.
+HI_BOOL dequeue(RingBuffer* rb, Data* pData, const struct timespec* pDeadline) {
+    if (pDeadline && sem_timedwait(&rb->ready, pDeadline))
+        return HI_FALSE;
+
+    unsigned tail = atomic_load_explicit(&rb->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&rb->head, memory_order_acquire))
+        return HI_FALSE;
+
+    *pData = rb->buffer[tail % RINGBUFFER_SIZE];
+    atomic_store_explicit(&rb->tail, tail + 1, memory_order_release);
+    return HI_TRUE;
+}
+
+// Start write back of the new range right away and wait for the older
+// ones, so dirty pages never pile up in RAM and the card sees a steady
+// stream of large writes instead of bursts at every sync
+static void writeBehind(HI_U64 u64Offset, HI_U32 size)
+{
+    sync_file_range(fdRecordFile, u64Offset, size, SYNC_FILE_RANGE_WRITE);
+    if(u64Offset - u64FileRetired < RECORDER_WRITE_SIZE)
+      return;
+
+    sync_file_range(fdRecordFile, u64FileRetired, u64Offset - u64FileRetired,
+      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fdRecordFile, u64FileRetired, u64Offset - u64FileRetired,
+      POSIX_FADV_DONTNEED);
+    u64FileRetired = u64Offset;
+}
+
+// Reserve clusters up front, FAT allocation is slow while writing.
+// File size stays at the written data, a cut file has no zero tail.
+static void preallocate(void)
+{
+    if(bPreallocate == HI_FALSE)
+      return;
+
+    if(fallocate(fdRecordFile, FALLOC_FL_KEEP_SIZE, u64FileAllocated,
+        RECORDER_PREALLOCATE))
     {
-      rb->buffer[i].pData = malloc(BUFFER_SIZE);
+      printf("WARN: Unable to preallocate video file: %s\n", strerror(errno));
+      bPreallocate = HI_FALSE;
+      return;
     }
+    u64FileAllocated += RECORDER_PREALLOCATE;
 }
 
-void destroy(RingBuffer* rb) {
-    for(int i = 0; i<RINGBUFFER_SIZE; i++)
+static HI_BOOL flushWriteBuffer(void)
+{
+    // Segment could not be opened, retried at the next I frame
+    if(fdRecordFile < 0)
     {
-      free(rb->buffer[i].pData);
+      u32WriteBufferSize = 0;
+      return HI_FALSE;
     }
-    pthread_mutex_destroy(&rb->lock);
-    pthread_cond_destroy(&rb->not_full);
-    pthread_cond_destroy(&rb->not_empty);
+
+    HI_U32 offset = 0;
+    while(offset < u32WriteBufferSize)
+    {
+      ssize_t written = write(fdRecordFile, pWriteBuffer + offset,
+        u32WriteBufferSize - offset);
+      if(written <= 0)
+      {
+        printf("ERROR: Unable to write video file: %s\n", strerror(errno));
+        u32WriteBufferSize = 0;
+        return HI_FALSE;
+      }
+      offset += written;
+    }
+
+    writeBehind(u64FileSize, u32WriteBufferSize);
+    u64FileSize += u32WriteBufferSize;
+    u32WriteBufferSize = 0;
+
+    if(u64FileSize + RECORDER_WRITE_SIZE > u64FileAllocated)
+      preallocate();
+    return HI_TRUE;
 }
 
-void enqueue(RingBuffer* rb, HI_U8* pData, HI_U32 size) {
-  if(bIsRecorderReady == HI_TRUE)
-  {
-    pthread_mutex_lock(&rb->lock);
-    while (rb->count == RINGBUFFER_SIZE) {
-        pthread_cond_wait(&rb->not_full, &rb->lock);
+static int writeFile(void* pContext, const HI_U8* pData, HI_U32 size)
+{
+    while(size)
+    {
+      HI_U32 chunk = RECORDER_WRITE_SIZE - u32WriteBufferSize;
+      if(chunk > size)
+        chunk = size;
+      memcpy(pWriteBuffer + u32WriteBufferSize, pData, chunk);
+      u32WriteBufferSize += chunk;
+      pData += chunk;
+      size -= chunk;
+
+      if(u32WriteBufferSize == RECORDER_WRITE_SIZE && !flushWriteBuffer())
+        return -1;
     }
-    memcpy(rb->buffer[rb->head].pData, pData, size);
-    rb->buffer[rb->head].size = size;
-    rb->head = (rb->head + 1) % RINGBUFFER_SIZE;
-    rb->count++;
-    pthread_cond_signal(&rb->not_empty);
-    pthread_mutex_unlock(&rb->lock);
-    // printf("Enque %d byte\n", size);
-  }
+    return 0;
+}
+
+static void syncFile(void)
+{
+    if(fdRecordFile < 0)
+      return;
+    flushWriteBuffer();
+    fdatasync(fdRecordFile);
+}
+
+static void getSegmentPath(char* pPath, HI_U32 size, HI_U32 u32Index)
+{
+    snprintf(pPath, size, "%s/%s_%05u%s", szSegmentDirectory, szSegmentStem,
+      u32Index, szSegmentExtension);
 }
 
-Data* dequeue(RingBuffer* rb) {
-    pthread_mutex_lock(&rb->lock);
-    while (rb->count == 0) {
-        pthread_cond_wait(&rb->not_empty, &rb->lock);
+static HI_BOOL addSegment(HI_U32 u32Index, HI_U64 u64Size)
+{
+    if(u32SegmentCount == u32SegmentCapacity)
+    {
+      HI_U32 capacity = u32SegmentCapacity ? u32SegmentCapacity * 2 : 64;
+      Segment* pGrown = realloc(pSegments, capacity * sizeof(Segment));
+      if(!pGrown)
+        return HI_FALSE;
+      pSegments = pGrown;
+      u32SegmentCapacity = capacity;
     }
-    Data* data = &rb->buffer[rb->tail];
-    // printf("dequeue %d byte\n", data->size);
-    rb->tail = (rb->tail + 1) % RINGBUFFER_SIZE;
-    rb->count--;
-    pthread_cond_signal(&rb->not_full);
-    pthread_mutex_unlock(&rb->lock);
-    return data;
+    pSegments[u32SegmentCount].u32Index = u32Index;
+    pSegments[u32SegmentCount].u64Size = u64Size;
+    u32SegmentCount++;
+    return HI_TRUE;
 }
 
-HI_BOOL RingIsEmpty(RingBuffer* rb)
+static int compareSegments(const void* pA, const void* pB)
 {
-  return rb->count == 0;
+    HI_U32 a = ((const Segment*)pA)->u32Index;
+    HI_U32 b = ((const Segment*)pB)->u32Index;
+    return a < b ? -1 : a > b;
 }
 
-void recorder_int(const char* pPath)
+// One pass over the directory finds earlier segments, their total size
+// counts against the budget and numbering continues after the last one
+static void scanSegments(void)
+{
+    DIR* pDir = opendir(szSegmentDirectory);
+    if(!pDir)
+      return;
+
+    size_t stem = strlen(szSegmentStem);
+    size_t extension = strlen(szSegmentExtension);
+    struct dirent* pEntry;
+    while((pEntry = readdir(pDir)))
+    {
+      const char* pName = pEntry->d_name;
+      size_t length = strlen(pName);
+      if(length != stem + 6 + extension || strncmp(pName, szSegmentStem, stem) ||
+          pName[stem] != '_' || strcasecmp(pName + stem + 6, szSegmentExtension))
+        continue;
+
+      char* pEnd;
+      HI_U32 u32Index = strtoul(pName + stem + 1, &pEnd, 10);
+      struct stat info;
+      if(pEnd != pName + stem + 6 || fstatat(dirfd(pDir), pName, &info, 0))
+        continue;
+
+      addSegment(u32Index, info.st_size);
+      u64SegmentsSize += info.st_size;
+    }
+    closedir(pDir);
+
+    qsort(pSegments, u32SegmentCount, sizeof(Segment), compareSegments);
+}
+
+// Delete the oldest closed segments until everything fits the budget
+static void enforceBudget(void)
+{
+    while(u64Budget && u32SegmentCount > 1 &&
+        u64SegmentsSize + u64FileSize > u64Budget)
+    {
+      char szPath[512];
+      getSegmentPath(szPath, sizeof(szPath), pSegments[0].u32Index);
+      if(unlink(szPath) && errno != ENOENT)
+      {
+        printf("ERROR: Unable to delete segment [%s]: %s\n", szPath, strerror(errno));
+        return;
+      }
+      printf("> Recorder: deleted %s\n", szPath);
+      strcat(szPath, DVR_INDEX_EXTENSION);
+      unlink(szPath);
+      u64SegmentsSize -= pSegments[0].u64Size;
+      u32SegmentCount--;
+      memmove(pSegments, pSegments + 1, u32SegmentCount * sizeof(Segment));
+    }
+}
+
+static void finishGop(HI_U64 u64EndFrame)
+{
+    if(bGopOpen == HI_FALSE)
+      return;
+
+    bGopOpen = HI_FALSE;
+    HI_U64 u64Frames = u64EndFrame - u64GopFirstFrame;
+    if(bMuxMp4 == HI_TRUE)
+      stGop.frames = u64Frames < 0xFFFF ? u64Frames : 0xFFFF;
+    // Measured within the GOP, a gap after it would stretch the frames
+    else if(stGop.frames > 1)
+      stGop.frame_duration = (u32GopLastTime - u32GopFirstTime) / (stGop.frames - 1);
+    if(fdIndexFile >= 0 && write(fdIndexFile, &stGop, sizeof(stGop)) != sizeof(stGop))
+    {
+      printf("WARN: Unable to write keyframe index: %s\n", strerror(errno));
+      close(fdIndexFile);
+      fdIndexFile = -1;
+    }
+}
+
+// Raw files: a GOP starts at the parameter sets of an I frame
+static void indexRaw(const Data* pData)
+{
+    const HI_U8 u8Start = NAL_FLAG_RECOVERY | NAL_FLAG_UNIT_START;
+    if((pData->u8Flags & u8Start) == u8Start && (bGopOpen == HI_FALSE || bGopSlice == HI_TRUE))
+    {
+      finishGop(0);
+      stGop.offset = u64FileSize + u32WriteBufferSize;
+      stGop.time = pData->u32Timestamp - u32SegmentStart;
+      stGop.frames = 0;
+      stGop.frame_duration = 0;
+      bGopOpen = HI_TRUE;
+      bGopSlice = HI_FALSE;
+    }
+
+    if(bGopOpen == HI_TRUE && (pData->u8Flags & NAL_FLAG_SLICE))
+    {
+      bGopSlice = HI_TRUE;
+      if((pData->u8Flags & NAL_FLAG_UNIT_START) && stGop.frames < 0xFFFF)
+      {
+        if(!stGop.frames)
+          u32GopFirstTime = pData->u32Timestamp;
+        stGop.frames++;
+        u32GopLastTime = pData->u32Timestamp;
+      }
+    }
+}
+
+// MP4 files: a GOP starts at the moof of a fragment opened by a keyframe
+static void indexMuxed(void)
+{
+    if(stMuxer.sync_fragments == u64SyncFragments)
+      return;
+
+    u64SyncFragments = stMuxer.sync_fragments;
+    finishGop(stMuxer.sync_frames);
+    stGop.offset = stMuxer.sync_offset;
+    stGop.time = stMuxer.sync_time;
+    stGop.frames = 0;
+    stGop.frame_duration = 0;
+    u64GopFirstFrame = stMuxer.sync_frames;
+    bGopOpen = HI_TRUE;
+}
+
+static HI_BOOL openFile(const char* pPath)
+{
+    fdRecordFile = open(pPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fdRecordFile < 0)
+    {
+      printf("ERROR: Unable to open video file [%s]: %s\n", pPath, strerror(errno));
+      return HI_FALSE;
+    }
+
+    u64FileSize = 0;
+    u64FileAllocated = 0;
+    u64FileRetired = 0;
+    bPreallocate = HI_TRUE;
+    preallocate();
+
+    // Recording goes on without, playback just can not seek
+    char szIndexPath[512];
+    snprintf(szIndexPath, sizeof(szIndexPath), "%s%s", pPath, DVR_INDEX_EXTENSION);
+    fdIndexFile = open(szIndexPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fdIndexFile < 0)
+      printf("WARN: Unable to open keyframe index [%s]: %s\n", szIndexPath, strerror(errno));
+    bGopOpen = HI_FALSE;
+    return HI_TRUE;
+}
+
+static void closeFile(void)
+{
+    if(fdRecordFile < 0)
+      return;
+
+    if(bMuxMp4 == HI_TRUE)
+    {
+      mp4_finish(&stMuxer);
+      indexMuxed();
+    }
+    finishGop(stMuxer.frames);
+    syncFile();
+    if(fdIndexFile >= 0)
+    {
+      close(fdIndexFile);
+      fdIndexFile = -1;
+    }
+
+    // Drop preallocated space past the end
+    ftruncate(fdRecordFile, u64FileSize);
+    close(fdRecordFile);
+    fdRecordFile = -1;
+    stStats.u64WrittenBytes += u64FileSize;
+
+    if(bSegmented == HI_TRUE && u32SegmentCount)
+    {
+      pSegments[u32SegmentCount - 1].u64Size = u64FileSize;
+      u64SegmentsSize += u64FileSize;
+    }
+    u64FileSize = 0;
+}
+
+static HI_BOOL openSegment(void)
+{
+    HI_U32 u32Index = u32SegmentCount ? pSegments[u32SegmentCount - 1].u32Index + 1 : 0;
+    char szPath[512];
+    getSegmentPath(szPath, sizeof(szPath), u32Index);
+    if(!addSegment(u32Index, 0))
+      return HI_FALSE;
+    if(!openFile(szPath))
+    {
+      u32SegmentCount--;
+      return HI_FALSE;
+    }
+
+    if(bMuxMp4 == HI_TRUE)
+      mp4_restart(&stMuxer);
+    bSegmentEmpty = HI_TRUE;
+    printf("> Recorder: writing %s\n", szPath);
+    enforceBudget();
+    return HI_TRUE;
+}
+
+// Split at I frames once the segment is long or big enough
+static void checkSegment(const Data* pData)
+{
+    if(bSegmented == HI_FALSE || !(pData->u8Flags & NAL_FLAG_RECOVERY))
+      return;
+
+    if(fdRecordFile < 0)
+    {
+      openSegment();
+      return;
+    }
+
+    HI_U64 u64Size = u64FileSize + u32WriteBufferSize;
+    if(bSegmentEmpty == HI_FALSE &&
+        ((u32SegmentTime && pData->u32Timestamp - u32SegmentStart >= u32SegmentTime) ||
+        (u64SegmentSize && u64Size >= u64SegmentSize)))
+    {
+      closeFile();
+      openSegment();
+    }
+}
+
+void recorder_int(const char* pPath, NalPool* pPool, const RecorderConfig* pConfig)
 {
     init(&ringbuff);
-    videoDataBuffer.pData = malloc(BUFFER_SIZE);
-    fpRecordFile = fopen(pPath, "wb");
-    if(!fpRecordFile)
+    pNalPool = pPool;
+    const char* pExtension = strrchr(pPath, '.');
+    const char* pName = strrchr(pPath, '/');
+    pName = pName ? pName + 1 : pPath;
+    if(pExtension < pName)
+      pExtension = pPath + strlen(pPath);
+    bMuxMp4 = !strcasecmp(pExtension, ".mp4") ? HI_TRUE : HI_FALSE;
+
+    // FAT32 files end at 4 GB
+    HI_U32 u32SegmentMBytes = pConfig->u32SegmentMBytes < 4000 ? pConfig->u32SegmentMBytes : 4000;
+    u32SegmentTime = pConfig->u32SegmentSeconds * 90000;
+    u64SegmentSize = (HI_U64)u32SegmentMBytes * 1024 * 1024;
+    u64Budget = (HI_U64)pConfig->u32BudgetMBytes * 1024 * 1024;
+    bOnEvent = pConfig->bOnEvent;
+    u32Preroll = pConfig->u32PrerollSeconds * 90000;
+    // Blocks are switched once the reserve no longer fits, so the cap
+    // counts blocks rather than bytes
+    u32PrerollBlockLimit = pPool->count > 2 ? pPool->count - 2 : 1;
+    atomic_init(&s32PrerollFull, 0);
+    bSegmented = u32SegmentTime || u64SegmentSize ? HI_TRUE : HI_FALSE;
+    if(bSegmented == HI_TRUE)
+    {
+      snprintf(szSegmentDirectory, sizeof(szSegmentDirectory), "%.*s",
+        pName > pPath ? (int)(pName - pPath - 1) : 1, pName > pPath ? pPath : ".");
+      snprintf(szSegmentStem, sizeof(szSegmentStem), "%.*s", (int)(pExtension - pName), pName);
+      snprintf(szSegmentExtension, sizeof(szSegmentExtension), "%s", pExtension);
+      scanSegments();
+      printf("> Recorder: %u segments, %.1f MB found in %s\n", u32SegmentCount,
+        (double)u64SegmentsSize / 1024 / 1024, szSegmentDirectory);
+    }
+
+    if(posix_memalign((void**)&pWriteBuffer, 4096, RECORDER_WRITE_SIZE))
+      pWriteBuffer = HI_NULL;
+    HI_BOOL bOpened = pWriteBuffer && (!bMuxMp4 || !mp4_init(&stMuxer, false, writeFile, HI_NULL));
+    // Event mode opens the first segment on the first event
+    if(bOpened)
+      bOpened = bSegmented ? bOnEvent || openSegment() : openFile(pPath);
+    if(!bOpened)
     {
       printf("ERROR: Can not record video\n");
     }
     else
     {
-      pthread_t recording_thread;
       allowSavingThreadRun = HI_TRUE;
       pthread_create(&recording_thread, NULL, recorder_save_file_thread, &ringbuff);
     }
     printf("Finish setup video recorder\n");
 }
 
-void recorder_input_data(const VDEC_STREAM_S *pStream)
+void recorder_input_data(const VDEC_STREAM_S *pStream, HI_BOOL bHevc,
+    HI_U8 u8Flags, HI_U32 u32Timestamp)
 {
     if(bIsRecorderReady == HI_FALSE)
         return;
 
+    // Depacketizer already classified the NAL units, no need to look again
     if(isFoundIFrame == HI_FALSE)
     {
-      HI_U8 t = (pStream->pu8Addr[4] >> 1) & 0x3f;
-      if(t == 32)
-      {
-        printf("Found I Frame, start recording\n");
-        isFoundIFrame = HI_TRUE;
-      }
-      else
+      if(!(u8Flags & NAL_FLAG_RECOVERY))
       {
-        printf("Not I Frame %d\n", t);
+        if(bDropping == HI_TRUE)
+        {
+          stStats.u64DroppedNals++;
+          stStats.u64DroppedBytes += pStream->u32Len;
+        }
         return;
       }
+      if(bDropping == HI_FALSE)
+        printf("Found I Frame, start recording\n");
+      isFoundIFrame = HI_TRUE;
     }
 
-    if(isFoundIFrame == HI_TRUE)
+    // Reassembled NAL units already sit at the pool write position,
+    // single ones are still in the receive buffer and get copied once
+    HI_U32 capacity;
+    HI_U8* pData = pool_buffer(pNalPool, &capacity);
+    if(pStream->pu8Addr != pData)
     {
-      if(videoDataBuffer.size + pStream->u32Len <= BUFFER_SIZE)
-      {
-        memcpy(videoDataBuffer.pData + videoDataBuffer.size, pStream->pu8Addr, pStream->u32Len);
-        videoDataBuffer.size += pStream->u32Len;
-      }
-      else
+      if(pStream->u32Len > capacity)
+        return;
+      memcpy(pData, pStream->pu8Addr, pStream->u32Len);
+    }
+
+    // Pool or queue full, SD card stalled: skip to the next I frame
+    Data item;
+    item.pBlock = pool_commit(pNalPool, pStream->u32Len);
+    item.pData = pData;
+    item.size = pStream->u32Len;
+    item.bHevc = bHevc;
+    item.u8Flags = u8Flags;
+    item.u32Timestamp = u32Timestamp;
+    item.bDiscontinuity = bDropping == HI_TRUE && bDropGap == HI_TRUE ? HI_TRUE : HI_FALSE;
+
+    // Live video goes first: with the SD card stalled the rest of the GOP
+    // is dropped and recording resumes at the next I frame
+    PoolBlock* pBlock = item.pBlock;
+    if(!pBlock || !enqueue(&ringbuff, &item))
+    {
+      if(pBlock)
+        pool_release(pNalPool, pBlock);
+
+      if(bDropping == HI_FALSE)
       {
-        enqueue(&ringbuff, videoDataBuffer.pData, videoDataBuffer.size);
-        memcpy(videoDataBuffer.pData, pStream->pu8Addr, pStream->u32Len);
-        videoDataBuffer.size = pStream->u32Len;
+        // Waiting for an event only the pre-roll holds blocks, the writer
+        // thread gives up its oldest GOP instead of the pre-roll ending
+        // in a gap
+        bDropGap = !pBlock && bOnEvent == HI_TRUE && !atomic_load(&s32Triggered) ? HI_FALSE : HI_TRUE;
+        stStats.u64DroppedGops++;
+        if(bDropGap == HI_TRUE)
+          printf("WARN: Recorder queue full, dropping until the next I frame, "
+            "%llu GOPs dropped\n", stStats.u64DroppedGops);
       }
+      if(bDropGap == HI_FALSE)
+        atomic_store(&s32PrerollFull, 1);
+      stStats.u64DroppedNals++;
+      stStats.u64DroppedBytes += pStream->u32Len;
+      bDropping = HI_TRUE;
+      isFoundIFrame = HI_FALSE;
+      return;
     }
+
+    bDropping = HI_FALSE;
 }
 
 void recorder_stop()
 {
+    if(allowSavingThreadRun == HI_FALSE)
+        return;
+
+    // Called from the receive thread, nothing is queued after this
     bIsRecorderReady = HI_FALSE;
+    allowSavingThreadRun = HI_FALSE;
+    sem_post(&ringbuff.ready);
+    pthread_join(recording_thread, NULL);
+}
+
+void recorder_get_stats(RecorderStats* pStats)
+{
+    *pStats = stStats;
+}
+
+void recorder_trigger(HI_BOOL bRecord)
+{
+    atomic_store(&s32Triggered, bRecord == HI_TRUE);
+}
+
+static void writeData(const Data* pData)
+{
+    checkSegment(pData);
+    if(bSegmentEmpty == HI_TRUE)
+    {
+      u32SegmentStart = pData->u32Timestamp;
+      bSegmentEmpty = HI_FALSE;
+    }
+
+    if(bMuxMp4 == HI_TRUE)
+    {
+      // Codec is only certain once the stream arrived
+      if(!stMuxer.header_written)
+        stMuxer.hevc = pData->bHevc ? true : false;
+      // Timeline gets a gap instead of a frame stretched over it
+      if(pData->bDiscontinuity)
+        mp4_discontinuity(&stMuxer, pData->u32Timestamp);
+      mp4_write(&stMuxer, pData->pData, pData->size, pData->u8Flags, pData->u32Timestamp);
+      indexMuxed();
+    }
+    else
+    {
+      indexRaw(pData);
+      writeFile(HI_NULL, pData->pData, pData->size);
+    }
+    pool_release(pNalPool, pData->pBlock);
+}
+
+static void releasePreroll(HI_U32 u32Count)
+{
+    for(HI_U32 i = 0; i < u32Count; i++)
+    {
+      // Block stays held if the kept NAL units continue in it
+      if(i + 1 == u32PrerollCount || pPreroll[i + 1].pBlock != pPreroll[i].pBlock)
+        u32PrerollBlocks--;
+      pool_release(pNalPool, pPreroll[i].pBlock);
+    }
+    u32PrerollCount -= u32Count;
+    memmove(pPreroll, pPreroll + u32Count, u32PrerollCount * sizeof(Data));
+}
+
+// Start of the second GOP, the first I frame with slices before it.
+// Parameter sets ahead of the I frame belong to its GOP.
+static HI_U32 findNextGop(void)
+{
+    const HI_U8 u8Start = NAL_FLAG_RECOVERY | NAL_FLAG_UNIT_START;
+    HI_BOOL bSlice = (pPreroll[0].u8Flags & NAL_FLAG_SLICE) ? HI_TRUE : HI_FALSE;
+    for(HI_U32 i = 1; i < u32PrerollCount; i++)
+    {
+      if((pPreroll[i].u8Flags & u8Start) == u8Start && bSlice == HI_TRUE)
+        return i;
+      if(pPreroll[i].u8Flags & NAL_FLAG_SLICE)
+        bSlice = HI_TRUE;
+    }
+    return 0;
+}
+
+static void warnPrerollLimited(HI_U32 u32Span)
+{
+    if(bPrerollLimited == HI_TRUE)
+      return;
+
+    printf("WARN: Pre-roll limited to %.1f s by --dvr-buffer\n",
+      (double)u32Span / 90000);
+    bPrerollLimited = HI_TRUE;
+}
+
+// Keep the newest GOPs covering the pre-roll time, the oldest GOP goes
+// once the ones after it are long enough on their own
+static void keepPreroll(const Data* pData)
+{
+    // Older GOPs end in a gap, pre-roll restarts at this I frame
+    if(pData->bDiscontinuity)
+      releasePreroll(u32PrerollCount);
+
+    if(u32PrerollCount == u32PrerollCapacity)
+    {
+      HI_U32 capacity = u32PrerollCapacity ? u32PrerollCapacity * 2 : 1024;
+      Data* pGrown = realloc(pPreroll, capacity * sizeof(Data));
+      if(!pGrown)
+      {
+        pool_release(pNalPool, pData->pBlock);
+        return;
+      }
+      pPreroll = pGrown;
+      u32PrerollCapacity = capacity;
+    }
+
+    if(!u32PrerollCount || pPreroll[u32PrerollCount - 1].pBlock != pData->pBlock)
+      u32PrerollBlocks++;
+    pPreroll[u32PrerollCount++] = *pData;
+
+    while(u32PrerollCount)
+    {
+      HI_U32 u32Span = pData->u32Timestamp - pPreroll[0].u32Timestamp;
+      if(u32Span < u32Preroll && u32PrerollBlocks <= u32PrerollBlockLimit)
+        break;
+
+      HI_U32 u32Next = findNextGop();
+      if(!u32Next)
+        break;
+
+      u32Span = pData->u32Timestamp - pPreroll[u32Next].u32Timestamp;
+      if(u32Span < u32Preroll && u32PrerollBlocks <= u32PrerollBlockLimit)
+        break;
+
+      if(u32Span < u32Preroll)
+        warnPrerollLimited(u32Span);
+      releasePreroll(u32Next);
+    }
+}
+
+// Receive thread ran out of pool blocks while the pre-roll held them,
+// the oldest GOP goes and the pre-roll stays one block shorter from now on
+static void shrinkPreroll(void)
+{
+    if(!atomic_exchange(&s32PrerollFull, 0))
+      return;
+
+    if(u32PrerollBlockLimit > 1)
+      u32PrerollBlockLimit--;
+
+    HI_U32 u32Next = u32PrerollCount ? findNextGop() : 0;
+    if(!u32Next)
+      return;
+
+    warnPrerollLimited(pPreroll[u32PrerollCount - 1].u32Timestamp - pPreroll[u32Next].u32Timestamp);
+    releasePreroll(u32Next);
+}
+
+// Writer thread side of recorder_trigger
+static void updateEvent(void)
+{
+    HI_BOOL bTriggered = atomic_load(&s32Triggered) ? HI_TRUE : HI_FALSE;
+    if(bOnEvent == HI_FALSE || bTriggered == bEventActive)
+      return;
+
+    bEventActive = bTriggered;
+    if(bEventActive == HI_TRUE)
+    {
+      printf("> Recorder: event started, %.1f s pre-roll\n", u32PrerollCount ?
+        (double)(pPreroll[u32PrerollCount - 1].u32Timestamp - pPreroll[0].u32Timestamp) / 90000 : 0);
+
+      // Continues after the previous event in a single file
+      if(u32PrerollCount)
+        pPreroll[0].bDiscontinuity = HI_TRUE;
+      for(HI_U32 i = 0; i < u32PrerollCount; i++)
+        writeData(&pPreroll[i]);
+      u32PrerollCount = 0;
+      u32PrerollBlocks = 0;
+      return;
+    }
+
+    printf("> Recorder: event ended\n");
+    if(bSegmented == HI_TRUE)
+    {
+      closeFile();
+    }
+    else
+    {
+      if(bMuxMp4 == HI_TRUE)
+        mp4_finish(&stMuxer);
+      syncFile();
+    }
+}
+
+static void handleData(const Data* pData)
+{
+    if(bOnEvent == HI_TRUE && bEventActive == HI_FALSE)
+      keepPreroll(pData);
+    else
+      writeData(pData);
 }
 
 void* recorder_save_file_thread(void* arg)
-{    
+{
     RingBuffer* rb = (RingBuffer*)arg;
-    HI_U8* video_buffer = malloc(BUFFER_SIZE);
-    HI_U8* nal_buffer = malloc(BUFFER_SIZE);
     struct timespec current_timestamp;
-    struct timespec prev_timestamp = {0, 0};
+    struct timespec sync_timestamp;
 
     printf("Starting to record video\n");
+    clock_gettime(CLOCK_MONOTONIC, &sync_timestamp);
+
+    // Writer yields to the receive and decode threads
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
     bIsRecorderReady = HI_TRUE;
-    
+
+    Data data;
     while(allowSavingThreadRun == HI_TRUE)
-    {      
-        Data* data = dequeue(rb);
+    {
+        // Wake up for the periodic sync even if the stream stopped
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000000;
+        if(deadline.tv_nsec >= 1000000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000;
+        }
 
-        fwrite(data->pData, data->size, 1, fpRecordFile);
-        fflush(fpRecordFile);
+        updateEvent();
+        shrinkPreroll();
+        if(dequeue(rb, &data, &deadline) == HI_TRUE)
+          handleData(&data);
+
+        clock_gettime(CLOCK_MONOTONIC, &current_timestamp);
+        if(getTimeInterval(&current_timestamp, &sync_timestamp) >= RECORDER_SYNC_INTERVAL)
+        {
+          syncFile();
+          enforceBudget();
+          sync_timestamp = current_timestamp;
+        }
     }
     /******************************************
      stop recording video
     ******************************************/
+    while(dequeue(rb, &data, HI_NULL) == HI_TRUE)
+      handleData(&data);
+    releasePreroll(u32PrerollCount);
+    free(pPreroll);
+    pPreroll = HI_NULL;
+    u32PrerollCapacity = 0;
+
     printf("Close video file\n");
-    bIsRecorderReady = HI_FALSE;
-    fflush(fpRecordFile);
-    fclose(fpRecordFile);
-    free(video_buffer);
-    video_buffer = HI_NULL;
-    free(nal_buffer);
-    nal_buffer = HI_NULL;
+    closeFile();
+    enforceBudget();
+    if(bMuxMp4 == HI_TRUE)
+      mp4_free(&stMuxer);
+    free(pSegments);
+    pSegments = HI_NULL;
+    u32SegmentCount = 0;
+    u32SegmentCapacity = 0;
+    free(pWriteBuffer);
+    pWriteBuffer = HI_NULL;
     destroy(rb);
+    return HI_NULL;
 }
@@ -2,30 +2,76 @@
 #ifndef  __RECORDER_H__
 #define  __RECORDER_H__
 
+#include <semaphore.h>
+#include <stdatomic.h>
 #include "hi_type.h"
 #include "hi_comm_vdec.h"
+#include "../common/mp4.h"
+#include "../common/pool.h"
 
-#define RINGBUFFER_SIZE 100
-#define BUFFER_SIZE 512*1024
+// Power of two, queue positions wrap around freely
+#define RINGBUFFER_SIZE 4096
+
+// Size of a single write to the SD card, multiple of the page size
+#define RECORDER_WRITE_SIZE (256 * 1024)
+
+// File space reserved ahead of the write position
+#define RECORDER_PREALLOCATE (32 * 1024 * 1024)
+
+// Written data reaches the card at least this often
+#define RECORDER_SYNC_INTERVAL 2.0
 
 typedef struct {
-    HI_U8* pData; // Pointer to 1MB memory block
+    PoolBlock* pBlock; // Reference held until written
+    HI_U8* pData;
     HI_U32 size;
+    HI_BOOL bHevc;
+    HI_U8 u8Flags;        // NAL_FLAG_* from the depacketizer
+    HI_U32 u32Timestamp;  // 90 kHz, RTP or arrival time
+    HI_BOOL bDiscontinuity; // First keyframe after dropped data
 } Data;
 
+// Single producer (receive thread), single consumer (writer thread),
+// neither side takes a lock and the producer never waits
 typedef struct {
     Data buffer[RINGBUFFER_SIZE];
-    int head;
-    int tail;
-    int count;
-    pthread_mutex_t lock;
-    pthread_cond_t not_full;
-    pthread_cond_t not_empty;
+    atomic_uint head;     // Written by the producer only
+    atomic_uint tail;     // Written by the consumer only
+    sem_t ready;          // Posted per queued item, wakes the writer
 } RingBuffer;
 
-void recorder_int(const char* pPath);
-void recorder_input_data(const VDEC_STREAM_S *pStream);
+typedef struct {
+    HI_U32 u32Index;
+    HI_U64 u64Size;
+} Segment;
+
+typedef struct {
+    HI_U32 u32SegmentSeconds;   // Split at the next I frame after, 0 for no limit
+    HI_U32 u32SegmentMBytes;    // Split at the next I frame above, 0 for no limit
+    HI_U32 u32BudgetMBytes;     // Oldest segments deleted above, 0 for no limit
+    HI_BOOL bOnEvent;           // Write only while triggered by recorder_trigger
+    HI_U32 u32PrerollSeconds;   // Kept in RAM and written first on a trigger
+} RecorderConfig;
+
+typedef struct {
+    HI_U64 u64WrittenBytes;
+    HI_U64 u64DroppedGops;    // Cut short by a full queue or pool
+    HI_U64 u64DroppedNals;
+    HI_U64 u64DroppedBytes;
+} RecorderStats;
+
+// Paths ending in .mp4 are muxed to fragmented MP4, raw Annex-B otherwise.
+// With a segment limit files are split at I frames and named
+// <name>_00000<ext> next to pPath, numbering continues after the files
+// found. Without limits pPath is a single growing file.
+void recorder_int(const char* pPath, NalPool* pPool, const RecorderConfig* pConfig);
+void recorder_input_data(const VDEC_STREAM_S *pStream, HI_BOOL bHevc,
+    HI_U8 u8Flags, HI_U32 u32Timestamp);
 void* recorder_save_file_thread(void* arg);
+// Writes queued data, closes the file and joins the writer thread
 void recorder_stop();
+void recorder_get_stats(RecorderStats* pStats);
+// Start or end an event in bOnEvent mode, async signal safe
+void recorder_trigger(HI_BOOL bRecord);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "control.h"
+#include <errno.h>
+#include <stdarg.h>
+
+int control_open(uint16_t port) {
+  int handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (handle < 0) {
+    printf("ERROR: Unable to create control socket\n");
+    return -1;
+  }
+
+  struct sockaddr_in address;
+  memset(&address, 0x00, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (bind(handle, (struct sockaddr*)&address, sizeof(address))) {
+    printf("ERROR: Unable to bind control port %d: %s\n", port, strerror(errno));
+    close(handle);
+    return -1;
+  }
+
+  fcntl(handle, F_SETFL, fcntl(handle, F_GETFL) | O_NONBLOCK);
+  printf("> Control socket listening on port %d\n", port);
+  return handle;
+}
+
+bool control_receive(int handle, ControlMessage* message) {
+  char buffer[256];
+  socklen_t address_size = sizeof(message->sender);
+  ssize_t size = recvfrom(handle, buffer, sizeof(buffer) - 1, 0,
+    (struct sockaddr*)&message->sender, &address_size);
+  if (size <= 0) {
+    return false;
+  }
+
+  // Strip trailing line ending, clients are usually "echo | nc -u"
+  buffer[size] = 0;
+  while (size > 0 && (buffer[size - 1] == '\n' || buffer[size - 1] == '\r')) {
+    buffer[--size] = 0;
+  }
+
+  message->command[0] = 0;
+  message->argument[0] = 0;
+  sscanf(buffer, "%31s %223[^\n]", message->command, message->argument);
+  return message->command[0] != 0;
+}
+
+void control_reply(int handle, const ControlMessage* message,
+  const char* format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf(buffer, sizeof(buffer) - 1, format, args);
+  va_end(args);
+
+  size = MIN(size, (int)sizeof(buffer) - 2);
+  buffer[size++] = '\n';
+  sendto(handle, buffer, size, 0, (struct sockaddr*)&message->sender,
+    sizeof(message->sender));
+}
+
+void control_send(int handle, const struct sockaddr_in* address,
+  const uint8_t* data, uint32_t size) {
+  while (size) {
+    uint32_t chunk = MIN(size, CONTROL_CHUNK_SIZE);
+    if (sendto(handle, data, chunk, 0, (const struct sockaddr*)address,
+        sizeof(*address)) < 0 && errno == EAGAIN) {
+      // Socket buffer full, give the network stack a moment
+      usleep(1000);
+      continue;
+    }
+
+    data += chunk;
+    size -= chunk;
+  }
+}
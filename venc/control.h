@@ -0,0 +1,40 @@
+#pragma once
+#include "main.h"
+
+// Largest datagram sent back to the control client
+#define CONTROL_CHUNK_SIZE 1400
+
+typedef struct ControlMessage {
+  char command[32];
+  char argument[224];
+  struct sockaddr_in sender;
+} ControlMessage;
+
+/**
+ * @brief Open non-blocking UDP control socket
+ * @param port - Local port to listen on
+ * @return Socket handle or -1 on failure
+ */
+int control_open(uint16_t port);
+
+/**
+ * @brief Receive one pending text command in form "command [argument]"
+ * @param handle - Control socket handle
+ * @param message - Parsed command and its sender
+ * @return true if a command was received
+ */
+bool control_receive(int handle, ControlMessage* message);
+
+/**
+ * @brief Send formatted text reply to the command sender
+ */
+void control_reply(int handle, const ControlMessage* message,
+  const char* format, ...);
+
+/**
+ * @brief Send binary data to the command sender split into datagrams
+ * @param data - Data to send
+ * @param size - Size of data
+ */
+void control_send(int handle, const struct sockaddr_in* address,
+  const uint8_t* data, uint32_t size);
@@ -0,0 +1,82 @@
+#pragma once
+#include "main.h"
+
+// Maximum packs (NAL units) returned by one get_stream call
+#define ENCODER_MAX_PACKS 32
+
+typedef struct {
+  uint8_t* data;  // NAL unit with Annex-B start code, RTP framed on Star6E
+  uint32_t size;
+} EncoderPack;
+
+typedef struct {
+  EncoderPack packs[ENCODER_MAX_PACKS];
+  uint32_t pack_count;
+  uint64_t timestamp;  // Capture time in microseconds
+  bool frame_end;      // Last pack closes the access unit
+  void* handle;        // Backend specific, passed back on release
+} EncoderStream;
+
+typedef struct {
+  PAYLOAD_TYPE_E codec;
+  int rc_mode;
+  uint32_t width;
+  uint32_t height;
+  uint32_t framerate;
+  uint32_t gop_size;
+  uint32_t bitrate;         // Kbit/sec.
+  HI_BOOL by_frame;         // Whole frames instead of single slices per call
+  const char* source_path;  // Annex-B input of the host replay backend
+  bool source_loop;         // Restart replay at end of file
+} EncoderConfig;
+
+typedef struct {
+  const char* name;
+
+  /**
+   * @brief Create encoder channel, hardware backends still need the input
+   * bound and reception started by the pipeline
+   * @return 0 on success
+   */
+  int (*create)(int channel, const EncoderConfig* config);
+
+  /**
+   * @brief Stop and destroy encoder channel
+   */
+  void (*destroy)(int channel);
+
+  /**
+   * @brief Handle that becomes readable when stream data is pending
+   * @return File descriptor or -1 if the backend can't be polled
+   */
+  int (*get_fd)(int channel);
+
+  /**
+   * @brief Acquire pending stream data, must be released after use
+   * @param timeout_ms - 0 returns immediately, -1 blocks
+   * @return 1 if stream was acquired, 0 if nothing pending, -1 at end of stream
+   */
+  int (*get_stream)(int channel, EncoderStream* stream, int timeout_ms);
+
+  /**
+   * @brief Return stream buffers to the encoder
+   */
+  void (*release)(int channel, EncoderStream* stream);
+
+  /**
+   * @brief Encode next frame as IDR
+   * @return 0 on success
+   */
+  int (*request_idr)(int channel);
+
+  /**
+   * @brief Change target bitrate on the fly
+   * @param bitrate - Kbit/sec.
+   * @return 0 on success
+   */
+  int (*set_bitrate)(int channel, uint32_t bitrate);
+} EncoderBackend;
+
+extern const EncoderBackend encoder_hisi;
+extern const EncoderBackend encoder_star6e;
+extern const EncoderBackend encoder_host;
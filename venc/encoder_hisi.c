@@ -0,0 +1,134 @@
+#include "encoder.h"
+
+#ifdef PLATFORM_HISI
+// One in-flight stream per channel, VENC_MAX_CHN_NUM is small on these SoCs
+static VENC_STREAM_S streams[VENC_MAX_CHN_NUM];
+static VENC_PACK_S stream_packs[VENC_MAX_CHN_NUM][ENCODER_MAX_PACKS];
+
+static int hisiCreate(int channel, const EncoderConfig* config) {
+  return createEncoderChannel(channel, config->codec, config->rc_mode,
+    config->width, config->height, config->framerate, config->gop_size,
+    config->bitrate, config->by_frame);
+}
+
+static void hisiDestroy(int channel) {
+  HI_MPI_VENC_StopRecvFrame(channel);
+  HI_MPI_VENC_DestroyChn(channel);
+}
+
+static int hisiGetFd(int channel) {
+  return HI_MPI_VENC_GetFd(channel);
+}
+
+static int hisiGetStream(int channel, EncoderStream* stream, int timeout_ms) {
+  // Get channel status
+  VENC_CHN_STATUS_S channel_status;
+  int ret = HI_MPI_VENC_QueryStatus(channel, &channel_status);
+  if (ret != HI_SUCCESS) {
+    printf("WARN: Unable to query VENC status = 0x%x\n", ret);
+    usleep(100000);
+    return 0;
+  }
+
+  // Check if has encoded data, callers wait on the channel fd instead of
+  // blocking here since the pack count must be known up front
+  if (!channel_status.u32CurPacks) {
+    return 0;
+  }
+
+  // Per-Slice mode always return one slice at a time.
+  // Per-Frame mode may return multiple slices, we need to allocate memory for all reported slices.
+  VENC_STREAM_S* venc_stream = &streams[channel];
+  memset(venc_stream, 0x00, sizeof(VENC_STREAM_S));
+  venc_stream->pstPack = stream_packs[channel];
+  venc_stream->u32PackCount = MIN(channel_status.u32CurPacks, ENCODER_MAX_PACKS);
+
+  // Acquire stream
+  ret = HI_MPI_VENC_GetStream(channel, venc_stream, 0);
+  if (ret != HI_SUCCESS) {
+    printf("WARN: Failed to get VENC stream  = 0x%x. Current packs = %d\n",
+      ret, channel_status.u32CurPacks);
+    usleep(100000);
+    return 0;
+  }
+
+  stream->pack_count = venc_stream->u32PackCount;
+  for (uint32_t i = 0; i < venc_stream->u32PackCount; i++) {
+    VENC_PACK_S* pack = &venc_stream->pstPack[i];
+    stream->packs[i].data = pack->pu8Addr + pack->u32Offset;
+    stream->packs[i].size = pack->u32Len - pack->u32Offset;
+  }
+
+  stream->timestamp = venc_stream->u32PackCount ? venc_stream->pstPack[0].u64PTS : 0;
+  stream->frame_end = venc_stream->u32PackCount &&
+    venc_stream->pstPack[venc_stream->u32PackCount - 1].bFrameEnd;
+  stream->handle = venc_stream;
+  return 1;
+}
+
+static void hisiRelease(int channel, EncoderStream* stream) {
+  HI_MPI_VENC_ReleaseStream(channel, (VENC_STREAM_S*)stream->handle);
+}
+
+static int hisiRequestIdr(int channel) {
+  return HI_MPI_VENC_RequestIDR(channel, HI_TRUE);
+}
+
+static int hisiSetBitrate(int channel, uint32_t bitrate) {
+  VENC_CHN_ATTR_S config;
+  int ret = HI_MPI_VENC_GetChnAttr(channel, &config);
+  if (ret != HI_SUCCESS) {
+    return ret;
+  }
+
+  switch (config.stRcAttr.enRcMode) {
+    case VENC_RC_MODE_H264AVBR:
+      config.stRcAttr.stH264AVbr.u32MaxBitRate = bitrate;
+      break;
+
+    case VENC_RC_MODE_H264QVBR:
+      config.stRcAttr.stH264QVbr.u32TargetBitRate = bitrate;
+      break;
+
+    case VENC_RC_MODE_H264VBR:
+      config.stRcAttr.stH264Vbr.u32MaxBitRate = bitrate;
+      break;
+
+    case VENC_RC_MODE_H264CBR:
+      config.stRcAttr.stH264Cbr.u32BitRate = bitrate;
+      break;
+
+    case VENC_RC_MODE_H265AVBR:
+      config.stRcAttr.stH265AVbr.u32MaxBitRate = bitrate;
+      break;
+
+    case VENC_RC_MODE_H265QVBR:
+      config.stRcAttr.stH265QVbr.u32TargetBitRate = bitrate;
+      break;
+
+    case VENC_RC_MODE_H265VBR:
+      config.stRcAttr.stH265Vbr.u32MaxBitRate = bitrate;
+      break;
+
+    case VENC_RC_MODE_H265CBR:
+      config.stRcAttr.stH265Cbr.u32BitRate = bitrate;
+      break;
+
+    default:
+      return -1;
+  }
+
+  return HI_MPI_VENC_SetChnAttr(channel, &config);
+}
+
+const EncoderBackend encoder_hisi = {
+  .name = "hisi",
+  .create = hisiCreate,
+  .destroy = hisiDestroy,
+  .get_fd = hisiGetFd,
+  .get_stream = hisiGetStream,
+  .release = hisiRelease,
+  .request_idr = hisiRequestIdr,
+  .set_bitrate = hisiSetBitrate,
+};
+#endif
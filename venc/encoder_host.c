@@ -0,0 +1,274 @@
+#include "encoder.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#define HOST_MAX_CHANNELS 4
+
+typedef struct {
+  uint32_t offset;      // Start code position
+  uint32_t size;        // Including start code
+  bool au_start;        // First NAL unit of an access unit
+  bool keyframe;        // Access unit opens with parameter sets
+} HostNal;
+
+typedef struct {
+  EncoderConfig config;
+  uint8_t* data;
+  uint32_t data_size;
+  HostNal* nals;
+  uint32_t nal_count;
+  uint32_t nal_position;
+  uint64_t frame_count;
+  uint64_t credits;     // Timer expirations not yet turned into frames
+  int timer_fd;
+  bool idr_requested;
+} HostChannel;
+
+static HostChannel channels[HOST_MAX_CHANNELS];
+
+static uint8_t getNalType(PAYLOAD_TYPE_E codec, uint8_t header) {
+  return codec == PT_H265 ? (header >> 1) & 0x3F : header & 0x1F;
+}
+
+static bool isVcl(PAYLOAD_TYPE_E codec, uint8_t type) {
+  return codec == PT_H265 ? type < 32 : type >= 1 && type <= 5;
+}
+
+static bool isParameterSet(PAYLOAD_TYPE_E codec, uint8_t type) {
+  return codec == PT_H265 ? type == 32 || type == 33 || type == 34
+    : type == 7 || type == 8;
+}
+
+static uint32_t indexNals(HostChannel* channel) {
+  PAYLOAD_TYPE_E codec = channel->config.codec;
+  uint8_t* data = channel->data;
+  uint32_t size = channel->data_size;
+
+  // Count start codes first, then fill the index in a second pass
+  uint32_t capacity = 0;
+  for (uint32_t i = 0; i + 3 <= size; i++) {
+    if (!data[i] && !data[i + 1] && data[i + 2] == 1) {
+      capacity++;
+      i += 2;
+    }
+  }
+
+  channel->nals = calloc(capacity ? capacity : 1, sizeof(HostNal));
+  uint32_t count = 0;
+  bool au_has_vcl = false;
+
+  for (uint32_t i = 0; i + 3 <= size; i++) {
+    if (data[i] || data[i + 1] || data[i + 2] != 1) {
+      continue;
+    }
+
+    // Keep 4-byte start codes intact, packetizer strips them as a whole
+    uint32_t start = i > 0 && !data[i - 1] ? i - 1 : i;
+    if (count) {
+      HostNal* previous = &channel->nals[count - 1];
+      previous->size = start - previous->offset;
+    }
+
+    uint32_t header = i + 3;
+    uint8_t type = header < size ? getNalType(codec, data[header]) : 0;
+    uint32_t slice = header + (codec == PT_H265 ? 2 : 1);
+    bool first_slice = slice < size && (data[slice] & 0x80);
+
+    // New access unit on prefix NAL units or first slice after a picture
+    bool au_start = !count || (au_has_vcl &&
+      (isVcl(codec, type) ? first_slice : true));
+    if (au_start) {
+      au_has_vcl = false;
+    }
+
+    au_has_vcl |= isVcl(codec, type);
+
+    HostNal* nal = &channel->nals[count++];
+    nal->offset = start;
+    nal->size = size - start;
+    nal->au_start = au_start;
+    nal->keyframe = au_start && isParameterSet(codec, type);
+    i += 2;
+  }
+
+  return count;
+}
+
+static int hostCreate(int channel_id, const EncoderConfig* config) {
+  if (channel_id < 0 || channel_id >= HOST_MAX_CHANNELS || !config->source_path) {
+    printf("ERROR: Host encoder needs a channel below %d and a source file\n",
+      HOST_MAX_CHANNELS);
+    return -1;
+  }
+
+  HostChannel* channel = &channels[channel_id];
+  memset(channel, 0x00, sizeof(HostChannel));
+  channel->config = *config;
+  channel->timer_fd = -1;
+
+  int file = open(config->source_path, O_RDONLY);
+  struct stat file_stat;
+  if (file < 0 || fstat(file, &file_stat) || !file_stat.st_size) {
+    printf("ERROR: Unable to open source [%s]\n", config->source_path);
+    if (file >= 0) {
+      close(file);
+    }
+    return -1;
+  }
+
+  channel->data_size = file_stat.st_size;
+  channel->data = mmap(NULL, channel->data_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (channel->data == MAP_FAILED) {
+    printf("ERROR: Unable to map source [%s]\n", config->source_path);
+    return -1;
+  }
+
+  channel->nal_count = indexNals(channel);
+  if (!channel->nal_count) {
+    printf("ERROR: No Annex-B NAL units in [%s]\n", config->source_path);
+    return -1;
+  }
+
+  // Frame clock, zero framerate replays as fast as the consumer drains
+  if (config->framerate) {
+    channel->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = 0;
+    interval.it_interval.tv_nsec = 1000000000 / config->framerate;
+    interval.it_value = interval.it_interval;
+    timerfd_settime(channel->timer_fd, 0, &interval, NULL);
+  }
+
+  printf("> Host encoder: %s, %u NAL units, %u fps\n",
+    config->source_path, channel->nal_count, config->framerate);
+  return 0;
+}
+
+static void hostDestroy(int channel_id) {
+  HostChannel* channel = &channels[channel_id];
+  if (channel->data && channel->data != MAP_FAILED) {
+    munmap(channel->data, channel->data_size);
+  }
+
+  if (channel->timer_fd >= 0) {
+    close(channel->timer_fd);
+  }
+
+  free(channel->nals);
+  memset(channel, 0x00, sizeof(HostChannel));
+  channel->timer_fd = -1;
+}
+
+static int hostGetFd(int channel_id) {
+  return channels[channel_id].timer_fd;
+}
+
+static bool takeFrameCredit(HostChannel* channel, int timeout_ms) {
+  if (channel->timer_fd < 0) {
+    return true;
+  }
+
+  if (!channel->credits && timeout_ms) {
+    struct pollfd poll_fd = {.fd = channel->timer_fd, .events = POLLIN};
+    poll(&poll_fd, 1, timeout_ms);
+  }
+
+  uint64_t expirations;
+  if (read(channel->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    channel->credits += expirations;
+  }
+
+  if (!channel->credits) {
+    return false;
+  }
+
+  channel->credits--;
+  return true;
+}
+
+static void seekKeyframe(HostChannel* channel) {
+  // Jump to the next keyframe, wrapping to the first one
+  for (uint32_t n = 0; n < channel->nal_count; n++) {
+    uint32_t i = (channel->nal_position + n) % channel->nal_count;
+    if (channel->nals[i].keyframe) {
+      channel->nal_position = i;
+      return;
+    }
+  }
+}
+
+static int hostGetStream(int channel_id, EncoderStream* stream, int timeout_ms) {
+  HostChannel* channel = &channels[channel_id];
+
+  if (channel->nal_position >= channel->nal_count) {
+    if (!channel->config.source_loop) {
+      return -1;
+    }
+
+    channel->nal_position = 0;
+  }
+
+  // Access units are released on the frame clock, their slices back to back
+  HostNal* nal = &channel->nals[channel->nal_position];
+  if (nal->au_start) {
+    if (!takeFrameCredit(channel, timeout_ms)) {
+      return 0;
+    }
+
+    if (channel->idr_requested) {
+      channel->idr_requested = false;
+      seekKeyframe(channel);
+    }
+
+    channel->frame_count++;
+  }
+
+  // Slice mode returns one NAL unit per call like the hardware encoders
+  stream->pack_count = 0;
+  do {
+    nal = &channel->nals[channel->nal_position++];
+    stream->packs[stream->pack_count].data = channel->data + nal->offset;
+    stream->packs[stream->pack_count].size = nal->size;
+    stream->pack_count++;
+  } while (channel->config.by_frame && stream->pack_count < ENCODER_MAX_PACKS &&
+    channel->nal_position < channel->nal_count &&
+    !channel->nals[channel->nal_position].au_start);
+
+  stream->frame_end = channel->nal_position >= channel->nal_count ||
+    channel->nals[channel->nal_position].au_start;
+  stream->timestamp = channel->config.framerate
+    ? channel->frame_count * 1000000 / channel->config.framerate : 0;
+  stream->handle = channel;
+  return 1;
+}
+
+static void hostRelease(int channel_id, EncoderStream* stream) {
+  // Packs point into the mapped source file
+}
+
+static int hostRequestIdr(int channel_id) {
+  channels[channel_id].idr_requested = true;
+  return 0;
+}
+
+static int hostSetBitrate(int channel_id, uint32_t bitrate) {
+  // Replay can't re-encode, keep the value for reporting only
+  channels[channel_id].config.bitrate = bitrate;
+  printf("> Host encoder: bitrate %u Kbit/s requested\n", bitrate);
+  return 0;
+}
+
+const EncoderBackend encoder_host = {
+  .name = "host",
+  .create = hostCreate,
+  .destroy = hostDestroy,
+  .get_fd = hostGetFd,
+  .get_stream = hostGetStream,
+  .release = hostRelease,
+  .request_idr = hostRequestIdr,
+  .set_bitrate = hostSetBitrate,
+};
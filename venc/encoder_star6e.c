@@ -0,0 +1,122 @@
+#include "encoder.h"
+
+#ifdef PLATFORM_STAR6E
+#include "star6e.h"
+#include "../common/packet.h"
+
+// MI returns one contiguous buffer per call, kept until release
+static MI_VENC_Stream_t streams[8];
+
+static MI_VENC_RcMode_e translate_rc_mode(PAYLOAD_TYPE_E codec, int rc_mode) {
+  if (codec == PT_H265) {
+    switch (rc_mode) {
+      case 3: return E_MI_VENC_RC_MODE_H265CBR;
+      case 4: return E_MI_VENC_RC_MODE_H265VBR;
+      case 5: return E_MI_VENC_RC_MODE_H265AVBR;
+      case 6: return E_MI_VENC_RC_MODE_H265QVBR;
+      default: return E_MI_VENC_RC_MODE_H265CBR;
+    }
+  }
+
+  switch (rc_mode) {
+    case 0: return E_MI_VENC_RC_MODE_H264AVBR;
+    case 1: return E_MI_VENC_RC_MODE_H264QVBR;
+    case 2: return E_MI_VENC_RC_MODE_H264VBR;
+    case 3: return E_MI_VENC_RC_MODE_H264CBR;
+    default: return E_MI_VENC_RC_MODE_H264AVBR;
+  }
+}
+
+static MI_VENC_ModType_e translate_codec(PAYLOAD_TYPE_E codec) {
+  switch (codec) {
+    case PT_H265:
+      return E_MI_VENC_MODTYPE_H265;
+    case PT_H264:
+    default:
+      return E_MI_VENC_MODTYPE_H264;
+  }
+}
+
+static int star6eCreate(int channel, const EncoderConfig* config) {
+  MI_VENC_ChnAttr_t attr = {
+    .eType = translate_codec(config->codec),
+    .u32PicWidth = config->width,
+    .u32PicHeight = config->height,
+    .u32MaxBitRate = config->bitrate * 1024,
+    .u32SrcFrmRateNum = config->framerate,
+    .u32Gop = config->gop_size,
+    .eRcMode = translate_rc_mode(config->codec, config->rc_mode),
+  };
+
+  MI_S32 ret = MI_VENC_CreateChn(channel, &attr);
+  if (ret != 0) {
+    printf("ERROR: MI_VENC_CreateChn failed %d\n", ret);
+    return ret;
+  }
+
+  ret = MI_VENC_StartRecvPic(channel);
+  if (ret != 0) {
+    printf("ERROR: MI_VENC_StartRecvPic failed %d\n", ret);
+    return ret;
+  }
+
+  return 0;
+}
+
+static void star6eDestroy(int channel) {
+  MI_VENC_StopRecvPic(channel);
+  MI_VENC_DestroyChn(channel);
+}
+
+static int star6eGetFd(int channel) {
+  return MI_VENC_GetFd(channel);
+}
+
+static int star6eGetStream(int channel, EncoderStream* stream, int timeout_ms) {
+  MI_VENC_Stream_t* mi_stream = &streams[channel];
+  if (MI_VENC_GetStream(channel, mi_stream, timeout_ms) != 0) {
+    return 0;
+  }
+
+  stream->pack_count = 1;
+  stream->packs[0].data = mi_stream->pStream;
+  stream->packs[0].size = mi_stream->u32Len;
+  stream->timestamp = mi_stream->u64Pts;
+
+  // MI frames the stream as RTP, its marker bit flags the last slice
+  stream->frame_end = packet_header_size(mi_stream->pStream, mi_stream->u32Len) &&
+    (mi_stream->pStream[1] & 0x80);
+  stream->handle = mi_stream;
+  return 1;
+}
+
+static void star6eRelease(int channel, EncoderStream* stream) {
+  MI_VENC_ReleaseStream(channel, (MI_VENC_Stream_t*)stream->handle);
+}
+
+static int star6eRequestIdr(int channel) {
+  return MI_VENC_RequestIdr(channel, true);
+}
+
+static int star6eSetBitrate(int channel, uint32_t bitrate) {
+  MI_VENC_ChnAttr_t attr;
+  MI_S32 ret = MI_VENC_GetChnAttr(channel, &attr);
+  if (ret != 0) {
+    return ret;
+  }
+
+  attr.u32MaxBitRate = bitrate * 1024;
+  return MI_VENC_SetChnAttr(channel, &attr);
+}
+
+const EncoderBackend encoder_star6e = {
+  .name = "star6e",
+  .create = star6eCreate,
+  .destroy = star6eDestroy,
+  .get_fd = star6eGetFd,
+  .get_stream = star6eGetStream,
+  .release = star6eRelease,
+  .request_idr = star6eRequestIdr,
+  .set_bitrate = star6eSetBitrate,
+};
+#endif
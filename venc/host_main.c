@@ -0,0 +1,208 @@
+#include "main.h"
+#include "encoder.h"
+#include "recorder.h"
+#include "stream.h"
+#include <signal.h>
+#include <sys/select.h>
+#include <time.h>
+
+static volatile bool loop_running = true;
+
+static void handler(int value) {
+  loop_running = false;
+}
+
+static void printHostHelp(void) {
+  printf(
+    "\n\t\tOpenIPC FPV Streamer, host replay (%s)\n"
+    "\n"
+    "  Usage:\n"
+    "    venc-host -i [File] [Arguments]\n"
+    "\n"
+    "  Arguments:\n"
+    "    -i [File]      - Annex-B .h264 / .h265 source\n"
+    "    -c [Codec]     - 264 / 265                       (Default: by extension)\n"
+    "    -f [FPS]       - Replay rate, 0 for unpaced      (Default: 60)\n"
+    "    -d [Format]    - stream / frame                  (Default: stream)\n"
+    "    -h [IP]        - Sink IP address                 (Default: 127.0.0.1)\n"
+    "    -p [Port]      - Sink port                       (Default: 5000)\n"
+    "    -n [Size]      - Max payload frame size in bytes (Default: 1400)\n"
+    "    -m [Mode]      - compact / rtp                   (Default: compact)\n"
+    "    -t [Seconds]   - Stop after duration             (Default: end of file)\n"
+    "    --loop         - Restart at end of file\n"
+    "    --record [Path] - Record segments into directory\n"
+    "\n", __DATE__
+  );
+}
+
+int main(int argc, const char* argv[]) {
+  EncoderConfig config;
+  memset(&config, 0x00, sizeof(config));
+  config.codec = PT_H264;
+  config.framerate = 60;
+  config.by_frame = HI_FALSE;
+
+  uint32_t udp_sink_ip = inet_addr("127.0.0.1");
+  uint16_t udp_sink_port = 5000;
+  uint16_t max_frame_size = 1400;
+  uint32_t duration = 0;
+  const char* record_path = 0;
+  bool codec_set = false;
+
+  __BeginParseConsoleArguments__(printHostHelp) __OnArgument("-i") {
+    config.source_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("-c") {
+    config.codec = !strcmp(__ArgValue, "265") ? PT_H265 : PT_H264;
+    codec_set = true;
+    continue;
+  }
+
+  __OnArgument("-f") {
+    config.framerate = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("-d") {
+    config.by_frame = !strcmp(__ArgValue, "frame") ? HI_TRUE : HI_FALSE;
+    continue;
+  }
+
+  __OnArgument("-h") {
+    udp_sink_ip = inet_addr(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("-p") {
+    udp_sink_port = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("-n") {
+    max_frame_size = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("-m") {
+    const char* value = __ArgValue;
+    if (!strcmp(value, "compact")) {
+      stream_mode = 0;
+    } else if (!strcmp(value, "rtp")) {
+      stream_mode = 1;
+    } else {
+      printf("> ERROR: Unknown streaming mode\n");
+      return 1;
+    }
+    continue;
+  }
+
+  __OnArgument("-t") {
+    duration = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--loop") {
+    config.source_loop = true;
+    continue;
+  }
+
+  __OnArgument("--record") {
+    record_path = __ArgValue;
+    continue;
+  }
+
+  __EndParseConsoleArguments__
+
+  if (!config.source_path) {
+    printf("ERROR: No source file\n");
+    return 1;
+  }
+
+  if (!codec_set) {
+    const char* extension = strrchr(config.source_path, '.');
+    if (extension && (!strcmp(extension, ".h265") || !strcmp(extension, ".hevc"))) {
+      config.codec = PT_H265;
+    }
+  }
+
+  const EncoderBackend* encoder = &encoder_host;
+  int channel_id = 0;
+  if (encoder->create(channel_id, &config)) {
+    return 1;
+  }
+
+  if (record_path && recorder_init(record_path, config.codec,
+      64 * 1024 * 1024, 4 * 1024 * 1024)) {
+    return 1;
+  }
+
+  int socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in dst_addr;
+  memset(&dst_addr, 0x00, sizeof(dst_addr));
+  dst_addr.sin_family = AF_INET;
+  dst_addr.sin_port = htons(udp_sink_port);
+  dst_addr.sin_addr.s_addr = udp_sink_ip;
+
+  initStream(config.codec, max_frame_size);
+  signal(SIGINT, handler);
+
+  struct timespec start_timestamp, start_cpu;
+  clock_gettime(CLOCK_MONOTONIC, &start_timestamp);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_cpu);
+
+  // Same drain loop as the camera, waiting on the replay frame clock
+  int encoder_fd = encoder->get_fd(channel_id);
+  uint64_t streams = 0;
+
+  while (loop_running) {
+    if (encoder_fd >= 0) {
+      fd_set read_fds;
+      FD_ZERO(&read_fds);
+      FD_SET(encoder_fd, &read_fds);
+      struct timeval timeout = {0, 100000};
+      if (select(encoder_fd + 1, &read_fds, NULL, NULL, &timeout) <= 0) {
+        continue;
+      }
+    }
+
+    int ret;
+    while ((ret = processStream(encoder, channel_id, 0, socket_handle,
+        (struct sockaddr*)&dst_addr, record_path)) > 0) {
+      streams++;
+    }
+
+    if (ret < 0) {
+      break;
+    }
+
+    if (duration) {
+      struct timespec current_timestamp;
+      clock_gettime(CLOCK_MONOTONIC, &current_timestamp);
+      if (getTimeInterval(&current_timestamp, &start_timestamp) >= duration) {
+        break;
+      }
+    }
+  }
+
+  struct timespec end_timestamp, end_cpu;
+  clock_gettime(CLOCK_MONOTONIC, &end_timestamp);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end_cpu);
+  double elapsed = getTimeInterval(&end_timestamp, &start_timestamp);
+  double cpu = getTimeInterval(&end_cpu, &start_cpu);
+
+  // Summary line is parsed by benchmark scripts, keep the format stable
+  printf("> Replay: %llu streams, %llu packets, %.2f MB in %.2f s, "
+    "%.2f Mbit/sec., CPU %.2f s (%.2f us/stream)\n",
+    (unsigned long long)streams,
+    (unsigned long long)stream_packetizer.packets,
+    (double)stream_packetizer.bytes / 1024 / 1024, elapsed,
+    elapsed > 0 ? (double)stream_packetizer.bytes * 8 / elapsed / 1024 / 1024 : 0,
+    cpu, streams ? cpu * 1000000 / streams : 0);
+
+  recorder_stop();
+  encoder->destroy(channel_id);
+  close(socket_handle);
+  return 0;
+}
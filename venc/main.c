@@ -1,6 +1,13 @@
 #include "main.h"
+#include "control.h"
+#include "output.h"
+#include "recorder.h"
+#include "startup.h"
+#include "stream.h"
 #include <stdbool.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <sys/select.h>
 #include <time.h>
 
 // Configuration profiles
@@ -17,22 +24,34 @@ extern VI_PIPE_ATTR_S PIPE_ATTR_RAW12_420_3DNR_RFR;
 extern ISP_PUB_ATTR_S ISP_PROFILE_IMX307_MIPI_2M_30FPS;
 extern ISP_PUB_ATTR_S ISP_PROFILE_IMX307_MIPI_2M_30FPS_WDR2TO1_LINE;
 
-uint8_t* tx_buffer;
-uint32_t tx_buffer_used = 0;
+const EncoderBackend* encoder = &encoder_hisi;
 
-uint8_t stream_mode = 0;
 uint16_t goke_version = 200;
 SensorType sensor_type = IMX307;
 uint32_t sensor_width = 1280;
 uint32_t sensor_height = 720;
 uint32_t sensor_framerate = 60;
 bool loop_running = true;
+volatile bool isp_cache_streaming = false;  // AE/AWB in charge since the first frame
+
+// Pending JPEG snapshot, served by the streaming loop
+bool snapshot_pending = false;
+ControlMessage snapshot_request;
+
+typedef struct {
+  uint8_t* data;
+  uint32_t size;
+  int control_handle;
+  ControlMessage request;
+} SnapshotJob;
 
 static void handler(int value) {
   loop_running = false;
 }
 
 int main(int argc, const char* argv[]) {
+  startup_mark("launch");
+
   if (argc == 2 && !strcmp(argv[1], "help")) {
     printHelp();
     return 1;
@@ -60,6 +79,7 @@ int main(int argc, const char* argv[]) {
 
   VENC_CHN venc_first_ch_id = 0;
   VENC_CHN venc_second_ch_id = 1;
+  VENC_CHN venc_jpeg_ch_id = 2;
   HI_BOOL venc_by_frame = HI_FALSE;
   uint32_t venc_slice_size = 4;
 
@@ -67,6 +87,31 @@ int main(int argc, const char* argv[]) {
   uint16_t udp_sink_port = 5000;
   uint16_t max_frame_size = 1400;
 
+  // High quality stream at sensor resolution (disabled without output)
+  const char* hq_file_path = 0;
+  uint32_t hq_max_rate = 1024 * 20;
+
+  // Onboard segmented recorder
+  const char* record_path = 0;
+  bool record_hq = false;
+  uint32_t record_segment_size = 64;
+  uint32_t record_queue_size = 4;
+
+  // Control socket and on-demand JPEG snapshots
+  uint16_t control_port = 0;
+  bool snapshot_enabled = false;
+  uint32_t snapshot_quality = 90;
+
+  // Fast startup
+  const char* isp_cache_path = 0;
+  const char* startup_log_path = 0;
+
+  // Thread scheduling
+  int sched_policy = SCHED_FIFO;
+  ThreadScheduling isp_scheduling = {SCHED_FIFO, 0, -1};
+  ThreadScheduling stream_scheduling = {SCHED_FIFO, 0, -1};
+  bool lock_memory = false;
+
   int enable_slices = 1;
   int enable_lowdelay = 0;
   int enable_roi = 0;
@@ -282,6 +327,94 @@ int main(int argc, const char* argv[]) {
     continue;
   }
 
+  __OnArgument("--hq-file") {
+    hq_file_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--hq-rate") {
+    hq_max_rate = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--record") {
+    record_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--record-hq") {
+    record_hq = true;
+    continue;
+  }
+
+  __OnArgument("--record-segment") {
+    record_segment_size = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--record-queue") {
+    record_queue_size = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--control-port") {
+    control_port = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--snapshot") {
+    snapshot_enabled = true;
+    continue;
+  }
+
+  __OnArgument("--snapshot-quality") {
+    snapshot_quality = MIN(MAX(atoi(__ArgValue), 1), 99);
+    continue;
+  }
+
+  __OnArgument("--isp-cache") {
+    isp_cache_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--startup-log") {
+    startup_log_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--rt-policy") {
+    sched_policy = parseSchedulingPolicy(__ArgValue);
+    if (sched_policy < 0) {
+      return 1;
+    }
+    continue;
+  }
+
+  __OnArgument("--rt-isp") {
+    isp_scheduling.priority = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--rt-stream") {
+    stream_scheduling.priority = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--cpu-isp") {
+    isp_scheduling.cpu = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--cpu-stream") {
+    stream_scheduling.cpu = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--mlock") {
+    lock_memory = true;
+    continue;
+  }
+
   __OnArgument("-s") {
     const char* value = __ArgValue;
     if (!strcmp(value, "D1")) {
@@ -331,6 +464,22 @@ int main(int argc, const char* argv[]) {
   // Normalize GOP
   venc_gop_size = sensor_framerate / venc_gop_denom;
 
+  isp_scheduling.policy = sched_policy;
+  stream_scheduling.policy = sched_policy;
+
+  // Recording the HQ stream requires the HQ channel
+  record_hq = record_hq && record_path;
+  bool hq_enabled = hq_file_path || record_hq;
+
+  // Snapshots are requested over the control socket
+  if (snapshot_enabled && !control_port) {
+    printf("ERROR: Snapshot requires --control-port\n");
+    return 1;
+  }
+
+  // VPSS channel #0 at sensor resolution feeds HQ and JPEG encoders
+  bool full_enabled = hq_enabled || snapshot_enabled;
+
   /* --- v300 IMX307 --- */
   combo_dev_attr_t* mipi_profile = 0;
   ISP_PUB_ATTR_S* isp_profile = 0;
@@ -410,8 +559,8 @@ int main(int argc, const char* argv[]) {
   VB_CONFIG_S vb_conf;
   memset(&vb_conf, 0x00, sizeof(vb_conf));
 
-  // Use two memory pools
-  vb_conf.u32MaxPoolCnt = 2;
+  // Use two memory pools, plus one for the sensor resolution channel
+  vb_conf.u32MaxPoolCnt = full_enabled ? 3 : 2;
 
   // Memory pool for VI
   vb_conf.astCommPool[0].u32BlkCnt  = (goke_version == 300 && sensor_type == IMX335)
@@ -427,6 +576,14 @@ int main(int argc, const char* argv[]) {
     image_height, PIXEL_FORMAT_YVU_SEMIPLANAR_420, DATA_BITWIDTH_8,
     COMPRESS_MODE_NONE, DEFAULT_ALIGN);
 
+  // Memory pool for high quality and JPEG VENC
+  if (full_enabled) {
+    vb_conf.astCommPool[2].u32BlkCnt = 2;
+    vb_conf.astCommPool[2].u64BlkSize = COMMON_GetPicBufferSize(sensor_width,
+      sensor_height, PIXEL_FORMAT_YVU_SEMIPLANAR_420, DATA_BITWIDTH_8,
+      COMPRESS_MODE_NONE, DEFAULT_ALIGN);
+  }
+
   // Configure video buffer
   ret = HI_MPI_VB_SetConfig(&vb_conf);
   if (ret) {
@@ -446,6 +603,8 @@ int main(int argc, const char* argv[]) {
     HI_MPI_VB_Exit();
   }
 
+  startup_mark("sys");
+
   // Set VI-VPSS mode to VI offline and VPSS online
   VI_VPSS_MODE_S vi_vpss_mode_config;
   HI_MPI_SYS_GetVIVPSSMode(&vi_vpss_mode_config);
@@ -483,6 +642,7 @@ int main(int argc, const char* argv[]) {
 
   // Close MIPI (not needed anymore)
   close(mipi_device);
+  startup_mark("mipi");
 
   // Set VI device configuration
   sns_profile->stSize.u32Width = sensor_width;
@@ -538,55 +698,24 @@ int main(int argc, const char* argv[]) {
     return ret;
   }
 
-  // Initialize ISP for VI pipe
-  ISP_SNS_COMMBUS_U bus;
-  bus.s8I2cDev = 0; // I2C device #0
-  sns_object->pfnSetBusInfo(vi_pipe_id, bus);
-
-  // Register ISP libraries in sensor driver
-  ALG_LIB_S ae_lib;
-  ALG_LIB_S awb_lib;
-
-  ae_lib.s32Id = 0;
-  awb_lib.s32Id = 0;
-
-  strncpy(ae_lib.acLibName, HI_AE_LIB_NAME, sizeof(HI_AE_LIB_NAME));
-  strncpy(awb_lib.acLibName, HI_AWB_LIB_NAME, sizeof(HI_AWB_LIB_NAME));
-
-  // Register library callbacks
-  sns_object->pfnRegisterCallback(vi_pipe_id, &ae_lib, &awb_lib);
-
-  // Load (register) ISP libraries in MPI
-  HI_MPI_AE_Register(vi_pipe_id, &ae_lib);
-  HI_MPI_AWB_Register(vi_pipe_id, &awb_lib);
-
-  // Initialize ISP memory for VI pipe
-  HI_MPI_ISP_MemInit(vi_pipe_id);
-
-  // Configure ISP
-  HI_MPI_ISP_SetPubAttr(vi_pipe_id, isp_profile);
-
-  // Initialize ISP
-  ret = HI_MPI_ISP_Init(vi_pipe_id);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to init ISP\n");
-    return ret;
-  }
+  // ISP initializes and converges on its own thread while VPSS/VENC are set up
+  IspConfig isp_config;
+  isp_config.pipe_id = vi_pipe_id;
+  isp_config.sns_object = sns_object;
+  isp_config.profile = isp_profile;
+  isp_config.framerate = sensor_framerate;
+  isp_config.limit_exposure = limit_exposure;
+  isp_config.cache_path = isp_cache_path;
+  isp_config.scheduling = isp_scheduling;
 
-  if (limit_exposure) {
-    ISP_EXPOSURE_ATTR_S attr;
-    ret = HI_MPI_ISP_GetExposureAttr(0, &attr);
-    if (ret != HI_SUCCESS) {
-      printf("ERROR: Unable to get exposure\n");
-      return ret;
-    }
+  pthread_t isp_thread;
+  pthread_create(&isp_thread, NULL, __ISP_THREAD__, &isp_config);
+  startup_mark("vi");
 
-    attr.stAuto.stExpTimeRange.u32Max = 10000 * 1000 / sensor_framerate;
-    ret = HI_MPI_ISP_SetExposureAttr(0, &attr);
-    if (ret != HI_SUCCESS) {
-      printf("ERROR: Unable to set exposure\n");
-      return ret;
-    }
+  // Cache file writes and fsync stay off the streaming thread
+  pthread_t isp_cache_thread;
+  if (isp_cache_path) {
+    pthread_create(&isp_cache_thread, NULL, __ISP_CACHE_THREAD__, &isp_config);
   }
 
   // Create VPSS group
@@ -605,31 +734,9 @@ int main(int argc, const char* argv[]) {
   HI_MPI_VPSS_CreateGrp(vpss_group_id, &grp_attr);
 
   // Create second VPSS channel #1 for small stream (secondary stream)
-  VPSS_CHN_ATTR_S chn_attr;
-  memset(&chn_attr, 0x00, sizeof(chn_attr));
-  chn_attr.u32Width = image_width;
-  chn_attr.u32Height = image_height;
-  chn_attr.enChnMode = VPSS_CHN_MODE_USER;
-  chn_attr.enCompressMode = COMPRESS_MODE_NONE;
-  chn_attr.enDynamicRange = DYNAMIC_RANGE_SDR8;
-  chn_attr.enPixelFormat = PIXEL_FORMAT_YVU_SEMIPLANAR_420;
-  if (chn_attr.u32Width * chn_attr.u32Height > 2688 * 1520) {
-    chn_attr.stFrameRate.s32SrcFrameRate = sensor_framerate;
-    chn_attr.stFrameRate.s32DstFrameRate = 20;
-  } else {
-    chn_attr.stFrameRate.s32SrcFrameRate = sensor_framerate;
-    chn_attr.stFrameRate.s32DstFrameRate = sensor_framerate;
-  }
-
-  chn_attr.u32Depth = 0;
-  chn_attr.bMirror = image_mirror;
-  chn_attr.bFlip = image_flip;
-  chn_attr.enVideoFormat = VIDEO_FORMAT_LINEAR;
-  chn_attr.stAspectRatio.enMode = ASPECT_RATIO_NONE;
-
-  ret = HI_MPI_VPSS_SetChnAttr(vpss_group_id, vpss_second_ch_id, &chn_attr);
+  ret = createVpssChannel(vpss_group_id, vpss_second_ch_id,
+    image_width, image_height, sensor_framerate, image_mirror, image_flip);
   if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to set VPSS channel configuration = 0x0%x\n", ret);
     return ret;
   }
 
@@ -656,6 +763,21 @@ int main(int argc, const char* argv[]) {
     return ret;
   }
 
+  // Create first VPSS channel #0 for full size stream (main stream)
+  if (full_enabled) {
+    ret = createVpssChannel(vpss_group_id, vpss_first_ch_id,
+      sensor_width, sensor_height, sensor_framerate, image_mirror, image_flip);
+    if (ret != HI_SUCCESS) {
+      return ret;
+    }
+
+    ret = HI_MPI_VPSS_EnableChn(vpss_group_id, vpss_first_ch_id);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to enable VPSS channel\n");
+      return ret;
+    }
+  }
+
   // Start group
   ret = HI_MPI_VPSS_StartGrp(vpss_group_id);
   if (ret != HI_SUCCESS) {
@@ -676,159 +798,26 @@ int main(int argc, const char* argv[]) {
   vpss_dst.s32ChnId = vpss_second_ch_id;
 
   HI_MPI_SYS_Bind(&vi_src, &vpss_dst);
-
-  // Configure h264 encoder
-  VENC_CHN_ATTR_S config;
-  memset(&config, 0x00, sizeof(config));
-  config.stVencAttr.enType = rc_codec;
-  config.stVencAttr.u32MaxPicWidth = image_width;
-  config.stVencAttr.u32MaxPicHeight = image_height;
-  config.stVencAttr.u32PicWidth = image_width;
-  config.stVencAttr.u32PicHeight = image_height;
-  config.stVencAttr.u32BufSize = ALIGN_UP(image_width * image_height * 3 / 4, 64);
-  config.stVencAttr.u32Profile = 0; // Baseline (0), Main(1), High(1)
-  config.stVencAttr.bByFrame = venc_by_frame;
-  config.stGopAttr.enGopMode = VENC_GOPMODE_NORMALP;
-  config.stGopAttr.stNormalP.s32IPQpDelta = 4;
-  config.stRcAttr.enRcMode = rc_mode;
-
-  switch (rc_codec) {
-    case PT_H264:
-      config.stVencAttr.stAttrH264e.bRcnRefShareBuf = HI_TRUE;
-      break;
-
-    case PT_H265:
-      config.stVencAttr.stAttrH265e.bRcnRefShareBuf = HI_TRUE;
-      break;
-  }
-
-  switch (rc_mode) {
-    case VENC_RC_MODE_H264AVBR:
-      printf("> Codec: h264 AVBR\n");
-      config.stRcAttr.stH264AVbr.u32SrcFrameRate = sensor_framerate;
-      config.stRcAttr.stH264AVbr.fr32DstFrameRate = sensor_framerate;
-      config.stRcAttr.stH264AVbr.u32Gop = venc_gop_size;
-      config.stRcAttr.stH264AVbr.u32MaxBitRate = venc_max_rate;
-      config.stRcAttr.stH264AVbr.u32StatTime = 1;
-      break;
-
-    case VENC_RC_MODE_H264QVBR:
-      printf("> Codec: h264 QVBR\n");
-      config.stRcAttr.stH264QVbr.u32SrcFrameRate = sensor_framerate;
-      config.stRcAttr.stH264QVbr.fr32DstFrameRate = sensor_framerate;
-      config.stRcAttr.stH264QVbr.u32StatTime = 1;
-      config.stRcAttr.stH264QVbr.u32Gop = venc_gop_size;
-      config.stRcAttr.stH264QVbr.u32TargetBitRate = venc_max_rate;
-
-    case VENC_RC_MODE_H264VBR:
-      printf("> Codec: h264 VBR\n");
-      config.stRcAttr.stH264Vbr.u32SrcFrameRate = sensor_framerate;
-      config.stRcAttr.stH264Vbr.fr32DstFrameRate = sensor_framerate;
-      config.stRcAttr.stH264Vbr.u32StatTime = 1;
-      config.stRcAttr.stH264Vbr.u32Gop = venc_gop_size;
-      config.stRcAttr.stH264Vbr.u32MaxBitRate = venc_max_rate;
-      break;
-
-    case VENC_RC_MODE_H264CBR:
-      printf("> Codec: h264 CBR\n");
-      config.stRcAttr.stH264Cbr.u32SrcFrameRate = sensor_framerate;
-      config.stRcAttr.stH264Cbr.fr32DstFrameRate = sensor_framerate;
-      config.stRcAttr.stH264Cbr.u32StatTime = 1;
-      config.stRcAttr.stH264Cbr.u32Gop = venc_gop_size;
-      config.stRcAttr.stH264Cbr.u32BitRate = venc_max_rate;
-      break;
-
-    case VENC_RC_MODE_H265AVBR:
-      printf("> Codec: h265 AVBR\n");
-      config.stRcAttr.stH265AVbr.u32SrcFrameRate = sensor_framerate;
-      config.stRcAttr.stH265AVbr.fr32DstFrameRate = sensor_framerate;
-      config.stRcAttr.stH265AVbr.u32StatTime = 1;
-      config.stRcAttr.stH265AVbr.u32Gop = venc_gop_size;
-      config.stRcAttr.stH265AVbr.u32MaxBitRate = venc_max_rate;
-      break;
-
-    case VENC_RC_MODE_H265VBR:
-      printf("> Codec: h265 VBR\n");
-      config.stRcAttr.stH265Vbr.u32SrcFrameRate = sensor_framerate;
-      config.stRcAttr.stH265Vbr.fr32DstFrameRate = sensor_framerate;
-      config.stRcAttr.stH265Vbr.u32StatTime = 1;
-      config.stRcAttr.stH265Vbr.u32Gop = venc_gop_size;
-      config.stRcAttr.stH265Vbr.u32MaxBitRate = venc_max_rate;
-      break;
-
-    case VENC_RC_MODE_H265CBR:
-      printf("> Codec: h265 CBR\n");
-      config.stRcAttr.stH265Cbr.u32SrcFrameRate = sensor_framerate;
-      config.stRcAttr.stH265Cbr.fr32DstFrameRate = sensor_framerate;
-      config.stRcAttr.stH265Cbr.u32StatTime = 1;
-      config.stRcAttr.stH265Cbr.u32Gop = venc_gop_size;
-      config.stRcAttr.stH265Cbr.u32BitRate = venc_max_rate;
-      break;
-
-    case VENC_RC_MODE_H265QVBR:
-      printf("> Codec: h265 QVBR\n");
-      config.stRcAttr.stH265QVbr.u32SrcFrameRate = sensor_framerate;
-      config.stRcAttr.stH265QVbr.fr32DstFrameRate = sensor_framerate;
-      config.stRcAttr.stH265QVbr.u32StatTime = 1;
-      config.stRcAttr.stH265QVbr.u32Gop = venc_gop_size;
-      config.stRcAttr.stH265QVbr.u32TargetBitRate = venc_max_rate;
-      break;
-  }
+  startup_mark("vpss");
 
   // Create channel #1
-  ret = HI_MPI_VENC_CreateChn(venc_second_ch_id, &config);
+  EncoderConfig live_config;
+  memset(&live_config, 0x00, sizeof(live_config));
+  live_config.codec = rc_codec;
+  live_config.rc_mode = rc_mode;
+  live_config.width = image_width;
+  live_config.height = image_height;
+  live_config.framerate = sensor_framerate;
+  live_config.gop_size = venc_gop_size;
+  live_config.bitrate = venc_max_rate;
+  live_config.by_frame = venc_by_frame;
+
+  ret = encoder->create(venc_second_ch_id, &live_config);
   if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to create VENC channel = 0x%x\n", ret);
     return ret;
   }
 
-  // Configure rate control for channel #1
   VENC_RC_PARAM_S rc_param;
-  HI_MPI_VENC_GetRcParam(venc_second_ch_id, &rc_param);
-  switch (rc_mode) {
-    case VENC_RC_MODE_H264AVBR:
-      rc_param.stParamH264AVbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H264QVBR:
-      rc_param.stParamH264QVbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H264VBR:
-      rc_param.stParamH264Vbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H264CBR:
-      rc_param.stParamH264Cbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H265AVBR:
-      rc_param.stParamH265AVbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H265QVBR:
-      rc_param.stParamH265QVbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H265VBR:
-      rc_param.stParamH265Vbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H265CBR:
-      rc_param.stParamH265Cbr.s32MaxReEncodeTimes = 0;
-      break;
-  }
-
-  rc_param.s32FirstFrameStartQp = -1;
-  rc_param.stSceneChangeDetect.bAdaptiveInsertIDRFrame = HI_TRUE;
-  rc_param.stSceneChangeDetect.bDetectSceneChange = HI_TRUE;
-
-  ret = HI_MPI_VENC_SetRcParam(venc_second_ch_id, &rc_param);
-  if (ret != HI_SUCCESS) {
-    printf("ERROR: Unable to set VENC RC options = 0x%x\n", ret);
-    return ret;
-  }
-
   HI_MPI_VENC_GetRcParam(venc_second_ch_id, &rc_param);
   printf("> Scene detect = %s, Adaptive IDR = %s, Start Qp = %d, Row dQp = %d\n",
     rc_param.stSceneChangeDetect.bDetectSceneChange ? "YES" : "NO",
@@ -943,18 +932,7 @@ int main(int argc, const char* argv[]) {
   }
 
   // Connect VPSS channel #1 to VENC channel #1
-  MPP_CHN_S vpss_src;
-  MPP_CHN_S venc_dst;
-
-  vpss_src.enModId = HI_ID_VPSS;
-  vpss_src.s32DevId = vpss_group_id;
-  vpss_src.s32ChnId = vpss_second_ch_id;
-
-  venc_dst.enModId = HI_ID_VENC;
-  venc_dst.s32DevId = 0;
-  venc_dst.s32ChnId = venc_second_ch_id;
-
-  HI_MPI_SYS_Bind(&vpss_src, &venc_dst);
+  bindVpssToEncoder(vpss_group_id, vpss_second_ch_id, venc_second_ch_id);
 
   // Start VENC channel #1 without frames count limit
   VENC_RECV_PIC_PARAM_S recv_param;
@@ -965,34 +943,190 @@ int main(int argc, const char* argv[]) {
     return ret;
   }
 
-  // Start ISP service thread
-  pthread_t isp_thread;
-  pthread_create(&isp_thread, NULL, __ISP_THREAD__, (void*)vi_pipe_id);
-
-  // Open socket handle
-  int socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  struct sockaddr_in dst_addr;
-  dst_addr.sin_family = AF_INET;
-  dst_addr.sin_port = htons(udp_sink_port);
-  dst_addr.sin_addr.s_addr = udp_sink_ip;
-
-  // Prepare Tx buffer
-  tx_buffer = malloc(65536);
-  printf("> Ready for streaming\n");
-  signal(SIGINT, handler);
+  startup_mark("venc");
 
-  while (loop_running) {
-    // Process stream on encoder channel #1
-    if (!processStream(venc_second_ch_id, socket_handle,
-        (struct sockaddr*)&dst_addr, max_frame_size)) {
-      // --- Take a rest if no frames received
-      // Another way: HI_MPI_VENC_GetFd(vecn_channel_id) + epoll
-      usleep(1);
+  // Create high quality VENC channel #0 on VPSS channel #0
+  // Writer thread keeps SD card stalls and slow FIFO readers off the live path
+  if (hq_file_path) {
+    if (output_open(hq_file_path, rc_codec, record_queue_size * 1024 * 1024)) {
+      return 1;
     }
   }
 
-  printf("> Stop streaming\n");
-
+  if (hq_enabled) {
+    // Whole frames per pack suit file output, GOP matches the live stream
+    uint32_t hq_framerate = getVpssFramerate(
+      sensor_width, sensor_height, sensor_framerate);
+    EncoderConfig hq_config = live_config;
+    hq_config.width = sensor_width;
+    hq_config.height = sensor_height;
+    hq_config.framerate = hq_framerate;
+    hq_config.gop_size = hq_framerate / venc_gop_denom;
+    hq_config.bitrate = hq_max_rate;
+    hq_config.by_frame = HI_TRUE;
+
+    ret = encoder->create(venc_first_ch_id, &hq_config);
+    if (ret != HI_SUCCESS) {
+      return ret;
+    }
+
+    bindVpssToEncoder(vpss_group_id, vpss_first_ch_id, venc_first_ch_id);
+
+    ret = HI_MPI_VENC_StartRecvFrame(venc_first_ch_id, &recv_param);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to start HQ Rx frames\n");
+      return ret;
+    }
+
+    printf("> HQ stream: %d x %d @ %d, %d Kbit/s\n",
+      sensor_width, sensor_height, hq_framerate, hq_max_rate);
+  }
+
+  // Create JPEG VENC channel #2 on VPSS channel #0, idle until requested
+  if (snapshot_enabled) {
+    ret = createJpegChannel(venc_jpeg_ch_id, sensor_width, sensor_height,
+      snapshot_quality);
+    if (ret != HI_SUCCESS) {
+      return ret;
+    }
+
+    bindVpssToEncoder(vpss_group_id, vpss_first_ch_id, venc_jpeg_ch_id);
+    printf("> Snapshot: %d x %d, quality %d\n",
+      sensor_width, sensor_height, snapshot_quality);
+  }
+
+  // Start recorder, writer thread keeps SD card stalls off the live path
+  if (record_path) {
+    ret = recorder_init(record_path, rc_codec,
+      record_segment_size * 1024 * 1024, record_queue_size * 1024 * 1024);
+    if (ret) {
+      return ret;
+    }
+  }
+
+  // Open control socket
+  int control_handle = -1;
+  if (control_port) {
+    control_handle = control_open(control_port);
+    if (control_handle < 0) {
+      return 1;
+    }
+  }
+
+  // Open socket handle
+  int socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in dst_addr;
+  dst_addr.sin_family = AF_INET;
+  dst_addr.sin_port = htons(udp_sink_port);
+  dst_addr.sin_addr.s_addr = udp_sink_ip;
+
+  // Prepare packetizer
+  initStream(rc_codec, max_frame_size);
+  startup_mark("ready");
+  printf("> Ready for streaming\n");
+  signal(SIGINT, handler);
+
+  // All encoder channels are serviced by one loop, waiting on VENC handles
+  int live_fd = encoder->get_fd(venc_second_ch_id);
+  int hq_fd = hq_enabled ? encoder->get_fd(venc_first_ch_id) : -1;
+  int jpeg_fd = snapshot_enabled ? HI_MPI_VENC_GetFd(venc_jpeg_ch_id) : -1;
+  int max_fd = MAX(MAX(live_fd, hq_fd), MAX(jpeg_fd, control_handle));
+  bool first_frame = true;
+
+  // Drain and send share this thread, helper threads are already running
+  applyThreadScheduling("stream", &stream_scheduling);
+  if (lock_memory) {
+    lockProcessMemory();
+  }
+
+  while (loop_running) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(live_fd, &read_fds);
+    if (hq_fd >= 0) {
+      FD_SET(hq_fd, &read_fds);
+    }
+
+    if (jpeg_fd >= 0 && snapshot_pending) {
+      FD_SET(jpeg_fd, &read_fds);
+    }
+
+    if (control_handle >= 0) {
+      FD_SET(control_handle, &read_fds);
+    }
+
+    struct timeval timeout = {0, 100000};
+    ret = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
+
+    if (ret <= 0) {
+      continue;
+    }
+
+    // Live stream has priority, drain all pending slices first
+    if (FD_ISSET(live_fd, &read_fds)) {
+      while (processStream(encoder, venc_second_ch_id, 0, socket_handle,
+          (struct sockaddr*)&dst_addr, record_path && !record_hq) > 0);
+
+      if (first_frame) {
+        first_frame = false;
+        startup_mark("first frame");
+        startup_report(startup_log_path);
+        releaseIspCache(vi_pipe_id);
+        isp_cache_streaming = true;
+      }
+    }
+
+    // Process stream on encoder channel #0
+    if (hq_fd >= 0 && FD_ISSET(hq_fd, &read_fds)) {
+      writeStream(venc_first_ch_id, hq_file_path != 0, record_hq);
+    }
+
+    // Process finished snapshot on encoder channel #2
+    if (jpeg_fd >= 0 && snapshot_pending && FD_ISSET(jpeg_fd, &read_fds)) {
+      processSnapshot(venc_jpeg_ch_id, control_handle);
+    }
+
+    // Process control commands
+    if (control_handle >= 0 && FD_ISSET(control_handle, &read_fds)) {
+      ControlMessage message;
+      while (control_receive(control_handle, &message)) {
+        if (!strcmp(message.command, "snapshot")) {
+          if (!snapshot_enabled) {
+            control_reply(control_handle, &message, "ERROR snapshot disabled");
+          } else {
+            requestSnapshot(venc_jpeg_ch_id, control_handle, &message);
+          }
+        } else {
+          control_reply(control_handle, &message, "ERROR unknown command");
+        }
+      }
+    }
+  }
+
+  printf("> Stop streaming\n");
+
+  recorder_stop();
+
+  if (hq_enabled) {
+    encoder->destroy(venc_first_ch_id);
+  }
+
+  output_close();
+
+  if (snapshot_enabled) {
+    HI_MPI_VENC_StopRecvFrame(venc_jpeg_ch_id);
+    HI_MPI_VENC_DestroyChn(venc_jpeg_ch_id);
+  }
+
+  if (control_handle >= 0) {
+    close(control_handle);
+  }
+
+  if (isp_cache_path) {
+    pthread_join(isp_cache_thread, NULL);
+    saveIspCache(vi_pipe_id, isp_cache_path);
+  }
+
   HI_MPI_ISP_Exit(vi_pipe_id);
   HI_MPI_VPSS_StopGrp(vpss_group_id);
   HI_MPI_VPSS_DestroyGrp(vpss_group_id);
@@ -1008,253 +1142,594 @@ int main(int argc, const char* argv[]) {
   return 0;
 }
 
-void* __ISP_THREAD__(void* param) {
-  HI_MPI_ISP_Run((VI_PIPE)param);
+uint32_t getVpssFramerate(uint32_t width, uint32_t height, uint32_t framerate) {
+  // Channels above 4MP can't keep up with the sensor rate
+  return width * height > 2688 * 1520 ? MIN(framerate, 20) : framerate;
 }
 
-double getTimeInterval(
-  struct timespec* timestamp, struct timespec* last_meansure_timestamp) {
-  return (timestamp->tv_sec - last_meansure_timestamp->tv_sec) +
-       (timestamp->tv_nsec - last_meansure_timestamp->tv_nsec) / 1000000000.;
-}
+int createVpssChannel(VPSS_GRP group_id, VPSS_CHN channel_id, uint32_t width,
+  uint32_t height, uint32_t framerate, int mirror, int flip) {
+  int ret;
 
-struct timespec last_timestamp = {0, 0};
-uint32_t bytes_sent = 0;
-uint32_t frames_sent = 0;
-uint64_t seq_last = 0;
-
-uint64_t jitter_sum = 0;
-uint64_t jitter_cnt = 0;
-uint32_t nal_max_size = 0;
-uint32_t single_packets = 0;
-
-uint32_t pps_count = 0;
-uint32_t sps_count = 0;
-uint32_t idr_count = 0;
-uint32_t sei_count = 0;
-uint32_t s_count = 0;
-uint32_t packets_sent = 0;
-
-int processStream(VENC_CHN channel_id, int socket_handle,
-  struct sockaddr* dst_address, uint16_t max_frame_size) {
-  // Get channel status
-  VENC_CHN_STATUS_S channel_status;
-  int ret = HI_MPI_VENC_QueryStatus(channel_id, &channel_status);
+  VPSS_CHN_ATTR_S chn_attr;
+  memset(&chn_attr, 0x00, sizeof(chn_attr));
+  chn_attr.u32Width = width;
+  chn_attr.u32Height = height;
+  chn_attr.enChnMode = VPSS_CHN_MODE_USER;
+  chn_attr.enCompressMode = COMPRESS_MODE_NONE;
+  chn_attr.enDynamicRange = DYNAMIC_RANGE_SDR8;
+  chn_attr.enPixelFormat = PIXEL_FORMAT_YVU_SEMIPLANAR_420;
+  chn_attr.stFrameRate.s32SrcFrameRate = framerate;
+  chn_attr.stFrameRate.s32DstFrameRate = getVpssFramerate(width, height, framerate);
+
+  chn_attr.u32Depth = 0;
+  chn_attr.bMirror = mirror;
+  chn_attr.bFlip = flip;
+  chn_attr.enVideoFormat = VIDEO_FORMAT_LINEAR;
+  chn_attr.stAspectRatio.enMode = ASPECT_RATIO_NONE;
+
+  ret = HI_MPI_VPSS_SetChnAttr(group_id, channel_id, &chn_attr);
   if (ret != HI_SUCCESS) {
-    printf("WARN: Unable to query VENC status = 0x%x\n", ret);
-    usleep(100000);
-    return 0;
+    printf("ERROR: Unable to set VPSS channel configuration = 0x0%x\n", ret);
+    return ret;
   }
 
-  // Check if has encoded data
-  if (!channel_status.u32CurPacks) {
-    // Nothing to get
-    return 0;
-  }
+  return HI_SUCCESS;
+}
 
-  // Stream packets descriptors
-  // Per-Slice mode always return one slice at a time.
-  // Per-Frame mode may return multiple slices, we need to allocate memory for all reported slices.
-  VENC_PACK_S packet_descriptor[32];
+int bindVpssToEncoder(VPSS_GRP group_id, VPSS_CHN vpss_channel_id,
+  VENC_CHN venc_channel_id) {
+  MPP_CHN_S vpss_src;
+  MPP_CHN_S venc_dst;
 
-  // Stream buffer
-  VENC_STREAM_S stream;
-  memset(&stream, 0x00, sizeof(stream));
-  stream.pstPack = packet_descriptor;
-  stream.u32PackCount = channel_status.u32CurPacks;
+  vpss_src.enModId = HI_ID_VPSS;
+  vpss_src.s32DevId = group_id;
+  vpss_src.s32ChnId = vpss_channel_id;
 
-  // Acquire stream
-  ret = HI_MPI_VENC_GetStream(channel_id, &stream, 0);
-  if (ret != HI_SUCCESS) {
-    printf("WARN: Failed to get VENC stream  = 0x%x. Current packs = %d\n",
-      ret, channel_status.u32CurPacks);
-    usleep(100000);
-    return 0;
-  }
+  venc_dst.enModId = HI_ID_VENC;
+  venc_dst.s32DevId = 0;
+  venc_dst.s32ChnId = venc_channel_id;
 
-  // Send encoded packets
-  for (uint32_t i = 0; i < stream.u32PackCount; i++) {
-    sendPacket(stream.pstPack[i].pu8Addr + stream.pstPack[i].u32Offset,
-      stream.pstPack[i].u32Len - stream.pstPack[i].u32Offset,
-      socket_handle, dst_address, max_frame_size);
-  }
+  return HI_MPI_SYS_Bind(&vpss_src, &venc_dst);
+}
 
-  // Release stream
-  HI_MPI_VENC_ReleaseStream(channel_id, &stream);
+int createEncoderChannel(VENC_CHN channel_id, PAYLOAD_TYPE_E rc_codec,
+  int rc_mode, uint32_t width, uint32_t height, uint32_t framerate,
+  uint32_t gop_size, uint32_t max_rate, HI_BOOL by_frame) {
+  int ret;
 
-  // Print rate stats
-  struct timespec current_timestamp;
-  if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &current_timestamp)) {
-    double interval = getTimeInterval(&current_timestamp, &last_timestamp);
-    if (interval > 1) {
-      printf("> Rate: %.2f Mbit/sec. (%.1f pps) | Frames: %d, NotFrag: "
-           "%d | AVG Size: %d, MAX Size: %d | S: %d, IDR: %d, SEI: %d, "
-           "PPS: %d, SPS: %d | Packets: %d\n",
-        ((double)bytes_sent * 8) / interval / 1024 / 1024,
-        (double)frames_sent / interval, /* jitter_sum / jitter_cnt,*/
-        frames_sent, single_packets, bytes_sent / frames_sent,
-        nal_max_size, s_count, idr_count, sei_count, pps_count,
-        sps_count, packets_sent);
-
-      bytes_sent = 0;
-      frames_sent = 0;
-      jitter_sum = 0;
-      jitter_cnt = 0;
-      nal_max_size = 0;
-      s_count = 0;
-      idr_count = 0;
-      pps_count = 0;
-      sps_count = 0;
-      sei_count = 0;
-      single_packets = 0;
-      packets_sent = 0;
-      last_timestamp = current_timestamp;
-    }
+  // Configure h264 encoder
+  VENC_CHN_ATTR_S config;
+  memset(&config, 0x00, sizeof(config));
+  config.stVencAttr.enType = rc_codec;
+  config.stVencAttr.u32MaxPicWidth = width;
+  config.stVencAttr.u32MaxPicHeight = height;
+  config.stVencAttr.u32PicWidth = width;
+  config.stVencAttr.u32PicHeight = height;
+  config.stVencAttr.u32BufSize = ALIGN_UP(width * height * 3 / 4, 64);
+  config.stVencAttr.u32Profile = 0; // Baseline (0), Main(1), High(1)
+  config.stVencAttr.bByFrame = by_frame;
+  config.stGopAttr.enGopMode = VENC_GOPMODE_NORMALP;
+  config.stGopAttr.stNormalP.s32IPQpDelta = 4;
+  config.stRcAttr.enRcMode = rc_mode;
+
+  switch (rc_codec) {
+    case PT_H264:
+      config.stVencAttr.stAttrH264e.bRcnRefShareBuf = HI_TRUE;
+      break;
+
+    case PT_H265:
+      config.stVencAttr.stAttrH265e.bRcnRefShareBuf = HI_TRUE;
+      break;
   }
 
-  return 1;
-}
+  switch (rc_mode) {
+    case VENC_RC_MODE_H264AVBR:
+      printf("> Codec: h264 AVBR\n");
+      config.stRcAttr.stH264AVbr.u32SrcFrameRate = framerate;
+      config.stRcAttr.stH264AVbr.fr32DstFrameRate = framerate;
+      config.stRcAttr.stH264AVbr.u32Gop = gop_size;
+      config.stRcAttr.stH264AVbr.u32MaxBitRate = max_rate;
+      config.stRcAttr.stH264AVbr.u32StatTime = 1;
+      break;
 
-uint32_t sequence_id = 0;
-uint32_t frame_id = 0;
-uint16_t rtp_sequence = 0;
+    case VENC_RC_MODE_H264QVBR:
+      printf("> Codec: h264 QVBR\n");
+      config.stRcAttr.stH264QVbr.u32SrcFrameRate = framerate;
+      config.stRcAttr.stH264QVbr.fr32DstFrameRate = framerate;
+      config.stRcAttr.stH264QVbr.u32StatTime = 1;
+      config.stRcAttr.stH264QVbr.u32Gop = gop_size;
+      config.stRcAttr.stH264QVbr.u32TargetBitRate = max_rate;
 
-void transmit(int socket_handle, uint8_t* tx_buffer, uint32_t tx_size,
-  struct sockaddr* dst_address) {
+    case VENC_RC_MODE_H264VBR:
+      printf("> Codec: h264 VBR\n");
+      config.stRcAttr.stH264Vbr.u32SrcFrameRate = framerate;
+      config.stRcAttr.stH264Vbr.fr32DstFrameRate = framerate;
+      config.stRcAttr.stH264Vbr.u32StatTime = 1;
+      config.stRcAttr.stH264Vbr.u32Gop = gop_size;
+      config.stRcAttr.stH264Vbr.u32MaxBitRate = max_rate;
+      break;
 
-  switch (stream_mode) {
-    // Compact mode
-    case 0:
-      sendto(socket_handle, tx_buffer, tx_size, 0, dst_address, sizeof(struct sockaddr_in));
+    case VENC_RC_MODE_H264CBR:
+      printf("> Codec: h264 CBR\n");
+      config.stRcAttr.stH264Cbr.u32SrcFrameRate = framerate;
+      config.stRcAttr.stH264Cbr.fr32DstFrameRate = framerate;
+      config.stRcAttr.stH264Cbr.u32StatTime = 1;
+      config.stRcAttr.stH264Cbr.u32Gop = gop_size;
+      config.stRcAttr.stH264Cbr.u32BitRate = max_rate;
       break;
 
-    // RTP mode
-    case 1: {
-      struct RTPHeader rtp_header;
-      rtp_header.version = 0x80;
-      rtp_header.sequence = htobe16(rtp_sequence++);
-      rtp_header.payload_type = 0x60;
-      rtp_header.timestamp = 0;
-      rtp_header.ssrc_id = 0xDEADBEEF;
-
-      struct iovec iov[2];
-      iov[0].iov_base = &rtp_header;
-      iov[0].iov_len = sizeof(struct RTPHeader);
-      iov[1].iov_base = tx_buffer;
-      iov[1].iov_len = tx_size;
-
-      struct msghdr msg;
-      msg.msg_iovlen = 2;
-      msg.msg_iov = iov;
-      msg.msg_name = dst_address;
-      msg.msg_namelen = sizeof(struct sockaddr_in);
-
-      sendmsg(socket_handle, &msg, 0);
+    case VENC_RC_MODE_H265AVBR:
+      printf("> Codec: h265 AVBR\n");
+      config.stRcAttr.stH265AVbr.u32SrcFrameRate = framerate;
+      config.stRcAttr.stH265AVbr.fr32DstFrameRate = framerate;
+      config.stRcAttr.stH265AVbr.u32StatTime = 1;
+      config.stRcAttr.stH265AVbr.u32Gop = gop_size;
+      config.stRcAttr.stH265AVbr.u32MaxBitRate = max_rate;
       break;
-    }
-  }
-}
 
-void sendPacket(uint8_t* pack_data, uint32_t pack_size, int socket_handle,
-    struct sockaddr* dst_address, uint32_t max_size) {
-  uint8_t prefix = 4;
-  pack_data += prefix;
-  pack_size -= prefix;
+    case VENC_RC_MODE_H265VBR:
+      printf("> Codec: h265 VBR\n");
+      config.stRcAttr.stH265Vbr.u32SrcFrameRate = framerate;
+      config.stRcAttr.stH265Vbr.fr32DstFrameRate = framerate;
+      config.stRcAttr.stH265Vbr.u32StatTime = 1;
+      config.stRcAttr.stH265Vbr.u32Gop = gop_size;
+      config.stRcAttr.stH265Vbr.u32MaxBitRate = max_rate;
+      break;
 
-  frame_id++;
-  frames_sent++;
+    case VENC_RC_MODE_H265CBR:
+      printf("> Codec: h265 CBR\n");
+      config.stRcAttr.stH265Cbr.u32SrcFrameRate = framerate;
+      config.stRcAttr.stH265Cbr.fr32DstFrameRate = framerate;
+      config.stRcAttr.stH265Cbr.u32StatTime = 1;
+      config.stRcAttr.stH265Cbr.u32Gop = gop_size;
+      config.stRcAttr.stH265Cbr.u32BitRate = max_rate;
+      break;
 
-  if (pack_size > nal_max_size) {
-    nal_max_size = pack_size;
+    case VENC_RC_MODE_H265QVBR:
+      printf("> Codec: h265 QVBR\n");
+      config.stRcAttr.stH265QVbr.u32SrcFrameRate = framerate;
+      config.stRcAttr.stH265QVbr.fr32DstFrameRate = framerate;
+      config.stRcAttr.stH265QVbr.u32StatTime = 1;
+      config.stRcAttr.stH265QVbr.u32Gop = gop_size;
+      config.stRcAttr.stH265QVbr.u32TargetBitRate = max_rate;
+      break;
   }
 
-  if (pack_size <= max_size) {
-    single_packets++;
+  // Create channel
+  ret = HI_MPI_VENC_CreateChn(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to create VENC channel = 0x%x\n", ret);
+    return ret;
   }
 
-  // Get NAL type
-  uint8_t nal_type = pack_data[0] & 0x1F;
-  switch (nal_type) {
-    case 1:
-      s_count++;
+  // Configure rate control
+  VENC_RC_PARAM_S rc_param;
+  HI_MPI_VENC_GetRcParam(channel_id, &rc_param);
+  switch (rc_mode) {
+    case VENC_RC_MODE_H264AVBR:
+      rc_param.stParamH264AVbr.s32MaxReEncodeTimes = 0;
       break;
 
-    case 5:
-      idr_count++;
+    case VENC_RC_MODE_H264QVBR:
+      rc_param.stParamH264QVbr.s32MaxReEncodeTimes = 0;
       break;
 
-    case 6:
-      sei_count++;
+    case VENC_RC_MODE_H264VBR:
+      rc_param.stParamH264Vbr.s32MaxReEncodeTimes = 0;
       break;
 
-    case 7:
-      sps_count++;
+    case VENC_RC_MODE_H264CBR:
+      rc_param.stParamH264Cbr.s32MaxReEncodeTimes = 0;
       break;
 
-    case 8:
-      pps_count++;
+    case VENC_RC_MODE_H265AVBR:
+      rc_param.stParamH265AVbr.s32MaxReEncodeTimes = 0;
+      break;
+
+    case VENC_RC_MODE_H265QVBR:
+      rc_param.stParamH265QVbr.s32MaxReEncodeTimes = 0;
       break;
 
-    default:
+    case VENC_RC_MODE_H265VBR:
+      rc_param.stParamH265Vbr.s32MaxReEncodeTimes = 0;
+      break;
+
+    case VENC_RC_MODE_H265CBR:
+      rc_param.stParamH265Cbr.s32MaxReEncodeTimes = 0;
       break;
   }
 
-  if (pack_size > max_size + prefix) {
-    uint8_t nal_type_avc = pack_data[0] & 0x1F;
-    uint8_t nal_type_hevc = (pack_data[0] >> 1) & 0x3F;
-    uint8_t nal_bits_avc = pack_data[0] & 0xE0;
-    uint8_t nal_bits_hevc = pack_data[0] & 0x81;
+  rc_param.s32FirstFrameStartQp = -1;
+  rc_param.stSceneChangeDetect.bAdaptiveInsertIDRFrame = HI_TRUE;
+  rc_param.stSceneChangeDetect.bDetectSceneChange = HI_TRUE;
 
-    bool start_bit = true;
-    uint8_t tx_size = 2;
+  ret = HI_MPI_VENC_SetRcParam(channel_id, &rc_param);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set VENC RC options = 0x%x\n", ret);
+    return ret;
+  }
 
-    while (pack_size) {
-      uint32_t chunk_size = pack_size > max_size ? max_size : pack_size;
-      if (nal_type_avc == 1 || nal_type_avc == 5) {
-        tx_buffer[0] = nal_bits_avc | 28;
-        tx_buffer[1] = nal_type_avc;
+  return HI_SUCCESS;
+}
 
-        if (start_bit) {
-          pack_data++;
-          pack_size--;
-          tx_buffer[1] = 0x80 | nal_type_avc;
-          start_bit = false;
-        }
+int initIsp(IspConfig* config) {
+  int ret;
 
-        if (chunk_size == pack_size) {
-          tx_buffer[1] |= 0x40;
-        }
-      }
+  // Initialize ISP for VI pipe
+  ISP_SNS_COMMBUS_U bus;
+  bus.s8I2cDev = 0; // I2C device #0
+  config->sns_object->pfnSetBusInfo(config->pipe_id, bus);
 
-      if (nal_type_hevc == 1 || nal_type_hevc == 19) {
-        tx_buffer[0] = nal_bits_hevc | 49 << 1;
-        tx_buffer[1] = 1;
-        tx_buffer[2] = nal_type_hevc;
-        tx_size = 3;
-
-        if (start_bit) {
-          pack_data += 2;
-          pack_size -= 2;
-          tx_buffer[2] = 0x80 | nal_type_hevc;
-          start_bit = false;
-        }
+  // Register ISP libraries in sensor driver
+  ALG_LIB_S ae_lib;
+  ALG_LIB_S awb_lib;
 
-        if (chunk_size == pack_size) {
-          tx_buffer[2] |= 0x40;
-        }
-      }
+  ae_lib.s32Id = 0;
+  awb_lib.s32Id = 0;
+
+  strncpy(ae_lib.acLibName, HI_AE_LIB_NAME, sizeof(HI_AE_LIB_NAME));
+  strncpy(awb_lib.acLibName, HI_AWB_LIB_NAME, sizeof(HI_AWB_LIB_NAME));
+
+  // Register library callbacks
+  config->sns_object->pfnRegisterCallback(config->pipe_id, &ae_lib, &awb_lib);
+
+  // Load (register) ISP libraries in MPI
+  HI_MPI_AE_Register(config->pipe_id, &ae_lib);
+  HI_MPI_AWB_Register(config->pipe_id, &awb_lib);
+
+  // Initialize ISP memory for VI pipe
+  HI_MPI_ISP_MemInit(config->pipe_id);
+
+  // Configure ISP
+  HI_MPI_ISP_SetPubAttr(config->pipe_id, config->profile);
+
+  // Initialize ISP
+  ret = HI_MPI_ISP_Init(config->pipe_id);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to init ISP\n");
+    return ret;
+  }
+
+  if (config->limit_exposure) {
+    ISP_EXPOSURE_ATTR_S attr;
+    ret = HI_MPI_ISP_GetExposureAttr(config->pipe_id, &attr);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to get exposure\n");
+      return ret;
+    }
+
+    attr.stAuto.stExpTimeRange.u32Max = 10000 * 1000 / config->framerate;
+    ret = HI_MPI_ISP_SetExposureAttr(config->pipe_id, &attr);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to set exposure\n");
+      return ret;
+    }
+  }
+
+  // Start from the last known exposure instead of converging from scratch
+  if (config->cache_path) {
+    loadIspCache(config->pipe_id, config->cache_path);
+  }
+
+  return HI_SUCCESS;
+}
+
+void* __ISP_THREAD__(void* param) {
+  IspConfig* config = (IspConfig*)param;
+  startup_mark("isp start");
+  applyThreadScheduling("isp", &config->scheduling);
+
+  if (initIsp(config) != HI_SUCCESS) {
+    loop_running = false;
+    return 0;
+  }
+
+  startup_mark("isp ready");
+  HI_MPI_ISP_Run(config->pipe_id);
+  return 0;
+}
+
+// Set by the ISP thread, cleared by the streaming thread
+atomic_bool isp_cache_manual = false;
+
+int loadIspCache(VI_PIPE pipe_id, const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return 1;
+  }
+
+  ISP_EXPOSURE_ATTR_S exposure;
+  ISP_WB_ATTR_S white_balance;
+  HI_MPI_ISP_GetExposureAttr(pipe_id, &exposure);
+  HI_MPI_ISP_GetWBAttr(pipe_id, &white_balance);
+
+  ISP_ME_ATTR_S* me = &exposure.stManual;
+  ISP_MWB_ATTR_S* mwb = &white_balance.stManual;
+  int count = fscanf(file, "%u %u %u %u %hu %hu %hu %hu",
+    &me->u32ExpTime, &me->u32AGain, &me->u32DGain, &me->u32ISPDGain,
+    &mwb->u16Rgain, &mwb->u16Grgain, &mwb->u16Gbgain, &mwb->u16Bgain);
+  fclose(file);
+
+  if (count != 8) {
+    printf("WARN: Ignoring malformed ISP cache [%s]\n", path);
+    return 1;
+  }
+
+  // Manual mode for the first frames, released once streaming starts
+  exposure.enOpType = OP_TYPE_MANUAL;
+  me->enExpTimeOpType = OP_TYPE_MANUAL;
+  me->enAGainOpType = OP_TYPE_MANUAL;
+  me->enDGainOpType = OP_TYPE_MANUAL;
+  me->enISPDGainOpType = OP_TYPE_MANUAL;
+  white_balance.enOpType = OP_TYPE_MANUAL;
+
+  if (HI_MPI_ISP_SetExposureAttr(pipe_id, &exposure) != HI_SUCCESS ||
+      HI_MPI_ISP_SetWBAttr(pipe_id, &white_balance) != HI_SUCCESS) {
+    printf("WARN: Unable to apply ISP cache\n");
+    return 1;
+  }
+
+  atomic_store(&isp_cache_manual, true);
+  printf("> ISP cache: exposure %u us, again %u, dgain %u\n",
+    me->u32ExpTime, me->u32AGain, me->u32DGain);
+  return 0;
+}
 
-      memcpy(tx_buffer + tx_size, pack_data, chunk_size + tx_size);
-      transmit(socket_handle, tx_buffer, chunk_size + tx_size, dst_address);
+void releaseIspCache(VI_PIPE pipe_id) {
+  if (!atomic_load(&isp_cache_manual)) {
+    return;
+  }
 
-      packets_sent++;
-      bytes_sent += chunk_size + tx_size;
+  // Hand over to AE/AWB, they continue from the applied values
+  ISP_EXPOSURE_ATTR_S exposure;
+  ISP_WB_ATTR_S white_balance;
+  HI_MPI_ISP_GetExposureAttr(pipe_id, &exposure);
+  HI_MPI_ISP_GetWBAttr(pipe_id, &white_balance);
+  exposure.enOpType = OP_TYPE_AUTO;
+  white_balance.enOpType = OP_TYPE_AUTO;
+  HI_MPI_ISP_SetExposureAttr(pipe_id, &exposure);
+  HI_MPI_ISP_SetWBAttr(pipe_id, &white_balance);
+
+  atomic_store(&isp_cache_manual, false);
+}
 
-      pack_data += chunk_size;
-      pack_size -= chunk_size;
+// Power may be cut at any time, so refresh periodically and not only on
+// exit. The first save waits a full interval for AE/AWB to settle.
+void* __ISP_CACHE_THREAD__(void* param) {
+  IspConfig* config = (IspConfig*)param;
+  uint32_t elapsed = 0;
+  while (loop_running) {
+    sleep(1);
+    if (!isp_cache_streaming || ++elapsed < ISP_CACHE_INTERVAL) {
+      continue;
+    }
+
+    elapsed = 0;
+    saveIspCache(config->pipe_id, config->cache_path);
+  }
+
+  return 0;
+}
+
+void saveIspCache(VI_PIPE pipe_id, const char* path) {
+  ISP_EXP_INFO_S exposure;
+  ISP_WB_INFO_S white_balance;
+  if (HI_MPI_ISP_QueryExposureInfo(pipe_id, &exposure) != HI_SUCCESS ||
+      HI_MPI_ISP_QueryWBInfo(pipe_id, &white_balance) != HI_SUCCESS) {
+    return;
+  }
+
+  // Write and rename, a brownout must not leave a truncated cache behind
+  char temp_path[256];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+  FILE* file = fopen(temp_path, "w");
+  if (!file) {
+    printf("ERROR: Unable to write ISP cache [%s]\n", temp_path);
+    return;
+  }
+
+  fprintf(file, "%u %u %u %u %hu %hu %hu %hu\n",
+    exposure.u32ExpTime, exposure.u32AGain, exposure.u32DGain,
+    exposure.u32ISPDGain, white_balance.u16Rgain, white_balance.u16Grgain,
+    white_balance.u16Gbgain, white_balance.u16Bgain);
+  fflush(file);
+  fsync(fileno(file));
+  fclose(file);
+  rename(temp_path, path);
+}
+
+int createJpegChannel(VENC_CHN channel_id, uint32_t width, uint32_t height,
+  uint32_t quality) {
+  int ret;
+
+  VENC_CHN_ATTR_S config;
+  memset(&config, 0x00, sizeof(config));
+  config.stVencAttr.enType = PT_JPEG;
+  config.stVencAttr.u32MaxPicWidth = width;
+  config.stVencAttr.u32MaxPicHeight = height;
+  config.stVencAttr.u32PicWidth = width;
+  config.stVencAttr.u32PicHeight = height;
+  config.stVencAttr.u32BufSize = ALIGN_UP(width * height / 2, 64);
+  config.stVencAttr.bByFrame = HI_TRUE;
+  config.stVencAttr.stAttrJpege.bSupportDCF = HI_FALSE;
+  config.stVencAttr.stAttrJpege.stMPFCfg.u8LargeThumbNailNum = 0;
+  config.stVencAttr.stAttrJpege.enReceiveMode = VENC_PIC_RECEIVE_SINGLE;
+
+  ret = HI_MPI_VENC_CreateChn(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to create JPEG VENC channel = 0x%x\n", ret);
+    return ret;
+  }
+
+  VENC_JPEG_PARAM_S jpeg_param;
+  HI_MPI_VENC_GetJpegParam(channel_id, &jpeg_param);
+  jpeg_param.u32Qfactor = quality;
+  ret = HI_MPI_VENC_SetJpegParam(channel_id, &jpeg_param);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set JPEG quality = 0x%x\n", ret);
+    return ret;
+  }
+
+  return HI_SUCCESS;
+}
+
+void requestSnapshot(VENC_CHN channel_id, int control_handle,
+  const ControlMessage* message) {
+  if (snapshot_pending) {
+    control_reply(control_handle, message, "ERROR snapshot in progress");
+    return;
+  }
+
+  // Encode exactly one picture, channel stops receiving by itself
+  VENC_RECV_PIC_PARAM_S recv_param;
+  recv_param.s32RecvPicNum = 1;
+  int ret = HI_MPI_VENC_StartRecvFrame(channel_id, &recv_param);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to start JPEG Rx frames = 0x%x\n", ret);
+    control_reply(control_handle, message, "ERROR encoder 0x%x", ret);
+    return;
+  }
+
+  snapshot_request = *message;
+  snapshot_pending = true;
+}
+
+void processSnapshot(VENC_CHN channel_id, int control_handle) {
+  VENC_CHN_STATUS_S channel_status;
+  int ret = HI_MPI_VENC_QueryStatus(channel_id, &channel_status);
+  if (ret != HI_SUCCESS || !channel_status.u32CurPacks) {
+    return;
+  }
+
+  // All packs of the picture, a JPEG may come in more than a few
+  VENC_PACK_S packet_descriptor[channel_status.u32CurPacks];
+  VENC_STREAM_S stream;
+  memset(&stream, 0x00, sizeof(stream));
+  stream.pstPack = packet_descriptor;
+  stream.u32PackCount = channel_status.u32CurPacks;
+
+  ret = HI_MPI_VENC_GetStream(channel_id, &stream, 0);
+  if (ret != HI_SUCCESS) {
+    printf("WARN: Failed to get JPEG VENC stream = 0x%x\n", ret);
+    return;
+  }
+
+  // Copy out, slow file or socket output runs on its own thread
+  uint32_t size = 0;
+  for (uint32_t i = 0; i < stream.u32PackCount; i++) {
+    size += stream.pstPack[i].u32Len - stream.pstPack[i].u32Offset;
+  }
+
+  SnapshotJob* job = malloc(sizeof(SnapshotJob));
+  uint8_t* data = malloc(size);
+  if (job && data) {
+    job->data = data;
+    job->size = 0;
+    job->control_handle = control_handle;
+    job->request = snapshot_request;
+
+    for (uint32_t i = 0; i < stream.u32PackCount; i++) {
+      uint32_t pack_size = stream.pstPack[i].u32Len - stream.pstPack[i].u32Offset;
+      memcpy(job->data + job->size,
+        stream.pstPack[i].pu8Addr + stream.pstPack[i].u32Offset, pack_size);
+      job->size += pack_size;
+    }
+  }
+
+  HI_MPI_VENC_ReleaseStream(channel_id, &stream);
+  HI_MPI_VENC_StopRecvFrame(channel_id);
+  snapshot_pending = false;
+
+  if (!job || !data) {
+    printf("ERROR: Unable to allocate %u bytes for snapshot\n", size);
+    control_reply(control_handle, &snapshot_request, "ERROR out of memory");
+    free(data);
+    free(job);
+    return;
+  }
+
+  // Default scheduling and a small stack, not inherited from the stream thread
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+
+  pthread_t snapshot_thread;
+  if (pthread_create(&snapshot_thread, &attr, __SNAPSHOT_THREAD__, job)) {
+    printf("ERROR: Unable to start snapshot thread\n");
+    control_reply(control_handle, &snapshot_request, "ERROR snapshot failed");
+    free(job->data);
+    free(job);
+  }
+
+  pthread_attr_destroy(&attr);
+}
+
+void* __SNAPSHOT_THREAD__(void* param) {
+  SnapshotJob* job = (SnapshotJob*)param;
+  const char* path = job->request.argument;
+
+  if (path[0]) {
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file >= 0 && write(file, job->data, job->size) == (ssize_t)job->size) {
+      control_reply(job->control_handle, &job->request, "OK %u", job->size);
+      printf("> Snapshot: %s, %u bytes\n", path, job->size);
+    } else {
+      control_reply(job->control_handle, &job->request, "ERROR unable to write");
+      printf("ERROR: Unable to write snapshot [%s]\n", path);
+    }
+
+    if (file >= 0) {
+      close(file);
     }
   } else {
-    transmit(socket_handle, pack_data, pack_size, dst_address);
-    packets_sent++;
+    // Size header first, then raw JPEG split into datagrams
+    control_reply(job->control_handle, &job->request, "JPEG %u", job->size);
+    control_send(job->control_handle, &job->request.sender, job->data, job->size);
+  }
+
+  free(job->data);
+  free(job);
+  return 0;
+}
+
+struct timespec hq_last_timestamp = {0, 0};
+uint32_t hq_bytes_written = 0;
+uint32_t hq_frames_written = 0;
+
+int writeStream(VENC_CHN channel_id, bool output, bool record) {
+  EncoderStream stream;
+  if (encoder->get_stream(channel_id, &stream, 0) <= 0) {
+    return 0;
+  }
+
+  if (record) {
+    recordStream(&stream);
+  }
+
+  // Packs already carry Annex-B start codes
+  for (uint32_t i = 0; output && i < stream.pack_count; i++) {
+    hq_bytes_written += output_write(stream.packs[i].data, stream.packs[i].size);
   }
+
+  hq_frames_written++;
+  encoder->release(channel_id, &stream);
+
+  struct timespec current_timestamp;
+  if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &current_timestamp)) {
+    double interval = getTimeInterval(&current_timestamp, &hq_last_timestamp);
+    if (interval > 1) {
+      printf("> HQ Rate: %.2f Mbit/sec. | Frames: %d\n",
+        ((double)hq_bytes_written * 8) / interval / 1024 / 1024,
+        hq_frames_written);
+
+      hq_bytes_written = 0;
+      hq_frames_written = 0;
+      hq_last_timestamp = current_timestamp;
+    }
+  }
+
+  return 1;
 }
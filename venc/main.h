@@ -2,8 +2,10 @@
 #define _POSIX_TIMERS
 #define _REENTRANT
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -17,7 +19,12 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 
-#ifndef PLATFORM_STAR6E
+// HiSilicon/Goke MPP unless building for Star6E or the host replay target
+#if !defined(PLATFORM_STAR6E) && !defined(PLATFORM_HOST)
+#define PLATFORM_HISI
+#endif
+
+#ifdef PLATFORM_HISI
 #include "hi_buffer.h"
 #include "hi_comm_adec.h"
 #include "hi_comm_aenc.h"
@@ -81,15 +88,64 @@ struct RTPHeader {
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+typedef struct {
+  int policy;    // SCHED_FIFO or SCHED_RR
+  int priority;  // Realtime priority, 0 keeps default scheduling
+  int cpu;       // CPU to pin to, -1 keeps default affinity
+} ThreadScheduling;
+
+#ifdef PLATFORM_HISI
+// Seconds between refreshes of the ISP cache file
+#define ISP_CACHE_INTERVAL 60
+
+typedef struct {
+  VI_PIPE pipe_id;
+  ISP_SNS_OBJ_S* sns_object;
+  ISP_PUB_ATTR_S* profile;
+  uint32_t framerate;
+  bool limit_exposure;
+  const char* cache_path;
+  ThreadScheduling scheduling;
+} IspConfig;
+#endif
+
 void printHelp(void);
+double getTimeInterval(
+  struct timespec* timestamp, struct timespec* last_meansure_timestamp);
+int parseSchedulingPolicy(const char* value);
+void applyThreadScheduling(const char* name, const ThreadScheduling* config);
+void lockProcessMemory(void);
 void* __ISP_THREAD__(void* param);
-#ifndef PLATFORM_STAR6E
-int processStream(VENC_CHN channel_id, int socket_handle,
-  struct sockaddr* dst_address, uint16_t max_frame_size);
-#endif
-void sendPacket(uint8_t* pack_data, uint32_t pack_size, int socket_handle,
-  struct sockaddr* dst_address, uint32_t max_size);
-#ifndef PLATFORM_STAR6E
+#ifdef PLATFORM_HISI
+int writeStream(VENC_CHN channel_id, bool output, bool record);
+
+struct ControlMessage;
+int createJpegChannel(VENC_CHN channel_id, uint32_t width, uint32_t height,
+  uint32_t quality);
+void requestSnapshot(VENC_CHN channel_id, int control_handle,
+  const struct ControlMessage* message);
+void processSnapshot(VENC_CHN channel_id, int control_handle);
+void* __SNAPSHOT_THREAD__(void* param);
+
+int initIsp(IspConfig* config);
+int loadIspCache(VI_PIPE pipe_id, const char* path);
+void releaseIspCache(VI_PIPE pipe_id);
+void saveIspCache(VI_PIPE pipe_id, const char* path);
+void* __ISP_CACHE_THREAD__(void* param);
+
+uint32_t getVpssFramerate(uint32_t width, uint32_t height, uint32_t framerate);
+int createVpssChannel(VPSS_GRP group_id, VPSS_CHN channel_id, uint32_t width,
+  uint32_t height, uint32_t framerate, int mirror, int flip);
+int createEncoderChannel(VENC_CHN channel_id, PAYLOAD_TYPE_E rc_codec,
+  int rc_mode, uint32_t width, uint32_t height, uint32_t framerate,
+  uint32_t gop_size, uint32_t max_rate, HI_BOOL by_frame);
+int bindVpssToEncoder(VPSS_GRP group_id, VPSS_CHN vpss_channel_id,
+  VENC_CHN venc_channel_id);
+
 HI_S32 getGOPAttributes(VENC_GOP_MODE_E enGopMode, VENC_GOP_ATTR_S* pstGopAttr);
 
 int mipi_set_hs_mode(int device, lane_divide_mode_t mode);
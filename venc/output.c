@@ -0,0 +1,193 @@
+#include "output.h"
+#include "stream.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Byte ring filled by the streaming thread, drained by the writer thread
+static uint8_t* queue = 0;
+static uint32_t queue_size = 0;
+static uint32_t queue_head = 0;
+static uint32_t queue_tail = 0;
+static uint32_t queue_used = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static bool output_running = false;
+
+static const char* output_path = 0;
+static int output_file = -1;
+static bool output_ready = false;  // File open, guarded by queue_lock
+static bool wait_keyframe = true;  // Guarded by queue_lock
+
+// Producer side state, only touched from the streaming thread
+static PAYLOAD_TYPE_E output_codec = PT_H264;
+static uint64_t bytes_dropped = 0;
+
+// FIFO without reader fails with ENXIO instead of blocking. Only the first
+// open truncates, a file reopened after a write error keeps its data.
+static int openOutput(int mode) {
+  int file = open(output_path, O_WRONLY | O_CREAT | O_NONBLOCK | mode, 0644);
+  if (file < 0) {
+    return errno == ENXIO ? 0 : -1;
+  }
+
+  // Writer thread may block, the streaming thread never waits for it
+  fcntl(file, F_SETFL, fcntl(file, F_GETFL) & ~O_NONBLOCK);
+  output_file = file;
+  pthread_mutex_lock(&queue_lock);
+  output_ready = true;
+  pthread_mutex_unlock(&queue_lock);
+  printf("> HQ output: writing %s\n", output_path);
+  return 0;
+}
+
+// Queued data belongs to the old reader, the next one starts at a keyframe
+static void closeOutput(void) {
+  pthread_mutex_lock(&queue_lock);
+  output_ready = false;
+  wait_keyframe = true;
+  queue_tail = queue_head;
+  queue_used = 0;
+  pthread_mutex_unlock(&queue_lock);
+  close(output_file);
+  output_file = -1;
+}
+
+static void* __OUTPUT_THREAD__(void* param) {
+  while (true) {
+    pthread_mutex_lock(&queue_lock);
+    if (!queue_used && output_running) {
+      // Wake up once a second to look for a FIFO reader
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec++;
+      pthread_cond_timedwait(&queue_ready, &queue_lock, &deadline);
+    }
+
+    if (!queue_used && !output_running) {
+      pthread_mutex_unlock(&queue_lock);
+      break;
+    }
+
+    // Contiguous part up to the end of the ring
+    uint32_t chunk = MIN(queue_used, queue_size - queue_tail);
+    uint8_t* data = queue + queue_tail;
+    pthread_mutex_unlock(&queue_lock);
+
+    if (output_file < 0) {
+      openOutput(O_APPEND);
+    }
+
+    // Slow part runs without lock, streaming thread keeps queueing
+    uint32_t offset = 0;
+    while (output_file >= 0 && offset < chunk) {
+      ssize_t written = write(output_file, data + offset, chunk - offset);
+      if (written <= 0) {
+        // FIFO reader went away, reopen once another one attaches
+        printf("WARN: HQ output closed: %s\n", strerror(errno));
+        closeOutput();
+        break;
+      }
+
+      offset += written;
+    }
+
+    // Closing already dropped the chunk
+    pthread_mutex_lock(&queue_lock);
+    if (output_ready) {
+      queue_tail = (queue_tail + chunk) % queue_size;
+      queue_used -= chunk;
+    }
+    pthread_mutex_unlock(&queue_lock);
+  }
+
+  if (output_file >= 0) {
+    closeOutput();
+  }
+
+  return 0;
+}
+
+int output_open(const char* path, PAYLOAD_TYPE_E codec, uint32_t size) {
+  output_path = path;
+  output_codec = codec;
+
+  // Reader of a FIFO leaving must not end the process
+  signal(SIGPIPE, SIG_IGN);
+  if (openOutput(O_TRUNC)) {
+    printf("ERROR: Unable to open HQ output [%s]: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  if (output_file < 0) {
+    printf("> HQ output: waiting for a reader on %s\n", path);
+  }
+
+  queue_size = size;
+  queue = malloc(queue_size);
+  if (!queue) {
+    printf("ERROR: Unable to allocate HQ output queue\n");
+    return 1;
+  }
+
+  output_running = true;
+  if (pthread_create(&writer_thread, NULL, __OUTPUT_THREAD__, NULL)) {
+    printf("ERROR: Unable to start HQ output thread\n");
+    output_running = false;
+    return 1;
+  }
+
+  return 0;
+}
+
+uint32_t output_write(const uint8_t* data, uint32_t size) {
+  if (!output_running) {
+    return 0;
+  }
+
+  bool keyframe = isKeyframeStart(output_codec, data, size);
+  pthread_mutex_lock(&queue_lock);
+  bool accepted = (keyframe || !wait_keyframe) && output_ready &&
+    queue_size - queue_used >= size;
+  if (accepted) {
+    uint32_t chunk = MIN(size, queue_size - queue_head);
+    memcpy(queue + queue_head, data, chunk);
+    memcpy(queue, data + chunk, size - chunk);
+    queue_head = (queue_head + size) % queue_size;
+    queue_used += size;
+    pthread_cond_signal(&queue_ready);
+  }
+
+  // Card stalled or reader behind, drop the rest of the GOP
+  wait_keyframe = !accepted;
+  pthread_mutex_unlock(&queue_lock);
+
+  if (!accepted) {
+    bytes_dropped += size;
+    return 0;
+  }
+
+  return size;
+}
+
+void output_close(void) {
+  if (!output_running) {
+    return;
+  }
+
+  pthread_mutex_lock(&queue_lock);
+  output_running = false;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+  pthread_join(writer_thread, NULL);
+
+  if (bytes_dropped) {
+    printf("> HQ output: %.1f MB dropped\n", (double)bytes_dropped / 1024 / 1024);
+  }
+
+  free(queue);
+  queue = 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "main.h"
+#include <stdbool.h>
+
+/**
+ * @brief Start writer thread for an Annex-B file or FIFO. Opening never
+ * blocks, a FIFO without reader is retried until one attaches.
+ * @param path - Output file or FIFO
+ * @param codec - Payload type, selects keyframe detection
+ * @param queue_size - RAM queue size in bytes
+ * @return 0 on success
+ */
+int output_open(const char* path, PAYLOAD_TYPE_E codec, uint32_t queue_size);
+
+/**
+ * @brief Queue one encoded pack (Annex-B NAL unit). Never blocks, data is
+ * dropped until the next keyframe if the queue is full or nobody reads.
+ * @return Bytes queued
+ */
+uint32_t output_write(const uint8_t* data, uint32_t size);
+
+/**
+ * @brief Flush queued data, stop writer thread and close output
+ */
+void output_close(void);
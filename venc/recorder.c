@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include "recorder.h"
+#include "stream.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Preallocation step, reserved ahead of the written data
+#define RECORDER_PREALLOCATE (8 * 1024 * 1024)
+
+// Written data reaches the card at least this often, seconds
+#define RECORDER_SYNC_INTERVAL 2
+
+typedef struct {
+  uint8_t* data;
+  uint32_t size;
+  bool segment_end; // Rotate segment file after this block
+} RecorderBlock;
+
+static RecorderBlock* blocks = 0;
+static uint32_t block_count = 0;
+static uint32_t block_head = 0;   // Block filled by the streaming thread
+static uint32_t block_tail = 0;   // Block written by the writer thread
+static uint32_t blocks_queued = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static bool recorder_running = false;
+
+static const char* segment_directory = 0;
+static const char* segment_extension = 0;
+static uint32_t segment_size = 0;
+static uint32_t segment_index = 0;
+static int segment_file = -1;
+static uint64_t segment_written = 0;
+static uint64_t segment_allocated = 0;
+static time_t segment_synced = 0;
+
+// Producer side state, only touched from the streaming thread
+static PAYLOAD_TYPE_E recorder_codec = PT_H264;
+static bool wait_keyframe = true;
+static uint64_t segment_queued = 0;
+static uint64_t gop_queued = 0;
+static uint64_t gop_max = 0;
+static bool dropping = false;
+static uint64_t bytes_dropped = 0;
+
+static uint32_t findNextSegmentIndex(void) {
+  DIR* dir = opendir(segment_directory);
+  if (!dir) {
+    return 0;
+  }
+
+  uint32_t next = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    uint32_t index;
+    if (sscanf(entry->d_name, "rec%05u.", &index) == 1 && index >= next) {
+      next = index + 1;
+    }
+  }
+
+  closedir(dir);
+  return next;
+}
+
+static void openSegment(void) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/rec%05u.%s",
+    segment_directory, segment_index++, segment_extension);
+
+  segment_file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (segment_file < 0) {
+    printf("ERROR: Unable to open segment [%s]: %s\n", path, strerror(errno));
+    return;
+  }
+
+  segment_written = 0;
+  segment_allocated = 0;
+  segment_synced = time(0);
+  printf("> Recorder: writing %s\n", path);
+}
+
+// Reserve clusters ahead of the data, FAT allocation is slow while writing.
+// Size stays at the written data: no zeroing on vfat and a file cut by
+// power loss has no zero tail.
+static void preallocate(void) {
+  if (segment_written + RECORDER_BLOCK_SIZE <= segment_allocated ||
+      segment_allocated >= segment_size) {
+    return;
+  }
+
+  uint64_t size = MIN(RECORDER_PREALLOCATE, segment_size - segment_allocated);
+  if (fallocate(segment_file, FALLOC_FL_KEEP_SIZE, segment_allocated, size)) {
+    printf("WARN: Unable to preallocate segment: %s\n", strerror(errno));
+    segment_allocated = segment_size;
+    return;
+  }
+
+  segment_allocated += size;
+}
+
+// Bound what a brownout can take with it to the last few seconds
+static void syncSegment(void) {
+  time_t now = time(0);
+  if (now - segment_synced >= RECORDER_SYNC_INTERVAL) {
+    fdatasync(segment_file);
+    segment_synced = now;
+  }
+}
+
+static void closeSegment(void) {
+  if (segment_file < 0) {
+    return;
+  }
+
+  // Drop unused preallocated space
+  ftruncate(segment_file, segment_written);
+  fdatasync(segment_file);
+  close(segment_file);
+  segment_file = -1;
+
+  printf("> Recorder: segment closed, %.1f MB, %.1f MB dropped so far\n",
+    (double)segment_written / 1024 / 1024, (double)bytes_dropped / 1024 / 1024);
+}
+
+static void* __RECORDER_THREAD__(void* param) {
+  while (true) {
+    pthread_mutex_lock(&queue_lock);
+    while (!blocks_queued && recorder_running) {
+      pthread_cond_wait(&queue_ready, &queue_lock);
+    }
+
+    if (!blocks_queued) {
+      pthread_mutex_unlock(&queue_lock);
+      break;
+    }
+
+    RecorderBlock* block = &blocks[block_tail];
+    pthread_mutex_unlock(&queue_lock);
+
+    // Slow part runs without lock, streaming thread keeps filling blocks
+    if (segment_file < 0) {
+      openSegment();
+    }
+
+    if (segment_file >= 0) {
+      preallocate();
+    }
+
+    uint32_t offset = 0;
+    while (segment_file >= 0 && offset < block->size) {
+      ssize_t written = write(segment_file, block->data + offset,
+        block->size - offset);
+      if (written <= 0) {
+        printf("ERROR: Unable to write segment: %s\n", strerror(errno));
+        break;
+      }
+
+      offset += written;
+      segment_written += written;
+    }
+
+    if (segment_file >= 0) {
+      syncSegment();
+    }
+
+    if (block->segment_end) {
+      closeSegment();
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    block->size = 0;
+    block->segment_end = false;
+    block_tail = (block_tail + 1) % block_count;
+    blocks_queued--;
+    pthread_mutex_unlock(&queue_lock);
+  }
+
+  closeSegment();
+  return 0;
+}
+
+static void submitBlock(bool segment_end) {
+  pthread_mutex_lock(&queue_lock);
+  blocks[block_head].segment_end = segment_end;
+  block_head = (block_head + 1) % block_count;
+  blocks_queued++;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+int recorder_init(const char* directory, PAYLOAD_TYPE_E codec,
+  uint32_t size, uint32_t queue_size) {
+  segment_directory = directory;
+  segment_extension = codec == PT_H265 ? "h265" : "h264";
+  segment_size = size;
+  segment_index = findNextSegmentIndex();
+  recorder_codec = codec;
+
+  // One block is always owned by the streaming thread
+  block_count = MAX(queue_size / RECORDER_BLOCK_SIZE, 2);
+  blocks = calloc(block_count, sizeof(RecorderBlock));
+  for (uint32_t i = 0; i < block_count; i++) {
+    if (posix_memalign((void**)&blocks[i].data, 4096, RECORDER_BLOCK_SIZE)) {
+      printf("ERROR: Unable to allocate recorder queue\n");
+      return 1;
+    }
+  }
+
+  recorder_running = true;
+  if (pthread_create(&writer_thread, NULL, __RECORDER_THREAD__, NULL)) {
+    printf("ERROR: Unable to start recorder thread\n");
+    recorder_running = false;
+    return 1;
+  }
+
+  printf("> Recorder: %s, segment %d MB, queue %d x %d KB\n",
+    directory, size / 1024 / 1024, block_count, RECORDER_BLOCK_SIZE / 1024);
+  return 0;
+}
+
+void recorder_write(const uint8_t* data, uint32_t size) {
+  if (!recorder_running) {
+    return;
+  }
+
+  bool keyframe = isKeyframeStart(recorder_codec, data, size);
+  if (!keyframe && wait_keyframe) {
+    bytes_dropped += dropping ? size : 0;
+    return;
+  }
+
+  // Rotate before a GOP that would not fit in the preallocated space
+  bool rotate = false;
+  if (keyframe) {
+    gop_max = MAX(gop_max, gop_queued);
+    gop_queued = 0;
+    rotate = segment_queued && segment_queued + gop_max > segment_size;
+  }
+
+  // Blocks required beyond the one currently being filled
+  uint32_t fill = rotate ? 0 : blocks[block_head].size;
+  uint32_t needed = (fill + size) / RECORDER_BLOCK_SIZE + (rotate ? 1 : 0);
+
+  pthread_mutex_lock(&queue_lock);
+  uint32_t available = block_count - blocks_queued - 1;
+  pthread_mutex_unlock(&queue_lock);
+
+  // SD card stalled, drop the rest of the GOP instead of blocking streaming
+  if (needed > available) {
+    bytes_dropped += size;
+    wait_keyframe = true;
+    dropping = true;
+    return;
+  }
+
+  wait_keyframe = false;
+  dropping = false;
+
+  if (rotate) {
+    submitBlock(true);
+    segment_queued = 0;
+  }
+
+  while (size) {
+    RecorderBlock* block = &blocks[block_head];
+    uint32_t chunk = MIN(size, RECORDER_BLOCK_SIZE - block->size);
+    memcpy(block->data + block->size, data, chunk);
+    block->size += chunk;
+    data += chunk;
+    size -= chunk;
+
+    segment_queued += chunk;
+    gop_queued += chunk;
+
+    if (block->size == RECORDER_BLOCK_SIZE) {
+      submitBlock(false);
+    }
+  }
+}
+
+void recorder_stop(void) {
+  if (!recorder_running) {
+    return;
+  }
+
+  if (blocks[block_head].size) {
+    submitBlock(true);
+  }
+
+  pthread_mutex_lock(&queue_lock);
+  recorder_running = false;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+  pthread_join(writer_thread, NULL);
+
+  for (uint32_t i = 0; i < block_count; i++) {
+    free(blocks[i].data);
+  }
+
+  free(blocks);
+  blocks = 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "main.h"
+#include <stdbool.h>
+
+// Size of a single write to the SD card, multiple of the page size
+#define RECORDER_BLOCK_SIZE (256 * 1024)
+
+/**
+ * @brief Start segmented recorder and its writer thread
+ * @param directory - Directory for segment files
+ * @param codec - Payload type, selects file extension and keyframe detection
+ * @param segment_size - Size limit of each segment file in bytes, clusters
+ * are reserved ahead of the data in steps
+ * @param queue_size - RAM queue size in bytes
+ * @return 0 on success
+ */
+int recorder_init(const char* directory, PAYLOAD_TYPE_E codec,
+  uint32_t segment_size, uint32_t queue_size);
+
+/**
+ * @brief Queue one encoded pack (Annex-B NAL unit) for recording.
+ * Never blocks, data is dropped until the next keyframe if the queue is full.
+ * @param data - NAL unit with start code
+ * @param size - Size of NAL unit
+ */
+void recorder_write(const uint8_t* data, uint32_t size);
+
+/**
+ * @brief Flush queued data, close current segment and stop writer thread
+ */
+void recorder_stop(void);
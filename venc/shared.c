@@ -1,4 +1,8 @@
+#define _GNU_SOURCE
 #include "main.h"
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 void printHelp() {
   printf(
@@ -84,54 +88,97 @@ void printHelp() {
     "\n"
     "    --roi          - Enable ROI\n"
     "    --roi-qp [QP]  - ROI quality points              (Default: 20)\n"
+    "\n"
+    "    --hq-file [Path] - Record full sensor resolution stream to file or FIFO\n"
+    "    --hq-rate [Rate] - HQ stream rate in Kbit/sec.   (Default: 20480)\n"
+    "\n"
+    "    --record [Path]         - Record segments into directory on SD card\n"
+    "    --record-hq             - Record HQ stream instead of live stream,\n"
+    "                              not on Star6E\n"
+    "    --record-segment [Size] - Segment size in MB      (Default: 64)\n"
+    "    --record-queue [Size]   - RAM queue size in MB    (Default: 4)\n"
+    "                              also used for --hq-file\n"
+    "\n"
+    "    --control-port [Port]      - UDP control port, text commands (Default: off)\n"
+    "    --snapshot                 - Enable JPEG snapshots at sensor resolution\n"
+    "    --snapshot-quality [Value] - JPEG quality 1..99   (Default: 90)\n"
+    "\n"
+    "      Control commands\n"
+    "        snapshot        - Reply \"JPEG <size>\" followed by image datagrams\n"
+    "        snapshot [Path] - Write image to file, reply \"OK <size>\"\n"
+    "\n"
+    "    --isp-cache [Path]   - Save AE/AWB state and start from it next launch\n"
+    "    --startup-log [Path] - Export startup phase timing to file\n"
+    "\n"
+    "    --rt-policy [Policy] - Realtime policy fifo / rr  (Default: fifo)\n"
+    "    --rt-isp [Prio]      - ISP thread priority 1..99  (Default: off)\n"
+    "    --rt-stream [Prio]   - Stream thread priority     (Default: off)\n"
+    "    --cpu-isp [CPU]      - Pin ISP thread to CPU      (Default: any)\n"
+    "    --cpu-stream [CPU]   - Pin stream thread to CPU   (Default: any)\n"
+    "    --mlock              - Lock memory to avoid page faults\n"
     "\n", __DATE__
   );
 }
 
-#ifdef PLATFORM_STAR6E
-void sendPacket(uint8_t* pack_data, uint32_t pack_size, int socket_handle,
-  struct sockaddr* dst_address, uint32_t max_size) {
-  struct RTPHeader* header = (struct RTPHeader*)pack_data;
-  if (pack_size <= max_size) {
-    sendto(socket_handle, pack_data, pack_size, 0, dst_address,
-      sizeof(struct sockaddr_in));
-    return;
+int parseSchedulingPolicy(const char* value) {
+  if (!strcmp(value, "fifo")) {
+    return SCHED_FIFO;
+  } else if (!strcmp(value, "rr")) {
+    return SCHED_RR;
+  }
+
+  printf("ERROR: Unknown scheduling policy\n");
+  return -1;
+}
+
+void applyThreadScheduling(const char* name, const ThreadScheduling* config) {
+  if (config->priority > 0) {
+    struct sched_param param;
+    memset(&param, 0x00, sizeof(param));
+    param.sched_priority = config->priority;
+
+    int ret = pthread_setschedparam(pthread_self(), config->policy, &param);
+    if (ret) {
+      printf("WARN: Unable to set %s thread priority: %s\n", name, strerror(ret));
+    }
   }
 
-  uint32_t payload_offset = sizeof(struct RTPHeader);
-  uint32_t payload_size = pack_size - payload_offset;
-  uint8_t* payload = pack_data + payload_offset;
-  uint8_t marker = header->payload_type & 0x80;
-  uint16_t sequence = ntohs(header->sequence);
-  uint32_t timestamp = ntohl(header->timestamp);
-  uint32_t ssrc_id = ntohl(header->ssrc_id);
+  if (config->cpu >= 0) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(config->cpu, &cpu_set);
 
-  uint32_t offset = 0;
-  while (offset < payload_size) {
-    uint32_t fragment_size = MIN(max_size - sizeof(struct RTPHeader),
-      payload_size - offset);
-    struct RTPHeader fragment_header = {
-      .version = 0x80,
-      .payload_type = (header->payload_type & 0x7F) | ((offset + fragment_size >= payload_size) ? marker : 0),
-      .sequence = htons(sequence++),
-      .timestamp = htonl(timestamp),
-      .ssrc_id = htonl(ssrc_id),
-    };
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (ret) {
+      printf("WARN: Unable to pin %s thread to CPU %d: %s\n",
+        name, config->cpu, strerror(ret));
+    }
+  }
 
-    struct iovec vec[2] = {
-      {.iov_base = &fragment_header, .iov_len = sizeof(fragment_header)},
-      {.iov_base = payload + offset, .iov_len = fragment_size},
-    };
+  // Report what the kernel actually granted
+  int policy;
+  struct sched_param param;
+  pthread_getschedparam(pthread_self(), &policy, &param);
 
-    struct msghdr msg = {
-      .msg_name = dst_address,
-      .msg_namelen = sizeof(struct sockaddr_in),
-      .msg_iov = vec,
-      .msg_iovlen = 2,
-    };
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  pthread_getaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
 
-    sendmsg(socket_handle, &msg, 0);
-    offset += fragment_size;
+  uint32_t cpu_mask = 0;
+  for (int i = 0; i < 32; i++) {
+    cpu_mask |= CPU_ISSET(i, &cpu_set) ? 1 << i : 0;
   }
+
+  printf("> Thread %s: %s, priority %d, CPU mask 0x%x\n", name,
+    policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER",
+    param.sched_priority, cpu_mask);
+}
+
+void lockProcessMemory(void) {
+  if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+    printf("WARN: Unable to lock memory: %s\n", strerror(errno));
+    return;
+  }
+
+  printf("> Memory locked\n");
 }
-#endif
@@ -188,6 +188,10 @@ typedef struct {
 
 MI_S32 MI_VENC_GetStream(MI_VENC_CHN chn, MI_VENC_Stream_t* stream, MI_S32 timeout_ms);
 MI_S32 MI_VENC_ReleaseStream(MI_VENC_CHN chn, MI_VENC_Stream_t* stream);
+MI_S32 MI_VENC_GetFd(MI_VENC_CHN chn);
+MI_S32 MI_VENC_RequestIdr(MI_VENC_CHN chn, MI_BOOL instant);
+MI_S32 MI_VENC_GetChnAttr(MI_VENC_CHN chn, MI_VENC_ChnAttr_t* attr);
+MI_S32 MI_VENC_SetChnAttr(MI_VENC_CHN chn, MI_VENC_ChnAttr_t* attr);
 
 #ifdef __cplusplus
 }
@@ -1,5 +1,8 @@
 #include "main.h"
+#include "encoder.h"
+#include "recorder.h"
 #include "star6e.h"
+#include "stream.h"
 #include <signal.h>
 #include <stdbool.h>
 #include <time.h>
@@ -11,36 +14,6 @@ static void handle_signal(int sig) {
   g_running = false;
 }
 
-static MI_VENC_RcMode_e translate_rc_mode(PAYLOAD_TYPE_E codec, int rc_mode) {
-  if (codec == PT_H265) {
-    switch (rc_mode) {
-      case 3: return E_MI_VENC_RC_MODE_H265CBR;
-      case 4: return E_MI_VENC_RC_MODE_H265VBR;
-      case 5: return E_MI_VENC_RC_MODE_H265AVBR;
-      case 6: return E_MI_VENC_RC_MODE_H265QVBR;
-      default: return E_MI_VENC_RC_MODE_H265CBR;
-    }
-  }
-
-  switch (rc_mode) {
-    case 0: return E_MI_VENC_RC_MODE_H264AVBR;
-    case 1: return E_MI_VENC_RC_MODE_H264QVBR;
-    case 2: return E_MI_VENC_RC_MODE_H264VBR;
-    case 3: return E_MI_VENC_RC_MODE_H264CBR;
-    default: return E_MI_VENC_RC_MODE_H264AVBR;
-  }
-}
-
-static MI_VENC_ModType_e translate_codec(PAYLOAD_TYPE_E codec) {
-  switch (codec) {
-    case PT_H265:
-      return E_MI_VENC_MODTYPE_H265;
-    case PT_H264:
-    default:
-      return E_MI_VENC_MODTYPE_H264;
-  }
-}
-
 static int start_sensor(uint32_t width, uint32_t height) {
   MI_S32 ret = MI_SNR_SetPlaneMode(E_MI_SNR_PAD_ID_0, E_MI_SNR_PLANE_MODE_LINEAR);
   if (ret != 0) {
@@ -162,41 +135,6 @@ static void stop_vpe(void) {
   MI_VPE_DestroyChannel(0);
 }
 
-static int start_venc(uint32_t width, uint32_t height, uint32_t bitrate,
-  uint32_t framerate, uint32_t gop, PAYLOAD_TYPE_E codec,
-  int rc_mode, MI_VENC_CHN* chn)
-{
-  MI_VENC_ChnAttr_t attr = {
-    .eType = translate_codec(codec),
-    .u32PicWidth = width,
-    .u32PicHeight = height,
-    .u32MaxBitRate = bitrate * 1024,
-    .u32SrcFrmRateNum = framerate,
-    .u32Gop = gop,
-    .eRcMode = translate_rc_mode(codec, rc_mode),
-  };
-
-  *chn = 0;
-  MI_S32 ret = MI_VENC_CreateChn(*chn, &attr);
-  if (ret != 0) {
-    printf("ERROR: MI_VENC_CreateChn failed %d\n", ret);
-    return ret;
-  }
-
-  ret = MI_VENC_StartRecvPic(*chn);
-  if (ret != 0) {
-    printf("ERROR: MI_VENC_StartRecvPic failed %d\n", ret);
-    return ret;
-  }
-
-  return 0;
-}
-
-static void stop_venc(MI_VENC_CHN chn) {
-  MI_VENC_StopRecvPic(chn);
-  MI_VENC_DestroyChn(chn);
-}
-
 int main(int argc, const char* argv[]) {
   if (argc == 2 && !strcmp(argv[1], "help")) {
     printHelp();
@@ -228,6 +166,16 @@ int main(int argc, const char* argv[]) {
   bool limit_exposure = false;
   int image_mirror = 0;
   int image_flip = 0;
+  int sched_policy = SCHED_FIFO;
+  ThreadScheduling isp_scheduling = {SCHED_FIFO, 0, -1};
+  ThreadScheduling stream_scheduling = {SCHED_FIFO, 0, -1};
+  bool lock_memory = false;
+  const char* record_path = 0;
+  uint32_t record_segment_size = 64;
+  uint32_t record_queue_size = 4;
+
+  // MI output has always been sent RTP framed
+  stream_mode = 1;
 
   __BeginParseConsoleArguments__(printHelp)
     __OnArgument("-h") {
@@ -256,6 +204,7 @@ int main(int argc, const char* argv[]) {
         printf("> ERROR: Unknown streaming mode\n");
         return 1;
       }
+      stream_mode = !strcmp(value, "rtp");
       continue;
     }
 
@@ -385,6 +334,54 @@ int main(int argc, const char* argv[]) {
       limit_exposure = true;
       continue;
     }
+
+    __OnArgument("--rt-policy") {
+      sched_policy = parseSchedulingPolicy(__ArgValue);
+      if (sched_policy < 0) {
+        return 1;
+      }
+      continue;
+    }
+
+    __OnArgument("--rt-isp") {
+      isp_scheduling.priority = atoi(__ArgValue);
+      continue;
+    }
+
+    __OnArgument("--rt-stream") {
+      stream_scheduling.priority = atoi(__ArgValue);
+      continue;
+    }
+
+    __OnArgument("--cpu-isp") {
+      isp_scheduling.cpu = atoi(__ArgValue);
+      continue;
+    }
+
+    __OnArgument("--cpu-stream") {
+      stream_scheduling.cpu = atoi(__ArgValue);
+      continue;
+    }
+
+    __OnArgument("--mlock") {
+      lock_memory = true;
+      continue;
+    }
+
+    __OnArgument("--record") {
+      record_path = __ArgValue;
+      continue;
+    }
+
+    __OnArgument("--record-segment") {
+      record_segment_size = atoi(__ArgValue);
+      continue;
+    }
+
+    __OnArgument("--record-queue") {
+      record_queue_size = atoi(__ArgValue);
+      continue;
+    }
   __EndParseConsoleArguments__
 
   venc_gop_size = sensor_framerate / (venc_gop_denom ? venc_gop_denom : 1);
@@ -398,11 +395,15 @@ int main(int argc, const char* argv[]) {
   (void)enable_roi;
   (void)roi_qp;
   (void)venc_slice_size;
-  (void)venc_by_frame;
   (void)limit_exposure;
   (void)image_mirror;
   (void)image_flip;
 
+  // ISP runs inside the MI driver on this platform, there is no thread to tune
+  if (isp_scheduling.priority || isp_scheduling.cpu >= 0) {
+    printf("WARN: --rt-isp and --cpu-isp have no effect on Star6E\n");
+  }
+
   int ret = MI_SYS_Init();
   if (ret != 0) {
     printf("ERROR: MI_SYS_Init failed %d\n", ret);
@@ -424,9 +425,20 @@ int main(int argc, const char* argv[]) {
     goto cleanup_vif;
   }
 
+  const EncoderBackend* encoder = &encoder_star6e;
+  EncoderConfig encoder_config = {
+    .codec = rc_codec,
+    .rc_mode = rc_mode,
+    .width = image_width,
+    .height = image_height,
+    .framerate = sensor_framerate,
+    .gop_size = venc_gop_size,
+    .bitrate = venc_max_rate,
+    .by_frame = venc_by_frame,
+  };
+
   MI_VENC_CHN venc_channel = 0;
-  ret = start_venc(image_width, image_height, venc_max_rate,
-    sensor_framerate, venc_gop_size, rc_codec, rc_mode, &venc_channel);
+  ret = encoder->create(venc_channel, &encoder_config);
   if (ret != 0) {
     goto cleanup_vpe;
   }
@@ -479,20 +491,30 @@ int main(int argc, const char* argv[]) {
   dst.sin_family = AF_INET;
   dst.sin_port = htons(udp_sink_port);
   dst.sin_addr.s_addr = udp_sink_ip;
-
-  while (g_running) {
-    MI_VENC_Stream_t stream;
-    ret = MI_VENC_GetStream(venc_channel, &stream, 1000);
-    if (ret != 0) {
-      continue;
+  initStream(rc_codec, max_frame_size);
+
+  // Writer thread keeps SD card stalls off the live path
+  if (record_path) {
+    ret = recorder_init(record_path, rc_codec,
+      record_segment_size * 1024 * 1024, record_queue_size * 1024 * 1024);
+    if (ret) {
+      close(socket_handle);
+      goto cleanup_venc;
     }
+  }
 
-    sendPacket(stream.pStream, stream.u32Len, socket_handle,
-      (struct sockaddr*)&dst, max_frame_size);
+  stream_scheduling.policy = sched_policy;
+  applyThreadScheduling("stream", &stream_scheduling);
+  if (lock_memory) {
+    lockProcessMemory();
+  }
 
-    MI_VENC_ReleaseStream(venc_channel, &stream);
+  while (g_running) {
+    processStream(encoder, venc_channel, 1000, socket_handle,
+      (struct sockaddr*)&dst, record_path != 0);
   }
 
+  recorder_stop();
   close(socket_handle);
 
 cleanup_venc:
@@ -502,7 +524,7 @@ cleanup_venc:
   if (bound_vif_vpe) {
     MI_SYS_UnBind(&vif_port, &vpe_port);
   }
-  stop_venc(venc_channel);
+  encoder->destroy(venc_channel);
 
 cleanup_vpe:
   stop_vpe();
@@ -0,0 +1,63 @@
+#include "startup.h"
+#include <time.h>
+
+typedef struct {
+  const char* name;
+  struct timespec timestamp;
+} StartupPhase;
+
+static StartupPhase phases[STARTUP_MAX_PHASES];
+static uint32_t phase_count = 0;
+static struct timespec start_timestamp;
+static struct timespec start_boottime;
+static pthread_mutex_t phase_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double getElapsedMs(struct timespec* to, struct timespec* from) {
+  return (to->tv_sec - from->tv_sec) * 1000. +
+    (to->tv_nsec - from->tv_nsec) / 1000000.;
+}
+
+void startup_mark(const char* phase) {
+  struct timespec timestamp;
+  clock_gettime(CLOCK_MONOTONIC, &timestamp);
+
+  pthread_mutex_lock(&phase_lock);
+  if (!phase_count && !start_timestamp.tv_sec && !start_timestamp.tv_nsec) {
+    start_timestamp = timestamp;
+    clock_gettime(CLOCK_BOOTTIME, &start_boottime);
+  }
+
+  if (phase_count < STARTUP_MAX_PHASES) {
+    phases[phase_count].name = phase;
+    phases[phase_count].timestamp = timestamp;
+    phase_count++;
+  }
+  pthread_mutex_unlock(&phase_lock);
+}
+
+void startup_report(const char* path) {
+  FILE* file = path ? fopen(path, "w") : 0;
+
+  pthread_mutex_lock(&phase_lock);
+  printf("> Startup timing (started %.0f ms after boot)\n",
+    start_boottime.tv_sec * 1000. + start_boottime.tv_nsec / 1000000.);
+
+  struct timespec* previous = &start_timestamp;
+  for (uint32_t i = 0; i < phase_count; i++) {
+    double elapsed = getElapsedMs(&phases[i].timestamp, previous);
+    double total = getElapsedMs(&phases[i].timestamp, &start_timestamp);
+    printf("  - %-16s : %8.1f ms | %8.1f ms\n", phases[i].name, elapsed, total);
+    if (file) {
+      fprintf(file, "%s %.1f %.1f\n", phases[i].name, elapsed, total);
+    }
+
+    previous = &phases[i].timestamp;
+  }
+  pthread_mutex_unlock(&phase_lock);
+
+  if (file) {
+    fclose(file);
+  } else if (path) {
+    printf("ERROR: Unable to write startup timing [%s]\n", path);
+  }
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "main.h"
+
+// Maximum number of recorded startup phases
+#define STARTUP_MAX_PHASES 32
+
+/**
+ * @brief Record end of a startup phase, thread safe
+ * @param phase - Phase name, must stay valid until report
+ */
+void startup_mark(const char* phase);
+
+/**
+ * @brief Print timing breakdown of recorded phases
+ * @param path - Optional file to export "phase elapsed_ms total_ms" lines
+ */
+void startup_report(const char* path);
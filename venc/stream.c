@@ -0,0 +1,215 @@
+#include "stream.h"
+#include "recorder.h"
+#include <time.h>
+
+uint8_t stream_mode = 0;
+Packetizer stream_packetizer;
+
+double getTimeInterval(
+  struct timespec* timestamp, struct timespec* last_meansure_timestamp) {
+  return (timestamp->tv_sec - last_meansure_timestamp->tv_sec) +
+       (timestamp->tv_nsec - last_meansure_timestamp->tv_nsec) / 1000000000.;
+}
+
+struct timespec last_timestamp = {0, 0};
+uint32_t bytes_sent = 0;
+uint32_t frames_sent = 0;
+uint64_t seq_last = 0;
+
+uint64_t jitter_sum = 0;
+uint64_t jitter_cnt = 0;
+uint32_t nal_max_size = 0;
+uint32_t single_packets = 0;
+
+uint32_t pps_count = 0;
+uint32_t sps_count = 0;
+uint32_t idr_count = 0;
+uint32_t sei_count = 0;
+uint32_t s_count = 0;
+uint32_t packets_sent = 0;
+
+void initStream(PAYLOAD_TYPE_E codec, uint16_t max_frame_size) {
+  if (packetizer_init(&stream_packetizer, codec == PT_H265, stream_mode,
+      max_frame_size)) {
+    printf("ERROR: Unable to allocate packetizer\n");
+  }
+}
+
+bool isKeyframeStart(PAYLOAD_TYPE_E codec, const uint8_t* data, uint32_t size) {
+  // Skip Annex-B start code
+  uint32_t offset = 0;
+  while (offset + 1 < size && data[offset] == 0) {
+    offset++;
+  }
+
+  if (offset + 1 >= size || data[offset] != 1) {
+    return false;
+  }
+
+  uint8_t header = data[offset + 1];
+  if (codec == PT_H265) {
+    return ((header >> 1) & 0x3F) == 32; // VPS
+  }
+
+  return (header & 0x1F) == 7; // SPS
+}
+
+#ifdef PLATFORM_STAR6E
+// MI packs are RTP framed, the recorder takes Annex-B NAL units
+uint8_t* record_buffer = 0;
+uint32_t record_capacity = 0;
+
+void recordStream(EncoderStream* stream) {
+  static const uint8_t start_code[] = {0x00, 0x00, 0x00, 0x01};
+  for (uint32_t i = 0; i < stream->pack_count; i++) {
+    uint8_t* pack_data = stream->packs[i].data;
+    uint32_t pack_size = stream->packs[i].size;
+    uint32_t header_size = packet_header_size(pack_data, pack_size);
+    uint32_t size = sizeof(start_code) + pack_size - header_size;
+    if (size > record_capacity) {
+      uint8_t* buffer = realloc(record_buffer, size);
+      if (!buffer) {
+        printf("ERROR: Unable to allocate record buffer\n");
+        return;
+      }
+
+      record_buffer = buffer;
+      record_capacity = size;
+    }
+
+    memcpy(record_buffer, start_code, sizeof(start_code));
+    memcpy(record_buffer + sizeof(start_code), pack_data + header_size,
+      pack_size - header_size);
+    recorder_write(record_buffer, size);
+  }
+}
+#else
+void recordStream(EncoderStream* stream) {
+  for (uint32_t i = 0; i < stream->pack_count; i++) {
+    recorder_write(stream->packs[i].data, stream->packs[i].size);
+  }
+}
+#endif
+
+int processStream(const EncoderBackend* encoder, int channel_id,
+  int timeout_ms, int socket_handle, struct sockaddr* dst_address,
+  bool record) {
+  // Acquire stream, per-slice mode returns one slice at a time
+  EncoderStream stream;
+  int ret = encoder->get_stream(channel_id, &stream, timeout_ms);
+  if (ret <= 0) {
+    return ret;
+  }
+
+  // Send encoded packets, RTP timestamps run at 90 kHz
+  stream_packetizer.timestamp = stream.timestamp * 9 / 100;
+  for (uint32_t i = 0; i < stream.pack_count; i++) {
+    stream_packetizer.marker = stream.frame_end && i + 1 == stream.pack_count;
+    sendPacket(stream.packs[i].data, stream.packs[i].size,
+      socket_handle, dst_address);
+  }
+
+  // Queue for recording after the live path is served
+  if (record) {
+    recordStream(&stream);
+  }
+
+  // Release stream
+  encoder->release(channel_id, &stream);
+
+  // Print rate stats
+  struct timespec current_timestamp;
+  if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &current_timestamp)) {
+    double interval = getTimeInterval(&current_timestamp, &last_timestamp);
+    if (interval > 1 && frames_sent) {
+      printf("> Rate: %.2f Mbit/sec. (%.1f pps) | Frames: %d, NotFrag: "
+           "%d | AVG Size: %d, MAX Size: %d | S: %d, IDR: %d, SEI: %d, "
+           "PPS: %d, SPS: %d | Packets: %d\n",
+        ((double)bytes_sent * 8) / interval / 1024 / 1024,
+        (double)frames_sent / interval, /* jitter_sum / jitter_cnt,*/
+        frames_sent, single_packets, bytes_sent / frames_sent,
+        nal_max_size, s_count, idr_count, sei_count, pps_count,
+        sps_count, packets_sent);
+
+      bytes_sent = 0;
+      frames_sent = 0;
+      jitter_sum = 0;
+      jitter_cnt = 0;
+      nal_max_size = 0;
+      s_count = 0;
+      idr_count = 0;
+      pps_count = 0;
+      sps_count = 0;
+      sei_count = 0;
+      single_packets = 0;
+      packets_sent = 0;
+      last_timestamp = current_timestamp;
+    }
+  }
+
+  return 1;
+}
+
+// Count NAL types for the rate printout
+static void countNal(const uint8_t* nal, uint32_t size) {
+  frames_sent++;
+  bytes_sent += size;
+  if (size > nal_max_size) {
+    nal_max_size = size;
+  }
+
+  if (size <= stream_packetizer.max_payload) {
+    single_packets++;
+  }
+
+  switch (nal[0] & 0x1F) {
+    case 1:
+      s_count++;
+      break;
+
+    case 5:
+      idr_count++;
+      break;
+
+    case 6:
+      sei_count++;
+      break;
+
+    case 7:
+      sps_count++;
+      break;
+
+    case 8:
+      pps_count++;
+      break;
+
+    default:
+      break;
+  }
+}
+
+#ifdef PLATFORM_STAR6E
+// MI streams arrive RTP framed, repacketize the payload NAL unit
+void sendPacket(uint8_t* pack_data, uint32_t pack_size, int socket_handle,
+  struct sockaddr* dst_address) {
+  struct RTPHeader* header = (struct RTPHeader*)pack_data;
+  uint32_t header_size = packet_header_size(pack_data, pack_size);
+  if (header_size) {
+    stream_packetizer.timestamp = ntohl(header->timestamp);
+  }
+
+  countNal(pack_data + header_size, pack_size - header_size);
+  int packets = packetizer_send(&stream_packetizer, pack_data + header_size,
+    pack_size - header_size, socket_handle, dst_address);
+  packets_sent += MAX(packets, 0);
+}
+#else
+void sendPacket(uint8_t* pack_data, uint32_t pack_size, int socket_handle,
+  struct sockaddr* dst_address) {
+  uint8_t prefix = 4;
+  countNal(pack_data + prefix, pack_size - prefix);
+  int packets = packetizer_send(&stream_packetizer, pack_data, pack_size,
+    socket_handle, dst_address);
+  packets_sent += MAX(packets, 0);
+}
+#endif
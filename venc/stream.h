@@ -0,0 +1,47 @@
+#pragma once
+#include "encoder.h"
+#include "../common/packet.h"
+
+// Streaming mode, 0 - compact, 1 - RTP
+extern uint8_t stream_mode;
+
+// Packetizer for the live stream, totals since start in packets/bytes
+extern Packetizer stream_packetizer;
+
+/**
+ * @brief Set up packetizer for the live stream, after stream_mode is known
+ * @param codec - Payload type of the live stream
+ * @param max_frame_size - Maximum NAL bytes per datagram
+ */
+void initStream(PAYLOAD_TYPE_E codec, uint16_t max_frame_size);
+
+/**
+ * @brief Drain one stream from the encoder, packetize and send it
+ * @param encoder - Encoder backend
+ * @param channel_id - Encoder channel
+ * @param timeout_ms - Wait for stream data, 0 to poll
+ * @param record - Queue packs to the onboard recorder as well
+ * @return 1 if a stream was sent, 0 if nothing pending, -1 at end of stream
+ */
+int processStream(const EncoderBackend* encoder, int channel_id,
+  int timeout_ms, int socket_handle, struct sockaddr* dst_address,
+  bool record);
+
+/**
+ * @brief Check if a NAL unit opens an IDR access unit, parameter sets
+ * come first so this is the VPS or SPS
+ * @param codec - Payload type of the stream
+ * @param data - NAL unit with Annex-B start code
+ */
+bool isKeyframeStart(PAYLOAD_TYPE_E codec, const uint8_t* data, uint32_t size);
+
+/**
+ * @brief Queue all packs of a stream to the onboard recorder
+ */
+void recordStream(EncoderStream* stream);
+
+/**
+ * @brief Packetize one NAL unit (with start code) and send it
+ */
+void sendPacket(uint8_t* pack_data, uint32_t pack_size, int socket_handle,
+  struct sockaddr* dst_address);